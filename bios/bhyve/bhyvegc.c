@@ -40,6 +40,7 @@ __FBSDID("$FreeBSD$");
 struct bhyvegc {
 	struct bhyvegc_image	*gc_image;
 	int raw;
+	int dirty;		/* rows marked since the last commit */
 };
 
 struct bhyvegc *
@@ -61,7 +62,10 @@ bhyvegc_init(int width, int height, void *fbaddr)
 		gc->raw = 0;
 	}
 
+	gc_image->row_gen = calloc(height, sizeof (uint64_t));
 	gc->gc_image = gc_image;
+	bhyvegc_mark_dirty(gc, 0, height);
+	bhyvegc_commit(gc);
 
 	return (gc);
 }
@@ -79,6 +83,7 @@ void
 bhyvegc_resize(struct bhyvegc *gc, int width, int height)
 {
 	struct bhyvegc_image *gc_image;
+	uint64_t *row_gen;
 
 	gc_image = gc->gc_image;
 
@@ -91,6 +96,13 @@ bhyvegc_resize(struct bhyvegc *gc, int width, int height)
 			memset(gc_image->data, 0, width * height *
 			    sizeof (uint32_t));
 	}
+
+	row_gen = reallocarray(gc_image->row_gen, height, sizeof (uint64_t));
+	if (row_gen == NULL)
+		free(gc_image->row_gen);
+	gc_image->row_gen = row_gen;
+	bhyvegc_mark_dirty(gc, 0, height);
+	bhyvegc_commit(gc);
 }
 
 struct bhyvegc_image *
@@ -101,3 +113,48 @@ bhyvegc_get_image(struct bhyvegc *gc)
 
 	return (gc->gc_image);
 }
+
+/*
+ * Record that scanlines [y, y + h) were modified by the renderer. They are
+ * stamped with the next generation, which becomes visible on commit.
+ * Without a row_gen array every row counts as changed in every generation.
+ */
+void
+bhyvegc_mark_dirty(struct bhyvegc *gc, int y, int h)
+{
+	struct bhyvegc_image *gc_image;
+	int i;
+
+	gc_image = gc->gc_image;
+	if (gc_image->row_gen == NULL) {
+		gc->dirty = 1;
+		return;
+	}
+
+	if (y < 0) {
+		h += y;
+		y = 0;
+	}
+	if (y + h > gc_image->height)
+		h = gc_image->height - y;
+
+	for (i = y; i < y + h; i++)
+		gc_image->row_gen[i] = gc_image->gen + 1;
+	if (h > 0)
+		gc->dirty = 1;
+}
+
+/*
+ * Publish the rows marked since the last commit as a new frame generation.
+ * Returns 1 if the generation advanced.
+ */
+int
+bhyvegc_commit(struct bhyvegc *gc)
+{
+	if (!gc->dirty)
+		return (0);
+
+	gc->dirty = 0;
+	gc->gc_image->gen++;
+	return (1);
+}
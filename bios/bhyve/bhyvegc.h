@@ -38,11 +38,21 @@ struct bhyvegc_image {
 	int		width;
 	int		height;
 	uint32_t	*data;
+
+	/*
+	 * Frame generation. Renderers mark the scanlines they change and
+	 * the generation is bumped once per refresh that changed anything.
+	 * row_gen[y] holds the generation in which scanline y last changed.
+	 */
+	uint64_t	gen;
+	uint64_t	*row_gen;
 };
 
 struct bhyvegc *bhyvegc_init(int width, int height, void *fbaddr);
 void bhyvegc_set_fbaddr(struct bhyvegc *gc, void *fbaddr);
 void bhyvegc_resize(struct bhyvegc *gc, int width, int height);
 struct bhyvegc_image *bhyvegc_get_image(struct bhyvegc *gc);
+void bhyvegc_mark_dirty(struct bhyvegc *gc, int y, int h);
+int bhyvegc_commit(struct bhyvegc *gc);
 
 #endif /* _BHYVEGC_H_ */
@@ -85,6 +85,7 @@ __FBSDID("$FreeBSD$");
 #include "bhyverun.h"
 #include "acpi.h"
 #include "atkbdc.h"
+#include "block_if.h"
 #include "bootrom.h"
 #include "inout.h"
 #include "dbgport.h"
@@ -256,7 +257,7 @@ usage(int code)
 #endif
 		"       -p: pin 'vcpu' to 'hostcpu'\n"
 		"       -P: vmexit from the guest on pause\n"
-		"       -o: overrides (acpi_base, smbios_base)\n"
+		"       -o: overrides (acpi_base, smbios_base, blockif_pool)\n"
 		"       -s: <slot,driver,configinfo> PCI slot config\n"
 		"       -S: guest memory cannot be swapped\n"
 		"       -u: RTC keeps UTC time\n"
@@ -1206,6 +1207,12 @@ main(int argc, char *argv[])
 						fprintf(stderr, "Invalid %s\n", key);
 						exit(1);
 					}
+				} else if (strcasecmp(key, "blockif_pool") == 0) {
+					if (str == NULL ||
+					    blockif_pool_config(str) != 0) {
+						fprintf(stderr, "Invalid %s\n", key);
+						exit(1);
+					}
 				} else {
 					fprintf(stderr, "Unknown override key %s\n", key);
 					exit(1);
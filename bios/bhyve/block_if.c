@@ -36,18 +36,24 @@ __FBSDID("$FreeBSD$");
 #ifndef WITHOUT_CAPSICUM
 #include <sys/capsicum.h>
 #endif
+#include <sys/cpuset.h>
 #include <sys/queue.h>
 #include <sys/errno.h>
+#include <sys/event.h>
+#include <sys/linker_set.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 #include <sys/disk.h>
+#include <sys/mman.h>
 
+#include <aio.h>
 #include <assert.h>
 #ifndef WITHOUT_CAPSICUM
 #include <capsicum_helpers.h>
 #endif
 #include <err.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -64,12 +70,38 @@ __FBSDID("$FreeBSD$");
 #include "debug.h"
 #include "mevent.h"
 #include "block_if.h"
+#include "overlay.h"
+#include "qcow2.h"
 
 #define BLOCKIF_SIG	0xb109b109
 
 #define BLOCKIF_NUMTHR	8
 #define BLOCKIF_MAXREQ	(BLOCKIF_RING_MAX + BLOCKIF_NUMTHR)
 
+/* Completions reaped per kevent(2) call by the aio engine */
+#define BLOCKIF_AIO_NEVENTS	32
+
+/* Shared read cache geometry: segment size and associativity */
+#define BLOCKIF_CACHE_MAGIC	0xb10cca5e
+#define BLOCKIF_CACHE_SEGSZ	(64 * 1024)
+#define BLOCKIF_CACHE_WAYS	8
+
+/* Cached data/hole extents of a sparse image */
+#define BLOCKIF_HMAP_SIZE	32
+
+/* Smallest all-zero write turned into a hole punch */
+#define BLOCKIF_PUNCH_MIN	4096
+
+/* MAXPHYS-sized aligned bounce buffers shared by all direct i/o devices */
+#define BLOCKIF_BOUNCE_NBUF	32
+
+/* Latency histogram buckets: bucket i counts [2^i, 2^(i+1)) ns */
+#define BLOCKIF_HIST_BUCKETS	40
+
+/* Slots in the lock-free element rings; a power of 2 >= BLOCKIF_MAXREQ */
+#define BLOCKIF_RING_SLOTS	256
+#define BLOCKIF_RING_MASK	(BLOCKIF_RING_SLOTS - 1)
+
 enum blockop {
 	BOP_READ,
 	BOP_WRITE,
@@ -77,6 +109,16 @@ enum blockop {
 	BOP_DELETE
 };
 
+#define BLOCKIF_NOPS	(BOP_DELETE + 1)
+
+/* Phases of a request that are timed */
+enum blocklat {
+	BLAT_QUEUE,	/* submitted until an engine picks it up */
+	BLAT_SERVICE,	/* i/o on the backing store */
+	BLAT_CALLBACK,	/* completion callback into the device model */
+	BLAT_NUM
+};
+
 enum blockstat {
 	BST_FREE,
 	BST_BLOCK,
@@ -92,10 +134,98 @@ struct blockif_elem {
 	enum blockstat	     be_status;
 	pthread_t            be_tid;
 	off_t		     be_block;
+	off_t		     be_len;	/* bytes requested, for the stats */
+	struct blockif_elem *be_next;	/* coalesced with this one */
+	struct aiocb	     be_aiocb;
+	uint64_t	     be_tsub;	/* ns, blockif_nsec() */
+	uint64_t	     be_tstart;
+};
+
+/*
+ * Per-device, per-op counters and log2 latency histograms, updated
+ * with unlocked atomics and dumped on SIGINFO.
+ */
+struct blockif_opstats {
+	uint64_t	os_ops;
+	uint64_t	os_bytes;
+	uint64_t	os_errors;
+	uint64_t	os_hist[BLAT_NUM][BLOCKIF_HIST_BUCKETS];
+};
+
+/*
+ * Bounded multi-producer/multi-consumer ring of elements. Each slot
+ * carries a sequence number that tells a producer whether the slot is
+ * free for ticket 'pos' (seq == pos) and a consumer whether it has been
+ * published (seq == pos + 1), so that neither side needs a lock.
+ */
+struct blockif_slot {
+	u_int			slot_seq;
+	struct blockif_elem	*slot_be;
+};
+
+struct blockif_ring {
+	u_int			ring_enq __aligned(CACHE_LINE_SIZE);
+	u_int			ring_deq __aligned(CACHE_LINE_SIZE);
+	struct blockif_slot	ring_slot[BLOCKIF_RING_SLOTS]
+				    __aligned(CACHE_LINE_SIZE);
+};
+
+/*
+ * Read cache for read-only images, kept in a POSIX shared memory object
+ * named after the image's device and inode so that every bhyve process
+ * booting from the same image shares it. The image is divided into
+ * BLOCKIF_CACHE_SEGSZ segments, cached in a set-associative array with
+ * LRU replacement inside each set. Sets are protected by robust
+ * process-shared mutexes; a set whose holder died is simply emptied.
+ */
+struct blockif_cache_ent {
+	off_t		ce_seg;		/* segment number, -1 if unused */
+	uint32_t	ce_len;		/* valid bytes, short at EOF */
+	uint64_t	ce_stamp;
+};
+
+struct blockif_cache_set {
+	pthread_mutex_t		cs_mtx;
+	struct blockif_cache_ent cs_ent[BLOCKIF_CACHE_WAYS];
+};
+
+struct blockif_cache_hdr {
+	uint32_t	ch_magic;
+	uint32_t	ch_ready;
+	uint32_t	ch_nsets;
+	dev_t		ch_dev;
+	ino_t		ch_ino;
+	off_t		ch_size;
+	struct timespec	ch_mtime;
+	uint64_t	ch_clock;	/* LRU stamps */
+};
+
+struct blockif_cache {
+	struct blockif_cache_hdr *c_hdr;
+	struct blockif_cache_set *c_sets;
+	uint8_t		*c_data;
+	size_t		c_maplen;
+};
+
+/*
+ * Extent of a regular file found with SEEK_DATA/SEEK_HOLE. Data extents
+ * are only a hint that saves the lseek(2) calls; hole extents are used
+ * to satisfy reads without touching the file, so writes must drop the
+ * ones they overlap.
+ */
+struct blockif_extent {
+	off_t		ext_start;
+	off_t		ext_end;	/* 0 if the slot is unused */
+	int		ext_hole;
+	uint64_t	ext_stamp;
 };
 
+struct blockif_engine;
+
 struct blockif_ctxt {
 	int			bc_magic;
+	char			bc_ident[32];
+	TAILQ_ENTRY(blockif_ctxt) bc_link;	/* blockif_ctxts */
 	int			bc_fd;
 	int			bc_ischr;
 	int			bc_isgeom;
@@ -105,21 +235,89 @@ struct blockif_ctxt {
 	int			bc_sectsz;
 	int			bc_psectsz;
 	int			bc_psectoff;
+	struct blockif_cache	*bc_cache;
+	struct qcow2		*bc_qcow;
+	struct ovl		*bc_ovl;
+	int			bc_sparse;
+	int			bc_direct;	/* O_DIRECT raw image */
+	int			bc_align;	/* direct i/o alignment */
+	pthread_mutex_t		bc_hmtx;
+	uint64_t		bc_hgen;	/* bumped by every invalidation */
+	uint64_t		bc_hclock;
+	struct blockif_extent	bc_hmap[BLOCKIF_HMAP_SIZE];
 	int			bc_closing;
 	int			bc_paused;
 	int			bc_work_count;
+	u_int			bc_idle;
+	u_int			bc_plug;	/* defer kicks, see blockif_plug() */
+	struct blockif_engine	*bc_engine;
+	TAILQ_ENTRY(blockif_ctxt) bc_pool_link;	/* pool run queue */
+	int			bc_pool_queued;
+	int			bc_pool_refs;
+	int			bc_pool_closing;
+	int			bc_kq;
 	pthread_t		bc_btid[BLOCKIF_NUMTHR];
 	pthread_mutex_t		bc_mtx;
 	pthread_cond_t		bc_cond;
 	pthread_cond_t		bc_paused_cond;
 	pthread_cond_t		bc_work_done_cond;
 
-	/* Request elements and free/pending/busy queues */
-	TAILQ_HEAD(, blockif_elem) bc_freeq;       
+	/*
+	 * Request elements. Free elements and newly submitted ones live
+	 * in lock-free rings so that submitters never take bc_mtx; the
+	 * engine admits submissions into the pending queue under bc_mtx,
+	 * in submission order, which is where overlapping requests are
+	 * ordered.
+	 */
+	struct blockif_ring	bc_freer;
+	struct blockif_ring	bc_subr;
 	TAILQ_HEAD(, blockif_elem) bc_pendq;
 	TAILQ_HEAD(, blockif_elem) bc_busyq;
 	struct blockif_elem	bc_reqs[BLOCKIF_MAXREQ];
+
+	struct blockif_opstats	bc_stats[BLOCKIF_NOPS];
+};
+
+/*
+ * Bounce buffers for direct i/o, carved out of one superpage-aligned
+ * mapping. Requests that need more than a buffer, or find the pool
+ * empty, fall back to a private aligned allocation.
+ */
+static struct {
+	pthread_once_t	bp_once;
+	pthread_mutex_t	bp_mtx;
+	uint8_t		*bp_base;
+	uint8_t		*bp_free[BLOCKIF_BOUNCE_NBUF];
+	int		bp_nfree;
+} blockif_bounce = {
+	.bp_once = PTHREAD_ONCE_INIT,
+	.bp_mtx = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static TAILQ_HEAD(, blockif_ctxt) blockif_ctxts =
+    TAILQ_HEAD_INITIALIZER(blockif_ctxts);
+static pthread_mutex_t blockif_ctxts_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * An i/o engine moves elements from the pending queue to the backing
+ * store and back through blockif_complete(). All engines share the
+ * queues, request ordering and pause accounting in the context.
+ *
+ * init: start the engine for a freshly opened context
+ * kick: called without bc_mtx when a request has been submitted while
+ *	the engine advertised itself idle in bc_idle
+ * cancel: called with bc_mtx held to abort a busy element; the
+ *	element's callback is still invoked through the normal path
+ * close: stop the engine once bc_closing has been set
+ */
+struct blockif_engine {
+	const char *name;
+	int (*init)(struct blockif_ctxt *bc, const char *ident);
+	void (*kick)(struct blockif_ctxt *bc);
+	void (*cancel)(struct blockif_ctxt *bc, struct blockif_elem *be);
+	void (*close)(struct blockif_ctxt *bc);
 };
+SET_DECLARE(blockif_engine_set, struct blockif_engine);
 
 static pthread_once_t blockif_once = PTHREAD_ONCE_INIT;
 
@@ -132,32 +330,89 @@ struct blockif_sig_elem {
 
 static struct blockif_sig_elem *blockif_bse_head;
 
+static void
+blockif_ring_init(struct blockif_ring *r)
+{
+	u_int i;
+
+	r->ring_enq = r->ring_deq = 0;
+	for (i = 0; i < BLOCKIF_RING_SLOTS; i++) {
+		r->ring_slot[i].slot_seq = i;
+		r->ring_slot[i].slot_be = NULL;
+	}
+}
+
 static int
-blockif_enqueue(struct blockif_ctxt *bc, struct blockif_req *breq,
-		enum blockop op)
+blockif_ring_put(struct blockif_ring *r, struct blockif_elem *be)
 {
-	struct blockif_elem *be, *tbe;
-	off_t off;
-	int i;
+	struct blockif_slot *sl;
+	u_int pos;
+	int dif;
 
-	be = TAILQ_FIRST(&bc->bc_freeq);
-	assert(be != NULL);
-	assert(be->be_status == BST_FREE);
-	TAILQ_REMOVE(&bc->bc_freeq, be, be_link);
-	be->be_req = breq;
-	be->be_op = op;
-	switch (op) {
-	case BOP_READ:
-	case BOP_WRITE:
-	case BOP_DELETE:
-		off = breq->br_offset;
-		for (i = 0; i < breq->br_iovcnt; i++)
-			off += breq->br_iov[i].iov_len;
-		break;
-	default:
-		off = OFF_MAX;
+	pos = atomic_load_acq_int(&r->ring_enq);
+	for (;;) {
+		sl = &r->ring_slot[pos & BLOCKIF_RING_MASK];
+		dif = (int)(atomic_load_acq_int(&sl->slot_seq) - pos);
+		if (dif == 0) {
+			if (atomic_fcmpset_int(&r->ring_enq, &pos, pos + 1))
+				break;
+		} else if (dif < 0)
+			return (0);	/* full */
+		else
+			pos = atomic_load_acq_int(&r->ring_enq);
 	}
-	be->be_block = off;
+	sl->slot_be = be;
+	atomic_store_rel_int(&sl->slot_seq, pos + 1);
+	return (1);
+}
+
+static struct blockif_elem *
+blockif_ring_get(struct blockif_ring *r)
+{
+	struct blockif_elem *be;
+	struct blockif_slot *sl;
+	u_int pos;
+	int dif;
+
+	pos = atomic_load_acq_int(&r->ring_deq);
+	for (;;) {
+		sl = &r->ring_slot[pos & BLOCKIF_RING_MASK];
+		dif = (int)(atomic_load_acq_int(&sl->slot_seq) - (pos + 1));
+		if (dif == 0) {
+			if (atomic_fcmpset_int(&r->ring_deq, &pos, pos + 1))
+				break;
+		} else if (dif < 0)
+			return (NULL);	/* empty */
+		else
+			pos = atomic_load_acq_int(&r->ring_deq);
+	}
+	be = sl->slot_be;
+	atomic_store_rel_int(&sl->slot_seq, pos + BLOCKIF_RING_SLOTS);
+	return (be);
+}
+
+static int
+blockif_ring_empty(struct blockif_ring *r)
+{
+	struct blockif_slot *sl;
+	u_int pos;
+
+	pos = atomic_load_acq_int(&r->ring_deq);
+	sl = &r->ring_slot[pos & BLOCKIF_RING_MASK];
+	return (atomic_load_acq_int(&sl->slot_seq) != pos + 1);
+}
+
+/*
+ * Place a submitted element on the pending queue, blocked behind any
+ * pending or busy request that ends where this one starts.
+ */
+static void
+blockif_enqueue(struct blockif_ctxt *bc, struct blockif_elem *be)
+{
+	struct blockif_req *breq;
+	struct blockif_elem *tbe;
+
+	breq = be->be_req;
 	TAILQ_FOREACH(tbe, &bc->bc_pendq, be_link) {
 		if (tbe->be_block == breq->br_offset)
 			break;
@@ -173,7 +428,19 @@ blockif_enqueue(struct blockif_ctxt *bc, struct blockif_req *breq,
 	else
 		be->be_status = BST_BLOCK;
 	TAILQ_INSERT_TAIL(&bc->bc_pendq, be, be_link);
-	return (be->be_status == BST_PEND);
+}
+
+/*
+ * Move everything submitted so far onto the pending queue. Called with
+ * bc_mtx held, so admission order is submission order.
+ */
+static void
+blockif_admit(struct blockif_ctxt *bc)
+{
+	struct blockif_elem *be;
+
+	while ((be = blockif_ring_get(&bc->bc_subr)) != NULL)
+		blockif_enqueue(bc, be);
 }
 
 static int
@@ -181,6 +448,7 @@ blockif_dequeue(struct blockif_ctxt *bc, pthread_t t, struct blockif_elem **bep)
 {
 	struct blockif_elem *be;
 
+	blockif_admit(bc);
 	TAILQ_FOREACH(be, &bc->bc_pendq, be_link) {
 		if (be->be_status == BST_PEND)
 			break;
@@ -196,6 +464,53 @@ blockif_dequeue(struct blockif_ctxt *bc, pthread_t t, struct blockif_elem **bep)
 	return (1);
 }
 
+/*
+ * Append pending reads or writes that continue where 'be' ends to its
+ * be_next chain, so that the whole run can be issued as one vectored
+ * syscall of at most MAXPHYS bytes and IOV_MAX segments. A request is
+ * only taken if nothing outside the chain would have held it back.
+ */
+static void
+blockif_coalesce(struct blockif_ctxt *bc, pthread_t t, struct blockif_elem *be)
+{
+	struct blockif_elem *tail, *tbe;
+	off_t bytes, len;
+	int iovcnt;
+
+	if (bc->bc_isgeom || bc->bc_cache != NULL ||
+	    (be->be_op != BOP_READ && be->be_op != BOP_WRITE))
+		return;
+
+	bytes = be->be_block - be->be_req->br_offset;
+	iovcnt = be->be_req->br_iovcnt;
+	for (tail = be;; tail = tbe) {
+		TAILQ_FOREACH(tbe, &bc->bc_busyq, be_link) {
+			if (tbe != tail && tbe->be_block == tail->be_block)
+				return;
+		}
+		TAILQ_FOREACH(tbe, &bc->bc_pendq, be_link) {
+			if (tbe->be_block == tail->be_block)
+				return;
+			if (tbe->be_req->br_offset == tail->be_block)
+				break;
+		}
+		if (tbe == NULL || tbe->be_op != be->be_op)
+			return;
+		len = tbe->be_block - tbe->be_req->br_offset;
+		if (bytes + len > MAXPHYS ||
+		    iovcnt + tbe->be_req->br_iovcnt > IOV_MAX)
+			return;
+
+		TAILQ_REMOVE(&bc->bc_pendq, tbe, be_link);
+		tbe->be_status = BST_BUSY;
+		tbe->be_tid = t;
+		TAILQ_INSERT_TAIL(&bc->bc_busyq, tbe, be_link);
+		tail->be_next = tbe;
+		bytes += len;
+		iovcnt += tbe->be_req->br_iovcnt;
+	}
+}
+
 static void
 blockif_complete(struct blockif_ctxt *bc, struct blockif_elem *be)
 {
@@ -212,12 +527,235 @@ blockif_complete(struct blockif_ctxt *bc, struct blockif_elem *be)
 	be->be_tid = 0;
 	be->be_status = BST_FREE;
 	be->be_req = NULL;
-	TAILQ_INSERT_TAIL(&bc->bc_freeq, be, be_link);
+	blockif_ring_put(&bc->bc_freer, be);
+}
+
+/*
+ * Called by an engine thread, with bc_mtx held, before it sleeps.
+ * Returns non-zero if work was submitted in the meantime and the
+ * thread should not sleep; the caller must call blockif_busy() after
+ * either outcome.
+ */
+static int
+blockif_idle(struct blockif_ctxt *bc)
+{
+
+	atomic_add_int(&bc->bc_idle, 1);
+	atomic_thread_fence_seq_cst();
+	return (!blockif_ring_empty(&bc->bc_subr));
+}
+
+static void
+blockif_busy(struct blockif_ctxt *bc)
+{
+
+	atomic_subtract_int(&bc->bc_idle, 1);
+}
+
+/*
+ * Return non-zero if a worker could dequeue a request right now.
+ * Called with bc_mtx held.
+ */
+static int
+blockif_runnable(struct blockif_ctxt *bc)
+{
+	struct blockif_elem *be;
+
+	if (bc->bc_paused)
+		return (0);
+	blockif_admit(bc);
+	TAILQ_FOREACH(be, &bc->bc_pendq, be_link) {
+		if (be->be_status == BST_PEND)
+			return (1);
+	}
+	return (0);
+}
+
+static void
+blockif_bounce_init(void)
+{
+	size_t len;
+	int i;
+
+	len = BLOCKIF_BOUNCE_NBUF * MAXPHYS;
+	blockif_bounce.bp_base = mmap(NULL, len, PROT_READ | PROT_WRITE,
+	    MAP_ANON | MAP_PRIVATE | MAP_ALIGNED_SUPER, -1, 0);
+	if (blockif_bounce.bp_base == MAP_FAILED)
+		blockif_bounce.bp_base = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		    MAP_ANON | MAP_PRIVATE, -1, 0);
+	if (blockif_bounce.bp_base == MAP_FAILED) {
+		blockif_bounce.bp_base = NULL;
+		return;
+	}
+	for (i = 0; i < BLOCKIF_BOUNCE_NBUF; i++)
+		blockif_bounce.bp_free[i] = blockif_bounce.bp_base + i * MAXPHYS;
+	blockif_bounce.bp_nfree = BLOCKIF_BOUNCE_NBUF;
+}
+
+static uint8_t *
+blockif_bounce_get(size_t len)
+{
+	void *p;
+
+	p = NULL;
+	if (len <= MAXPHYS) {
+		pthread_mutex_lock(&blockif_bounce.bp_mtx);
+		if (blockif_bounce.bp_nfree > 0)
+			p = blockif_bounce.bp_free[--blockif_bounce.bp_nfree];
+		pthread_mutex_unlock(&blockif_bounce.bp_mtx);
+	}
+	if (p == NULL && posix_memalign(&p, PAGE_SIZE, len) != 0)
+		return (NULL);
+	return (p);
+}
+
+static void
+blockif_bounce_put(uint8_t *p)
+{
+	uint8_t *base;
+
+	base = blockif_bounce.bp_base;
+	if (base == NULL || p < base ||
+	    p >= base + BLOCKIF_BOUNCE_NBUF * MAXPHYS) {
+		free(p);
+		return;
+	}
+	pthread_mutex_lock(&blockif_bounce.bp_mtx);
+	blockif_bounce.bp_free[blockif_bounce.bp_nfree++] = p;
+	pthread_mutex_unlock(&blockif_bounce.bp_mtx);
+}
+
+static int
+blockif_iov_aligned(struct blockif_ctxt *bc, const struct iovec *iov)
+{
+
+	return ((((uintptr_t)iov->iov_base | iov->iov_len) &
+	    (bc->bc_align - 1)) == 0);
+}
+
+/*
+ * Walk the runs of misaligned segments of a direct i/o request. A run
+ * starts at a misaligned segment and extends until it covers a multiple
+ * of the alignment and the next segment is aligned; it is replaced by a
+ * single segment in the bounce buffer. With 'diov' NULL just return the
+ * bounce space needed; otherwise fill in 'diov', returning its segment
+ * count, and copy the runs into the bounce buffer ('in') or out of it.
+ */
+static size_t
+blockif_direct_runs(struct blockif_ctxt *bc, const struct iovec *iov,
+    int iovcnt, struct iovec *diov, uint8_t *bounce, int in)
+{
+	size_t bpos, rlen;
+	int i, n;
+
+	bpos = 0;
+	n = 0;
+	i = 0;
+	while (i < iovcnt) {
+		if (blockif_iov_aligned(bc, &iov[i])) {
+			if (diov != NULL)
+				diov[n++] = iov[i];
+			i++;
+			continue;
+		}
+		rlen = 0;
+		do {
+			if (diov != NULL) {
+				if (in)
+					memcpy(bounce + bpos + rlen,
+					    iov[i].iov_base, iov[i].iov_len);
+				else
+					memcpy(iov[i].iov_base,
+					    bounce + bpos + rlen,
+					    iov[i].iov_len);
+			}
+			rlen += iov[i++].iov_len;
+		} while (i < iovcnt && ((rlen & (bc->bc_align - 1)) != 0 ||
+		    !blockif_iov_aligned(bc, &iov[i])));
+		if (diov != NULL) {
+			diov[n].iov_base = bounce + bpos;
+			diov[n].iov_len = rlen;
+			n++;
+		}
+		bpos += rlen;
+	}
+
+	return (diov != NULL ? (size_t)n : bpos);
+}
+
+/*
+ * O_DIRECT i/o on a raw image: aligned segments go straight to the
+ * device, misaligned ones through a bounce buffer.
+ */
+static ssize_t
+blockif_direct_io(struct blockif_ctxt *bc, const struct iovec *iov,
+    int iovcnt, off_t off, int write)
+{
+	struct iovec diov[IOV_MAX];
+	size_t blen;
+	ssize_t len;
+	uint8_t *bounce;
+	int n;
+
+	blen = blockif_direct_runs(bc, iov, iovcnt, NULL, NULL, 0);
+	if (blen == 0) {
+		if (write)
+			return (pwritev(bc->bc_fd, iov, iovcnt, off));
+		return (preadv(bc->bc_fd, iov, iovcnt, off));
+	}
+
+	if ((bounce = blockif_bounce_get(blen)) == NULL) {
+		errno = ENOMEM;
+		return (-1);
+	}
+	n = blockif_direct_runs(bc, iov, iovcnt, diov, bounce, write);
+	if (write)
+		len = pwritev(bc->bc_fd, diov, n, off);
+	else {
+		len = preadv(bc->bc_fd, diov, n, off);
+		if (len > 0)
+			blockif_direct_runs(bc, iov, iovcnt, diov, bounce, 0);
+	}
+	blockif_bounce_put(bounce);
+
+	return (len);
+}
+
+static ssize_t
+blockif_preadv(struct blockif_ctxt *bc, const struct iovec *iov, int iovcnt,
+    off_t off)
+{
+
+	if (bc->bc_qcow != NULL)
+		return (qcow2_preadv(bc->bc_qcow, iov, iovcnt, off));
+	if (bc->bc_ovl != NULL)
+		return (ovl_preadv(bc->bc_ovl, iov, iovcnt, off));
+	if (bc->bc_direct)
+		return (blockif_direct_io(bc, iov, iovcnt, off, 0));
+	return (preadv(bc->bc_fd, iov, iovcnt, off));
+}
+
+static ssize_t
+blockif_pwritev(struct blockif_ctxt *bc, const struct iovec *iov, int iovcnt,
+    off_t off)
+{
+
+	if (bc->bc_qcow != NULL)
+		return (qcow2_pwritev(bc->bc_qcow, iov, iovcnt, off));
+	if (bc->bc_ovl != NULL)
+		return (ovl_pwritev(bc->bc_ovl, iov, iovcnt, off));
+	if (bc->bc_direct)
+		return (blockif_direct_io(bc, iov, iovcnt, off, 1));
+	return (pwritev(bc->bc_fd, iov, iovcnt, off));
 }
 
 static int
 blockif_flush_bc(struct blockif_ctxt *bc)
 {
+	if (bc->bc_qcow != NULL)
+		return (qcow2_flush(bc->bc_qcow));
+	if (bc->bc_ovl != NULL)
+		return (ovl_flush(bc->bc_ovl));
 	if (bc->bc_ischr) {
 		if (ioctl(bc->bc_fd, DIOCGFLUSH))
 			return (errno);
@@ -227,67 +765,610 @@ blockif_flush_bc(struct blockif_ctxt *bc)
 	return (0);
 }
 
+static size_t
+blockif_cache_maplen(u_int nsets)
+{
+	size_t len;
+
+	len = roundup2(sizeof(struct blockif_cache_hdr), CACHE_LINE_SIZE);
+	len += nsets * sizeof(struct blockif_cache_set);
+	len = roundup2(len, PAGE_SIZE);
+	return (len + (size_t)nsets * BLOCKIF_CACHE_WAYS * BLOCKIF_CACHE_SEGSZ);
+}
+
 static void
-blockif_proc(struct blockif_ctxt *bc, struct blockif_elem *be, uint8_t *buf)
+blockif_cache_setup(struct blockif_cache *c, void *base, size_t maplen,
+    u_int nsets)
 {
-	struct blockif_req *br;
-	off_t arg[2];
-	ssize_t clen, len, off, boff, voff;
-	int i, err;
+	size_t off;
+
+	c->c_hdr = base;
+	off = roundup2(sizeof(struct blockif_cache_hdr), CACHE_LINE_SIZE);
+	c->c_sets = (struct blockif_cache_set *)((uint8_t *)base + off);
+	off = roundup2(off + nsets * sizeof(struct blockif_cache_set),
+	    PAGE_SIZE);
+	c->c_data = (uint8_t *)base + off;
+	c->c_maplen = maplen;
+}
 
-	br = be->be_req;
-	if (br->br_iovcnt <= 1)
-		buf = NULL;
-	err = 0;
-	switch (be->be_op) {
-	case BOP_READ:
-		if (buf == NULL) {
-			if ((len = preadv(bc->bc_fd, br->br_iov, br->br_iovcnt,
-				   br->br_offset)) < 0)
-				err = errno;
-			else
-				br->br_resid -= len;
+static struct blockif_cache *
+blockif_cache_open(const struct stat *sbuf, off_t size, int mb)
+{
+	char name[64];
+	pthread_mutexattr_t attr;
+	struct blockif_cache *c;
+	struct blockif_cache_hdr *ch;
+	struct stat st;
+	size_t maplen;
+	void *base;
+	u_int nsets;
+	int creat, fd, i, j, retry, tries;
+
+	snprintf(name, sizeof(name), "/bhyve-blkcache-%ju-%ju",
+	    (uintmax_t)sbuf->st_dev, (uintmax_t)sbuf->st_ino);
+	nsets = MAX(1, ((size_t)mb << 20) /
+	    (BLOCKIF_CACHE_SEGSZ * BLOCKIF_CACHE_WAYS));
+
+	c = calloc(1, sizeof(struct blockif_cache));
+	if (c == NULL)
+		return (NULL);
+
+	for (retry = 0; retry < 2; retry++) {
+		creat = 1;
+		fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+		if (fd < 0 && errno == EEXIST) {
+			creat = 0;
+			fd = shm_open(name, O_RDWR, 0);
+		}
+		if (fd < 0) {
+			warn("Could not open block cache %s", name);
 			break;
 		}
-		i = 0;
-		off = voff = 0;
-		while (br->br_resid > 0) {
-			len = MIN(br->br_resid, MAXPHYS);
-			if (pread(bc->bc_fd, buf, len, br->br_offset +
-			    off) < 0) {
-				err = errno;
+
+		if (creat) {
+			maplen = blockif_cache_maplen(nsets);
+			if (ftruncate(fd, maplen) < 0) {
+				warn("Could not size block cache %s", name);
+				close(fd);
+				shm_unlink(name);
 				break;
 			}
-			boff = 0;
-			do {
-				clen = MIN(len - boff, br->br_iov[i].iov_len -
-				    voff);
-				memcpy(br->br_iov[i].iov_base + voff,
-				    buf + boff, clen);
-				if (clen < br->br_iov[i].iov_len - voff)
-					voff += clen;
-				else {
-					i++;
-					voff = 0;
+		} else {
+			/* Wait for the creator to size the object */
+			maplen = 0;
+			for (tries = 0; tries < 100; tries++) {
+				if (fstat(fd, &st) == 0 && st.st_size > 0) {
+					maplen = st.st_size;
+					break;
 				}
-				boff += clen;
-			} while (boff < len);
-			off += len;
-			br->br_resid -= len;
+				usleep(10000);
+			}
+			if (maplen == 0) {
+				warnx("Block cache %s was never sized", name);
+				close(fd);
+				break;
+			}
 		}
-		break;
-	case BOP_WRITE:
-		if (bc->bc_rdonly) {
-			err = EROFS;
+
+		base = mmap(NULL, maplen, PROT_READ | PROT_WRITE, MAP_SHARED,
+		    fd, 0);
+		close(fd);
+		if (base == MAP_FAILED) {
+			warn("Could not map block cache %s", name);
 			break;
 		}
-		if (buf == NULL) {
-			if ((len = pwritev(bc->bc_fd, br->br_iov, br->br_iovcnt,
-				    br->br_offset)) < 0)
-				err = errno;
-			else
-				br->br_resid -= len;
-			break;
+		ch = base;
+
+		if (creat) {
+			blockif_cache_setup(c, base, maplen, nsets);
+			ch->ch_magic = BLOCKIF_CACHE_MAGIC;
+			ch->ch_nsets = nsets;
+			ch->ch_dev = sbuf->st_dev;
+			ch->ch_ino = sbuf->st_ino;
+			ch->ch_size = size;
+			ch->ch_mtime = sbuf->st_mtim;
+			pthread_mutexattr_init(&attr);
+			pthread_mutexattr_setpshared(&attr,
+			    PTHREAD_PROCESS_SHARED);
+			pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+			for (i = 0; i < nsets; i++) {
+				pthread_mutex_init(&c->c_sets[i].cs_mtx, &attr);
+				for (j = 0; j < BLOCKIF_CACHE_WAYS; j++)
+					c->c_sets[i].cs_ent[j].ce_seg = -1;
+			}
+			pthread_mutexattr_destroy(&attr);
+			atomic_store_rel_int(&ch->ch_ready, 1);
+			return (c);
+		}
+
+		for (tries = 0; tries < 100; tries++) {
+			if (atomic_load_acq_int(&ch->ch_ready))
+				break;
+			usleep(10000);
+		}
+		if (atomic_load_acq_int(&ch->ch_ready) &&
+		    ch->ch_magic == BLOCKIF_CACHE_MAGIC &&
+		    ch->ch_dev == sbuf->st_dev && ch->ch_ino == sbuf->st_ino &&
+		    ch->ch_size == size &&
+		    ch->ch_mtime.tv_sec == sbuf->st_mtim.tv_sec &&
+		    ch->ch_mtime.tv_nsec == sbuf->st_mtim.tv_nsec &&
+		    maplen >= blockif_cache_maplen(ch->ch_nsets)) {
+			blockif_cache_setup(c, base, maplen, ch->ch_nsets);
+			return (c);
+		}
+
+		/*
+		 * Left behind by an earlier version of the image (or by a
+		 * creator that died): discard it and start over.
+		 */
+		munmap(base, maplen);
+		shm_unlink(name);
+	}
+
+	EPRINTLN("Block cache disabled for this image");
+	free(c);
+	return (NULL);
+}
+
+static void
+blockif_cache_close(struct blockif_cache *c)
+{
+
+	munmap(c->c_hdr, c->c_maplen);
+	free(c);
+}
+
+static struct blockif_cache_set *
+blockif_cache_lock(struct blockif_cache *c, off_t seg)
+{
+	struct blockif_cache_set *cs;
+	int i;
+
+	cs = &c->c_sets[(((uint64_t)seg * 0x9e3779b97f4a7c15ull) >> 32) %
+	    c->c_hdr->ch_nsets];
+	if (pthread_mutex_lock(&cs->cs_mtx) == EOWNERDEAD) {
+		/* The previous holder may have died mid-copy */
+		for (i = 0; i < BLOCKIF_CACHE_WAYS; i++)
+			cs->cs_ent[i].ce_seg = -1;
+		pthread_mutex_consistent(&cs->cs_mtx);
+	}
+	return (cs);
+}
+
+static uint8_t *
+blockif_cache_data(struct blockif_cache *c, struct blockif_cache_set *cs,
+    int way)
+{
+	size_t idx;
+
+	idx = (cs - c->c_sets) * BLOCKIF_CACHE_WAYS + way;
+	return (c->c_data + idx * BLOCKIF_CACHE_SEGSZ);
+}
+
+/*
+ * Copy 'len' bytes from 'src' into the request's iovecs at position
+ * (*iovi, *voff), advancing the position.
+ */
+static void
+blockif_copyout(struct blockif_req *br, int *iovi, size_t *voff,
+    const uint8_t *src, size_t len)
+{
+	size_t clen;
+
+	while (len > 0 && *iovi < br->br_iovcnt) {
+		clen = MIN(len, br->br_iov[*iovi].iov_len - *voff);
+		memcpy((uint8_t *)br->br_iov[*iovi].iov_base + *voff, src,
+		    clen);
+		src += clen;
+		len -= clen;
+		*voff += clen;
+		if (*voff == br->br_iov[*iovi].iov_len) {
+			(*iovi)++;
+			*voff = 0;
+		}
+	}
+}
+
+/*
+ * Satisfy a read through the shared cache, one segment at a time.
+ * Misses read the whole segment into 'buf' and install it.
+ */
+static int
+blockif_cache_read(struct blockif_ctxt *bc, struct blockif_req *br,
+    uint8_t *buf)
+{
+	struct blockif_cache *c;
+	struct blockif_cache_set *cs;
+	struct blockif_cache_ent *ce, *victim;
+	struct iovec iov;
+	off_t off, seg;
+	ssize_t len;
+	size_t clen, soff, voff;
+	int i, iovi;
+
+	c = bc->bc_cache;
+	off = br->br_offset;
+	iovi = 0;
+	voff = 0;
+	while (br->br_resid > 0) {
+		seg = off / BLOCKIF_CACHE_SEGSZ;
+		soff = off % BLOCKIF_CACHE_SEGSZ;
+		clen = MIN(br->br_resid, BLOCKIF_CACHE_SEGSZ - soff);
+
+		cs = blockif_cache_lock(c, seg);
+		for (i = 0; i < BLOCKIF_CACHE_WAYS; i++) {
+			ce = &cs->cs_ent[i];
+			if (ce->ce_seg == seg)
+				break;
+		}
+		if (i < BLOCKIF_CACHE_WAYS) {
+			ce->ce_stamp = atomic_fetchadd_64(&c->c_hdr->ch_clock, 1);
+			len = ce->ce_len;
+			if (len > soff)
+				blockif_copyout(br, &iovi, &voff,
+				    blockif_cache_data(c, cs, i) + soff,
+				    MIN(clen, len - soff));
+			pthread_mutex_unlock(&cs->cs_mtx);
+		} else {
+			pthread_mutex_unlock(&cs->cs_mtx);
+
+			iov.iov_base = buf;
+			iov.iov_len = BLOCKIF_CACHE_SEGSZ;
+			len = blockif_preadv(bc, &iov, 1,
+			    seg * BLOCKIF_CACHE_SEGSZ);
+			if (len < 0)
+				return (errno);
+			if (len > soff)
+				blockif_copyout(br, &iovi, &voff, buf + soff,
+				    MIN(clen, len - soff));
+
+			/* Another process may have filled it meanwhile */
+			cs = blockif_cache_lock(c, seg);
+			victim = &cs->cs_ent[0];
+			for (i = 0; i < BLOCKIF_CACHE_WAYS; i++) {
+				ce = &cs->cs_ent[i];
+				if (ce->ce_seg == seg || ce->ce_seg == -1) {
+					victim = ce;
+					break;
+				}
+				if (ce->ce_stamp < victim->ce_stamp)
+					victim = ce;
+			}
+			i = victim - cs->cs_ent;
+			memcpy(blockif_cache_data(c, cs, i), buf, len);
+			victim->ce_seg = seg;
+			victim->ce_len = len;
+			victim->ce_stamp =
+			    atomic_fetchadd_64(&c->c_hdr->ch_clock, 1);
+			pthread_mutex_unlock(&cs->cs_mtx);
+		}
+
+		if (len < soff + clen) {
+			/* Short read at the end of the image */
+			if (len > soff)
+				br->br_resid -= len - soff;
+			break;
+		}
+		off += clen;
+		br->br_resid -= clen;
+	}
+
+	return (0);
+}
+
+static uint64_t
+blockif_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_FAST, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+static void
+blockif_hist_add(struct blockif_opstats *os, enum blocklat lat, uint64_t ns)
+{
+	int b;
+
+	b = ns != 0 ? flsll(ns) - 1 : 0;
+	if (b >= BLOCKIF_HIST_BUCKETS)
+		b = BLOCKIF_HIST_BUCKETS - 1;
+	atomic_add_64(&os->os_hist[lat][b], 1);
+}
+
+/*
+ * Hand a finished element back to its device model, accounting for it
+ * in the device's statistics.
+ */
+static void
+blockif_done(struct blockif_ctxt *bc, struct blockif_elem *be, int err)
+{
+	struct blockif_opstats *os;
+	struct blockif_req *br;
+	uint64_t tdone, tcb;
+	off_t bytes;
+
+	/*
+	 * The callback hands the request back to the device model, which may
+	 * reuse it at once, so everything taken from it is read beforehand.
+	 */
+	br = be->be_req;
+	os = &bc->bc_stats[be->be_op];
+	bytes = be->be_len - (be->be_op != BOP_FLUSH ? br->br_resid : 0);
+
+	tdone = blockif_nsec();
+	be->be_status = BST_DONE;
+	(*br->br_callback)(br, err);
+	tcb = blockif_nsec();
+
+	atomic_add_64(&os->os_ops, 1);
+	if (err != 0)
+		atomic_add_64(&os->os_errors, 1);
+	else
+		atomic_add_64(&os->os_bytes, bytes);
+	blockif_hist_add(os, BLAT_QUEUE, be->be_tstart - be->be_tsub);
+	blockif_hist_add(os, BLAT_SERVICE, tdone - be->be_tstart);
+	blockif_hist_add(os, BLAT_CALLBACK, tcb - tdone);
+}
+
+/*
+ * Find a cached extent covering [off, off + len). Called with bc_hmtx
+ * held.
+ */
+static struct blockif_extent *
+blockif_hmap_lookup(struct blockif_ctxt *bc, off_t off, off_t len)
+{
+	struct blockif_extent *ext;
+	int i;
+
+	for (i = 0; i < BLOCKIF_HMAP_SIZE; i++) {
+		ext = &bc->bc_hmap[i];
+		if (ext->ext_start <= off && off + len <= ext->ext_end) {
+			ext->ext_stamp = ++bc->bc_hclock;
+			return (ext);
+		}
+	}
+	return (NULL);
+}
+
+/*
+ * Remember an extent found by lseek(2), unless the map was invalidated
+ * since 'gen' was sampled, in which case the extent may be stale.
+ */
+static void
+blockif_hmap_insert(struct blockif_ctxt *bc, off_t start, off_t end,
+    int hole, uint64_t gen)
+{
+	struct blockif_extent *ext, *victim;
+	int i;
+
+	pthread_mutex_lock(&bc->bc_hmtx);
+	if (gen == bc->bc_hgen) {
+		victim = &bc->bc_hmap[0];
+		for (i = 0; i < BLOCKIF_HMAP_SIZE; i++) {
+			ext = &bc->bc_hmap[i];
+			if (ext->ext_stamp < victim->ext_stamp)
+				victim = ext;
+		}
+		victim->ext_start = start;
+		victim->ext_end = end;
+		victim->ext_hole = hole;
+		victim->ext_stamp = ++bc->bc_hclock;
+	}
+	pthread_mutex_unlock(&bc->bc_hmtx);
+}
+
+/*
+ * Drop the cached extents overlapping [off, off + len) after it was
+ * written (data) or punched (!data). Must be called once the file has
+ * been changed so that concurrent lookups cannot cache the old state.
+ */
+static void
+blockif_hmap_invalidate(struct blockif_ctxt *bc, off_t off, off_t len,
+    int data)
+{
+	struct blockif_extent *ext;
+	int i;
+
+	pthread_mutex_lock(&bc->bc_hmtx);
+	for (i = 0; i < BLOCKIF_HMAP_SIZE; i++) {
+		ext = &bc->bc_hmap[i];
+		if (ext->ext_end <= off || off + len <= ext->ext_start)
+			continue;
+		if (data && !ext->ext_hole)
+			continue;
+		ext->ext_start = ext->ext_end = 0;
+		ext->ext_stamp = 0;
+	}
+	bc->bc_hgen++;
+	pthread_mutex_unlock(&bc->bc_hmtx);
+}
+
+/*
+ * Return 1 if [off, off + len) of a sparse file lies in a hole.
+ */
+static int
+blockif_hole(struct blockif_ctxt *bc, off_t off, off_t len)
+{
+	struct blockif_extent *ext;
+	uint64_t gen;
+	off_t data, hole;
+	int ishole;
+
+	pthread_mutex_lock(&bc->bc_hmtx);
+	if ((ext = blockif_hmap_lookup(bc, off, len)) != NULL) {
+		ishole = ext->ext_hole;
+		pthread_mutex_unlock(&bc->bc_hmtx);
+		return (ishole);
+	}
+	gen = bc->bc_hgen;
+	pthread_mutex_unlock(&bc->bc_hmtx);
+
+	data = lseek(bc->bc_fd, off, SEEK_DATA);
+	if (data < 0) {
+		if (errno != ENXIO)
+			return (0);
+		data = bc->bc_size;	/* no data past off */
+	}
+	if (data > off) {
+		blockif_hmap_insert(bc, off, data, 1, gen);
+		return (off + len <= data);
+	}
+
+	hole = lseek(bc->bc_fd, off, SEEK_HOLE);
+	if (hole > off)
+		blockif_hmap_insert(bc, off, hole, 0, gen);
+	return (0);
+}
+
+static int
+blockif_iszero(const struct iovec *iov, int iovcnt)
+{
+	const uint8_t *p;
+	size_t len;
+	int i;
+
+	for (i = 0; i < iovcnt; i++) {
+		p = iov[i].iov_base;
+		len = iov[i].iov_len;
+		if (len > 0 && (p[0] != 0 || memcmp(p, p + 1, len - 1) != 0))
+			return (0);
+	}
+	return (1);
+}
+
+static int
+blockif_punch(struct blockif_ctxt *bc, off_t off, off_t len)
+{
+#ifdef SPACECTL_DEALLOC
+	struct spacectl_range sr;
+
+	sr.r_offset = off;
+	sr.r_len = len;
+	while (sr.r_len > 0) {
+		if (fspacectl(bc->bc_fd, SPACECTL_DEALLOC, &sr, 0, &sr) < 0)
+			return (errno);
+	}
+	blockif_hmap_invalidate(bc, off, len, 0);
+	return (0);
+#else
+	return (EOPNOTSUPP);
+#endif
+}
+
+/*
+ * Reads of a hole in a sparse file are zero-filled without i/o; returns
+ * 1 if the read was satisfied that way.
+ */
+static int
+blockif_sparse_read(struct blockif_ctxt *bc, const struct iovec *iov,
+    int iovcnt, off_t off, off_t len)
+{
+	int i;
+
+	if (!bc->bc_sparse || !blockif_hole(bc, off, len))
+		return (0);
+	for (i = 0; i < iovcnt; i++)
+		memset(iov[i].iov_base, 0, iov[i].iov_len);
+	return (1);
+}
+
+/*
+ * All-zero writes to a sparse file are turned into hole punches so that
+ * thin images stay thin; returns 1 if the write was done that way. A
+ * failed punch leaves the write to be done normally.
+ */
+static int
+blockif_sparse_write(struct blockif_ctxt *bc, const struct iovec *iov,
+    int iovcnt, off_t off, off_t len)
+{
+
+	if (!bc->bc_sparse || !bc->bc_candelete || len < BLOCKIF_PUNCH_MIN ||
+	    !blockif_iszero(iov, iovcnt))
+		return (0);
+	return (blockif_punch(bc, off, len) == 0);
+}
+
+static void
+blockif_proc(struct blockif_ctxt *bc, struct blockif_elem *be, uint8_t *buf)
+{
+	struct blockif_req *br;
+	off_t arg[2];
+	ssize_t clen, len, off, boff, voff;
+	int i, err;
+
+	br = be->be_req;
+	be->be_tstart = blockif_nsec();
+	if (be->be_op == BOP_READ && bc->bc_cache != NULL) {
+		err = blockif_cache_read(bc, br, buf);
+		goto done;
+	}
+	if (br->br_iovcnt <= 1)
+		buf = NULL;
+	err = 0;
+	switch (be->be_op) {
+	case BOP_READ:
+		if (blockif_sparse_read(bc, br->br_iov, br->br_iovcnt,
+		    br->br_offset, br->br_resid)) {
+			br->br_resid = 0;
+			break;
+		}
+		if (buf == NULL) {
+			if ((len = blockif_preadv(bc, br->br_iov, br->br_iovcnt,
+				   br->br_offset)) < 0)
+				err = errno;
+			else
+				br->br_resid -= len;
+			break;
+		}
+		i = 0;
+		off = voff = 0;
+		while (br->br_resid > 0) {
+			len = MIN(br->br_resid, MAXPHYS);
+			if (pread(bc->bc_fd, buf, len, br->br_offset +
+			    off) < 0) {
+				err = errno;
+				break;
+			}
+			boff = 0;
+			do {
+				clen = MIN(len - boff, br->br_iov[i].iov_len -
+				    voff);
+				memcpy(br->br_iov[i].iov_base + voff,
+				    buf + boff, clen);
+				if (clen < br->br_iov[i].iov_len - voff)
+					voff += clen;
+				else {
+					i++;
+					voff = 0;
+				}
+				boff += clen;
+			} while (boff < len);
+			off += len;
+			br->br_resid -= len;
+		}
+		break;
+	case BOP_WRITE:
+		if (bc->bc_rdonly) {
+			err = EROFS;
+			break;
+		}
+		if (blockif_sparse_write(bc, br->br_iov, br->br_iovcnt,
+		    br->br_offset, br->br_resid)) {
+			br->br_resid = 0;
+			break;
+		}
+		if (buf == NULL) {
+			if ((len = blockif_pwritev(bc, br->br_iov,
+			    br->br_iovcnt, br->br_offset)) < 0)
+				err = errno;
+			else {
+				if (bc->bc_sparse)
+					blockif_hmap_invalidate(bc,
+					    br->br_offset, len, 1);
+				br->br_resid -= len;
+			}
+			break;
 		}
 		i = 0;
 		off = voff = 0;
@@ -312,48 +1393,590 @@ blockif_proc(struct blockif_ctxt *bc, struct blockif_elem *be, uint8_t *buf)
 				err = errno;
 				break;
 			}
-			off += len;
-			br->br_resid -= len;
+			off += len;
+			br->br_resid -= len;
+		}
+		break;
+	case BOP_FLUSH:
+		err = blockif_flush_bc(bc);
+		break;
+	case BOP_DELETE:
+		if (!bc->bc_candelete)
+			err = EOPNOTSUPP;
+		else if (bc->bc_rdonly)
+			err = EROFS;
+		else if (bc->bc_ischr) {
+			arg[0] = br->br_offset;
+			arg[1] = br->br_resid;
+			if (ioctl(bc->bc_fd, DIOCGDELETE, arg))
+				err = errno;
+			else
+				br->br_resid = 0;
+		} else if (bc->bc_sparse) {
+			if ((err = blockif_punch(bc, br->br_offset,
+			    br->br_resid)) == 0)
+				br->br_resid = 0;
+		} else if (bc->bc_qcow != NULL) {
+			if ((err = qcow2_discard(bc->bc_qcow, br->br_offset,
+			    br->br_resid)) == 0)
+				br->br_resid = 0;
+		} else
+			err = EOPNOTSUPP;
+		break;
+	default:
+		err = EINVAL;
+		break;
+	}
+
+done:
+	blockif_done(bc, be, err);
+}
+
+/*
+ * Issue a chain built by blockif_coalesce() as a single preadv/pwritev
+ * and hand each request its share of the result.
+ */
+static void
+blockif_proc_chain(struct blockif_ctxt *bc, struct blockif_elem *be,
+    struct iovec *iov)
+{
+	struct blockif_elem *tbe;
+	struct blockif_req *br;
+	ssize_t clen, len;
+	off_t off, total;
+	int i, n, err;
+
+	n = 0;
+	for (tbe = be; tbe != NULL; tbe = tbe->be_next) {
+		br = tbe->be_req;
+		tbe->be_tstart = blockif_nsec();
+		for (i = 0; i < br->br_iovcnt; i++)
+			iov[n++] = br->br_iov[i];
+	}
+
+	err = 0;
+	off = be->be_req->br_offset;
+	for (tbe = be; tbe->be_next != NULL; tbe = tbe->be_next)
+		;
+	total = tbe->be_block - off;
+	len = 0;
+	if (be->be_op == BOP_READ) {
+		if (blockif_sparse_read(bc, iov, n, off, total))
+			len = total;
+		else
+			len = blockif_preadv(bc, iov, n, off);
+	} else if (bc->bc_rdonly)
+		err = EROFS;
+	else if (blockif_sparse_write(bc, iov, n, off, total))
+		len = total;
+	else {
+		len = blockif_pwritev(bc, iov, n, off);
+		if (len > 0 && bc->bc_sparse)
+			blockif_hmap_invalidate(bc, off, len, 1);
+	}
+	if (len < 0)
+		err = errno;
+
+	for (tbe = be; tbe != NULL; tbe = tbe->be_next) {
+		br = tbe->be_req;
+		if (err == 0) {
+			clen = MIN(len, tbe->be_block - br->br_offset);
+			br->br_resid -= clen;
+			len -= clen;
+		}
+		blockif_done(bc, tbe, err);
+	}
+}
+
+static void
+blockif_proc_elem(struct blockif_ctxt *bc, struct blockif_elem *be,
+    uint8_t *buf, struct iovec *iov)
+{
+
+	if (be->be_next == NULL)
+		blockif_proc(bc, be, buf);
+	else
+		blockif_proc_chain(bc, be, iov);
+}
+
+static void
+blockif_complete_chain(struct blockif_ctxt *bc, struct blockif_elem *be)
+{
+	struct blockif_elem *next;
+
+	for (; be != NULL; be = next) {
+		next = be->be_next;
+		be->be_next = NULL;
+		blockif_complete(bc, be);
+	}
+}
+
+static void *
+blockif_thr(void *arg)
+{
+	struct blockif_ctxt *bc;
+	struct blockif_elem *be;
+	struct iovec *iov;
+	pthread_t t;
+	uint8_t *buf;
+
+	bc = arg;
+	if (bc->bc_isgeom || bc->bc_cache != NULL)
+		buf = malloc(MAXPHYS);
+	else
+		buf = NULL;
+	iov = malloc(IOV_MAX * sizeof(struct iovec));
+	t = pthread_self();
+
+	pthread_mutex_lock(&bc->bc_mtx);
+	for (;;) {
+		bc->bc_work_count++;
+
+		/* We cannot process work if the interface is paused */
+		while (!bc->bc_paused && blockif_dequeue(bc, t, &be)) {
+			if (iov != NULL)
+				blockif_coalesce(bc, t, be);
+			pthread_mutex_unlock(&bc->bc_mtx);
+			blockif_proc_elem(bc, be, buf, iov);
+			pthread_mutex_lock(&bc->bc_mtx);
+			blockif_complete_chain(bc, be);
+		}
+
+		bc->bc_work_count--;
+
+		/* If none of the workers are busy, notify the main thread */
+		if (bc->bc_work_count == 0)
+			pthread_cond_broadcast(&bc->bc_work_done_cond);
+
+		/* Check ctxt status here to see if exit requested */
+		if (bc->bc_closing)
+			break;
+
+		/* Make all worker threads wait here if the device is paused */
+		while (bc->bc_paused)
+			pthread_cond_wait(&bc->bc_paused_cond, &bc->bc_mtx);
+
+		if (!blockif_idle(bc))
+			pthread_cond_wait(&bc->bc_cond, &bc->bc_mtx);
+		blockif_busy(bc);
+	}
+	pthread_mutex_unlock(&bc->bc_mtx);
+
+	free(iov);
+	if (buf)
+		free(buf);
+	pthread_exit(NULL);
+	return (NULL);
+}
+
+static int
+blockif_thr_init(struct blockif_ctxt *bc, const char *ident)
+{
+	char tname[MAXCOMLEN + 1];
+	int i;
+
+	for (i = 0; i < BLOCKIF_NUMTHR; i++) {
+		pthread_create(&bc->bc_btid[i], NULL, blockif_thr, bc);
+		snprintf(tname, sizeof(tname), "blk-%s-%d", ident, i);
+		pthread_set_name_np(bc->bc_btid[i], tname);
+	}
+
+	return (0);
+}
+
+static void
+blockif_thr_kick(struct blockif_ctxt *bc)
+{
+
+	pthread_mutex_lock(&bc->bc_mtx);
+	pthread_cond_signal(&bc->bc_cond);
+	pthread_mutex_unlock(&bc->bc_mtx);
+}
+
+static void
+blockif_thr_cancel(struct blockif_ctxt *bc, struct blockif_elem *be)
+{
+
+	/*
+	 * Interrupt the processing thread to force it return
+	 * prematurely via it's normal callback path.
+	 */
+	while (be->be_status == BST_BUSY) {
+		struct blockif_sig_elem bse, *old_head;
+
+		pthread_mutex_init(&bse.bse_mtx, NULL);
+		pthread_cond_init(&bse.bse_cond, NULL);
+
+		bse.bse_pending = 1;
+
+		do {
+			old_head = blockif_bse_head;
+			bse.bse_next = old_head;
+		} while (!atomic_cmpset_ptr((uintptr_t *)&blockif_bse_head,
+					    (uintptr_t)old_head,
+					    (uintptr_t)&bse));
+
+		pthread_kill(be->be_tid, SIGCONT);
+
+		pthread_mutex_lock(&bse.bse_mtx);
+		while (bse.bse_pending)
+			pthread_cond_wait(&bse.bse_cond, &bse.bse_mtx);
+		pthread_mutex_unlock(&bse.bse_mtx);
+	}
+}
+
+static void
+blockif_thr_close(struct blockif_ctxt *bc)
+{
+	void *jval;
+	int i;
+
+	pthread_cond_broadcast(&bc->bc_cond);
+	for (i = 0; i < BLOCKIF_NUMTHR; i++)
+		pthread_join(bc->bc_btid[i], &jval);
+}
+
+static struct blockif_engine blockif_thr_engine = {
+	.name = "thread",
+	.init = blockif_thr_init,
+	.kick = blockif_thr_kick,
+	.cancel = blockif_thr_cancel,
+	.close = blockif_thr_close,
+};
+DATA_SET(blockif_engine_set, blockif_thr_engine);
+
+/*
+ * The pool engine services every device opened with it from one set of
+ * host-wide worker threads, so the number of i/o threads does not grow
+ * with the number of disks. The pool size and an optional CPU set for
+ * its threads are configured with blockif_pool_config().
+ *
+ * A device with runnable work sits once on the pool run queue. A
+ * worker takes the device at the head, dequeues a single request (or
+ * coalesced run) and, if the device has more work, puts it back at the
+ * tail before doing the i/o. Devices are thus served round-robin, one
+ * request per turn, while a busy device can still keep several workers
+ * occupied.
+ *
+ * For this engine bc_idle is 1 while the device is off the run queue
+ * and no worker has found more work for it; whoever moves it from 1 to
+ * 0 queues the device.
+ */
+struct blockif_pool {
+	pthread_mutex_t		bp_mtx;
+	pthread_cond_t		bp_cond;
+	pthread_cond_t		bp_done_cond;
+	TAILQ_HEAD(, blockif_ctxt) bp_runq;
+	int			bp_nthr;
+	pthread_t		*bp_tid;
+};
+
+static struct blockif_pool *blockif_pool;
+static pthread_mutex_t blockif_pool_mtx = PTHREAD_MUTEX_INITIALIZER;
+static int blockif_pool_nthr;
+static cpuset_t *blockif_pool_cpus;
+
+static void
+blockif_pool_sched(struct blockif_ctxt *bc)
+{
+	struct blockif_pool *bp;
+
+	bp = blockif_pool;
+	pthread_mutex_lock(&bp->bp_mtx);
+	if (!bc->bc_pool_closing && !bc->bc_pool_queued) {
+		TAILQ_INSERT_TAIL(&bp->bp_runq, bc, bc_pool_link);
+		bc->bc_pool_queued = 1;
+		pthread_cond_signal(&bp->bp_cond);
+	}
+	pthread_mutex_unlock(&bp->bp_mtx);
+}
+
+static void *
+blockif_pool_thr(void *arg)
+{
+	struct blockif_pool *bp;
+	struct blockif_ctxt *bc;
+	struct blockif_elem *be;
+	struct iovec *iov;
+	pthread_t t;
+	uint8_t *buf;
+	int more;
+
+	bp = arg;
+	buf = malloc(MAXPHYS);
+	iov = malloc(IOV_MAX * sizeof(struct iovec));
+	t = pthread_self();
+
+	pthread_mutex_lock(&bp->bp_mtx);
+	for (;;) {
+		while ((bc = TAILQ_FIRST(&bp->bp_runq)) == NULL)
+			pthread_cond_wait(&bp->bp_cond, &bp->bp_mtx);
+		TAILQ_REMOVE(&bp->bp_runq, bc, bc_pool_link);
+		bc->bc_pool_queued = 0;
+		bc->bc_pool_refs++;
+		pthread_mutex_unlock(&bp->bp_mtx);
+
+		pthread_mutex_lock(&bc->bc_mtx);
+		bc->bc_work_count++;
+		be = NULL;
+		if (!bc->bc_paused && blockif_dequeue(bc, t, &be) &&
+		    iov != NULL)
+			blockif_coalesce(bc, t, be);
+		more = blockif_runnable(bc);
+		if (!more && blockif_idle(bc))
+			more = atomic_cmpset_int(&bc->bc_idle, 1, 0);
+		pthread_mutex_unlock(&bc->bc_mtx);
+		if (more)
+			blockif_pool_sched(bc);
+
+		more = 0;
+		if (be != NULL) {
+			/*
+			 * The bounce buffer is only for the devices that
+			 * blockif_thr() would give one to; passing it to any
+			 * other would bypass the qcow2, overlay and direct
+			 * i/o paths of blockif_proc().
+			 */
+			blockif_proc_elem(bc, be,
+			    bc->bc_isgeom || bc->bc_cache != NULL ? buf : NULL,
+			    iov);
+			pthread_mutex_lock(&bc->bc_mtx);
+			blockif_complete_chain(bc, be);
+
+			/* Completion may have unblocked a queued request */
+			if (blockif_runnable(bc))
+				more = atomic_cmpset_int(&bc->bc_idle, 1, 0);
+		} else
+			pthread_mutex_lock(&bc->bc_mtx);
+		bc->bc_work_count--;
+		if (bc->bc_work_count == 0)
+			pthread_cond_broadcast(&bc->bc_work_done_cond);
+		pthread_mutex_unlock(&bc->bc_mtx);
+		if (more)
+			blockif_pool_sched(bc);
+
+		pthread_mutex_lock(&bp->bp_mtx);
+		if (--bc->bc_pool_refs == 0)
+			pthread_cond_broadcast(&bp->bp_done_cond);
+	}
+
+	/* NOTREACHED */
+	return (NULL);
+}
+
+static int
+blockif_pool_init(struct blockif_ctxt *bc, const char *ident)
+{
+	char tname[MAXCOMLEN + 1];
+	struct blockif_pool *bp;
+	int error, i;
+
+	pthread_mutex_lock(&blockif_pool_mtx);
+	if (blockif_pool == NULL) {
+		bp = calloc(1, sizeof(struct blockif_pool));
+		assert(bp != NULL);
+		pthread_mutex_init(&bp->bp_mtx, NULL);
+		pthread_cond_init(&bp->bp_cond, NULL);
+		pthread_cond_init(&bp->bp_done_cond, NULL);
+		TAILQ_INIT(&bp->bp_runq);
+		bp->bp_nthr = blockif_pool_nthr ? blockif_pool_nthr :
+		    BLOCKIF_NUMTHR;
+		bp->bp_tid = calloc(bp->bp_nthr, sizeof(pthread_t));
+		assert(bp->bp_tid != NULL);
+		for (i = 0; i < bp->bp_nthr; i++) {
+			pthread_create(&bp->bp_tid[i], NULL, blockif_pool_thr,
+			    bp);
+			snprintf(tname, sizeof(tname), "blk-pool-%d", i);
+			pthread_set_name_np(bp->bp_tid[i], tname);
+			if (blockif_pool_cpus != NULL) {
+				error = pthread_setaffinity_np(bp->bp_tid[i],
+				    sizeof(cpuset_t), blockif_pool_cpus);
+				if (error != 0)
+					EPRINTLN("blockif: unable to pin "
+					    "pool thread %d: %s", i,
+					    strerror(error));
+			}
+		}
+		blockif_pool = bp;
+	}
+	pthread_mutex_unlock(&blockif_pool_mtx);
+
+	bc->bc_idle = 1;
+	return (0);
+}
+
+static void
+blockif_pool_kick(struct blockif_ctxt *bc)
+{
+
+	if (atomic_cmpset_int(&bc->bc_idle, 1, 0))
+		blockif_pool_sched(bc);
+}
+
+static void
+blockif_pool_close(struct blockif_ctxt *bc)
+{
+	struct blockif_pool *bp;
+
+	bp = blockif_pool;
+	pthread_mutex_lock(&bp->bp_mtx);
+	bc->bc_pool_closing = 1;
+	if (bc->bc_pool_queued) {
+		TAILQ_REMOVE(&bp->bp_runq, bc, bc_pool_link);
+		bc->bc_pool_queued = 0;
+	}
+	while (bc->bc_pool_refs != 0)
+		pthread_cond_wait(&bp->bp_done_cond, &bp->bp_mtx);
+	pthread_mutex_unlock(&bp->bp_mtx);
+}
+
+static struct blockif_engine blockif_pool_engine = {
+	.name = "pool",
+	.init = blockif_pool_init,
+	.kick = blockif_pool_kick,
+	.cancel = blockif_thr_cancel,
+	.close = blockif_pool_close,
+};
+DATA_SET(blockif_engine_set, blockif_pool_engine);
+
+/*
+ * Size the shared worker pool and make it the default engine.
+ * 'opt' is "nthreads[:cpulist]", where cpulist is a comma separated
+ * list of host CPUs or CPU ranges, e.g. "4:0-1,6,7".
+ */
+int
+blockif_pool_config(const char *opt)
+{
+	char *str, *cpus, *cp;
+	cpuset_t *set;
+	int lo, hi, n;
+
+	str = strdup(opt);
+	if (str == NULL)
+		return (-1);
+	cpus = str;
+	cp = strsep(&cpus, ":");
+	n = atoi(cp);
+	if (n <= 0) {
+		EPRINTLN("Invalid blockif pool size \"%s\"", cp);
+		goto err;
+	}
+
+	set = NULL;
+	if (cpus != NULL) {
+		set = malloc(sizeof(cpuset_t));
+		if (set == NULL)
+			goto err;
+		CPU_ZERO(set);
+		while ((cp = strsep(&cpus, ",")) != NULL) {
+			if (sscanf(cp, "%d-%d", &lo, &hi) != 2) {
+				if (sscanf(cp, "%d", &lo) != 1)
+					lo = -1;
+				hi = lo;
+			}
+			if (lo < 0 || hi < lo || hi >= CPU_SETSIZE) {
+				EPRINTLN("Invalid blockif pool cpu \"%s\"",
+				    cp);
+				free(set);
+				goto err;
+			}
+			for (; lo <= hi; lo++)
+				CPU_SET(lo, set);
 		}
-		break;
-	case BOP_FLUSH:
-		err = blockif_flush_bc(bc);
-		break;
-	case BOP_DELETE:
-		if (!bc->bc_candelete)
-			err = EOPNOTSUPP;
-		else if (bc->bc_rdonly)
-			err = EROFS;
-		else if (bc->bc_ischr) {
-			arg[0] = br->br_offset;
-			arg[1] = br->br_resid;
-			if (ioctl(bc->bc_fd, DIOCGDELETE, arg))
-				err = errno;
-			else
-				br->br_resid = 0;
-		} else
-			err = EOPNOTSUPP;
-		break;
-	default:
-		err = EINVAL;
-		break;
 	}
 
-	be->be_status = BST_DONE;
+	blockif_pool_nthr = n;
+	free(blockif_pool_cpus);
+	blockif_pool_cpus = set;
+	free(str);
+	return (0);
+err:
+	free(str);
+	return (-1);
+}
 
-	(*br->br_callback)(br, err);
+/*
+ * The aio engine runs a single thread per context. Reads and writes
+ * are handed to the kernel with aio_readv(2)/aio_writev(2) and their
+ * completions are reaped in batches from a per-context kqueue, so the
+ * number of requests in flight is bounded by the ring rather than by
+ * the number of worker threads. Flushes, deletes and requests that
+ * need the GEOM bounce buffer are serviced inline with blockif_proc().
+ *
+ * bc_work_count counts the requests in flight, plus one while the
+ * engine thread is submitting, so that blockif_pause() drains both.
+ */
+static int
+blockif_aio_submit(struct blockif_ctxt *bc, struct blockif_elem *be)
+{
+	struct blockif_extent *ext;
+	struct blockif_req *br;
+	struct aiocb *cb;
+	int hole;
+
+	br = be->be_req;
+	if (be->be_op != BOP_READ && be->be_op != BOP_WRITE)
+		return (-1);
+	if (be->be_op == BOP_WRITE && bc->bc_rdonly)
+		return (-1);
+	if (bc->bc_isgeom && br->br_iovcnt > 1)
+		return (-1);
+	if (bc->bc_cache != NULL || bc->bc_qcow != NULL || bc->bc_ovl != NULL)
+		return (-1);
+
+	/* Misaligned direct i/o needs a bounce buffer */
+	if (bc->bc_direct &&
+	    blockif_direct_runs(bc, br->br_iov, br->br_iovcnt, NULL, NULL, 0))
+		return (-1);
+
+	/* Holes and zero writes are cheaper done inline */
+	if (bc->bc_sparse) {
+		if (be->be_op == BOP_WRITE && bc->bc_candelete &&
+		    br->br_resid >= BLOCKIF_PUNCH_MIN &&
+		    blockif_iszero(br->br_iov, br->br_iovcnt))
+			return (-1);
+		if (be->be_op == BOP_READ) {
+			pthread_mutex_lock(&bc->bc_hmtx);
+			ext = blockif_hmap_lookup(bc, br->br_offset,
+			    br->br_resid);
+			hole = ext != NULL && ext->ext_hole;
+			pthread_mutex_unlock(&bc->bc_hmtx);
+			if (hole)
+				return (-1);
+		}
+	}
+
+	be->be_tstart = blockif_nsec();
+	cb = &be->be_aiocb;
+	memset(cb, 0, sizeof(*cb));
+	cb->aio_fildes = bc->bc_fd;
+	cb->aio_offset = br->br_offset;
+	cb->aio_iov = br->br_iov;
+	cb->aio_iovcnt = br->br_iovcnt;
+	cb->aio_sigevent.sigev_notify = SIGEV_KEVENT;
+	cb->aio_sigevent.sigev_notify_kqueue = bc->bc_kq;
+	cb->aio_sigevent.sigev_value.sival_ptr = be;
+
+	if (be->be_op == BOP_READ)
+		return (aio_readv(cb));
+	return (aio_writev(cb));
 }
 
 static void *
-blockif_thr(void *arg)
+blockif_aio_thr(void *arg)
 {
 	struct blockif_ctxt *bc;
-	struct blockif_elem *be;
+	struct blockif_elem *be, *done[BLOCKIF_AIO_NEVENTS];
+	struct blockif_req *br;
+	struct kevent evs[BLOCKIF_AIO_NEVENTS];
+	struct timespec zero, *tsp;
 	pthread_t t;
+	ssize_t len;
 	uint8_t *buf;
+	int err, i, idle, n, ndone;
 
 	bc = arg;
-	if (bc->bc_isgeom)
+	if (bc->bc_isgeom || bc->bc_cache != NULL)
 		buf = malloc(MAXPHYS);
 	else
 		buf = NULL;
@@ -366,6 +1989,15 @@ blockif_thr(void *arg)
 		/* We cannot process work if the interface is paused */
 		while (!bc->bc_paused && blockif_dequeue(bc, t, &be)) {
 			pthread_mutex_unlock(&bc->bc_mtx);
+			if (blockif_aio_submit(bc, be) == 0) {
+				pthread_mutex_lock(&bc->bc_mtx);
+				bc->bc_work_count++;
+				continue;
+			}
+			/*
+			 * Not an aio candidate, or the kernel refused it
+			 * (e.g. EAGAIN on the aio job limits): do it here.
+			 */
 			blockif_proc(bc, be, buf);
 			pthread_mutex_lock(&bc->bc_mtx);
 			blockif_complete(bc, be);
@@ -373,19 +2005,55 @@ blockif_thr(void *arg)
 
 		bc->bc_work_count--;
 
-		/* If none of the workers are busy, notify the main thread */
-		if (bc->bc_work_count == 0)
+		/* If nothing is in flight, notify the main thread */
+		if (bc->bc_work_count == 0) {
 			pthread_cond_broadcast(&bc->bc_work_done_cond);
 
-		/* Check ctxt status here to see if exit requested */
-		if (bc->bc_closing)
-			break;
+			/* Check ctxt status here to see if exit requested */
+			if (bc->bc_closing)
+				break;
+		}
 
-		/* Make all worker threads wait here if the device is paused */
-		while (bc->bc_paused)
-			pthread_cond_wait(&bc->bc_paused_cond, &bc->bc_mtx);
+		/*
+		 * While paused only completions and blockif_resume() can
+		 * wake us. Otherwise just poll if work was submitted
+		 * while going idle.
+		 */
+		zero.tv_sec = zero.tv_nsec = 0;
+		tsp = NULL;
+		idle = !bc->bc_paused;
+		if (idle && blockif_idle(bc))
+			tsp = &zero;
+		pthread_mutex_unlock(&bc->bc_mtx);
+
+		n = kevent(bc->bc_kq, NULL, 0, evs, nitems(evs), tsp);
+		if (idle)
+			blockif_busy(bc);
+
+		ndone = 0;
+		for (i = 0; i < n; i++) {
+			if (evs[i].filter != EVFILT_AIO)
+				continue;
+			be = evs[i].udata;
+			br = be->be_req;
+			err = 0;
+			if ((len = aio_return(&be->be_aiocb)) < 0)
+				err = errno;
+			else {
+				if (be->be_op == BOP_WRITE && bc->bc_sparse)
+					blockif_hmap_invalidate(bc,
+					    br->br_offset, len, 1);
+				br->br_resid -= len;
+			}
+			blockif_done(bc, be, err);
+			done[ndone++] = be;
+		}
 
-		pthread_cond_wait(&bc->bc_cond, &bc->bc_mtx);
+		pthread_mutex_lock(&bc->bc_mtx);
+		for (i = 0; i < ndone; i++) {
+			blockif_complete(bc, done[i]);
+			bc->bc_work_count--;
+		}
 	}
 	pthread_mutex_unlock(&bc->bc_mtx);
 
@@ -395,6 +2063,71 @@ blockif_thr(void *arg)
 	return (NULL);
 }
 
+static int
+blockif_aio_init(struct blockif_ctxt *bc, const char *ident)
+{
+	char tname[MAXCOMLEN + 1];
+	struct kevent kev;
+
+	bc->bc_kq = kqueue();
+	if (bc->bc_kq < 0) {
+		warn("kqueue");
+		return (-1);
+	}
+	EV_SET(&kev, 0, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, NULL);
+	if (kevent(bc->bc_kq, &kev, 1, NULL, 0, NULL) < 0) {
+		warn("kevent");
+		close(bc->bc_kq);
+		return (-1);
+	}
+
+	pthread_create(&bc->bc_btid[0], NULL, blockif_aio_thr, bc);
+	snprintf(tname, sizeof(tname), "blk-%s-aio", ident);
+	pthread_set_name_np(bc->bc_btid[0], tname);
+
+	return (0);
+}
+
+static void
+blockif_aio_kick(struct blockif_ctxt *bc)
+{
+	struct kevent kev;
+
+	EV_SET(&kev, 0, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+	(void) kevent(bc->bc_kq, &kev, 1, NULL, 0, NULL);
+}
+
+static void
+blockif_aio_cancel(struct blockif_ctxt *bc, struct blockif_elem *be)
+{
+
+	/*
+	 * A request being serviced inline cannot be interrupted; one in
+	 * the kernel completes with ECANCELED through the kqueue.
+	 */
+	if (be->be_status == BST_BUSY)
+		(void) aio_cancel(bc->bc_fd, &be->be_aiocb);
+}
+
+static void
+blockif_aio_close(struct blockif_ctxt *bc)
+{
+	void *jval;
+
+	blockif_aio_kick(bc);
+	pthread_join(bc->bc_btid[0], &jval);
+	close(bc->bc_kq);
+}
+
+static struct blockif_engine blockif_aio_engine = {
+	.name = "aio",
+	.init = blockif_aio_init,
+	.kick = blockif_aio_kick,
+	.cancel = blockif_aio_cancel,
+	.close = blockif_aio_close,
+};
+DATA_SET(blockif_engine_set, blockif_aio_engine);
+
 static void
 blockif_sigcont_handler(int signal, enum ev_type type, void *arg)
 {
@@ -420,26 +2153,92 @@ blockif_sigcont_handler(int signal, enum ev_type type, void *arg)
 	}
 }
 
+/*
+ * Dump the statistics of every open device. Histograms are printed as
+ * "log2(ns):count" pairs for the non-empty buckets.
+ */
+static void
+blockif_siginfo_handler(int signal, enum ev_type type, void *arg)
+{
+	static const char *opname[BLOCKIF_NOPS] = {
+		"read", "write", "flush", "delete"
+	};
+	static const char *latname[BLAT_NUM] = {
+		"queue", "service", "callback"
+	};
+	struct blockif_opstats *os;
+	struct blockif_ctxt *bc;
+	char line[512];
+	uint64_t n;
+	size_t len;
+	int b, lat, op;
+
+	pthread_mutex_lock(&blockif_ctxts_mtx);
+	TAILQ_FOREACH(bc, &blockif_ctxts, bc_link) {
+		for (op = 0; op < BLOCKIF_NOPS; op++) {
+			os = &bc->bc_stats[op];
+			if (atomic_load_64(&os->os_ops) == 0)
+				continue;
+			EPRINTLN("blockif %s %s: %ju ops, %ju bytes, %ju errors",
+			    bc->bc_ident, opname[op],
+			    (uintmax_t)atomic_load_64(&os->os_ops),
+			    (uintmax_t)atomic_load_64(&os->os_bytes),
+			    (uintmax_t)atomic_load_64(&os->os_errors));
+			for (lat = 0; lat < BLAT_NUM; lat++) {
+				len = snprintf(line, sizeof(line), "  %-8s",
+				    latname[lat]);
+				for (b = 0; b < BLOCKIF_HIST_BUCKETS &&
+				    len < sizeof(line); b++) {
+					n = atomic_load_64(&os->os_hist[lat][b]);
+					if (n != 0)
+						len += snprintf(line + len,
+						    sizeof(line) - len, " %d:%ju",
+						    b, (uintmax_t)n);
+				}
+				EPRINTLN("%s", line);
+			}
+		}
+	}
+	pthread_mutex_unlock(&blockif_ctxts_mtx);
+}
+
 static void
 blockif_init(void)
 {
 	mevent_add(SIGCONT, EVF_SIGNAL, blockif_sigcont_handler, NULL);
 	(void) signal(SIGCONT, SIG_IGN);
+	mevent_add(SIGINFO, EVF_SIGNAL, blockif_siginfo_handler, NULL);
+	(void) signal(SIGINFO, SIG_IGN);
+}
+
+static struct blockif_engine *
+blockif_engine_lookup(const char *name)
+{
+	struct blockif_engine **pbe;
+
+	SET_FOREACH(pbe, blockif_engine_set) {
+		if (strcmp(name, (*pbe)->name) == 0)
+			return (*pbe);
+	}
+
+	return (NULL);
 }
 
 struct blockif_ctxt *
 blockif_open(const char *optstr, const char *ident)
 {
-	char tname[MAXCOMLEN + 1];
 	char name[MAXPATHLEN];
-	char *nopt, *xopts, *cp;
+	char *nopt, *xopts, *cp, *path, *ovlpath;
+	struct blockif_engine *engine;
 	struct blockif_ctxt *bc;
 	struct stat sbuf;
 	struct diocgattr_arg arg;
 	off_t size, psectsz, psectoff;
-	int extra, fd, i, sectsz;
+	int align, extra, fd, i, sectsz;
 	int nocache, sync, ro, candelete, geom, ssopt, pssopt;
-	int nodelete;
+	int nodelete, cachesz, l2cache, isqcow, isovl;
+	struct qcow2 *qcow;
+	struct ovl *ovl;
 
 #ifndef WITHOUT_CAPSICUM
 	cap_rights_t rights;
@@ -449,11 +2248,18 @@ blockif_open(const char *optstr, const char *ident)
 	pthread_once(&blockif_once, blockif_init);
 
 	fd = -1;
+	qcow = NULL;
+	ovl = NULL;
+	ovlpath = NULL;
 	ssopt = 0;
 	nocache = 0;
 	sync = 0;
 	ro = 0;
 	nodelete = 0;
+	cachesz = 0;
+	l2cache = 0;
+	isqcow = isovl = 0;
+	engine = blockif_pool_nthr ? &blockif_pool_engine : &blockif_thr_engine;
 
 	/*
 	 * The first element in the optstring is always a pathname.
@@ -476,40 +2282,106 @@ blockif_open(const char *optstr, const char *ident)
 			;
 		else if (sscanf(cp, "sectorsize=%d", &ssopt) == 1)
 			pssopt = ssopt;
-		else {
+		else if (sscanf(cp, "cache=%d", &cachesz) == 1 && cachesz > 0)
+			;
+		else if (sscanf(cp, "l2cache=%d", &l2cache) == 1 && l2cache > 0)
+			;
+		else if (!strcmp(cp, "format=qcow2")) {
+			isqcow = 1;
+			isovl = 0;
+		} else if (!strcmp(cp, "format=overlay")) {
+			isovl = 1;
+			isqcow = 0;
+		} else if (!strcmp(cp, "format=raw"))
+			isqcow = isovl = 0;
+		else if (!strncmp(cp, "overlay=", strlen("overlay=")))
+			ovlpath = cp + strlen("overlay=");
+		else if (!strncmp(cp, "engine=", strlen("engine="))) {
+			engine = blockif_engine_lookup(cp + strlen("engine="));
+			if (engine == NULL) {
+				EPRINTLN("Unknown i/o engine \"%s\"",
+				    cp + strlen("engine="));
+				goto err;
+			}
+		} else {
 			EPRINTLN("Invalid device option \"%s\"", cp);
 			goto err;
 		}
 	}
 
+	/*
+	 * With an overlay the pathname is its base image, raw or (with
+	 * format=overlay) another overlay; the overlay is created on first
+	 * use and opened in place of the base.
+	 */
+	path = nopt;
+	if (ovlpath != NULL) {
+		if (isqcow) {
+			EPRINTLN("a qcow2 image cannot be an overlay base");
+			goto err;
+		}
+		if (access(ovlpath, F_OK) != 0 &&
+		    ovl_create(ovlpath, nopt, isovl) != 0)
+			goto err;
+		path = ovlpath;
+		isovl = 1;
+	}
+
 	extra = 0;
 	if (nocache)
 		extra |= O_DIRECT;
 	if (sync)
 		extra |= O_SYNC;
 
-	fd = open(nopt, (ro ? O_RDONLY : O_RDWR) | extra);
+	fd = open(path, (ro ? O_RDONLY : O_RDWR) | extra);
 	if (fd < 0 && !ro) {
 		/* Attempt a r/w fail with a r/o open */
-		fd = open(nopt, O_RDONLY | extra);
+		fd = open(path, O_RDONLY | extra);
 		ro = 1;
 	}
 
 	if (fd < 0) {
-		warn("Could not open backing file: %s", nopt);
+		warn("Could not open backing file: %s", path);
 		goto err;
 	}
 
         if (fstat(fd, &sbuf) < 0) {
-		warn("Could not stat backing file %s", nopt);
+		warn("Could not stat backing file %s", path);
 		goto err;
         }
 
+	/*
+	 * The image format is never guessed from the contents: a guest
+	 * can write whatever header it likes into a raw image, and the
+	 * backing file named in a qcow2 or overlay header would then be
+	 * opened on its behalf.
+	 */
+	if (isqcow) {
+		if (!S_ISREG(sbuf.st_mode) || !qcow2_probe(fd)) {
+			EPRINTLN("%s is not a qcow2 image", path);
+			goto err;
+		}
+		qcow = qcow2_open(fd, path, ro, l2cache);
+		if (qcow == NULL)
+			goto err;
+		ro = qcow2_is_ro(qcow);
+	} else if (isovl) {
+		if (!S_ISREG(sbuf.st_mode)) {
+			EPRINTLN("%s is not an overlay", path);
+			goto err;
+		}
+		ovl = ovl_open(fd, path, ro);
+		if (ovl == NULL)
+			goto err;
+	}
+
 #ifndef WITHOUT_CAPSICUM
 	cap_rights_init(&rights, CAP_FSYNC, CAP_IOCTL, CAP_READ, CAP_SEEK,
 	    CAP_WRITE);
 	if (ro)
 		cap_rights_clear(&rights, CAP_FSYNC, CAP_WRITE);
+	else if (qcow != NULL)
+		cap_rights_set(&rights, CAP_FTRUNCATE);
 
 	if (caph_rights_limit(fd, &rights) == -1)
 		errx(EX_OSERR, "Unable to apply rights for sandbox");
@@ -538,14 +2410,28 @@ blockif_open(const char *optstr, const char *ident)
 			candelete = arg.value.i;
 		if (ioctl(fd, DIOCGPROVIDERNAME, name) == 0)
 			geom = 1;
-	} else
+	} else if (qcow != NULL) {
+		size = qcow2_size(qcow);
+		candelete = nodelete == 0 && qcow2_candelete(qcow);
+		psectsz = sbuf.st_blksize;
+	} else if (ovl != NULL) {
+		size = ovl_size(ovl);
+		psectsz = sbuf.st_blksize;
+	} else {
 		psectsz = sbuf.st_blksize;
+#ifdef SPACECTL_DEALLOC
+		candelete = nodelete == 0 && S_ISREG(sbuf.st_mode);
+#endif
+	}
 
 #ifndef WITHOUT_CAPSICUM
 	if (caph_ioctls_limit(fd, cmds, nitems(cmds)) == -1)
 		errx(EX_OSERR, "Unable to apply rights for sandbox");
 #endif
 
+	/* O_DIRECT transfers must be aligned to the native sector size */
+	align = sectsz;
+
 	if (ssopt != 0) {
 		if (!powerof2(ssopt) || !powerof2(pssopt) || ssopt < 512 ||
 		    ssopt > pssopt) {
@@ -582,6 +2468,7 @@ blockif_open(const char *optstr, const char *ident)
 	}
 
 	bc->bc_magic = BLOCKIF_SIG;
+	strlcpy(bc->bc_ident, ident, sizeof(bc->bc_ident));
 	bc->bc_fd = fd;
 	bc->bc_ischr = S_ISCHR(sbuf.st_mode);
 	bc->bc_isgeom = geom;
@@ -589,30 +2476,54 @@ blockif_open(const char *optstr, const char *ident)
 	bc->bc_rdonly = ro;
 	bc->bc_size = size;
 	bc->bc_sectsz = sectsz;
+	bc->bc_direct = nocache && qcow == NULL && ovl == NULL;
+	bc->bc_align = align;
+	if (bc->bc_direct)
+		pthread_once(&blockif_bounce.bp_once, blockif_bounce_init);
 	bc->bc_psectsz = psectsz;
 	bc->bc_psectoff = psectoff;
+	bc->bc_qcow = qcow;
+	bc->bc_ovl = ovl;
+	bc->bc_sparse = S_ISREG(sbuf.st_mode) && qcow == NULL && ovl == NULL;
+	pthread_mutex_init(&bc->bc_hmtx, NULL);
+	if (cachesz != 0) {
+		if (ro)
+			bc->bc_cache = blockif_cache_open(&sbuf, size, cachesz);
+		else
+			EPRINTLN("Ignoring cache option on writable image %s",
+			    path);
+	}
 	pthread_mutex_init(&bc->bc_mtx, NULL);
 	pthread_cond_init(&bc->bc_cond, NULL);
 	bc->bc_paused = 0;
 	bc->bc_work_count = 0;
 	pthread_cond_init(&bc->bc_paused_cond, NULL);
 	pthread_cond_init(&bc->bc_work_done_cond, NULL);
-	TAILQ_INIT(&bc->bc_freeq);
+	blockif_ring_init(&bc->bc_freer);
+	blockif_ring_init(&bc->bc_subr);
 	TAILQ_INIT(&bc->bc_pendq);
 	TAILQ_INIT(&bc->bc_busyq);
 	for (i = 0; i < BLOCKIF_MAXREQ; i++) {
 		bc->bc_reqs[i].be_status = BST_FREE;
-		TAILQ_INSERT_HEAD(&bc->bc_freeq, &bc->bc_reqs[i], be_link);
+		blockif_ring_put(&bc->bc_freer, &bc->bc_reqs[i]);
 	}
 
-	for (i = 0; i < BLOCKIF_NUMTHR; i++) {
-		pthread_create(&bc->bc_btid[i], NULL, blockif_thr, bc);
-		snprintf(tname, sizeof(tname), "blk-%s-%d", ident, i);
-		pthread_set_name_np(bc->bc_btid[i], tname);
+	bc->bc_engine = engine;
+	if ((*engine->init)(bc, ident) != 0) {
+		free(bc);
+		goto err;
 	}
 
+	pthread_mutex_lock(&blockif_ctxts_mtx);
+	TAILQ_INSERT_TAIL(&blockif_ctxts, bc, bc_link);
+	pthread_mutex_unlock(&blockif_ctxts_mtx);
+
 	return (bc);
 err:
+	if (qcow != NULL)
+		qcow2_close(qcow);
+	if (ovl != NULL)
+		ovl_close(ovl);
 	if (fd >= 0)
 		close(fd);
 	free(nopt);
@@ -623,30 +2534,85 @@ static int
 blockif_request(struct blockif_ctxt *bc, struct blockif_req *breq,
 		enum blockop op)
 {
-	int err;
+	struct blockif_elem *be;
+	off_t off;
+	int i;
 
-	err = 0;
+	/*
+	 * Callers are not allowed to enqueue more than
+	 * the specified blockif queue limit. Return an
+	 * error to indicate that the queue length has been
+	 * exceeded.
+	 */
+	be = blockif_ring_get(&bc->bc_freer);
+	if (be == NULL)
+		return (E2BIG);
+	assert(be->be_status == BST_FREE);
 
-	pthread_mutex_lock(&bc->bc_mtx);
-	if (!TAILQ_EMPTY(&bc->bc_freeq)) {
-		/*
-		 * Enqueue and inform the block i/o thread
-		 * that there is work available
-		 */
-		if (blockif_enqueue(bc, breq, op))
-			pthread_cond_signal(&bc->bc_cond);
-	} else {
-		/*
-		 * Callers are not allowed to enqueue more than
-		 * the specified blockif queue limit. Return an
-		 * error to indicate that the queue length has been
-		 * exceeded.
-		 */
-		err = E2BIG;
+	be->be_req = breq;
+	be->be_op = op;
+	switch (op) {
+	case BOP_READ:
+	case BOP_WRITE:
+	case BOP_DELETE:
+		off = breq->br_offset;
+		for (i = 0; i < breq->br_iovcnt; i++)
+			off += breq->br_iov[i].iov_len;
+		break;
+	default:
+		off = OFF_MAX;
 	}
-	pthread_mutex_unlock(&bc->bc_mtx);
+	be->be_block = off;
+	if (op == BOP_DELETE)
+		be->be_len = breq->br_resid;
+	else if (op == BOP_FLUSH)
+		be->be_len = 0;
+	else
+		be->be_len = off - breq->br_offset;
+	be->be_tsub = blockif_nsec();
+
+	/*
+	 * The submission ring has a slot for every element, so this
+	 * cannot fail. Only wake the engine if it has gone idle and
+	 * nobody holds a plug; the last unplug rechecks the ring.
+	 */
+	blockif_ring_put(&bc->bc_subr, be);
+	atomic_thread_fence_seq_cst();
+	if (atomic_load_acq_int(&bc->bc_plug) != 0)
+		return (0);
+	if (atomic_load_acq_int(&bc->bc_idle) != 0)
+		(*bc->bc_engine->kick)(bc);
 
-	return (err);
+	return (0);
+}
+
+/*
+ * Hold back engine wakeups while a caller submits a batch of requests,
+ * so that an idle engine is kicked once and finds the whole batch
+ * instead of waking for the first request alone. Plugs nest; the
+ * last blockif_unplug() kicks the engine if it is idle. A worker that
+ * is still running picks the requests up as usual.
+ */
+void
+blockif_plug(struct blockif_ctxt *bc)
+{
+
+	assert(bc->bc_magic == BLOCKIF_SIG);
+	atomic_add_int(&bc->bc_plug, 1);
+}
+
+void
+blockif_unplug(struct blockif_ctxt *bc)
+{
+
+	assert(bc->bc_magic == BLOCKIF_SIG);
+	assert(bc->bc_plug > 0);
+	if (atomic_fetchadd_int(&bc->bc_plug, -1) != 1)
+		return;
+	atomic_thread_fence_seq_cst();
+	if (atomic_load_acq_int(&bc->bc_idle) != 0 &&
+	    !blockif_ring_empty(&bc->bc_subr))
+		(*bc->bc_engine->kick)(bc);
 }
 
 int
@@ -660,13 +2626,25 @@ blockif_read(struct blockif_ctxt *bc, struct blockif_req *breq)
 int
 blockif_write_sync(struct blockif_ctxt *bc, void *buf, size_t sectors, off_t lba)
 {
-	return pwrite(bc->bc_fd, buf, sectors * bc->bc_sectsz, lba * bc->bc_sectsz);
+	struct iovec iov;
+	ssize_t len;
+
+	iov.iov_base = buf;
+	iov.iov_len = sectors * bc->bc_sectsz;
+	len = blockif_pwritev(bc, &iov, 1, lba * bc->bc_sectsz);
+	if (len > 0 && bc->bc_sparse)
+		blockif_hmap_invalidate(bc, lba * bc->bc_sectsz, len, 1);
+	return (len);
 }
 
 int
 blockif_read_sync(struct blockif_ctxt *bc, void *buf, size_t sectors, off_t lba)
 {
-	return pread(bc->bc_fd, buf, sectors * bc->bc_sectsz, lba * bc->bc_sectsz);
+	struct iovec iov;
+
+	iov.iov_base = buf;
+	iov.iov_len = sectors * bc->bc_sectsz;
+	return (blockif_preadv(bc, &iov, 1, lba * bc->bc_sectsz));
 }
 
 
@@ -703,6 +2681,7 @@ blockif_cancel(struct blockif_ctxt *bc, struct blockif_req *breq)
 
 	pthread_mutex_lock(&bc->bc_mtx);
 	/* XXX: not waiting while paused */
+	blockif_admit(bc);
 
 	/*
 	 * Check pending requests.
@@ -736,32 +2715,7 @@ blockif_cancel(struct blockif_ctxt *bc, struct blockif_req *breq)
 		return (EINVAL);
 	}
 
-	/*
-	 * Interrupt the processing thread to force it return
-	 * prematurely via it's normal callback path.
-	 */
-	while (be->be_status == BST_BUSY) {
-		struct blockif_sig_elem bse, *old_head;
-
-		pthread_mutex_init(&bse.bse_mtx, NULL);
-		pthread_cond_init(&bse.bse_cond, NULL);
-
-		bse.bse_pending = 1;
-
-		do {
-			old_head = blockif_bse_head;
-			bse.bse_next = old_head;
-		} while (!atomic_cmpset_ptr((uintptr_t *)&blockif_bse_head,
-					    (uintptr_t)old_head,
-					    (uintptr_t)&bse));
-
-		pthread_kill(be->be_tid, SIGCONT);
-
-		pthread_mutex_lock(&bse.bse_mtx);
-		while (bse.bse_pending)
-			pthread_cond_wait(&bse.bse_cond, &bse.bse_mtx);
-		pthread_mutex_unlock(&bse.bse_mtx);
-	}
+	(*bc->bc_engine->cancel)(bc, be);
 
 	pthread_mutex_unlock(&bc->bc_mtx);
 
@@ -775,8 +2729,6 @@ blockif_cancel(struct blockif_ctxt *bc, struct blockif_req *breq)
 int
 blockif_close(struct blockif_ctxt *bc)
 {
-	void *jval;
-	int i;
 
 	assert(bc->bc_magic == BLOCKIF_SIG);
 
@@ -786,16 +2738,24 @@ blockif_close(struct blockif_ctxt *bc)
 	pthread_mutex_lock(&bc->bc_mtx);
 	bc->bc_closing = 1;
 	pthread_mutex_unlock(&bc->bc_mtx);
-	pthread_cond_broadcast(&bc->bc_cond);
-	for (i = 0; i < BLOCKIF_NUMTHR; i++)
-		pthread_join(bc->bc_btid[i], &jval);
+	(*bc->bc_engine->close)(bc);
 
 	/* XXX Cancel queued i/o's ??? */
 
+	pthread_mutex_lock(&blockif_ctxts_mtx);
+	TAILQ_REMOVE(&blockif_ctxts, bc, bc_link);
+	pthread_mutex_unlock(&blockif_ctxts_mtx);
+
 	/*
 	 * Release resources
 	 */
 	bc->bc_magic = 0;
+	if (bc->bc_cache != NULL)
+		blockif_cache_close(bc->bc_cache);
+	if (bc->bc_qcow != NULL)
+		qcow2_close(bc->bc_qcow);
+	if (bc->bc_ovl != NULL)
+		ovl_close(bc->bc_ovl);
 	close(bc->bc_fd);
 	free(bc);
 
@@ -945,6 +2905,7 @@ blockif_resume(struct blockif_ctxt *bc)
 	/* kick the threads after restore */
 	pthread_cond_broadcast(&bc->bc_cond);
 	pthread_mutex_unlock(&bc->bc_mtx);
+	(*bc->bc_engine->kick)(bc);
 }
 
 int
@@ -0,0 +1,322 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright 2020 Leon Dang
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY NETAPP, INC ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL NETAPP, INC OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Microbenchmark for the blockif request path. A number of submitter
+ * threads keep 4K requests outstanding against an image. By default
+ * they read an empty sparse image, whose holes blockif serves without
+ * any i/o, so what is measured is the cost of queueing, dispatching and
+ * completing requests.
+ *
+ *  cc -O2 -o blockif_bench blockif_bench.c block_if.c qcow2.c overlay.c \
+ *      iov.c mevent.c -lpthread
+ *
+ *  blockif_bench [-Fr] [-d depth] [-j submitters] [-o options]
+ *      [-s seconds] [-w writepct] [image]
+ *
+ * Without an image a temporary one is created, sparse unless -F fills
+ * it with data. Options are passed to blockif_open(). -r picks random
+ * offsets rather than sequential ones, and -w makes that percentage of
+ * the requests writes of non-zero data; note that this writes to any
+ * image given.
+ *
+ * The i/o engines are compared on a plain file with
+ *
+ *  blockif_bench -F -r -j 4 -o engine=thread,nocache
+ *  blockif_bench -F -r -j 4 -o engine=aio,nocache
+ *
+ * where nocache keeps the reads from being served by the page cache.
+ *
+ * and qcow2 with raw with holes, both starting out empty, with
+ *
+ *  qemu-img create -f qcow2 /tmp/img.qcow2 1G
+ *  blockif_bench -r -w 50 -o format=qcow2 /tmp/img.qcow2
+ *  blockif_bench -r -w 50
+ */
+
+#include <sys/param.h>
+#include <sys/uio.h>
+
+#include <machine/atomic.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "block_if.h"
+
+#define	BENCH_IMAGE_SIZE	(1ULL << 30)
+#define	BENCH_IOSIZE		4096
+
+const char *vmname = "blockif_bench";
+int raw_stdio;
+
+struct bench_req {
+	struct blockif_req	r_br;
+	volatile u_int		r_done;
+	int			r_retired;	/* not resubmitted */
+	uint8_t			*r_buf;
+};
+
+struct bench_thr {
+	pthread_t		t_tid;
+	struct bench_req	*t_reqs;
+	uint64_t		t_base;		/* first offset used */
+	uint64_t		t_blocks;	/* blocks from t_base on */
+	u_int			t_seed;
+	uint64_t		t_ios;		/* completed requests */
+	uint64_t		t_writes;
+};
+
+static struct blockif_ctxt *bctxt;
+static volatile u_int bench_stop;
+static int depth = 8;
+static int njobs = 1;
+static int randoff;
+static int writepct;
+
+static void
+bench_done(struct blockif_req *br, int err)
+{
+	struct bench_req *r = br->br_param;
+
+	if (err != 0)
+		errx(1, "i/o failed: %s", strerror(err));
+	atomic_store_rel_int(&r->r_done, 1);
+}
+
+static void
+bench_submit(struct bench_thr *t, struct bench_req *r, uint64_t n)
+{
+	struct blockif_req *br = &r->r_br;
+	int write;
+
+	if (randoff)
+		n = rand_r(&t->t_seed);
+	write = writepct > 0 && rand_r(&t->t_seed) % 100 < writepct;
+	if (write)
+		t->t_writes++;
+
+	br->br_iovcnt = 1;
+	br->br_iov[0].iov_base = r->r_buf;
+	br->br_iov[0].iov_len = BENCH_IOSIZE;
+	br->br_offset = t->t_base + (n % t->t_blocks) * BENCH_IOSIZE;
+	br->br_resid = BENCH_IOSIZE;
+	r->r_done = 0;
+
+	/* The ring is shared by all submitters and may be full */
+	while ((write ? blockif_write(bctxt, br) :
+	    blockif_read(bctxt, br)) == E2BIG)
+		sched_yield();
+}
+
+/* Write the whole image so that it has no holes left. */
+static void
+bench_fill(const char *image)
+{
+	uint8_t *buf;
+	off_t off;
+	int fd;
+
+	buf = malloc(1 << 20);
+	memset(buf, 0x5a, 1 << 20);
+	fd = open(image, O_WRONLY);
+	if (fd < 0)
+		err(1, "%s", image);
+	for (off = 0; off < BENCH_IMAGE_SIZE; off += 1 << 20)
+		if (pwrite(fd, buf, 1 << 20, off) != 1 << 20)
+			err(1, "%s", image);
+	fsync(fd);
+	close(fd);
+	free(buf);
+}
+
+static void *
+bench_thr(void *arg)
+{
+	struct bench_thr *t = arg;
+	struct bench_req *r;
+	uint64_t n;
+	int i, busy;
+
+	n = 0;
+	for (i = 0; i < depth; i++)
+		bench_submit(t, &t->t_reqs[i], n++);
+
+	for (;;) {
+		busy = 0;
+		for (i = 0; i < depth; i++) {
+			r = &t->t_reqs[i];
+			if (!atomic_load_acq_int(&r->r_done)) {
+				busy = 1;
+				continue;
+			}
+			if (r->r_retired)
+				continue;
+			t->t_ios++;
+			if (atomic_load_acq_int(&bench_stop)) {
+				r->r_retired = 1;
+				continue;
+			}
+			bench_submit(t, r, n++);
+			busy = 1;
+		}
+		if (!busy)
+			break;
+	}
+
+	return (NULL);
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: blockif_bench [-Fr] [-d depth] "
+	    "[-j submitters] [-o options]\n"
+	    "                     [-s seconds] [-w writepct] [image]\n");
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	char image[MAXPATHLEN], *opts, *optstr;
+	struct timespec t0, t1;
+	struct bench_thr *thr;
+	struct bench_req *r;
+	uint64_t ios, size, writes;
+	double secs;
+	int ch, fd, fill, i, j, seconds;
+
+	opts = NULL;
+	fill = 0;
+	seconds = 5;
+	while ((ch = getopt(argc, argv, "Fd:j:o:rs:w:")) != -1) {
+		switch (ch) {
+		case 'F':
+			fill = 1;
+			break;
+		case 'd':
+			depth = atoi(optarg);
+			break;
+		case 'j':
+			njobs = atoi(optarg);
+			break;
+		case 'o':
+			opts = optarg;
+			break;
+		case 'r':
+			randoff = 1;
+			break;
+		case 's':
+			seconds = atoi(optarg);
+			break;
+		case 'w':
+			writepct = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc > 1 || depth <= 0 || njobs <= 0 || seconds <= 0 ||
+	    writepct < 0 || writepct > 100 || (fill && argc == 1))
+		usage();
+
+	if (argc == 1)
+		strlcpy(image, argv[0], sizeof(image));
+	else {
+		strlcpy(image, "/tmp/blockif_bench.XXXXXX", sizeof(image));
+		fd = mkstemp(image);
+		if (fd < 0 || ftruncate(fd, BENCH_IMAGE_SIZE) != 0)
+			err(1, "%s", image);
+		close(fd);
+		if (fill)
+			bench_fill(image);
+	}
+
+	if (opts != NULL)
+		asprintf(&optstr, "%s,%s", image, opts);
+	else
+		optstr = strdup(image);
+	bctxt = blockif_open(optstr, "bench");
+	if (bctxt == NULL)
+		errx(1, "could not open %s", optstr);
+	size = blockif_size(bctxt);
+	if (size / BENCH_IOSIZE < (uint64_t)njobs)
+		errx(1, "%s is too small", image);
+
+	thr = calloc(njobs, sizeof(struct bench_thr));
+	for (i = 0; i < njobs; i++) {
+		thr[i].t_blocks = size / BENCH_IOSIZE / njobs;
+		thr[i].t_base = i * thr[i].t_blocks * BENCH_IOSIZE;
+		thr[i].t_seed = i + 1;
+		thr[i].t_reqs = calloc(depth, sizeof(struct bench_req));
+		for (j = 0; j < depth; j++) {
+			r = &thr[i].t_reqs[j];
+			r->r_br.br_callback = bench_done;
+			r->r_br.br_param = r;
+			r->r_buf = aligned_alloc(BENCH_IOSIZE, BENCH_IOSIZE);
+			memset(r->r_buf, 0x5a, BENCH_IOSIZE);
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < njobs; i++)
+		pthread_create(&thr[i].t_tid, NULL, bench_thr, &thr[i]);
+	sleep(seconds);
+	atomic_store_rel_int(&bench_stop, 1);
+	ios = writes = 0;
+	for (i = 0; i < njobs; i++) {
+		pthread_join(thr[i].t_tid, NULL);
+		ios += thr[i].t_ios;
+		writes += thr[i].t_writes;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	printf("%d submitters, depth %d, %s: %ju reads and %ju writes in "
+	    "%.2fs, %.0f IOPS\n", njobs, depth,
+	    randoff ? "random" : "sequential", (uintmax_t)(ios - writes),
+	    (uintmax_t)writes, secs, ios / secs);
+
+	blockif_close(bctxt);
+	if (argc == 0)
+		unlink(image);
+
+	return (0);
+}
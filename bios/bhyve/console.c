@@ -81,8 +81,10 @@ console_fb_register(fb_render_func_t render_cb, void *arg)
 void
 console_refresh(void)
 {
-	if (console.fb_render_cb)
+	if (console.fb_render_cb) {
 		(*console.fb_render_cb)(console.gc, console.fb_arg);
+		bhyvegc_commit(console.gc);
+	}
 }
 
 void
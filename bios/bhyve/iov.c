@@ -81,6 +81,47 @@ count_iov(const struct iovec *iov, int niov)
 	return (total);
 }
 
+/*
+ * Describe bytes [skip, skip + len) of an iovec list in 'out', which
+ * must have room for 'niov' entries. Returns the entry count.
+ */
+int
+slice_iov(const struct iovec *iov, int niov, size_t skip, size_t len,
+    struct iovec *out)
+{
+	size_t clen;
+	int i, n;
+
+	for (i = 0; i < niov && skip >= iov[i].iov_len; i++)
+		skip -= iov[i].iov_len;
+	for (n = 0; i < niov && len > 0; i++, n++) {
+		clen = MIN(len, iov[i].iov_len - skip);
+		out[n].iov_base = (uint8_t *)iov[i].iov_base + skip;
+		out[n].iov_len = clen;
+		len -= clen;
+		skip = 0;
+	}
+
+	return (n);
+}
+
+/*
+ * Zero an iovec list from byte 'skip' on.
+ */
+void
+zero_iov(const struct iovec *iov, int niov, size_t skip)
+{
+	size_t clen;
+	int i;
+
+	for (i = 0; i < niov; i++) {
+		clen = MIN(skip, iov[i].iov_len);
+		memset((uint8_t *)iov[i].iov_base + clen, 0,
+		    iov[i].iov_len - clen);
+		skip -= clen;
+	}
+}
+
 void
 truncate_iov(struct iovec *iov, int *niov, size_t length)
 {
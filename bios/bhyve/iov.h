@@ -37,6 +37,9 @@ void seek_iov(const struct iovec *iov1, int niov1, struct iovec *iov2,
     int *niov2, size_t seek);
 void truncate_iov(struct iovec *iov, int *niov, size_t length);
 size_t count_iov(const struct iovec *iov, int niov);
+int slice_iov(const struct iovec *iov, int niov, size_t skip, size_t len,
+    struct iovec *out);
+void zero_iov(const struct iovec *iov, int niov, size_t skip);
 ssize_t iov_to_buf(const struct iovec *iov, int niov, void **buf);
 ssize_t buf_to_iov(const void *buf, size_t buflen, const struct iovec *iov,
     int niov, size_t seek);
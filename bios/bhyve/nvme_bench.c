@@ -0,0 +1,403 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright 2020 Leon Dang
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY NETAPP, INC ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL NETAPP, INC OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * IOPS versus number of queues for the NVMe emulation. The controller is
+ * driven directly, as a polling guest driver would, with guest memory
+ * mapped 1:1 onto the program's own. Reads go to an empty sparse image,
+ * whose holes blockif serves without any i/o, so the figures show how
+ * submission and completion scale across queues rather than storage.
+ *
+ *  cc -O2 -o nvme_bench nvme_bench.c block_if.c qcow2.c overlay.c iov.c \
+ *      mevent.c -lpthread
+ *
+ *  nvme_bench [-d depth] [-q maxqueues] [-s seconds] [image]
+ *
+ * One pair of I/O queues is created per queue, each served by its own
+ * thread, and the run is repeated for 1, 2, 4, ... queues up to -q.
+ * Queue depth is capped at the controller's ioslots, which it reduces
+ * so that all queues together fit in the blockif request ring.
+ */
+
+/* The emulation is built in so that its static entry points are visible */
+#include "pci_nvme.c"
+
+#include <err.h>
+#include <sched.h>
+
+#define	BENCH_IMAGE_SIZE	(1ULL << 30)
+#define	BENCH_SECTSZ		4096
+#define	BENCH_QSZ		256
+#define	BENCH_ADMIN_QSZ		16
+
+const char *vmname = "nvme_bench";
+int raw_stdio;
+
+struct bench_queue {
+	pthread_t		q_tid;
+	uint16_t		q_id;
+	struct nvme_command	*q_sq;
+	struct nvme_completion	*q_cq;
+	uint16_t		q_sqtail;
+	uint16_t		q_cqhead;
+	uint16_t		q_phase;
+	uint8_t			*q_bufs;
+	uint64_t		q_lba;
+	uint64_t		q_ios;
+};
+
+static struct pci_devinst bench_pi;
+static struct nvme_command *bench_asq;
+static struct nvme_completion *bench_acq;
+static uint16_t bench_atail, bench_ahead, bench_aphase = 1;
+static volatile u_int bench_stop;
+static int bench_depth;
+
+/*
+ * Host-side stand-ins for the VM and PCI layers: guest addresses are
+ * host addresses and the guest polls, so interrupts go nowhere.
+ */
+void *
+vm_map_gpa(struct vmctx *ctx, vm_paddr_t gaddr, size_t len)
+{
+
+	return ((void *)(uintptr_t)gaddr);
+}
+
+void *
+paddr_guest2host(struct vmctx *ctx, uintptr_t addr, size_t len)
+{
+
+	return ((void *)addr);
+}
+
+int
+pci_emul_alloc_bar(struct pci_devinst *pdi, int idx, enum pcibar_type type,
+    uint64_t size)
+{
+
+	return (0);
+}
+
+int
+pci_emul_add_msixcap(struct pci_devinst *pi, int msgnum, int barnum)
+{
+
+	return (0);
+}
+
+int
+pci_emul_add_pciecap(struct pci_devinst *pi, int pcie_device_type)
+{
+
+	return (0);
+}
+
+int
+pci_emul_msix_twrite(struct pci_devinst *pi, uint64_t offset, int size,
+    uint64_t value)
+{
+
+	return (0);
+}
+
+uint64_t
+pci_emul_msix_tread(struct pci_devinst *pi, uint64_t offset, int size)
+{
+
+	return (0);
+}
+
+int
+pci_msix_table_bar(struct pci_devinst *pi)
+{
+
+	return (-1);
+}
+
+int
+pci_msix_pba_bar(struct pci_devinst *pi)
+{
+
+	return (-1);
+}
+
+void
+pci_generate_msix(struct pci_devinst *pi, int msgnum)
+{
+}
+
+void
+pci_lintr_request(struct pci_devinst *pi)
+{
+}
+
+static void
+bench_reg_write(uint64_t offset, uint64_t value)
+{
+
+	pci_nvme_write(NULL, 0, &bench_pi, 0, offset, 4, value);
+}
+
+static void
+bench_sq_doorbell(uint16_t qid, uint16_t tail)
+{
+
+	bench_reg_write(NVME_DOORBELL_OFFSET + qid * 8, tail);
+}
+
+static void
+bench_cq_doorbell(uint16_t qid, uint16_t head)
+{
+
+	bench_reg_write(NVME_DOORBELL_OFFSET + qid * 8 + 4, head);
+}
+
+/* Admin commands complete before their doorbell write returns. */
+static void
+bench_admin(struct nvme_command *cmd)
+{
+	struct nvme_completion *c;
+
+	bench_asq[bench_atail] = *cmd;
+	bench_atail = (bench_atail + 1) % BENCH_ADMIN_QSZ;
+	bench_sq_doorbell(0, bench_atail);
+
+	c = &bench_acq[bench_ahead];
+	if (NVME_STATUS_GET_P(c->status) != bench_aphase ||
+	    NVME_STATUS_GET_SC(c->status) != NVME_SC_SUCCESS)
+		errx(1, "admin command 0x%x failed", cmd->opc);
+	if (++bench_ahead == BENCH_ADMIN_QSZ) {
+		bench_ahead = 0;
+		bench_aphase ^= 1;
+	}
+	bench_cq_doorbell(0, bench_ahead);
+}
+
+static void
+bench_create_queue(struct bench_queue *q)
+{
+	struct nvme_command cmd;
+
+	q->q_cq = aligned_alloc(PAGE_SIZE,
+	    roundup2(BENCH_QSZ * sizeof(struct nvme_completion), PAGE_SIZE));
+	q->q_sq = aligned_alloc(PAGE_SIZE,
+	    roundup2(BENCH_QSZ * sizeof(struct nvme_command), PAGE_SIZE));
+	q->q_bufs = aligned_alloc(PAGE_SIZE, BENCH_QSZ * BENCH_SECTSZ);
+	if (q->q_cq == NULL || q->q_sq == NULL || q->q_bufs == NULL)
+		err(1, "queue %u", q->q_id);
+	memset(q->q_cq, 0, BENCH_QSZ * sizeof(struct nvme_completion));
+	q->q_phase = 1;
+
+	/* Physically contiguous, no interrupts */
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.opc = NVME_OPC_CREATE_IO_CQ;
+	cmd.prp1 = (uintptr_t)q->q_cq;
+	cmd.cdw10 = q->q_id | (BENCH_QSZ - 1) << 16;
+	cmd.cdw11 = NVME_CMD_CDW11_PC;
+	bench_admin(&cmd);
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.opc = NVME_OPC_CREATE_IO_SQ;
+	cmd.prp1 = (uintptr_t)q->q_sq;
+	cmd.cdw10 = q->q_id | (BENCH_QSZ - 1) << 16;
+	cmd.cdw11 = NVME_CMD_CDW11_PC | q->q_id << 16;
+	bench_admin(&cmd);
+}
+
+static void
+bench_post(struct bench_queue *q, uint16_t cid)
+{
+	struct nvme_command *cmd;
+
+	cmd = &q->q_sq[q->q_sqtail];
+	memset(cmd, 0, sizeof(*cmd));
+	cmd->opc = NVME_OPC_READ;
+	cmd->cid = cid;
+	cmd->nsid = 1;
+	cmd->prp1 = (uintptr_t)(q->q_bufs + cid * BENCH_SECTSZ);
+	cmd->cdw10 = (uint32_t)q->q_lba;
+	cmd->cdw11 = (uint32_t)(q->q_lba >> 32);
+	cmd->cdw12 = 0;			/* one block */
+	q->q_lba = (q->q_lba + 1) % (BENCH_IMAGE_SIZE / BENCH_SECTSZ);
+	q->q_sqtail = (q->q_sqtail + 1) % BENCH_QSZ;
+}
+
+static void *
+bench_queue_thr(void *arg)
+{
+	struct bench_queue *q = arg;
+	struct nvme_completion *c;
+	int i, inflight, n;
+
+	for (i = 0; i < bench_depth; i++)
+		bench_post(q, i);
+	bench_sq_doorbell(q->q_id, q->q_sqtail);
+	inflight = bench_depth;
+
+	while (inflight > 0) {
+		n = 0;
+		for (;;) {
+			c = &q->q_cq[q->q_cqhead];
+			if (NVME_STATUS_GET_P(atomic_load_acq_16(&c->status)) !=
+			    q->q_phase)
+				break;
+			if (NVME_STATUS_GET_SC(c->status) != NVME_SC_SUCCESS)
+				errx(1, "read on queue %u failed", q->q_id);
+			if (!atomic_load_acq_int(&bench_stop))
+				bench_post(q, c->cid);
+			else
+				inflight--;
+			if (++q->q_cqhead == BENCH_QSZ) {
+				q->q_cqhead = 0;
+				q->q_phase ^= 1;
+			}
+			n++;
+		}
+		if (n == 0) {
+			sched_yield();
+			continue;
+		}
+		q->q_ios += n;
+		bench_cq_doorbell(q->q_id, q->q_cqhead);
+		if (!atomic_load_acq_int(&bench_stop))
+			bench_sq_doorbell(q->q_id, q->q_sqtail);
+	}
+
+	return (NULL);
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: nvme_bench [-d depth] [-q maxqueues] "
+	    "[-s seconds] [image]\n");
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	char image[MAXPATHLEN], *opts;
+	struct pci_nvme_softc *sc;
+	struct bench_queue *queues;
+	struct timespec t0, t1;
+	uint64_t ios;
+	double secs;
+	int ch, depth, fd, i, maxq, nq, seconds;
+
+	depth = 8;
+	maxq = 16;
+	seconds = 5;
+	while ((ch = getopt(argc, argv, "d:q:s:")) != -1) {
+		switch (ch) {
+		case 'd':
+			depth = atoi(optarg);
+			break;
+		case 'q':
+			maxq = atoi(optarg);
+			break;
+		case 's':
+			seconds = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc > 1 || depth <= 0 || depth >= BENCH_QSZ || maxq <= 0 ||
+	    seconds <= 0)
+		usage();
+
+	if (argc == 1)
+		strlcpy(image, argv[0], sizeof(image));
+	else {
+		strlcpy(image, "/tmp/nvme_bench.XXXXXX", sizeof(image));
+		fd = mkstemp(image);
+		if (fd < 0 || ftruncate(fd, BENCH_IMAGE_SIZE) != 0)
+			err(1, "%s", image);
+		close(fd);
+	}
+
+	asprintf(&opts, "%s,maxq=%d,qsz=%d,ioslots=%d,sectsz=%d", image,
+	    maxq, BENCH_QSZ, depth, BENCH_SECTSZ);
+	if (pci_nvme_init(NULL, &bench_pi, opts) != 0)
+		errx(1, "could not set up the controller");
+	sc = bench_pi.pi_arg;
+
+	bench_asq = aligned_alloc(PAGE_SIZE, PAGE_SIZE);
+	bench_acq = aligned_alloc(PAGE_SIZE, PAGE_SIZE);
+	memset(bench_acq, 0, PAGE_SIZE);
+	bench_reg_write(NVME_CR_AQA, (BENCH_ADMIN_QSZ - 1) |
+	    (BENCH_ADMIN_QSZ - 1) << 16);
+	bench_reg_write(NVME_CR_ASQ_LOW, (uintptr_t)bench_asq);
+	bench_reg_write(NVME_CR_ASQ_HI, (uint64_t)(uintptr_t)bench_asq >> 32);
+	bench_reg_write(NVME_CR_ACQ_LOW, (uintptr_t)bench_acq);
+	bench_reg_write(NVME_CR_ACQ_HI, (uint64_t)(uintptr_t)bench_acq >> 32);
+	bench_reg_write(NVME_CR_CC, 1 | 6 << 16 | 4 << 20);
+
+	queues = calloc(maxq, sizeof(struct bench_queue));
+	for (i = 0; i < maxq; i++) {
+		queues[i].q_id = i + 1;
+		queues[i].q_lba = i * (BENCH_IMAGE_SIZE / BENCH_SECTSZ / maxq);
+		bench_create_queue(&queues[i]);
+	}
+
+	for (nq = 1; ; nq = MIN(nq * 2, maxq)) {
+		bench_depth = MIN(depth, (int)sc->ioslots);
+		atomic_store_rel_int(&bench_stop, 0);
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for (i = 0; i < nq; i++) {
+			queues[i].q_ios = 0;
+			pthread_create(&queues[i].q_tid, NULL, bench_queue_thr,
+			    &queues[i]);
+		}
+		sleep(seconds);
+		atomic_store_rel_int(&bench_stop, 1);
+		ios = 0;
+		for (i = 0; i < nq; i++) {
+			pthread_join(queues[i].q_tid, NULL);
+			ios += queues[i].q_ios;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+
+		secs = (t1.tv_sec - t0.tv_sec) +
+		    (t1.tv_nsec - t0.tv_nsec) / 1e9;
+		printf("%2d queues, depth %3d: %10.0f IOPS\n", nq, bench_depth,
+		    ios / secs);
+		if (nq == maxq)
+			break;
+	}
+
+	if (argc == 0)
+		unlink(image);
+
+	return (0);
+}
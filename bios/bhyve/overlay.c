@@ -0,0 +1,600 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright 2020 Leon Dang
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY NETAPP, INC ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL NETAPP, INC OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Copy-on-write overlay images.
+ *
+ * An overlay names a base image, which is either raw or another
+ * overlay, and records which grains of the disk it holds in an
+ * allocation bitmap kept in memory and written through to the file.
+ * Grains are stored at their guest offset in a sparse data area, so no
+ * mapping table is needed: reads of grains whose bit is set go to the
+ * overlay, everything else falls through to the base. The first write
+ * to a grain copies the rest of it up from the base before setting its
+ * bit. The data is synced before the bit is written, so that after a
+ * crash a grain whose bit is set on disk holds its copied-up contents
+ * rather than a hole; the bit itself reaches stable storage only on
+ * the next flush.
+ *
+ * Creating an overlay only writes its header, so cloning a VM from a
+ * base image is O(1), and the base, which is only ever read, stays
+ * shared in the page cache between all its clones.
+ *
+ * Layout, all integers little-endian:
+ *	0	magic "BHYVEOVL"
+ *	8	version
+ *	12	log2 of the grain size
+ *	16	disk size in bytes
+ *	24	offset of the allocation bitmap (64-bit words)
+ *	32	offset of the data area
+ *	40	length of the base image name
+ *	44	flags
+ *	64	base image name
+ *
+ * Whether the base is raw or another overlay is recorded in the flags
+ * when the overlay is created; the base is never probed, as it may be
+ * a raw image whose contents a guest controls.
+ */
+
+#include <sys/cdefs.h>
+
+#include <sys/param.h>
+#ifndef WITHOUT_CAPSICUM
+#include <sys/capsicum.h>
+#endif
+#include <sys/disk.h>
+#include <sys/endian.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#ifndef WITHOUT_CAPSICUM
+#include <capsicum_helpers.h>
+#endif
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+#include <machine/atomic.h>
+
+#include "debug.h"
+#include "iov.h"
+#include "overlay.h"
+
+#define	OVL_MAGIC		"BHYVEOVL"
+#define	OVL_VERSION		1
+#define	OVL_HDR_SIZE		4096
+#define	OVL_NAME_OFF		64
+#define	OVL_F_BASE_OVL		0x1	/* base is an overlay */
+#define	OVL_GRAIN_SHIFT		16	/* 64k grains for new overlays */
+#define	OVL_MIN_GRAIN_SHIFT	9
+#define	OVL_MAX_GRAIN_SHIFT	24
+#define	OVL_MAX_CHAIN		16
+#define	OVL_GRAIN_LOCKS		64	/* copy-up locks, hashed by grain */
+
+struct ovl {
+	int		o_fd;
+	int		o_ownfd;
+	int		o_ro;
+	int		o_gshift;
+	uint64_t	o_gsize;
+	uint64_t	o_size;
+	uint64_t	o_map_off;
+	uint64_t	o_data_off;
+	uint64_t	*o_map;		/* host byte order */
+	size_t		o_map_words;
+	pthread_mutex_t	o_mtx;		/* serializes bitmap word writes */
+	pthread_mutex_t	o_glock[OVL_GRAIN_LOCKS];
+
+	uint32_t	o_flags;
+	struct ovl	*o_bo;		/* overlay base, or */
+	int		o_bfd;		/* raw base */
+	off_t		o_bsize;
+};
+
+static struct ovl *ovl_open_chain(int fd, const char *path, int ro, int depth);
+
+static int
+ovl_pread_full(int fd, void *buf, size_t len, off_t off)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = pread(fd, buf, len, off);
+		if (n < 0)
+			return (-1);
+		if (n == 0) {
+			memset(buf, 0, len);
+			break;
+		}
+		buf = (uint8_t *)buf + n;
+		len -= n;
+		off += n;
+	}
+	return (0);
+}
+
+static int
+ovl_pwrite_full(int fd, const void *buf, size_t len, off_t off)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = pwrite(fd, buf, len, off);
+		if (n < 0)
+			return (-1);
+		if (n == 0) {
+			errno = EIO;
+			return (-1);
+		}
+		buf = (const uint8_t *)buf + n;
+		len -= n;
+		off += n;
+	}
+	return (0);
+}
+
+static int
+ovl_isset(struct ovl *o, uint64_t g)
+{
+
+	return ((atomic_load_acq_64(&o->o_map[g >> 6]) >> (g & 63)) & 1);
+}
+
+/*
+ * Length, up to 'max', of the run of grains starting at 'voff' that are
+ * all in the overlay or all in the base; *setp tells which.
+ */
+static size_t
+ovl_run(struct ovl *o, uint64_t voff, size_t max, int *setp)
+{
+	uint64_t g;
+	size_t n;
+	int set;
+
+	g = voff >> o->o_gshift;
+	set = ovl_isset(o, g);
+	n = MIN(max, o->o_gsize - (voff & (o->o_gsize - 1)));
+	while (n < max && ovl_isset(o, ++g) == set)
+		n += MIN(max - n, o->o_gsize);
+	*setp = set;
+	return (n);
+}
+
+static int
+ovl_base_read(struct ovl *o, const struct iovec *iov, int iovcnt,
+    uint64_t voff, size_t len)
+{
+	ssize_t n;
+
+	n = 0;
+	if (voff < o->o_bsize) {
+		if (o->o_bo != NULL)
+			n = ovl_preadv(o->o_bo, iov, iovcnt, voff);
+		else
+			n = preadv(o->o_bfd, iov, iovcnt, voff);
+		if (n < 0)
+			return (-1);
+	}
+	if (n < len)
+		zero_iov(iov, iovcnt, n);
+	return (0);
+}
+
+ssize_t
+ovl_preadv(struct ovl *o, const struct iovec *iov, int iovcnt, off_t off)
+{
+	struct iovec *siov;
+	size_t done, len, n;
+	ssize_t rn;
+	int set, sn, error;
+
+	if (off < 0 || (uint64_t)off >= o->o_size)
+		return (0);
+	len = MIN(count_iov(iov, iovcnt), o->o_size - off);
+
+	siov = malloc(iovcnt * sizeof(struct iovec));
+	if (siov == NULL)
+		return (-1);
+	error = 0;
+	for (done = 0; done < len && error == 0; done += n) {
+		n = ovl_run(o, off + done, len - done, &set);
+		sn = slice_iov(iov, iovcnt, done, n, siov);
+		if (set) {
+			rn = preadv(o->o_fd, siov, sn, o->o_data_off + off + done);
+			if (rn < 0)
+				error = -1;
+			else if (rn < n)
+				zero_iov(siov, sn, rn);
+		} else
+			error = ovl_base_read(o, siov, sn, off + done, n);
+	}
+	free(siov);
+
+	return (error ? -1 : (ssize_t)len);
+}
+
+/*
+ * First write to a grain: copy up whatever of it is not being written
+ * from the base, sync it, then publish it in the bitmap. Only writers
+ * to grains sharing a copy-up lock wait for each other's sync; o_mtx
+ * is held just to update the bitmap word.
+ */
+static int
+ovl_write_grain(struct ovl *o, uint64_t voff, const struct iovec *iov,
+    int iovcnt, size_t len)
+{
+	struct iovec biov;
+	uint64_t g, goff, w;
+	uint8_t b[8], *buf, *p;
+	int error, i;
+
+	g = voff >> o->o_gshift;
+	goff = voff & ~(o->o_gsize - 1);
+	buf = NULL;
+	error = -1;
+
+	pthread_mutex_lock(&o->o_glock[g % OVL_GRAIN_LOCKS]);
+	if (ovl_isset(o, g)) {
+		/* Raced with another writer to the same grain */
+		if (pwritev(o->o_fd, iov, iovcnt, o->o_data_off + voff) >= 0)
+			error = 0;
+		goto done;
+	}
+
+	if (len == o->o_gsize) {
+		if (pwritev(o->o_fd, iov, iovcnt, o->o_data_off + voff) !=
+		    (ssize_t)len)
+			goto done;
+	} else {
+		if ((buf = malloc(o->o_gsize)) == NULL)
+			goto done;
+		biov.iov_base = buf;
+		biov.iov_len = o->o_gsize;
+		if (ovl_base_read(o, &biov, 1, goff, o->o_gsize))
+			goto done;
+		p = buf + (voff - goff);
+		for (i = 0; i < iovcnt; i++) {
+			memcpy(p, iov[i].iov_base, iov[i].iov_len);
+			p += iov[i].iov_len;
+		}
+		if (ovl_pwrite_full(o->o_fd, buf, o->o_gsize,
+		    o->o_data_off + goff))
+			goto done;
+	}
+	if (fdatasync(o->o_fd))
+		goto done;
+
+	w = g >> 6;
+	pthread_mutex_lock(&o->o_mtx);
+	atomic_set_rel_64(&o->o_map[w], 1ULL << (g & 63));
+	le64enc(b, o->o_map[w]);
+	if (ovl_pwrite_full(o->o_fd, b, sizeof(b), o->o_map_off + w * 8) == 0)
+		error = 0;
+	pthread_mutex_unlock(&o->o_mtx);
+done:
+	pthread_mutex_unlock(&o->o_glock[g % OVL_GRAIN_LOCKS]);
+	free(buf);
+	return (error);
+}
+
+ssize_t
+ovl_pwritev(struct ovl *o, const struct iovec *iov, int iovcnt, off_t off)
+{
+	struct iovec *siov;
+	size_t done, len, n;
+	int set, sn, error;
+
+	if (o->o_ro) {
+		errno = EROFS;
+		return (-1);
+	}
+	if (off < 0 || (uint64_t)off >= o->o_size)
+		return (0);
+	len = MIN(count_iov(iov, iovcnt), o->o_size - off);
+
+	siov = malloc(iovcnt * sizeof(struct iovec));
+	if (siov == NULL)
+		return (-1);
+	error = 0;
+	for (done = 0; done < len && error == 0; done += n) {
+		n = ovl_run(o, off + done, len - done, &set);
+		if (set) {
+			sn = slice_iov(iov, iovcnt, done, n, siov);
+			if (pwritev(o->o_fd, siov, sn,
+			    o->o_data_off + off + done) < 0)
+				error = -1;
+		} else {
+			n = MIN(n, o->o_gsize -
+			    ((off + done) & (o->o_gsize - 1)));
+			sn = slice_iov(iov, iovcnt, done, n, siov);
+			error = ovl_write_grain(o, off + done, siov, sn, n);
+		}
+	}
+	free(siov);
+
+	return (error ? -1 : (ssize_t)len);
+}
+
+int
+ovl_flush(struct ovl *o)
+{
+
+	if (fsync(o->o_fd))
+		return (errno);
+	return (0);
+}
+
+off_t
+ovl_size(struct ovl *o)
+{
+
+	return (o->o_size);
+}
+
+static int
+ovl_base_size(int fd, int isovl, off_t *sizep)
+{
+	struct stat sbuf;
+	uint8_t b[8];
+
+	if (isovl) {
+		if (ovl_pread_full(fd, b, sizeof(b), 16))
+			return (-1);
+		*sizep = le64dec(b);
+		return (0);
+	}
+	if (fstat(fd, &sbuf) < 0)
+		return (-1);
+	if (S_ISCHR(sbuf.st_mode))
+		return (ioctl(fd, DIOCGMEDIASIZE, sizep));
+	*sizep = sbuf.st_size;
+	return (0);
+}
+
+/*
+ * Create an empty overlay of 'base' at 'path'. The base is recorded by
+ * absolute path so that the overlay can be opened from anywhere, along
+ * with whether it is itself an overlay ('baseovl').
+ */
+int
+ovl_create(const char *path, const char *base, int baseovl)
+{
+	char rbase[MAXPATHLEN];
+	uint8_t hdr[OVL_HDR_SIZE];
+	uint64_t gsize, map_off, map_len, data_off;
+	off_t size;
+	int bfd, fd;
+
+	if (realpath(base, rbase) == NULL ||
+	    (bfd = open(rbase, O_RDONLY)) < 0) {
+		warn("Could not open overlay base %s", base);
+		return (-1);
+	}
+	if (ovl_base_size(bfd, baseovl, &size) < 0) {
+		warn("Could not size overlay base %s", base);
+		close(bfd);
+		return (-1);
+	}
+	close(bfd);
+
+	if (strlen(rbase) >= OVL_HDR_SIZE - OVL_NAME_OFF) {
+		EPRINTLN("Overlay base name %s is too long", rbase);
+		return (-1);
+	}
+
+	gsize = 1ULL << OVL_GRAIN_SHIFT;
+	map_off = OVL_HDR_SIZE;
+	map_len = roundup2(howmany(howmany(size, gsize), 64) * 8, OVL_HDR_SIZE);
+	data_off = roundup2(map_off + map_len, gsize);
+
+	memset(hdr, 0, sizeof(hdr));
+	memcpy(hdr, OVL_MAGIC, sizeof(OVL_MAGIC) - 1);
+	le32enc(hdr + 8, OVL_VERSION);
+	le32enc(hdr + 12, OVL_GRAIN_SHIFT);
+	le64enc(hdr + 16, size);
+	le64enc(hdr + 24, map_off);
+	le64enc(hdr + 32, data_off);
+	le32enc(hdr + 40, strlen(rbase));
+	le32enc(hdr + 44, baseovl ? OVL_F_BASE_OVL : 0);
+	memcpy(hdr + OVL_NAME_OFF, rbase, strlen(rbase));
+
+	fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0) {
+		warn("Could not create overlay %s", path);
+		return (-1);
+	}
+	if (ovl_pwrite_full(fd, hdr, sizeof(hdr), 0) ||
+	    ftruncate(fd, data_off + size) < 0 || fsync(fd) < 0) {
+		warn("Could not write overlay %s", path);
+		close(fd);
+		unlink(path);
+		return (-1);
+	}
+	close(fd);
+
+	return (0);
+}
+
+static int
+ovl_open_base(struct ovl *o, const char *path, const char *name, int depth)
+{
+	char bpath[MAXPATHLEN], dir[MAXPATHLEN];
+	int fd;
+#ifndef WITHOUT_CAPSICUM
+	cap_rights_t rights;
+	cap_ioctl_t cmds[] = { DIOCGMEDIASIZE };
+#endif
+
+	if (name[0] == '/')
+		strlcpy(bpath, name, sizeof(bpath));
+	else {
+		strlcpy(dir, path, sizeof(dir));
+		snprintf(bpath, sizeof(bpath), "%s/%s", dirname(dir), name);
+	}
+
+	fd = open(bpath, O_RDONLY);
+	if (fd < 0) {
+		warn("Could not open overlay base %s", bpath);
+		return (-1);
+	}
+	if (ovl_base_size(fd, o->o_flags & OVL_F_BASE_OVL, &o->o_bsize) < 0) {
+		warn("Could not size overlay base %s", bpath);
+		close(fd);
+		return (-1);
+	}
+
+#ifndef WITHOUT_CAPSICUM
+	cap_rights_init(&rights, CAP_FSTAT, CAP_IOCTL, CAP_READ, CAP_SEEK);
+	if (caph_rights_limit(fd, &rights) == -1 ||
+	    caph_ioctls_limit(fd, cmds, nitems(cmds)) == -1)
+		errx(EX_OSERR, "Unable to apply rights for sandbox");
+#endif
+
+	if (o->o_flags & OVL_F_BASE_OVL) {
+		o->o_bo = ovl_open_chain(fd, bpath, 1, depth + 1);
+		if (o->o_bo == NULL) {
+			close(fd);
+			return (-1);
+		}
+		o->o_bo->o_ownfd = 1;
+	} else
+		o->o_bfd = fd;
+	return (0);
+}
+
+static struct ovl *
+ovl_open_chain(int fd, const char *path, int ro, int depth)
+{
+	uint8_t hdr[OVL_HDR_SIZE];
+	struct ovl *o;
+	uint32_t nlen, version;
+	size_t i;
+
+	if (depth >= OVL_MAX_CHAIN) {
+		EPRINTLN("Overlay chain of %s is too long", path);
+		return (NULL);
+	}
+	if (ovl_pread_full(fd, hdr, sizeof(hdr), 0)) {
+		warn("Could not read overlay header of %s", path);
+		return (NULL);
+	}
+
+	o = calloc(1, sizeof(struct ovl));
+	if (o == NULL)
+		return (NULL);
+	o->o_fd = fd;
+	o->o_bfd = -1;
+	o->o_ro = ro;
+	pthread_mutex_init(&o->o_mtx, NULL);
+	for (i = 0; i < OVL_GRAIN_LOCKS; i++)
+		pthread_mutex_init(&o->o_glock[i], NULL);
+
+	version = le32dec(hdr + 8);
+	o->o_gshift = le32dec(hdr + 12);
+	o->o_size = le64dec(hdr + 16);
+	o->o_map_off = le64dec(hdr + 24);
+	o->o_data_off = le64dec(hdr + 32);
+	nlen = le32dec(hdr + 40);
+	o->o_flags = le32dec(hdr + 44);
+
+	if (memcmp(hdr, OVL_MAGIC, sizeof(OVL_MAGIC) - 1) != 0) {
+		EPRINTLN("%s is not an overlay", path);
+		goto fail;
+	}
+	if (version != OVL_VERSION) {
+		EPRINTLN("Overlay %s: unsupported version %u", path, version);
+		goto fail;
+	}
+	if (o->o_gshift < OVL_MIN_GRAIN_SHIFT ||
+	    o->o_gshift > OVL_MAX_GRAIN_SHIFT) {
+		EPRINTLN("Overlay %s: bad grain size", path);
+		goto fail;
+	}
+	o->o_gsize = 1ULL << o->o_gshift;
+	o->o_map_words = howmany(howmany(o->o_size, o->o_gsize), 64);
+	if (o->o_map_off < OVL_HDR_SIZE ||
+	    o->o_data_off < o->o_map_off + o->o_map_words * 8 ||
+	    nlen == 0 || nlen >= OVL_HDR_SIZE - OVL_NAME_OFF ||
+	    (o->o_flags & ~OVL_F_BASE_OVL) != 0) {
+		EPRINTLN("Overlay %s: bad header", path);
+		goto fail;
+	}
+
+	/* One spare word so that ovl_run() may look one grain past the end */
+	o->o_map = calloc(o->o_map_words + 1, sizeof(uint64_t));
+	if (o->o_map == NULL)
+		goto fail;
+	if (ovl_pread_full(fd, o->o_map, o->o_map_words * 8, o->o_map_off)) {
+		warn("Could not read overlay bitmap of %s", path);
+		goto fail;
+	}
+	for (i = 0; i < o->o_map_words; i++)
+		o->o_map[i] = le64dec(&o->o_map[i]);
+
+	hdr[OVL_NAME_OFF + nlen] = '\0';
+	if (ovl_open_base(o, path, (char *)hdr + OVL_NAME_OFF, depth))
+		goto fail;
+
+	return (o);
+fail:
+	ovl_close(o);
+	return (NULL);
+}
+
+struct ovl *
+ovl_open(int fd, const char *path, int ro)
+{
+
+	return (ovl_open_chain(fd, path, ro, 0));
+}
+
+void
+ovl_close(struct ovl *o)
+{
+	int i;
+
+	if (o->o_bo != NULL)
+		ovl_close(o->o_bo);
+	if (o->o_bfd >= 0)
+		close(o->o_bfd);
+	if (o->o_ownfd)
+		close(o->o_fd);
+	free(o->o_map);
+	pthread_mutex_destroy(&o->o_mtx);
+	for (i = 0; i < OVL_GRAIN_LOCKS; i++)
+		pthread_mutex_destroy(&o->o_glock[i]);
+	free(o);
+}
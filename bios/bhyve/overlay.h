@@ -0,0 +1,51 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright 2020 Leon Dang
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY NETAPP, INC ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL NETAPP, INC OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _OVERLAY_H_
+#define	_OVERLAY_H_
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+struct ovl;
+
+/*
+ * Copy-on-write overlays of a raw base image (or of another overlay).
+ * The i/o routines follow preadv(2)/pwritev(2).
+ */
+int	ovl_create(const char *path, const char *base, int baseovl);
+struct ovl *ovl_open(int fd, const char *path, int ro);
+void	ovl_close(struct ovl *o);
+off_t	ovl_size(struct ovl *o);
+ssize_t	ovl_preadv(struct ovl *o, const struct iovec *iov, int iovcnt,
+    off_t off);
+ssize_t	ovl_pwritev(struct ovl *o, const struct iovec *iov, int iovcnt,
+    off_t off);
+int	ovl_flush(struct ovl *o);
+
+#endif	/* _OVERLAY_H_ */
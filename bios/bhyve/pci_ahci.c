@@ -41,6 +41,8 @@ __FBSDID("$FreeBSD$");
 #include <sys/ata.h>
 #include <sys/endian.h>
 
+#include <machine/atomic.h>
+
 #include <machine/vmm_snapshot.h>
 
 #include <errno.h>
@@ -61,6 +63,7 @@ __FBSDID("$FreeBSD$");
 #include "pci_emul.h"
 #include "ahci.h"
 #include "block_if.h"
+#include "mevent.h"
 #include "microbios.h"
 
 #define	DEF_PORTS	6	/* Intel ICH8 AHCI supports 6 ports */
@@ -135,6 +138,8 @@ struct ahci_ioreq {
 	int slot;
 	int more;
 	int readop;
+	int err;
+	struct ahci_ioreq *io_cnext;	/* on the port's iodone stack */
 };
 
 struct ahci_port {
@@ -180,6 +185,7 @@ struct ahci_port {
 	int ioqsz;
 	STAILQ_HEAD(ahci_fhead, ahci_ioreq) iofhd;
 	TAILQ_HEAD(ahci_bhead, ahci_ioreq) iobhd;
+	struct ahci_ioreq *volatile iodone;	/* completed, not yet posted */
 };
 
 struct ahci_cmd_hdr {
@@ -213,6 +219,8 @@ struct pci_ahci_softc {
 	uint32_t cap2;
 	uint32_t bohc;
 	uint32_t lintr;
+	int ccc_count;			/* completions since last CCC intr */
+	struct mevent *ccc_timer;
 	struct ahci_port port[MAX_PORTS];
 };
 #define	ahci_ctx(sc)	((sc)->asc_pi->pi_vmctx)
@@ -249,6 +257,19 @@ ahci_md_getblkif(void *p)
 	return (struct blockif_ctxt *)((struct ahci_port *)p)->bctx;
 }
 
+/*
+ * PxIS bits that are coalesced when the port takes part in CCC.
+ */
+static inline uint32_t
+ahci_ccc_mask(struct ahci_port *p)
+{
+	struct pci_ahci_softc *sc = p->pr_sc;
+
+	if ((sc->ccc_ctl & AHCI_CCCC_EN) && (sc->ccc_pts & (1 << p->port)))
+		return (AHCI_P_IX_DHR | AHCI_P_IX_SDB);
+	return (0);
+}
+
 /*
  * Generate HBA interrupts on global IS register write.
  */
@@ -260,10 +281,13 @@ ahci_generate_intr(struct pci_ahci_softc *sc, uint32_t mask)
 	int i, nmsg;
 	uint32_t mmask;
 
-	/* Update global IS from PxIS/PxIE. */
+	/*
+	 * Update global IS from PxIS/PxIE.  Command completions on ports
+	 * covered by CCC are reported through the CCC interrupt instead.
+	 */
 	for (i = 0; i < sc->ports; i++) {
 		p = &sc->port[i];
-		if (p->is & p->ie)
+		if (p->is & p->ie & ~ahci_ccc_mask(p))
 			sc->is |= (1 << i);
 	}
 	DPRINTF("%s(%08x) %08x", __func__, mask, sc->is);
@@ -312,7 +336,7 @@ ahci_port_intr(struct ahci_port *p)
 	    p->port, p->is, p->ie, sc->is);
 
 	/* If there is nothing enabled -- we are done. */
-	if ((p->is & p->ie) == 0)
+	if ((p->is & p->ie & ~ahci_ccc_mask(p)) == 0)
 		return;
 
 	/* In case of non-shared MSI always generate interrupt. */
@@ -342,6 +366,91 @@ ahci_port_intr(struct ahci_port *p)
 	}
 }
 
+/*
+ * Raise the command completion coalescing interrupt.  Its IS bit is the
+ * first unimplemented port, reported to the guest in CCC_CTL.INT.
+ */
+static void
+ahci_ccc_intr(struct pci_ahci_softc *sc)
+{
+	struct pci_devinst *pi = sc->asc_pi;
+	int intr, nmsg;
+
+	sc->ccc_count = 0;
+	if (sc->ccc_timer != NULL) {
+		mevent_delete(sc->ccc_timer);
+		sc->ccc_timer = NULL;
+	}
+
+	intr = (sc->ccc_ctl & AHCI_CCCC_INT_MASK) >> AHCI_CCCC_INT_SHIFT;
+	if (sc->is & (1 << intr))
+		return;
+	sc->is |= (1 << intr);
+
+	DPRINTF("%s %08x", __func__, sc->is);
+
+	if ((sc->ghc & AHCI_GHC_IE) == 0)
+		return;
+	nmsg = pci_msi_maxmsgnum(pi);
+	if (nmsg > 0) {
+		pci_generate_msi(pi, MIN(intr, nmsg - 1));
+	} else if (!sc->lintr) {
+		sc->lintr = 1;
+		pci_lintr_assert(pi);
+	}
+}
+
+static void
+ahci_ccc_timer(int fd, enum ev_type type, void *param)
+{
+	struct pci_ahci_softc *sc = param;
+
+	pthread_mutex_lock(&sc->mtx);
+	if (sc->ccc_timer != NULL) {
+		mevent_delete(sc->ccc_timer);
+		sc->ccc_timer = NULL;
+	}
+	if ((sc->ccc_ctl & AHCI_CCCC_EN) && sc->ccc_count > 0)
+		ahci_ccc_intr(sc);
+	pthread_mutex_unlock(&sc->mtx);
+}
+
+/*
+ * Account for 'n' command completions on a CCC port.  The interrupt fires
+ * once CC completions have accumulated, or TV milliseconds after the
+ * first completion not yet reported, whichever comes first.
+ */
+static void
+ahci_ccc_complete(struct pci_ahci_softc *sc, int n)
+{
+	int cc, tv;
+
+	cc = (sc->ccc_ctl & AHCI_CCCC_CC_MASK) >> AHCI_CCCC_CC_SHIFT;
+	tv = (sc->ccc_ctl & AHCI_CCCC_TV_MASK) >> AHCI_CCCC_TV_SHIFT;
+
+	sc->ccc_count += n;
+	if (sc->ccc_count >= cc && cc != 0) {
+		ahci_ccc_intr(sc);
+		return;
+	}
+	if (sc->ccc_timer == NULL) {
+		sc->ccc_timer = mevent_add(tv, EVF_TIMER, ahci_ccc_timer, sc);
+		if (sc->ccc_timer == NULL)
+			ahci_ccc_intr(sc);
+	}
+}
+
+static void
+ahci_ccc_stop(struct pci_ahci_softc *sc)
+{
+
+	if (sc->ccc_timer != NULL) {
+		mevent_delete(sc->ccc_timer);
+		sc->ccc_timer = NULL;
+	}
+	sc->ccc_count = 0;
+}
+
 static void
 ahci_write_fis(struct ahci_port *p, enum sata_fis_type ft, uint8_t *fis)
 {
@@ -375,7 +484,11 @@ ahci_write_fis(struct ahci_port *p, enum sata_fis_type ft, uint8_t *fis)
 		irq |= AHCI_P_IX_TFE;
 	}
 	memcpy(p->rfis + offset, fis, len);
-	if (irq) {
+	if (irq && (irq & ~ahci_ccc_mask(p)) == 0) {
+		p->is |= irq;
+		ahci_ccc_complete(p->pr_sc, ft == FIS_TYPE_SETDEVBITS ?
+		    __builtin_popcount(le32dec(fis + 4)) : 1);
+	} else if (irq) {
 		if (~p->is & irq) {
 			p->is |= irq;
 			ahci_port_intr(p);
@@ -420,6 +533,28 @@ ahci_write_fis_sdb(struct ahci_port *p, int slot, uint8_t *cfis, uint32_t tfd)
 	ahci_write_fis(p, FIS_TYPE_SETDEVBITS, fis);
 }
 
+/*
+ * Report successful completion of every NCQ command in 'done' with a
+ * single Set Device Bits FIS.
+ */
+static void
+ahci_write_fis_sdb_done(struct ahci_port *p, uint32_t done)
+{
+	uint8_t fis[8];
+	uint32_t tfd;
+
+	tfd = (ATA_S_READY | ATA_S_DSC) & 0x77;
+	memset(fis, 0, sizeof(fis));
+	fis[0] = FIS_TYPE_SETDEVBITS;
+	fis[1] = (1 << 6);
+	fis[2] = tfd;
+	le32enc(fis + 4, done);
+	p->sact &= ~done;
+	p->tfd &= ~0x77;
+	p->tfd |= tfd;
+	ahci_write_fis(p, FIS_TYPE_SETDEVBITS, fis);
+}
+
 static void
 ahci_write_fis_d2h(struct ahci_port *p, int slot, uint8_t *cfis, uint32_t tfd)
 {
@@ -586,6 +721,11 @@ ahci_reset(struct pci_ahci_softc *sc)
 	sc->ghc = AHCI_GHC_AE;
 	sc->is = 0;
 
+	ahci_ccc_stop(sc);
+	sc->ccc_ctl &= AHCI_CCCC_INT_MASK;
+	sc->ccc_ctl |= (1 << AHCI_CCCC_CC_SHIFT) | (1 << AHCI_CCCC_TV_SHIFT);
+	sc->ccc_pts = 0;
+
 	if (sc->lintr) {
 		pci_lintr_deassert(sc->asc_pi);
 		sc->lintr = 0;
@@ -1888,7 +2028,10 @@ ahci_handle_port(struct ahci_port *p)
 	/*
 	 * Search for any new commands to issue ignoring those that
 	 * are already in-flight.  Stop if device is busy or in error.
+	 * Everything found in one pass goes to blockif as a batch.
 	 */
+	if (p->bctx != NULL)
+		blockif_plug(p->bctx);
 	for (; (p->ci & ~p->pending) != 0; p->ccs = ((p->ccs + 1) & 31)) {
 		if ((p->tfd & (ATA_S_BUSY | ATA_S_DRQ)) != 0)
 			break;
@@ -1900,82 +2043,140 @@ ahci_handle_port(struct ahci_port *p)
 			ahci_handle_slot(p, p->ccs);
 		}
 	}
+	if (p->bctx != NULL)
+		blockif_unplug(p->bctx);
 }
 
 /*
- * blockif callback routine - this runs in the context of the blockif
- * i/o thread, so the mutex needs to be acquired.
+ * Post every request on the port's iodone stack.  Successful NCQ
+ * commands are gathered and reported with one Set Device Bits FIS,
+ * and so one interrupt, per call.
  */
 static void
-ata_ioreq_cb(struct blockif_req *br, int err)
+ata_ioreq_done(struct ahci_port *p)
 {
 	struct ahci_cmd_hdr *hdr;
-	struct ahci_ioreq *aior;
-	struct ahci_port *p;
-	struct pci_ahci_softc *sc;
-	uint32_t tfd;
+	struct ahci_ioreq *aior, *list, *next;
+	uint32_t sdb, tfd;
 	uint8_t *cfis;
 	int slot, ncq, dsm;
 
-	DPRINTF("%s %d", __func__, err);
+	assert(pthread_mutex_isowned_np(&p->pr_sc->mtx));
 
-	ncq = dsm = 0;
-	aior = br->br_param;
-	p = aior->io_pr;
-	cfis = aior->cfis;
-	slot = aior->slot;
-	sc = p->pr_sc;
-	hdr = (struct ahci_cmd_hdr *)(p->cmd_lst + slot * AHCI_CL_SIZE);
+	/* Reverse the stack so requests are posted in completion order. */
+	aior = (struct ahci_ioreq *)atomic_swap_ptr(
+	    (volatile uintptr_t *)&p->iodone, 0);
+	for (list = NULL; aior != NULL; aior = next) {
+		next = aior->io_cnext;
+		aior->io_cnext = list;
+		list = aior;
+	}
 
-	if (cfis[2] == ATA_WRITE_FPDMA_QUEUED ||
-	    cfis[2] == ATA_READ_FPDMA_QUEUED ||
-	    cfis[2] == ATA_SEND_FPDMA_QUEUED)
-		ncq = 1;
-	if (cfis[2] == ATA_DATA_SET_MANAGEMENT ||
-	    (cfis[2] == ATA_SEND_FPDMA_QUEUED &&
-	     (cfis[13] & 0x1f) == ATA_SFPDMA_DSM))
-		dsm = 1;
+	sdb = 0;
+	for (aior = list; aior != NULL; aior = next) {
+		next = aior->io_cnext;
+		cfis = aior->cfis;
+		slot = aior->slot;
+		hdr = (struct ahci_cmd_hdr *)(p->cmd_lst + slot * AHCI_CL_SIZE);
 
-	pthread_mutex_lock(&sc->mtx);
+		ncq = dsm = 0;
+		if (cfis[2] == ATA_WRITE_FPDMA_QUEUED ||
+		    cfis[2] == ATA_READ_FPDMA_QUEUED ||
+		    cfis[2] == ATA_SEND_FPDMA_QUEUED)
+			ncq = 1;
+		if (cfis[2] == ATA_DATA_SET_MANAGEMENT ||
+		    (cfis[2] == ATA_SEND_FPDMA_QUEUED &&
+		     (cfis[13] & 0x1f) == ATA_SFPDMA_DSM))
+			dsm = 1;
 
-	/*
-	 * Delete the blockif request from the busy list
-	 */
-	TAILQ_REMOVE(&p->iobhd, aior, io_blist);
+		/*
+		 * Delete the blockif request from the busy list
+		 */
+		TAILQ_REMOVE(&p->iobhd, aior, io_blist);
 
-	/*
-	 * Move the blockif request back to the free list
-	 */
-	STAILQ_INSERT_TAIL(&p->iofhd, aior, io_flist);
+		/*
+		 * Move the blockif request back to the free list
+		 */
+		STAILQ_INSERT_TAIL(&p->iofhd, aior, io_flist);
 
-	if (!err)
-		hdr->prdbc = aior->done;
+		if (!aior->err)
+			hdr->prdbc = aior->done;
 
-	if (!err && aior->more) {
-		if (dsm)
-			ahci_handle_dsm_trim(p, slot, cfis, aior->done);
-		else 
-			ahci_handle_rw(p, slot, cfis, aior->done);
-		goto out;
+		if (!aior->err && aior->more) {
+			if (dsm)
+				ahci_handle_dsm_trim(p, slot, cfis, aior->done);
+			else
+				ahci_handle_rw(p, slot, cfis, aior->done);
+			continue;
+		}
+
+		if (ncq && !aior->err) {
+			sdb |= (1 << slot);
+		} else {
+			/*
+			 * Report the batch so far first, so its status does
+			 * not overwrite this command's.
+			 */
+			if (sdb != 0) {
+				ahci_write_fis_sdb_done(p, sdb);
+				sdb = 0;
+			}
+			if (!aior->err)
+				tfd = ATA_S_READY | ATA_S_DSC;
+			else
+				tfd = (ATA_E_ABORT << 8) | ATA_S_READY |
+				    ATA_S_ERROR;
+			if (ncq)
+				ahci_write_fis_sdb(p, slot, cfis, tfd);
+			else
+				ahci_write_fis_d2h(p, slot, cfis, tfd);
+		}
+
+		/*
+		 * This command is now complete.
+		 */
+		p->pending &= ~(1 << slot);
 	}
+	if (sdb != 0)
+		ahci_write_fis_sdb_done(p, sdb);
 
-	if (!err)
-		tfd = ATA_S_READY | ATA_S_DSC;
-	else
-		tfd = (ATA_E_ABORT << 8) | ATA_S_READY | ATA_S_ERROR;
-	if (ncq)
-		ahci_write_fis_sdb(p, slot, cfis, tfd);
-	else
-		ahci_write_fis_d2h(p, slot, cfis, tfd);
+	ahci_check_stopped(p);
+	ahci_handle_port(p);
+}
+
+/*
+ * blockif callback routine - this runs in the context of the blockif
+ * i/o thread, so the mutex needs to be acquired.
+ */
+static void
+ata_ioreq_cb(struct blockif_req *br, int err)
+{
+	struct ahci_ioreq *aior, *head;
+	struct ahci_port *p;
+	struct pci_ahci_softc *sc;
+
+	DPRINTF("%s %d", __func__, err);
+
+	aior = br->br_param;
+	p = aior->io_pr;
+	sc = p->pr_sc;
+	aior->err = err;
 
 	/*
-	 * This command is now complete.
+	 * Queue the request for posting, then take the port lock.  If
+	 * another completion holds it, that thread or the next one to
+	 * get the lock posts this request along with its own.
 	 */
-	p->pending &= ~(1 << slot);
+	do {
+		head = (struct ahci_ioreq *)atomic_load_acq_ptr(
+		    (volatile uintptr_t *)&p->iodone);
+		aior->io_cnext = head;
+	} while (!atomic_cmpset_rel_ptr((volatile uintptr_t *)&p->iodone,
+	    (uintptr_t)head, (uintptr_t)aior));
 
-	ahci_check_stopped(p);
-	ahci_handle_port(p);
-out:
+	pthread_mutex_lock(&sc->mtx);
+	if (p->iodone != NULL)
+		ata_ioreq_done(p);
 	pthread_mutex_unlock(&sc->mtx);
 	DPRINTF("%s exit", __func__);
 }
@@ -2202,6 +2403,32 @@ pci_ahci_host_write(struct pci_ahci_softc *sc, uint64_t offset, uint64_t value)
 		sc->is &= ~value;
 		ahci_generate_intr(sc, value);
 		break;
+	case AHCI_CCCC:
+		if ((sc->cap & AHCI_CAP_CCCS) == 0)
+			break;
+		/*
+		 * TV and CC are only read-only while CCC is enabled, so a
+		 * write that sets EN takes them along with it.
+		 */
+		if ((value & AHCI_CCCC_EN) == 0) {
+			sc->ccc_ctl &= AHCI_CCCC_INT_MASK;
+			sc->ccc_ctl |= value &
+			    (AHCI_CCCC_TV_MASK | AHCI_CCCC_CC_MASK);
+			ahci_ccc_stop(sc);
+		} else if ((sc->ccc_ctl & AHCI_CCCC_EN) == 0 &&
+		    (value & AHCI_CCCC_TV_MASK) != 0) {
+			/* A zero timeout value is reserved. */
+			sc->ccc_ctl &= AHCI_CCCC_INT_MASK;
+			sc->ccc_ctl |= value & (AHCI_CCCC_TV_MASK |
+			    AHCI_CCCC_CC_MASK | AHCI_CCCC_EN);
+		}
+		ahci_generate_intr(sc, 0xffffffff);
+		break;
+	case AHCI_CCCP:
+		if ((sc->cap & AHCI_CAP_CCCS) == 0)
+			break;
+		sc->ccc_pts = value & sc->pi;
+		break;
 	default:
 		break;
 	}
@@ -2440,6 +2667,15 @@ pci_ahci_init(struct vmctx *ctx, struct pci_devinst *pi, char *opts, int atapi)
 	    AHCI_CAP_PMD | AHCI_CAP_SSC | AHCI_CAP_PSC |
 	    (slots << AHCI_CAP_NCS_SHIFT) | AHCI_CAP_SXS | (sc->ports - 1);
 
+	/*
+	 * Command completion coalescing needs a spare IS bit for its
+	 * interrupt; use the first one past the implemented ports.
+	 */
+	if (sc->ports < MAX_PORTS) {
+		sc->cap |= AHCI_CAP_CCCS;
+		sc->ccc_ctl = sc->ports << AHCI_CCCC_INT_SHIFT;
+	}
+
 	sc->vs = 0x10300;
 	sc->cap2 = AHCI_CAP2_APST;
 	ahci_reset(sc);
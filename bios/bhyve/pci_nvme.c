@@ -33,42 +33,59 @@
  * bhyve PCIe-NVMe device emulation.
  *
  * options:
- *  -s <n>,nvme,devpath,maxq=#,qsz=#,ioslots=#,sectsz=#,ser=A-Z,eui64=#
+ *  -s <n>,nvme,devpath,maxq=#,qsz=#,ioslots=#,sectsz=#,ser=A-Z,eui64=#,
+ *      sqpoll=#
  *
  *  accepted devpath:
  *    /dev/blockdev
  *    /path/to/image
  *    ram=size_in_MiB
+ *    ramsnap=/path/to/snapshot
+ *
+ *  RAM namespaces are serviced inline with memcpy. They accept:
+ *  ramsnap = snapshot image; the namespace starts as a copy-on-write
+ *            view of it (its size unless ram= is given) and SIGUSR1
+ *            writes the current contents back to it
+ *  ramhuge = superpage aligned and wired memory
  *
  *  maxq    = max number of queues
  *  qsz     = max elements in each queue
- *  ioslots = max number of concurrent io requests
+ *  ioslots = max number of concurrent io requests per queue
  *  sectsz  = sector size (defaults to blockif sector size)
  *  ser     = serial number (20-chars max)
  *  eui64   = IEEE Extended Unique Identifier (8 byte value)
+ *  sqpoll  = poll shadow doorbells for this many uS after the last
+ *            submission before re-enabling doorbell writes
  *
  */
 
 /* TODO:
     - create async event for smart and log
-    - intr coalesce
  */
 
 #include <sys/cdefs.h>
 __FBSDID("$FreeBSD: head/usr.sbin/bhyve/pci_nvme.c 359367 2020-03-27 15:28:27Z chuck $");
 
+#include <sys/param.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <net/ieee_oui.h>
 
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <pthread.h>
-#include <semaphore.h>
+#include <pthread_np.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <machine/atomic.h>
 #include <machine/vmm.h>
@@ -79,6 +96,7 @@ __FBSDID("$FreeBSD: head/usr.sbin/bhyve/pci_nvme.c 359367 2020-03-27 15:28:27Z c
 #include "bhyverun.h"
 #include "block_if.h"
 #include "debug.h"
+#include "mevent.h"
 #include "pci_emul.h"
 
 
@@ -118,6 +136,45 @@ static int nvme_debug = 0;
 
 #define	NVME_DOORBELL_OFFSET	offsetof(struct nvme_registers, doorbell)
 
+/* Doorbell Buffer Config (NVMe 1.3), possibly absent from dev/nvme/nvme.h */
+#ifndef NVME_OPC_DOORBELL_BUFFER_CONFIG
+#define	NVME_OPC_DOORBELL_BUFFER_CONFIG		0x7c
+#endif
+#ifndef NVME_CTRLR_DATA_OACS_DBBUF_SHIFT
+#define	NVME_CTRLR_DATA_OACS_DBBUF_SHIFT	(8)
+#endif
+
+/* PRP or SGL Data Transfer (PSDT) field of a command */
+#ifndef NVME_CMD_PSDT_SHIFT
+#define	NVME_CMD_PSDT_SHIFT	(6)
+#define	NVME_CMD_PSDT_MASK	(0x3)
+#endif
+#define	NVME_CMD_GET_PSDT(cmd) \
+	(((cmd)->fuse >> NVME_CMD_PSDT_SHIFT) & NVME_CMD_PSDT_MASK)
+#define	NVME_PSDT_PRP		0
+
+/* SGL support: no alignment or granularity requirement on Data Blocks */
+#define	NVME_SGLS_SUPPORTED	0x1
+
+/* SGL descriptor types (NVMe 1.3 4.4) */
+#define	NVME_SGL_TYPE_DATA_BLOCK	0x0
+#define	NVME_SGL_TYPE_SEGMENT		0x2
+#define	NVME_SGL_TYPE_LAST_SEGMENT	0x3
+
+struct pci_nvme_sgl_desc {
+	uint64_t	address;
+	uint32_t	length;
+	uint8_t		reserved[3];
+	uint8_t		type;	/* descriptor type 7:4, sub type 3:0 */
+};
+
+/*
+ * Index of a queue's entry in the shadow doorbell and EventIdx buffers.
+ * The layout mirrors the doorbell registers, with CAP.DSTRD = 0.
+ */
+#define	NVME_DBBUF_SQ(qid)	((qid) * 2)
+#define	NVME_DBBUF_CQ(qid)	((qid) * 2 + 1)
+
 enum nvme_controller_register_offsets {
 	NVME_CR_CAP_LOW = 0x00,
 	NVME_CR_CAP_HI  = 0x04,
@@ -146,7 +203,7 @@ enum nvme_copy_dir {
 };
 
 #define	NVME_CQ_INTEN	0x01
-#define	NVME_CQ_INTCOAL	0x02
+#define	NVME_CQ_INTCOAL	0x02	/* interrupt coalescing applies */
 
 struct nvme_completion_queue {
 	struct nvme_completion *qbase;
@@ -156,6 +213,12 @@ struct nvme_completion_queue {
 	uint16_t	intr_vec;
 	uint32_t	intr_en;
 	pthread_mutex_t	mtx;
+
+	/* interrupt coalescing */
+	struct pci_nvme_softc *sc;
+	uint32_t	intr_pending;	/* entries posted without interrupt */
+	uint32_t	inflight;	/* ioreqs outstanding for this CQ */
+	struct mevent	*intr_timer;	/* aggregation time expiry */
 };
 
 struct nvme_submission_queue {
@@ -166,6 +229,18 @@ struct nvme_submission_queue {
 	uint16_t	cqid; /* completion queue id */
 	int		busy; /* queue is being processed */
 	int		qpriority;
+
+	/*
+	 * ioreq slab. Only the thread processing the queue (holding busy)
+	 * allocates, taking from ioreq_local and refilling it by grabbing
+	 * the whole of ioreq_free, which completions push onto lock-free.
+	 */
+	struct pci_nvme_ioreq *ioreqs;
+	struct pci_nvme_ioreq *ioreq_local;
+	struct pci_nvme_ioreq *volatile ioreq_free;
+	int		ioreq_waiters;
+	pthread_mutex_t	ioreq_mtx;
+	pthread_cond_t	ioreq_cond;
 };
 
 enum nvme_storage_type {
@@ -181,11 +256,14 @@ struct pci_nvme_blockstore {
 	uint32_t	sectsz_bits;
 	uint64_t	eui64;
 	uint32_t	deallocate:1;
+	uint32_t	ramhuge:1;	/* RAM: superpages, wired */
+	char		*ramsnap;	/* RAM: snapshot image or NULL */
+	uint64_t	ramsnap_len;	/* RAM: bytes mapped from ramsnap */
 };
 
 struct pci_nvme_ioreq {
 	struct pci_nvme_softc *sc;
-	STAILQ_ENTRY(pci_nvme_ioreq) link;
+	struct pci_nvme_ioreq *next;	/* free list */
 	struct nvme_submission_queue *nvme_sq;
 	uint16_t	sqid;
 
@@ -239,11 +317,7 @@ struct pci_nvme_softc {
 	uint32_t	num_cqueues;
 	uint32_t	num_squeues;
 
-	struct pci_nvme_ioreq *ioreqs;
-	STAILQ_HEAD(, pci_nvme_ioreq) ioreqs_free; /* free list of ioreqs */
-	uint32_t	pending_ios;
-	uint32_t	ioslots;
-	sem_t		iosemlock;
+	uint32_t	ioslots;	/* ioreqs per submission queue */
 
 	/*
 	 * Memory mapped Submission and Completion queues
@@ -255,13 +329,49 @@ struct pci_nvme_softc {
 	/* controller features */
 	uint32_t	intr_coales_aggr_time;   /* 0x08: uS to delay intr */
 	uint32_t	intr_coales_aggr_thresh; /* 0x08: compl-Q entries */
+	uint32_t	intr_coales_disable;     /* 0x09: per-vector CD bits */
 	uint32_t	async_ev_config;         /* 0x0B: async event config */
 
 	enum nvme_dsm_type dataset_management;
+
+	/*
+	 * Shadow doorbell and EventIdx pages set by Doorbell Buffer
+	 * Config; NULL until the guest issues the command. Reset clears
+	 * them while I/O paths may be reading them, so each user loads
+	 * a pointer once with atomic_load_acq_ptr() and works on that.
+	 */
+	uint32_t	*dbbuf_shadow;
+	uint32_t	*dbbuf_eventidx;
+
+	/*
+	 * I/O submission queue poller, see pci_nvme_sqpoll_thr(). The
+	 * state below is protected by mtx; sqpoll_active is also read
+	 * without it.
+	 */
+	uint32_t	sqpoll_usec;
+	int		sqpoll_active;
+	int		sqpoll_stop;	/* resets waiting for the poller */
+	int		sqpoll_parked;	/* poller is off the queues */
+	pthread_t	sqpoll_tid;
+	pthread_cond_t	sqpoll_cond;
+
+	SLIST_ENTRY(pci_nvme_softc) ramsnap_link;
 };
 
+/*
+ * RAM namespaces saved to their snapshot image on SIGUSR1, by a thread of
+ * their own so that a save does not hold up the mevent loop.
+ */
+static SLIST_HEAD(, pci_nvme_softc) pci_nvme_ramsnaps =
+    SLIST_HEAD_INITIALIZER(pci_nvme_ramsnaps);
+static pthread_mutex_t pci_nvme_ramsnap_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pci_nvme_ramsnap_cond = PTHREAD_COND_INITIALIZER;
+static int pci_nvme_ramsnap_req;
+
 
 static void pci_nvme_io_partial(struct blockif_req *br, int err);
+static void pci_nvme_sqpoll_stop(struct pci_nvme_softc *sc);
+static void pci_nvme_sqpoll_start(struct pci_nvme_softc *sc);
 
 /* Controller Configuration utils */
 #define	NVME_CC_GET_EN(cc) \
@@ -358,10 +468,12 @@ pci_nvme_init_ctrldata(struct pci_nvme_softc *sc)
 	cd->mic = 0;
 
 	cd->mdts = 9;	/* max data transfer size (2^mdts * CAP.MPSMIN) */
+	cd->sgls = NVME_SGLS_SUPPORTED;
 
 	cd->ver = 0x00010300;
 
-	cd->oacs = 1 << NVME_CTRLR_DATA_OACS_FORMAT_SHIFT;
+	cd->oacs = 1 << NVME_CTRLR_DATA_OACS_FORMAT_SHIFT |
+	    1 << NVME_CTRLR_DATA_OACS_DBBUF_SHIFT;
 	cd->acl = 2;
 	cd->aerl = 4;
 
@@ -459,6 +571,8 @@ pci_nvme_init_nsdata(struct pci_nvme_softc *sc,
 
 	if (nvstore->type == NVME_STOR_BLOCKIF)
 		nvstore->deallocate = blockif_candelete(nvstore->ctx);
+	else
+		nvstore->deallocate = 1;
 
 	nd->nlbaf = 0; /* NLBAF is a 0's based value (i.e. 1 LBA Format) */
 	nd->flbas = 0;
@@ -497,6 +611,8 @@ pci_nvme_reset_locked(struct pci_nvme_softc *sc)
 {
 	DPRINTF(("%s", __func__));
 
+	pci_nvme_sqpoll_stop(sc);
+
 	sc->regs.cap_lo = (ZERO_BASED(sc->max_qentries) & NVME_CAP_LO_REG_MQES_MASK) |
 	    (1 << NVME_CAP_LO_REG_CQR_SHIFT) |
 	    (60 << NVME_CAP_LO_REG_TO_SHIFT);
@@ -508,6 +624,9 @@ pci_nvme_reset_locked(struct pci_nvme_softc *sc)
 	sc->regs.cc = 0;
 	sc->regs.csts = 0;
 
+	atomic_store_rel_ptr((volatile uintptr_t *)&sc->dbbuf_shadow, 0);
+	atomic_store_rel_ptr((volatile uintptr_t *)&sc->dbbuf_eventidx, 0);
+
 	sc->num_cqueues = sc->num_squeues = sc->max_queues;
 	if (sc->submit_queues != NULL) {
 		for (int i = 0; i < sc->num_squeues + 1; i++) {
@@ -539,6 +658,14 @@ pci_nvme_reset_locked(struct pci_nvme_softc *sc)
 
 			sc->compl_queues[i].tail = 0;
 			sc->compl_queues[i].head = 0;
+
+			pthread_mutex_lock(&sc->compl_queues[i].mtx);
+			sc->compl_queues[i].intr_pending = 0;
+			if (sc->compl_queues[i].intr_timer != NULL) {
+				mevent_delete(sc->compl_queues[i].intr_timer);
+				sc->compl_queues[i].intr_timer = NULL;
+			}
+			pthread_mutex_unlock(&sc->compl_queues[i].mtx);
 		}
 	} else {
 		sc->compl_queues = calloc(sc->num_cqueues + 1,
@@ -547,6 +674,8 @@ pci_nvme_reset_locked(struct pci_nvme_softc *sc)
 		for (int i = 0; i < sc->num_cqueues + 1; i++)
 			pthread_mutex_init(&sc->compl_queues[i].mtx, NULL);
 	}
+
+	pci_nvme_sqpoll_start(sc);
 }
 
 static void
@@ -733,6 +862,11 @@ nvme_opc_create_io_cq(struct pci_nvme_softc* sc, struct nvme_command* command,
 		ncq = &sc->compl_queues[qid];
 		ncq->intr_en = (command->cdw11 & NVME_CMD_CDW11_IEN) >> 1;
 		ncq->intr_vec = (command->cdw11 >> 16) & 0xffff;
+		if (ncq->intr_vec >= 32 ||
+		    (sc->intr_coales_disable & (1 << ncq->intr_vec)) == 0)
+			ncq->intr_en |= NVME_CQ_INTCOAL;
+		ncq->sc = sc;
+		ncq->intr_pending = 0;
 		ncq->size = ONE_BASED((command->cdw10 >> 16) & 0xffff);
 
 		ncq->qbase = vm_map_gpa(sc->nsc_pi->pi_vmctx,
@@ -927,14 +1061,23 @@ nvme_opc_set_features(struct pci_nvme_softc* sc, struct nvme_command* command,
 		DPRINTF(("  interrupt vector configuration 0x%x",
 		        command->cdw11));
 
-		for (uint32_t i = 0; i < sc->num_cqueues + 1; i++) {
+		/* Coalescing Disable (CD) is remembered for later queues */
+		if (iv < 32) {
+			if (command->cdw11 & (1 << 16))
+				sc->intr_coales_disable |= 1 << iv;
+			else
+				sc->intr_coales_disable &= ~(1 << iv);
+		}
+
+		/* The admin completion queue is never coalesced */
+		for (uint32_t i = 1; i < sc->num_cqueues + 1; i++) {
 			if (sc->compl_queues[i].intr_vec == iv) {
 				if (command->cdw11 & (1 << 16))
-					sc->compl_queues[i].intr_en |=
-					                      NVME_CQ_INTCOAL;  
-				else
 					sc->compl_queues[i].intr_en &=
-					                     ~NVME_CQ_INTCOAL;  
+					                     ~NVME_CQ_INTCOAL;
+				else
+					sc->compl_queues[i].intr_en |=
+					                      NVME_CQ_INTCOAL;
 			}
 		}
 		break;
@@ -1018,9 +1161,15 @@ nvme_opc_get_features(struct pci_nvme_softc* sc, struct nvme_command* command,
 		break;
 	case NVME_FEAT_INTERRUPT_COALESCING:
 		DPRINTF(("  interrupt coalescing"));
+		compl->cdw0 = (sc->intr_coales_aggr_time / 100) << 8 |
+		    sc->intr_coales_aggr_thresh;
 		break;
 	case NVME_FEAT_INTERRUPT_VECTOR_CONFIGURATION:
 		DPRINTF(("  interrupt vector configuration"));
+		compl->cdw0 = command->cdw11 & 0xFFFF;
+		if (compl->cdw0 < 32 &&
+		    (sc->intr_coales_disable & (1 << compl->cdw0)) != 0)
+			compl->cdw0 |= 1 << 16;
 		break;
 	case NVME_FEAT_WRITE_ATOMICITY:
 		DPRINTF(("  write atomicity"));
@@ -1075,6 +1224,54 @@ nvme_opc_async_event_req(struct pci_nvme_softc* sc,
 	return (0);
 }
 
+/*
+ * Doorbell Buffer Config: PRP1 is the shadow doorbell page the guest
+ * writes new SQ tails and CQ heads to, PRP2 is the EventIdx page the
+ * controller uses to tell the guest when an MMIO doorbell write is
+ * still wanted. Only the I/O queues use the buffers.
+ */
+static int
+nvme_opc_doorbell_buf_config(struct pci_nvme_softc* sc,
+	struct nvme_command* command, struct nvme_completion* compl)
+{
+	uint32_t *shadow, *eventidx;
+	uint32_t i;
+
+	DPRINTF(("%s shadow 0x%lx eventidx 0x%lx", __func__,
+	    command->prp1, command->prp2));
+
+	if (command->prp1 == 0 || (command->prp1 & PAGE_MASK) != 0 ||
+	    command->prp2 == 0 || (command->prp2 & PAGE_MASK) != 0) {
+		pci_nvme_status_genc(&compl->status, NVME_SC_INVALID_FIELD);
+		return (1);
+	}
+
+	shadow = vm_map_gpa(sc->nsc_pi->pi_vmctx, command->prp1, PAGE_SIZE);
+	eventidx = vm_map_gpa(sc->nsc_pi->pi_vmctx, command->prp2, PAGE_SIZE);
+	if (shadow == NULL || eventidx == NULL) {
+		pci_nvme_status_genc(&compl->status, NVME_SC_INVALID_FIELD);
+		return (1);
+	}
+
+	/* Seed the buffers from the doorbell values seen so far */
+	for (i = 1; i <= sc->num_squeues; i++) {
+		shadow[NVME_DBBUF_SQ(i)] = sc->submit_queues[i].tail;
+		eventidx[NVME_DBBUF_SQ(i)] = sc->submit_queues[i].tail;
+	}
+	for (i = 1; i <= sc->num_cqueues; i++) {
+		shadow[NVME_DBBUF_CQ(i)] = sc->compl_queues[i].head;
+		eventidx[NVME_DBBUF_CQ(i)] = sc->compl_queues[i].head;
+	}
+
+	atomic_store_rel_ptr((volatile uintptr_t *)&sc->dbbuf_eventidx,
+	    (uintptr_t)eventidx);
+	atomic_store_rel_ptr((volatile uintptr_t *)&sc->dbbuf_shadow,
+	    (uintptr_t)shadow);
+
+	pci_nvme_status_genc(&compl->status, NVME_SC_SUCCESS);
+	return (1);
+}
+
 static void
 pci_nvme_handle_admin_cmd(struct pci_nvme_softc* sc, uint64_t value)
 {
@@ -1148,6 +1345,10 @@ pci_nvme_handle_admin_cmd(struct pci_nvme_softc* sc, uint64_t value)
 			*/
 			compl.status = NVME_NO_STATUS;
 			break;
+		case NVME_OPC_DOORBELL_BUFFER_CONFIG:
+			DPRINTF(("%s command DOORBELL_BUFFER_CONFIG", __func__));
+			nvme_opc_doorbell_buf_config(sc, cmd, &compl);
+			break;
 		default:
 			WPRINTF(("0x%x command is not implemented",
 			    cmd->opc));
@@ -1186,66 +1387,66 @@ static int
 pci_nvme_append_iov_req(struct pci_nvme_softc *sc, struct pci_nvme_ioreq *req,
 	uint64_t gpaddr, size_t size, int do_write, uint64_t lba)
 {
+	struct iovec *iov;
+	void *hva;
 	int iovidx;
 
 	if (req != NULL) {
-		/* concatenate contig block-iovs to minimize number of iovs */
-		if ((req->prev_gpaddr + req->prev_size) == gpaddr) {
-			iovidx = req->io_req.br_iovcnt - 1;
-
-			req->io_req.br_iov[iovidx].iov_base =
-			    paddr_guest2host(req->sc->nsc_pi->pi_vmctx,
-			                     req->prev_gpaddr, size);
-
-			req->prev_size += size;
-			req->io_req.br_resid += size;
-
-			req->io_req.br_iov[iovidx].iov_len = req->prev_size;
-		} else {
-			pthread_mutex_lock(&req->mtx);
-
-			iovidx = req->io_req.br_iovcnt;
-			if (iovidx == NVME_MAX_BLOCKIOVS) {
-				int err = 0;
-
-				DPRINTF(("large I/O, doing partial req"));
+		hva = paddr_guest2host(req->sc->nsc_pi->pi_vmctx, gpaddr, size);
+		if (hva == NULL)
+			return (-1);
 
-				iovidx = 0;
-				req->io_req.br_iovcnt = 0;
+		/*
+		 * Extend the previous iov when the page follows it in host
+		 * memory, so that large transfers need few iovs and rarely
+		 * take the partial request path below.
+		 */
+		iovidx = req->io_req.br_iovcnt;
+		if (iovidx != 0) {
+			iov = &req->io_req.br_iov[iovidx - 1];
+			if ((uint8_t *)iov->iov_base + iov->iov_len == hva) {
+				iov->iov_len += size;
+				req->io_req.br_resid += size;
+				return (0);
+			}
+		}
 
-				req->io_req.br_callback = pci_nvme_io_partial;
+		if (iovidx == NVME_MAX_BLOCKIOVS) {
+			int err = 0;
 
-				if (!do_write)
-					err = blockif_read(sc->nvstore.ctx,
-					                   &req->io_req);
-				else
-					err = blockif_write(sc->nvstore.ctx,
-					                    &req->io_req);
+			DPRINTF(("large I/O, doing partial req"));
 
-				/* wait until req completes before cont */
-				if (err == 0)
-					pthread_cond_wait(&req->cv, &req->mtx);
-			}
-			if (iovidx == 0) {
-				req->io_req.br_offset = lba;
-				req->io_req.br_resid = 0;
-				req->io_req.br_param = req;
-			}
+			pthread_mutex_lock(&req->mtx);
 
-			req->io_req.br_iov[iovidx].iov_base =
-			    paddr_guest2host(req->sc->nsc_pi->pi_vmctx,
-			                     gpaddr, size);
+			iovidx = 0;
+			req->io_req.br_iovcnt = 0;
 
-			req->io_req.br_iov[iovidx].iov_len = size;
+			req->io_req.br_callback = pci_nvme_io_partial;
 
-			req->prev_gpaddr = gpaddr;
-			req->prev_size = size;
-			req->io_req.br_resid += size;
+			if (!do_write)
+				err = blockif_read(sc->nvstore.ctx,
+				                   &req->io_req);
+			else
+				err = blockif_write(sc->nvstore.ctx,
+				                    &req->io_req);
 
-			req->io_req.br_iovcnt++;
+			/* wait until req completes before cont */
+			if (err == 0)
+				pthread_cond_wait(&req->cv, &req->mtx);
 
 			pthread_mutex_unlock(&req->mtx);
 		}
+		if (iovidx == 0) {
+			req->io_req.br_offset = lba;
+			req->io_req.br_resid = 0;
+			req->io_req.br_param = req;
+		}
+
+		req->io_req.br_iov[iovidx].iov_base = hva;
+		req->io_req.br_iov[iovidx].iov_len = size;
+		req->io_req.br_resid += size;
+
+		req->io_req.br_iovcnt++;
 	} else {
 		/* RAM buffer: read/write directly */
 		void *p = sc->nvstore.ctx;
@@ -1258,6 +1459,8 @@ pci_nvme_append_iov_req(struct pci_nvme_softc *sc, struct pci_nvme_ioreq *req,
 
 		p = (void *)((uintptr_t)p + (uintptr_t)lba);
 		gptr = paddr_guest2host(sc->nsc_pi->pi_vmctx, gpaddr, size);
+		if (gptr == NULL)
+			return (-1);
 		if (do_write) 
 			memcpy(p, gptr, size);
 		else
@@ -1266,6 +1469,151 @@ pci_nvme_append_iov_req(struct pci_nvme_softc *sc, struct pci_nvme_ioreq *req,
 	return (0);
 }
 
+/*
+ * Map the data of a command using SGLs (PSDT 01b or 10b). The SGL starts
+ * with the descriptor in the command's data pointer; a Segment
+ * descriptor, which must be the last one in its segment, chains to the
+ * next segment in guest memory. Only the descriptor types advertised in
+ * SGLS are accepted.
+ */
+static int
+pci_nvme_append_sgl(struct pci_nvme_softc *sc, struct pci_nvme_ioreq *req,
+	struct nvme_command *cmd, int do_write, uint64_t off, uint64_t bytes)
+{
+	struct pci_nvme_sgl_desc *list;
+	struct pci_nvme_sgl_desc desc;
+	uint32_t i, ndesc, nseg;
+	uint64_t len;
+	int last;
+
+	/* The data pointer (PRP1 and PRP2) holds the first descriptor */
+	list = (struct pci_nvme_sgl_desc *)&cmd->prp1;
+	ndesc = 1;
+	last = 0;
+
+	for (nseg = 0; ; nseg++) {
+		for (i = 0; i < ndesc; i++) {
+			/* Copy, the guest may change the list under us */
+			memcpy(&desc, &list[i], sizeof(desc));
+
+			if ((desc.type >> 4) == NVME_SGL_TYPE_DATA_BLOCK) {
+				len = MIN(desc.length, bytes);
+				if (len != 0 && pci_nvme_append_iov_req(sc, req,
+				    desc.address, len, do_write, off))
+					return (-1);
+				off += len;
+				bytes -= len;
+				continue;
+			}
+
+			if (((desc.type >> 4) != NVME_SGL_TYPE_SEGMENT &&
+			    (desc.type >> 4) != NVME_SGL_TYPE_LAST_SEGMENT) ||
+			    i != ndesc - 1 || last) {
+				WPRINTF(("%s invalid SGL descriptor type 0x%x",
+				    __func__, desc.type));
+				return (-1);
+			}
+			break;
+		}
+		if (i == ndesc)
+			break;
+
+		/* Segment chain; bound it in case the guest made a loop */
+		if (nseg == NVME_MAX_BLOCKIOVS || desc.length == 0 ||
+		    desc.length % sizeof(desc) != 0)
+			return (-1);
+		list = paddr_guest2host(sc->nsc_pi->pi_vmctx, desc.address,
+		    desc.length);
+		if (list == NULL)
+			return (-1);
+		ndesc = desc.length / sizeof(desc);
+		last = (desc.type >> 4) == NVME_SGL_TYPE_LAST_SEGMENT;
+	}
+
+	/* The SGL must describe at least the data of the command */
+	return (bytes == 0 ? 0 : -1);
+}
+
+static void
+pci_nvme_cq_intr(struct pci_nvme_softc *sc, struct nvme_completion_queue *cq)
+{
+
+	if (cq->intr_en & NVME_CQ_INTEN) {
+		pci_generate_msix(sc->nsc_pi, cq->intr_vec);
+	} else {
+		DPRINTF(("%s: CQ%ld interrupt disabled\n",
+					__func__, cq - sc->compl_queues));
+	}
+}
+
+static void
+pci_nvme_cq_timer(int fd __unused, enum ev_type t __unused, void *arg)
+{
+	struct nvme_completion_queue *cq = arg;
+	int fire;
+
+	/*
+	 * A timer cancelled while its expiry was being delivered can land
+	 * here after a newer one was armed; that only posts the interrupt
+	 * a little early.
+	 */
+	pthread_mutex_lock(&cq->mtx);
+	fire = cq->intr_pending != 0;
+	cq->intr_pending = 0;
+	if (cq->intr_timer != NULL) {
+		mevent_delete(cq->intr_timer);
+		cq->intr_timer = NULL;
+	}
+	pthread_mutex_unlock(&cq->mtx);
+
+	if (fire)
+		pci_nvme_cq_intr(cq->sc, cq);
+}
+
+/*
+ * Interrupt coalescing (Set Features 0x08/0x09), called with the CQ lock
+ * held after posting an entry. Returns non-zero if the interrupt is held
+ * back: it is posted once the aggregation threshold is reached, when the
+ * aggregation time expires, or as soon as no further completion is
+ * expected. The latter keeps low queue depth latency unchanged, so the
+ * interrupt rate only drops as the queue depth grows. Completions posted
+ * while the SQ is being processed (insq) are flushed by
+ * pci_nvme_cq_flush() when the queue has been drained.
+ *
+ * The aggregation time is rounded up to the millisecond resolution of
+ * mevent timers.
+ */
+static int
+pci_nvme_cq_coalesce(struct pci_nvme_softc *sc,
+	struct nvme_completion_queue *cq, int insq)
+{
+
+	if ((cq->intr_en & NVME_CQ_INTCOAL) == 0 ||
+	    sc->intr_coales_aggr_thresh == 0 ||
+	    sc->intr_coales_aggr_time == 0)
+		return (0);
+
+	cq->intr_pending++;
+
+	/* The completing ioreq is released after its entry is posted */
+	if (cq->intr_pending > sc->intr_coales_aggr_thresh ||
+	    (!insq && cq->inflight <= 1)) {
+		cq->intr_pending = 0;
+		if (cq->intr_timer != NULL) {
+			mevent_delete(cq->intr_timer);
+			cq->intr_timer = NULL;
+		}
+		return (0);
+	}
+
+	if (cq->intr_timer == NULL)
+		cq->intr_timer = mevent_add(
+		    (sc->intr_coales_aggr_time + 999) / 1000,
+		    EVF_TIMER, pci_nvme_cq_timer, cq);
+
+	return (1);
+}
+
 static void
 pci_nvme_set_completion(struct pci_nvme_softc *sc,
 	struct nvme_submission_queue *sq, int sqid, uint16_t cid,
@@ -1273,6 +1621,8 @@ pci_nvme_set_completion(struct pci_nvme_softc *sc,
 {
 	struct nvme_completion_queue *cq = &sc->compl_queues[sq->cqid];
 	struct nvme_completion *compl;
+	uint32_t *shadow;
+	int deferred;
 	int phase;
 
 	DPRINTF(("%s sqid %d cqid %u cid %u status: 0x%x 0x%x",
@@ -1297,57 +1647,134 @@ pci_nvme_set_completion(struct pci_nvme_softc *sc,
 
 	cq->tail = (cq->tail + 1) % cq->size;
 
+	deferred = pci_nvme_cq_coalesce(sc, cq, ignore_busy);
+
 	pthread_mutex_unlock(&cq->mtx);
 
-	if (cq->head != cq->tail) {
-		if (cq->intr_en & NVME_CQ_INTEN) {
-			pci_generate_msix(sc->nsc_pi, cq->intr_vec);
-		} else {
-			DPRINTF(("%s: CQ%u interrupt disabled\n",
-						__func__, sq->cqid));
+	/* With shadow doorbells the guest may not write the CQ head doorbell */
+	shadow = (uint32_t *)atomic_load_acq_ptr(
+	    (volatile uintptr_t *)&sc->dbbuf_shadow);
+	if (sq->cqid != 0 && shadow != NULL)
+		cq->head = (uint16_t)atomic_load_acq_32(
+		    &shadow[NVME_DBBUF_CQ(sq->cqid)]);
+
+	if (!deferred && cq->head != cq->tail)
+		pci_nvme_cq_intr(sc, cq);
+}
+
+/*
+ * Post the interrupt for entries a completion queue held back, once no
+ * ioreq remains outstanding against it; nothing else would trigger it
+ * before the aggregation time expires.
+ */
+static void
+pci_nvme_cq_flush(struct pci_nvme_softc *sc, struct nvme_completion_queue *cq)
+{
+	int fire;
+
+	pthread_mutex_lock(&cq->mtx);
+	fire = cq->intr_pending != 0 && cq->inflight == 0;
+	if (fire) {
+		cq->intr_pending = 0;
+		if (cq->intr_timer != NULL) {
+			mevent_delete(cq->intr_timer);
+			cq->intr_timer = NULL;
 		}
 	}
+	pthread_mutex_unlock(&cq->mtx);
+
+	if (fire)
+		pci_nvme_cq_intr(sc, cq);
+}
+
+/* Number of ioreqs outstanding across all queues */
+static uint32_t
+pci_nvme_pending_ios(struct pci_nvme_softc *sc)
+{
+	uint32_t pending = 0;
+
+	for (uint32_t i = 0; i < sc->max_queues + 1; i++)
+		pending += atomic_load_acq_int(&sc->compl_queues[i].inflight);
+
+	return (pending);
 }
 
 static void
 pci_nvme_release_ioreq(struct pci_nvme_softc *sc, struct pci_nvme_ioreq *req)
 {
+	struct nvme_submission_queue *sq = req->nvme_sq;
+	struct pci_nvme_ioreq *head;
+
+	atomic_subtract_int(&sc->compl_queues[sq->cqid].inflight, 1);
+
 	req->sc = NULL;
 	req->nvme_sq = NULL;
 	req->sqid = 0;
 
-	pthread_mutex_lock(&sc->mtx);
-
-	STAILQ_INSERT_TAIL(&sc->ioreqs_free, req, link);
-	sc->pending_ios--;
+	do {
+		head = (struct pci_nvme_ioreq *)atomic_load_acq_ptr(
+		    (volatile uintptr_t *)&sq->ioreq_free);
+		req->next = head;
+	} while (!atomic_cmpset_rel_ptr((volatile uintptr_t *)&sq->ioreq_free,
+	    (uintptr_t)head, (uintptr_t)req));
+
+	/* Pairs with the fence in pci_nvme_wait_ioreq() */
+	atomic_thread_fence_seq_cst();
+	if (atomic_load_acq_int(&sq->ioreq_waiters)) {
+		pthread_mutex_lock(&sq->ioreq_mtx);
+		pthread_cond_signal(&sq->ioreq_cond);
+		pthread_mutex_unlock(&sq->ioreq_mtx);
+	}
 
 	/* when no more IO pending, can set to ready if device reset/enabled */
-	if (sc->pending_ios == 0 &&
-	    NVME_CC_GET_EN(sc->regs.cc) && !(NVME_CSTS_GET_RDY(sc->regs.csts)))
-		sc->regs.csts |= NVME_CSTS_RDY;
-
-	pthread_mutex_unlock(&sc->mtx);
-
-	sem_post(&sc->iosemlock);
+	if (NVME_CC_GET_EN(sc->regs.cc) &&
+	    !(NVME_CSTS_GET_RDY(sc->regs.csts))) {
+		pthread_mutex_lock(&sc->mtx);
+		if (pci_nvme_pending_ios(sc) == 0 &&
+		    NVME_CC_GET_EN(sc->regs.cc) &&
+		    !(NVME_CSTS_GET_RDY(sc->regs.csts)))
+			sc->regs.csts |= NVME_CSTS_RDY;
+		pthread_mutex_unlock(&sc->mtx);
+	}
 }
 
+/* Slow path: every ioreq of the queue is in flight */
 static struct pci_nvme_ioreq *
-pci_nvme_get_ioreq(struct pci_nvme_softc *sc)
+pci_nvme_wait_ioreq(struct nvme_submission_queue *sq)
 {
-	struct pci_nvme_ioreq *req = NULL;;
-
-	sem_wait(&sc->iosemlock);
-	pthread_mutex_lock(&sc->mtx);
+	struct pci_nvme_ioreq *req;
+
+	pthread_mutex_lock(&sq->ioreq_mtx);
+	atomic_store_rel_int(&sq->ioreq_waiters, 1);
+	atomic_thread_fence_seq_cst();
+	while ((req = (struct pci_nvme_ioreq *)atomic_swap_ptr(
+	    (volatile uintptr_t *)&sq->ioreq_free, 0)) == NULL)
+		pthread_cond_wait(&sq->ioreq_cond, &sq->ioreq_mtx);
+	atomic_store_rel_int(&sq->ioreq_waiters, 0);
+	pthread_mutex_unlock(&sq->ioreq_mtx);
+
+	return (req);
+}
 
-	req = STAILQ_FIRST(&sc->ioreqs_free);
-	assert(req != NULL);
-	STAILQ_REMOVE_HEAD(&sc->ioreqs_free, link);
+static struct pci_nvme_ioreq *
+pci_nvme_get_ioreq(struct pci_nvme_softc *sc, struct nvme_submission_queue *sq,
+	uint16_t sqid)
+{
+	struct pci_nvme_ioreq *req;
+
+	req = sq->ioreq_local;
+	if (req == NULL) {
+		req = (struct pci_nvme_ioreq *)atomic_swap_ptr(
+		    (volatile uintptr_t *)&sq->ioreq_free, 0);
+		if (req == NULL)
+			req = pci_nvme_wait_ioreq(sq);
+	}
+	sq->ioreq_local = req->next;
 
 	req->sc = sc;
-
-	sc->pending_ios++;
-
-	pthread_mutex_unlock(&sc->mtx);
+	req->nvme_sq = sq;
+	req->sqid = sqid;
+	atomic_add_int(&sc->compl_queues[sq->cqid].inflight, 1);
 
 	req->io_req.br_iovcnt = 0;
 	req->io_req.br_offset = 0;
@@ -1383,7 +1810,10 @@ pci_nvme_io_partial(struct blockif_req *br, int err)
 
 	DPRINTF(("%s error %d %s", __func__, err, strerror(err)));
 
+	/* The submitter holds the mutex until it waits on cv */
+	pthread_mutex_lock(&req->mtx);
 	pthread_cond_signal(&req->cv);
+	pthread_mutex_unlock(&req->mtx);
 }
 
 static void
@@ -1421,6 +1851,53 @@ pci_nvme_dealloc_sm(struct blockif_req *br, int err)
 	}
 }
 
+/*
+ * Deallocate the ranges of a DSM command on a RAM namespace. Whole pages
+ * are replaced by fresh zero-fill ones so their memory is returned to
+ * the host; wired (ramhuge) namespaces are zeroed in place instead.
+ */
+static void
+pci_nvme_ram_dealloc(struct pci_nvme_softc *sc, struct nvme_command *cmd,
+    struct pci_nvme_blockstore *nvstore)
+{
+	struct nvme_dsm_range *range;
+	uint64_t off, len, start, end;
+	uint8_t *p = nvstore->ctx;
+	uint32_t nr, r;
+
+	range = calloc(1, NVME_MAX_DSM_TRIM);
+	if (range == NULL)
+		return;
+	nvme_prp_memcpy(sc->nsc_pi->pi_vmctx, cmd->prp1, cmd->prp2,
+	    (uint8_t *)range, NVME_MAX_DSM_TRIM, NVME_COPY_FROM_PRP);
+
+	/* Number of Ranges is a zero based value */
+	nr = cmd->cdw10 & 0xff;
+	for (r = 0; r <= nr; r++) {
+		off = range[r].starting_lba * nvstore->sectsz;
+		len = (uint64_t)range[r].length * nvstore->sectsz;
+		if (off >= nvstore->size)
+			continue;
+		len = MIN(len, nvstore->size - off);
+
+		start = roundup2(off, PAGE_SIZE);
+		end = rounddown2(off + len, PAGE_SIZE);
+		if (nvstore->ramhuge || start >= end) {
+			memset(p + off, 0, len);
+			continue;
+		}
+
+		memset(p + off, 0, start - off);
+		memset(p + end, 0, off + len - end);
+		if (mmap(p + start, end - start, PROT_READ | PROT_WRITE,
+		    MAP_ANON | MAP_PRIVATE | MAP_FIXED | MAP_NOCORE, -1, 0) ==
+		    MAP_FAILED)
+			memset(p + start, 0, end - start);
+	}
+
+	free(range);
+}
+
 static int
 nvme_opc_dataset_mgmt(struct pci_nvme_softc *sc,
     struct nvme_command *cmd,
@@ -1449,6 +1926,12 @@ nvme_opc_dataset_mgmt(struct pci_nvme_softc *sc,
 			goto out;
 		}
 
+		if (nvstore->type == NVME_STOR_RAM) {
+			pci_nvme_ram_dealloc(sc, cmd, nvstore);
+			pci_nvme_status_genc(status, NVME_SC_SUCCESS);
+			goto out;
+		}
+
 		if (req == NULL) {
 			pci_nvme_status_genc(status, NVME_SC_INTERNAL_DEVICE_ERROR);
 			goto out;
@@ -1508,6 +1991,59 @@ out:
 	return (err);
 }
 
+/*
+ * Current tail of an I/O submission queue. Once shadow doorbells are
+ * configured the guest may only have updated the shadow copy.
+ */
+static uint16_t
+pci_nvme_sq_tail(struct pci_nvme_softc *sc, struct nvme_submission_queue *sq,
+	uint16_t idx)
+{
+	uint32_t *shadow;
+	uint32_t tail;
+
+	shadow = (uint32_t *)atomic_load_acq_ptr(
+	    (volatile uintptr_t *)&sc->dbbuf_shadow);
+	if (shadow != NULL && idx != 0) {
+		tail = atomic_load_acq_32(&shadow[NVME_DBBUF_SQ(idx)]);
+		if (tail < sq->size)
+			atomic_store_short(&sq->tail, (uint16_t)tail);
+	}
+
+	return (atomic_load_acq_short(&sq->tail));
+}
+
+/*
+ * Publish the submission queue's EventIdx. The guest rings the MMIO
+ * doorbell only when EventIdx lies between its old and new tail, so
+ * setting it to the head asks for a doorbell on the next submission,
+ * and one behind the head (used while the poller is active) never
+ * does. Returns non-zero if the guest posted entries past sqhead
+ * in the meantime.
+ */
+static int
+pci_nvme_sq_rearm(struct pci_nvme_softc *sc, struct nvme_submission_queue *sq,
+	uint16_t idx, uint16_t sqhead)
+{
+	uint32_t *eventidx;
+	int polling;
+
+	eventidx = (uint32_t *)atomic_load_acq_ptr(
+	    (volatile uintptr_t *)&sc->dbbuf_eventidx);
+	if (idx == 0 || eventidx == NULL)
+		return (0);
+
+	do {
+		polling = atomic_load_acq_int(&sc->sqpoll_active);
+		atomic_store_rel_32(&eventidx[NVME_DBBUF_SQ(idx)],
+		    polling ? (uint16_t)(sqhead - 1) : sqhead);
+		atomic_thread_fence_seq_cst();
+		/* The poller may have gone idle; don't leave doorbells off */
+	} while (polling && !atomic_load_acq_int(&sc->sqpoll_active));
+
+	return (pci_nvme_sq_tail(sc, sq, idx) != sqhead);
+}
+
 static void
 pci_nvme_handle_io_cmd(struct pci_nvme_softc* sc, uint16_t idx)
 {
@@ -1519,6 +2055,7 @@ pci_nvme_handle_io_cmd(struct pci_nvme_softc* sc, uint16_t idx)
 	/* handle all submissions up to sq->tail index */
 	sq = &sc->submit_queues[idx];
 
+again:
 	if (atomic_testandset_int(&sq->busy, 1)) {
 		DPRINTF(("%s sqid %u busy", __func__, idx));
 		return;
@@ -1529,7 +2066,8 @@ pci_nvme_handle_io_cmd(struct pci_nvme_softc* sc, uint16_t idx)
 	DPRINTF(("nvme_handle_io qid %u head %u tail %u cmdlist %p",
 	         idx, sqhead, sq->tail, sq->qbase));
 
-	while (sqhead != atomic_load_acq_short(&sq->tail)) {
+rescan:
+	while (sqhead != pci_nvme_sq_tail(sc, sq, idx)) {
 		struct nvme_command *cmd;
 		struct pci_nvme_ioreq *req = NULL;
 		uint64_t lba;
@@ -1560,9 +2098,7 @@ pci_nvme_handle_io_cmd(struct pci_nvme_softc* sc, uint16_t idx)
 		}
 
 		if (sc->nvstore.type == NVME_STOR_BLOCKIF) {
-			req = pci_nvme_get_ioreq(sc);
-			req->nvme_sq = sq;
-			req->sqid = idx;
+			req = pci_nvme_get_ioreq(sc, sq, idx);
 		}
 
 		if (cmd->opc == NVME_OPC_DATASET_MANAGEMENT) {
@@ -1592,19 +2128,9 @@ pci_nvme_handle_io_cmd(struct pci_nvme_softc* sc, uint16_t idx)
 			     "WRITE" : "READ",
 		         lba, nblocks, bytes));
 
-		cmd->prp1 &= ~(0x03UL);
-		cmd->prp2 &= ~(0x03UL);
-
-		DPRINTF((" prp1 0x%lx prp2 0x%lx", cmd->prp1, cmd->prp2));
-
 		size = bytes;
 		lba *= sc->nvstore.sectsz;
 
-		cpsz = PAGE_SIZE - (cmd->prp1 % PAGE_SIZE);
-
-		if (cpsz > bytes)
-			cpsz = bytes;
-
 		if (req != NULL) {
 			req->io_req.br_offset = ((uint64_t)cmd->cdw11 << 32) |
 			                        cmd->cdw10;
@@ -1613,6 +2139,22 @@ pci_nvme_handle_io_cmd(struct pci_nvme_softc* sc, uint16_t idx)
 			req->nsid = cmd->nsid;
 		}
 
+		if (NVME_CMD_GET_PSDT(cmd) != NVME_PSDT_PRP) {
+			err = pci_nvme_append_sgl(sc, req, cmd,
+			    cmd->opc == NVME_OPC_WRITE, lba, bytes);
+			goto iodone;
+		}
+
+		cmd->prp1 &= ~(0x03UL);
+		cmd->prp2 &= ~(0x03UL);
+
+		DPRINTF((" prp1 0x%lx prp2 0x%lx", cmd->prp1, cmd->prp2));
+
+		cpsz = PAGE_SIZE - (cmd->prp1 % PAGE_SIZE);
+
+		if (cpsz > bytes)
+			cpsz = bytes;
+
 		err = pci_nvme_append_iov_req(sc, req, cmd->prp1, cpsz,
 		    cmd->opc == NVME_OPC_WRITE, lba);
 		lba += cpsz;
@@ -1718,7 +2260,142 @@ do_error:
 	}
 
 	atomic_store_short(&sq->head, sqhead);
+	if (pci_nvme_sq_rearm(sc, sq, idx, sqhead))
+		goto rescan;
 	atomic_store_int(&sq->busy, 0);
+
+	pci_nvme_cq_flush(sc, &sc->compl_queues[sq->cqid]);
+
+	/* A doorbell may have found the queue busy before it was released */
+	atomic_thread_fence_seq_cst();
+	if (atomic_load_acq_short(&sq->head) != pci_nvme_sq_tail(sc, sq, idx))
+		goto again;
+}
+
+/*
+ * Submission queue poller (sqpoll=#). While the guest keeps submitting
+ * it scans the shadow doorbells and keeps EventIdx behind the queue
+ * heads, so the guest does not exit to ring doorbells. After sqpoll
+ * microseconds without new entries it hands notification back to the
+ * guest and sleeps until a doorbell write wakes it.
+ *
+ * While asleep, or parked by pci_nvme_sqpoll_stop(), it does not touch
+ * the queues or the doorbell buffers, which is what allows a reset to
+ * tear them down.
+ */
+static void *
+pci_nvme_sqpoll_thr(void *arg)
+{
+	struct pci_nvme_softc *sc;
+	struct nvme_submission_queue *sq;
+	struct timespec now, last;
+	uint64_t idle;
+	uint32_t i;
+	int found;
+
+	sc = arg;
+	clock_gettime(CLOCK_MONOTONIC, &last);
+
+	for (;;) {
+		found = 0;
+		if (atomic_load_acq_int(&sc->sqpoll_active) &&
+		    atomic_load_acq_int(&sc->sqpoll_stop) == 0 &&
+		    atomic_load_acq_ptr(
+		    (volatile uintptr_t *)&sc->dbbuf_shadow) != 0) {
+			for (i = 1; i <= sc->num_squeues; i++) {
+				sq = &sc->submit_queues[i];
+				if (sq->qbase == NULL)
+					continue;
+				if (atomic_load_acq_short(&sq->head) !=
+				    pci_nvme_sq_tail(sc, sq, i)) {
+					pci_nvme_handle_io_cmd(sc, i);
+					found = 1;
+				}
+			}
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (found) {
+			last = now;
+			continue;
+		}
+		idle = (uint64_t)(now.tv_sec - last.tv_sec) * 1000000000 +
+		    now.tv_nsec - last.tv_nsec;
+		if (atomic_load_acq_int(&sc->sqpoll_active) &&
+		    atomic_load_acq_int(&sc->sqpoll_stop) == 0 &&
+		    idle < sc->sqpoll_usec * 1000ULL)
+			continue;
+
+		pthread_mutex_lock(&sc->mtx);
+		atomic_store_rel_int(&sc->sqpoll_active, 0);
+		atomic_thread_fence_seq_cst();
+		if (sc->sqpoll_stop == 0 && sc->dbbuf_shadow != NULL) {
+			for (i = 1; i <= sc->num_squeues; i++) {
+				sq = &sc->submit_queues[i];
+				if (sq->qbase != NULL &&
+				    pci_nvme_sq_rearm(sc, sq, i,
+				    atomic_load_acq_short(&sq->head)))
+					found = 1;
+			}
+		}
+		sc->sqpoll_parked = 1;
+		pthread_cond_broadcast(&sc->sqpoll_cond);
+		while ((!found && !sc->sqpoll_active) || sc->sqpoll_stop != 0)
+			pthread_cond_wait(&sc->sqpoll_cond, &sc->mtx);
+		sc->sqpoll_parked = 0;
+		atomic_store_rel_int(&sc->sqpoll_active, 1);
+		pthread_mutex_unlock(&sc->mtx);
+
+		clock_gettime(CLOCK_MONOTONIC, &last);
+	}
+
+	return (NULL);
+}
+
+static void
+pci_nvme_sqpoll_wakeup(struct pci_nvme_softc *sc)
+{
+
+	if (sc->sqpoll_usec == 0 ||
+	    atomic_load_acq_ptr((volatile uintptr_t *)&sc->dbbuf_shadow) == 0 ||
+	    atomic_load_acq_int(&sc->sqpoll_active))
+		return;
+
+	pthread_mutex_lock(&sc->mtx);
+	if (!sc->sqpoll_active) {
+		atomic_store_rel_int(&sc->sqpoll_active, 1);
+		pthread_cond_broadcast(&sc->sqpoll_cond);
+	}
+	pthread_mutex_unlock(&sc->mtx);
+}
+
+/*
+ * Park the poller before a reset tears down the queues and the doorbell
+ * buffers, and let it go again afterwards. Called with mtx held, which
+ * is dropped while waiting so that the poller can finish any request it
+ * is submitting.
+ */
+static void
+pci_nvme_sqpoll_stop(struct pci_nvme_softc *sc)
+{
+
+	if (sc->sqpoll_usec == 0)
+		return;
+
+	atomic_add_int(&sc->sqpoll_stop, 1);
+	while (!sc->sqpoll_parked)
+		pthread_cond_wait(&sc->sqpoll_cond, &sc->mtx);
+}
+
+static void
+pci_nvme_sqpoll_start(struct pci_nvme_softc *sc)
+{
+
+	if (sc->sqpoll_usec == 0)
+		return;
+
+	atomic_subtract_int(&sc->sqpoll_stop, 1);
+	pthread_cond_broadcast(&sc->sqpoll_cond);
 }
 
 static void
@@ -1743,6 +2420,7 @@ pci_nvme_handle_doorbell(struct vmctx *ctx, struct pci_nvme_softc* sc,
 				return;
 			}
 			pci_nvme_handle_io_cmd(sc, (uint16_t)idx);
+			pci_nvme_sqpoll_wakeup(sc);
 		}
 	} else {
 		if (idx > sc->num_cqueues) {
@@ -1891,7 +2569,7 @@ pci_nvme_write_bar_0(struct vmctx *ctx, struct pci_nvme_softc* sc,
 			sc->regs.cc &= ~NVME_CC_NEN_WRITE_MASK;
 			sc->regs.cc |= ccreg & NVME_CC_NEN_WRITE_MASK;
 			sc->regs.csts &= ~NVME_CSTS_RDY;
-		} else if (sc->pending_ios == 0) {
+		} else if (pci_nvme_pending_ios(sc) == 0) {
 			sc->regs.csts |= NVME_CSTS_RDY;
 		}
 		break;
@@ -2014,13 +2692,206 @@ pci_nvme_read(struct vmctx *ctx, int vcpu, struct pci_devinst *pi, int baridx,
 	return (0);
 }
 
+/*
+ * Allocate a RAM namespace. Anonymous memory is faulted in on first use.
+ * A snapshot image, when present, is mapped privately over the start of
+ * the namespace so that it is shared with the page cache until written.
+ */
+static int
+pci_nvme_ram_init(struct pci_nvme_blockstore *nvstore)
+{
+	struct stat sb;
+	uint64_t flen, fpages;
+	uint8_t *p;
+	int fd, flags;
+
+	fd = -1;
+	flen = 0;
+	if (nvstore->ramsnap != NULL) {
+		fd = open(nvstore->ramsnap, O_RDONLY);
+		if (fd < 0 && errno != ENOENT) {
+			perror("Could not open RAM snapshot");
+			return (-1);
+		}
+		if (fd >= 0) {
+			if (fstat(fd, &sb) != 0) {
+				perror("Could not stat RAM snapshot");
+				close(fd);
+				return (-1);
+			}
+			if (nvstore->size == 0)
+				nvstore->size = roundup2(sb.st_size,
+				    nvstore->sectsz);
+			flen = MIN((uint64_t)sb.st_size, nvstore->size);
+		}
+	}
+
+	if (nvstore->size == 0) {
+		EPRINTLN("RAM namespace size not specified");
+		if (fd >= 0)
+			close(fd);
+		return (-1);
+	}
+
+	flags = MAP_ANON | MAP_PRIVATE | MAP_NOCORE;
+	if (nvstore->ramhuge)
+		flags |= MAP_ALIGNED_SUPER;
+	p = mmap(NULL, nvstore->size, PROT_READ | PROT_WRITE, flags, -1, 0);
+	if (p == MAP_FAILED) {
+		perror("Unable to allocate RAM");
+		if (fd >= 0)
+			close(fd);
+		return (-1);
+	}
+
+	if (fd >= 0) {
+		fpages = rounddown2(flen, PAGE_SIZE);
+		if ((fpages != 0 && mmap(p, fpages, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_FIXED | MAP_NOCORE, fd, 0) ==
+		    MAP_FAILED) ||
+		    (flen != fpages && pread(fd, p + fpages, flen - fpages,
+		    fpages) != (ssize_t)(flen - fpages))) {
+			perror("Could not load RAM snapshot");
+			munmap(p, nvstore->size);
+			close(fd);
+			return (-1);
+		}
+		close(fd);
+		nvstore->ramsnap_len = fpages;
+	}
+
+	/* Wiring faults everything in, which lets superpages be promoted */
+	if (nvstore->ramhuge && mlock(p, nvstore->size) != 0)
+		WPRINTF(("RAM namespace not wired: %s", strerror(errno)));
+
+	nvstore->ctx = p;
+	return (0);
+}
+
+static int
+pci_nvme_ram_iszero(const uint8_t *p, size_t len)
+{
+
+	return (p[0] == 0 && memcmp(p, p + 1, len - 1) == 0);
+}
+
+/*
+ * Write a RAM namespace to its snapshot image. The image is written
+ * sparse to a temporary file that then replaces it, leaving a mapping
+ * of the previous image intact. The guest keeps running, so writes it
+ * issues meanwhile may be partially captured; quiesce it first for a
+ * consistent image.
+ *
+ * Anonymous pages that are not resident have never been written and are
+ * left as holes without reading them, which would allocate them. Pages
+ * paged out by the host are not resident either, so a namespace that
+ * must be saved under memory pressure should be wired with ramhuge.
+ * The part mapped from the previous image is always read, as its clean
+ * pages only come from the page cache.
+ */
+static int
+pci_nvme_ram_save(struct pci_nvme_blockstore *nvstore)
+{
+	char tmp[MAXPATHLEN];
+	uint8_t *p = nvstore->ctx;
+	uint64_t off, start, len;
+	ssize_t n;
+	char *vec;
+	int fd;
+
+	vec = malloc(howmany(nvstore->size, PAGE_SIZE));
+	if (vec == NULL)
+		return (-1);
+	if (mincore(p, nvstore->size, vec) != 0) {
+		free(vec);
+		return (-1);
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", nvstore->ramsnap);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		free(vec);
+		return (-1);
+	}
+
+	/* Write runs of non-zero pages, leaving holes for the rest */
+	start = 0;
+	for (off = 0; ; off += len) {
+		len = MIN(PAGE_SIZE, nvstore->size - off);
+		if (len != 0 && (off < nvstore->ramsnap_len ||
+		    (vec[off / PAGE_SIZE] & MINCORE_INCORE) != 0) &&
+		    !pci_nvme_ram_iszero(p + off, len))
+			continue;
+		while (start < off) {
+			n = pwrite(fd, p + start, off - start, start);
+			if (n <= 0) {
+				if (n == 0)
+					errno = EIO;
+				goto fail;
+			}
+			start += n;
+		}
+		if (len == 0)
+			break;
+		start = off + len;
+	}
+
+	if (ftruncate(fd, nvstore->size) != 0 || fsync(fd) != 0)
+		goto fail;
+	close(fd);
+	free(vec);
+
+	return (rename(tmp, nvstore->ramsnap));
+
+fail:
+	close(fd);
+	unlink(tmp);
+	free(vec);
+	return (-1);
+}
+
+static void *
+pci_nvme_ramsnap_thr(void *arg)
+{
+	struct pci_nvme_softc *sc;
+
+	pthread_mutex_lock(&pci_nvme_ramsnap_mtx);
+	for (;;) {
+		while (!pci_nvme_ramsnap_req)
+			pthread_cond_wait(&pci_nvme_ramsnap_cond,
+			    &pci_nvme_ramsnap_mtx);
+		pci_nvme_ramsnap_req = 0;
+		pthread_mutex_unlock(&pci_nvme_ramsnap_mtx);
+
+		SLIST_FOREACH(sc, &pci_nvme_ramsnaps, ramsnap_link) {
+			if (pci_nvme_ram_save(&sc->nvstore) != 0)
+				EPRINTLN("nvme: could not save %s: %s",
+				    sc->nvstore.ramsnap, strerror(errno));
+		}
+
+		pthread_mutex_lock(&pci_nvme_ramsnap_mtx);
+	}
+
+	return (NULL);
+}
+
+/* Signals arriving while a save runs are folded into one more save. */
+static void
+pci_nvme_ramsnap_handler(int signal, enum ev_type type, void *arg)
+{
+
+	pthread_mutex_lock(&pci_nvme_ramsnap_mtx);
+	pci_nvme_ramsnap_req = 1;
+	pthread_cond_signal(&pci_nvme_ramsnap_cond);
+	pthread_mutex_unlock(&pci_nvme_ramsnap_mtx);
+}
 
 static int
 pci_nvme_parse_opts(struct pci_nvme_softc *sc, char *opts)
 {
 	char bident[sizeof("XX:X:X")];
 	char	*uopt, *xopts, *config;
-	uint32_t sectsz;
+	uint32_t maxslots, sectsz;
 	int optidx;
 
 	sc->max_queues = NVME_QUEUES;
@@ -2048,6 +2919,8 @@ pci_nvme_parse_opts(struct pci_nvme_softc *sc, char *opts)
 			sc->max_qentries = atoi(config);
 		} else if (!strcmp("ioslots", xopts)) {
 			sc->ioslots = atoi(config);
+		} else if (!strcmp("sqpoll", xopts)) {
+			sc->sqpoll_usec = atoi(config);
 		} else if (!strcmp("sectsz", xopts)) {
 			sectsz = atoi(config);
 		} else if (!strcmp("ser", xopts)) {
@@ -2063,14 +2936,11 @@ pci_nvme_parse_opts(struct pci_nvme_softc *sc, char *opts)
 
 			sc->nvstore.type = NVME_STOR_RAM;
 			sc->nvstore.size = sz * 1024 * 1024;
-			sc->nvstore.ctx = calloc(1, sc->nvstore.size);
-			sc->nvstore.sectsz = 4096;
-			sc->nvstore.sectsz_bits = 12;
-			if (sc->nvstore.ctx == NULL) {
-				perror("Unable to allocate RAM");
-				free(uopt);
-				return (-1);
-			}
+		} else if (!strcmp("ramsnap", xopts) && config != NULL) {
+			sc->nvstore.type = NVME_STOR_RAM;
+			sc->nvstore.ramsnap = strdup(config);
+		} else if (!strcmp("ramhuge", xopts)) {
+			sc->nvstore.ramhuge = 1;
 		} else if (!strcmp("eui64", xopts)) {
 			sc->nvstore.eui64 = htobe64(strtoull(config, NULL, 0));
 		} else if (!strcmp("dsm", xopts)) {
@@ -2101,6 +2971,13 @@ pci_nvme_parse_opts(struct pci_nvme_softc *sc, char *opts)
 	}
 	free(uopt);
 
+	if (sc->nvstore.type == NVME_STOR_RAM) {
+		sc->nvstore.sectsz = 4096;
+		sc->nvstore.sectsz_bits = 12;
+		if (pci_nvme_ram_init(&sc->nvstore) != 0)
+			return (-1);
+	}
+
 	if (sc->nvstore.ctx == NULL || sc->nvstore.size == 0) {
 		EPRINTLN("backing store not specified");
 		return (-1);
@@ -2125,6 +3002,43 @@ pci_nvme_parse_opts(struct pci_nvme_softc *sc, char *opts)
 		return (-1);
 	}
 
+	/*
+	 * Every queue's requests share one blockif ring, and a full ring
+	 * fails the command rather than waiting, so all the slots must fit.
+	 */
+	if (sc->nvstore.type == NVME_STOR_BLOCKIF) {
+		maxslots = blockif_queuesz(sc->nvstore.ctx) / sc->max_queues;
+		if (sc->ioslots > maxslots) {
+			EPRINTLN("ioslots %u too large for maxq %u, using %u",
+			    sc->ioslots, sc->max_queues, maxslots);
+			sc->ioslots = maxslots;
+		}
+	}
+
+	return (0);
+}
+
+static int
+pci_nvme_init_ioreqs(struct pci_nvme_softc *sc, struct nvme_submission_queue *sq)
+{
+	struct pci_nvme_ioreq *req;
+
+	sq->ioreqs = calloc(sc->ioslots, sizeof(struct pci_nvme_ioreq));
+	if (sq->ioreqs == NULL)
+		return (-1);
+
+	sq->ioreq_local = NULL;
+	for (uint32_t i = 0; i < sc->ioslots; i++) {
+		req = &sq->ioreqs[i];
+		pthread_mutex_init(&req->mtx, NULL);
+		pthread_cond_init(&req->cv, NULL);
+		req->next = sq->ioreq_local;
+		sq->ioreq_local = req;
+	}
+	sq->ioreq_free = NULL;
+	pthread_mutex_init(&sq->ioreq_mtx, NULL);
+	pthread_cond_init(&sq->ioreq_cond, NULL);
+
 	return (0);
 }
 
@@ -2147,14 +3061,26 @@ pci_nvme_init(struct vmctx *ctx, struct pci_devinst *pi, char *opts)
 	else
 		error = 0;
 
-	STAILQ_INIT(&sc->ioreqs_free);
-	sc->ioreqs = calloc(sc->ioslots, sizeof(struct pci_nvme_ioreq));
-	for (int i = 0; i < sc->ioslots; i++) {
-		STAILQ_INSERT_TAIL(&sc->ioreqs_free, &sc->ioreqs[i], link);
-		pthread_mutex_init(&sc->ioreqs[i].mtx, NULL);
-		pthread_cond_init(&sc->ioreqs[i].cv, NULL);
+	sc->intr_coales_aggr_thresh = 0;
+
+	if (sc->nvstore.ramsnap != NULL) {
+		if (SLIST_EMPTY(&pci_nvme_ramsnaps)) {
+			pthread_t tid;
+
+			error = pthread_create(&tid, NULL, pci_nvme_ramsnap_thr,
+			    NULL);
+			if (error) {
+				WPRINTF(("%s ramsnap thread create failed",
+				    __func__));
+				goto done;
+			}
+			pthread_set_name_np(tid, "nvme-ramsnap");
+			mevent_add(SIGUSR1, EVF_SIGNAL,
+			    pci_nvme_ramsnap_handler, NULL);
+			(void) signal(SIGUSR1, SIG_IGN);
+		}
+		SLIST_INSERT_HEAD(&pci_nvme_ramsnaps, sc, ramsnap_link);
 	}
-	sc->intr_coales_aggr_thresh = 1;
 
 	pci_set_cfgdata16(pi, PCIR_DEVICE, 0x0A0A);
 	pci_set_cfgdata16(pi, PCIR_VENDOR, 0xFB5D);
@@ -2195,9 +3121,33 @@ pci_nvme_init(struct vmctx *ctx, struct pci_devinst *pi, char *opts)
 	}
 
 	pthread_mutex_init(&sc->mtx, NULL);
-	sem_init(&sc->iosemlock, 0, sc->ioslots);
+
+	if (sc->sqpoll_usec != 0) {
+		char tname[MAXCOMLEN + 1];
+
+		pthread_cond_init(&sc->sqpoll_cond, NULL);
+		error = pthread_create(&sc->sqpoll_tid, NULL,
+		    pci_nvme_sqpoll_thr, sc);
+		if (error) {
+			WPRINTF(("%s sqpoll thread create failed", __func__));
+			goto done;
+		}
+		snprintf(tname, sizeof(tname), "nvme-poll-%d:%d",
+		    pi->pi_slot, pi->pi_func);
+		pthread_set_name_np(sc->sqpoll_tid, tname);
+	}
 
 	pci_nvme_reset(sc);
+
+	/* The admin queue is handled without ioreqs */
+	for (uint32_t i = 1; i < sc->max_queues + 1; i++) {
+		error = pci_nvme_init_ioreqs(sc, &sc->submit_queues[i]);
+		if (error) {
+			WPRINTF(("%s ioreq allocation failed", __func__));
+			goto done;
+		}
+	}
+
 	/*
 	 * Controller data depends on Namespace data so initialize Namespace
 	 * data first.
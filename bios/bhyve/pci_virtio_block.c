@@ -61,7 +61,12 @@ __FBSDID("$FreeBSD: head/usr.sbin/bhyve/pci_virtio_block.c 360648 2020-05-05 00:
 
 #define	VTBLK_BSIZE	512
 #define	VTBLK_RINGSZ	128
+#define	VTBLK_MAXQ	8
 
+/*
+ * The queues share VTBLK_RINGSZ entries between them, so that every
+ * ring entry of every queue can always be queued to blockif.
+ */
 _Static_assert(VTBLK_RINGSZ <= BLOCKIF_RING_MAX, "Each ring entry must be able to queue a request");
 
 #define	VTBLK_S_OK	0
@@ -94,6 +99,7 @@ _Static_assert(VTBLK_RINGSZ <= BLOCKIF_RING_MAX, "Each ring entry must be able t
     VTBLK_F_BLK_SIZE |						    \
     VTBLK_F_FLUSH    |						    \
     VTBLK_F_TOPOLOGY |						    \
+    VIRTIO_RING_F_EVENT_IDX |					    \
     VIRTIO_RING_F_INDIRECT_DESC )	/* indirect descriptors */
 
 /*
@@ -168,11 +174,21 @@ static int pci_vtblk_debug;
 
 struct pci_vtblk_ioreq {
 	struct blockif_req		io_req;
-	struct pci_vtblk_softc		*io_sc;
+	struct pci_vtblk_queue		*io_q;
 	uint8_t				*io_status;
 	uint16_t			io_idx;
 };
 
+/*
+ * Per-virtqueue state.  Requests are taken from, and completed to, the
+ * queue under q_mtx only; blockif submission itself is lock-free.
+ */
+struct pci_vtblk_queue {
+	pthread_mutex_t			q_mtx;
+	struct vqueue_info		*q_vq;
+	struct pci_vtblk_ioreq		*q_ios;	/* one per ring entry */
+};
+
 struct virtio_blk_discard_write_zeroes {
 	uint64_t	sector;
 	uint32_t	num_sectors;
@@ -188,12 +204,13 @@ struct virtio_blk_discard_write_zeroes {
 struct pci_vtblk_softc {
 	struct virtio_softc vbsc_vs;
 	pthread_mutex_t vsc_mtx;
-	struct vqueue_info vbsc_vq;
+	struct vqueue_info vbsc_vq[VTBLK_MAXQ];
+	struct pci_vtblk_queue vbsc_q[VTBLK_MAXQ];
+	int vbsc_nq;
 	struct vtblk_config vbsc_cfg;
 	struct virtio_consts vbsc_consts;
 	struct blockif_ctxt *bc;
 	char vbsc_ident[VTBLK_BLK_ID_BYTES];
-	struct pci_vtblk_ioreq vbsc_ios[VTBLK_RINGSZ];
 };
 
 static void pci_vtblk_reset(void *);
@@ -208,7 +225,7 @@ static int pci_vtblk_snapshot(void *, struct vm_snapshot_meta *);
 
 static struct virtio_consts vtblk_vi_consts = {
 	"vtblk",		/* our name */
-	1,			/* we support 1 virtqueue */
+	1,			/* 1 virtqueue, or vbsc_nq with MQ */
 	sizeof(struct vtblk_config),	/* config reg size */
 	pci_vtblk_reset,	/* reset */
 	pci_vtblk_notify,	/* device-wide qnotify */
@@ -227,15 +244,20 @@ static void
 pci_vtblk_reset(void *vsc)
 {
 	struct pci_vtblk_softc *sc = vsc;
+	int i;
 
 	DPRINTF(("vtblk: device reset requested !"));
+	for (i = 0; i < sc->vbsc_nq; i++)
+		pthread_mutex_lock(&sc->vbsc_q[i].q_mtx);
 	vi_reset_dev(&sc->vbsc_vs);
+	for (i = 0; i < sc->vbsc_nq; i++)
+		pthread_mutex_unlock(&sc->vbsc_q[i].q_mtx);
 }
 
 static void
 pci_vtblk_done_locked(struct pci_vtblk_ioreq *io, int err)
 {
-	struct pci_vtblk_softc *sc = io->io_sc;
+	struct pci_vtblk_queue *q = io->io_q;
 
 	/* convert errno into a virtio block error return */
 	if (err == EOPNOTSUPP || err == ENOSYS)
@@ -249,8 +271,8 @@ pci_vtblk_done_locked(struct pci_vtblk_ioreq *io, int err)
 	 * Return the descriptor back to the host.
 	 * We wrote 1 byte (our status) to host.
 	 */
-	vq_relchain(&sc->vbsc_vq, io->io_idx, 1);
-	vq_endchains(&sc->vbsc_vq, 0);
+	vq_relchain(q->q_vq, io->io_idx, 1);
+	vq_endchains(q->q_vq, 0);
 }
 
 #ifdef BHYVE_SNAPSHOT
@@ -291,11 +313,11 @@ static void
 pci_vtblk_done(struct blockif_req *br, int err)
 {
 	struct pci_vtblk_ioreq *io = br->br_param;
-	struct pci_vtblk_softc *sc = io->io_sc;
+	struct pci_vtblk_queue *q = io->io_q;
 
-	pthread_mutex_lock(&sc->vsc_mtx);
+	pthread_mutex_lock(&q->q_mtx);
 	pci_vtblk_done_locked(io, err);
-	pthread_mutex_unlock(&sc->vsc_mtx);
+	pthread_mutex_unlock(&q->q_mtx);
 }
 
 static void
@@ -323,7 +345,7 @@ pci_vtblk_proc(struct pci_vtblk_softc *sc, struct vqueue_info *vq)
 	 */
 	assert(n >= 2 && n <= BLOCKIF_IOV_MAX + 2);
 
-	io = &sc->vbsc_ios[idx];
+	io = &sc->vbsc_q[vq->vq_num].q_ios[idx];
 	assert((flags[0] & VRING_DESC_F_WRITE) == 0);
 	assert(iov[0].iov_len == sizeof(struct virtio_blk_hdr));
 	vbh = (struct virtio_blk_hdr *)iov[0].iov_base;
@@ -442,21 +464,47 @@ pci_vtblk_init(struct vmctx *ctx, struct pci_devinst *pi, char *opts)
 	MD5_CTX mdctx;
 	u_char digest[16];
 	struct pci_vtblk_softc *sc;
+	struct pci_vtblk_queue *q;
+	char *bopts, *cp, *xopts;
 	off_t size;
-	int i, sectsz, sts, sto;
+	int i, j, nq, qsize, sectsz, sts, sto;
 
 	if (opts == NULL) {
 		WPRINTF(("virtio-block: backing device required"));
 		return (1);
 	}
 
+	/*
+	 * Pick out our own options; everything else goes to blockif.
+	 */
+	nq = 1;
+	bopts = calloc(1, strlen(opts) + 1);
+	xopts = strdup(opts);
+	for (cp = xopts; cp != NULL; ) {
+		char *opt = strsep(&cp, ",");
+
+		if (opt != xopts && sscanf(opt, "queues=%d", &nq) == 1)
+			continue;
+		if (bopts[0] != '\0')
+			strcat(bopts, ",");
+		strcat(bopts, opt);
+	}
+	free(xopts);
+	if (nq < 1 || nq > VTBLK_MAXQ) {
+		WPRINTF(("virtio-block: queues must be between 1 and %d",
+		    VTBLK_MAXQ));
+		free(bopts);
+		return (1);
+	}
+
 	/*
 	 * The supplied backing file has to exist
 	 */
 	snprintf(bident, sizeof(bident), "%d:%d", pi->pi_slot, pi->pi_func);
-	bctxt = blockif_open(opts, bident);
+	bctxt = blockif_open(bopts, bident);
 	if (bctxt == NULL) {
 		perror("Could not open backing file");
+		free(bopts);
 		return (1);
 	}
 
@@ -464,35 +512,52 @@ pci_vtblk_init(struct vmctx *ctx, struct pci_devinst *pi, char *opts)
 	sectsz = blockif_sectsz(bctxt);
 	blockif_psectsz(bctxt, &sts, &sto);
 
+	/* Split the ring entries evenly, keeping each a power of 2. */
+	for (qsize = VTBLK_RINGSZ; qsize * nq > VTBLK_RINGSZ; qsize /= 2)
+		;
+
 	sc = calloc(1, sizeof(struct pci_vtblk_softc));
 	sc->bc = bctxt;
-	for (i = 0; i < VTBLK_RINGSZ; i++) {
-		struct pci_vtblk_ioreq *io = &sc->vbsc_ios[i];
-		io->io_req.br_callback = pci_vtblk_done;
-		io->io_req.br_param = io;
-		io->io_sc = sc;
-		io->io_idx = i;
+	sc->vbsc_nq = nq;
+	for (i = 0; i < nq; i++) {
+		q = &sc->vbsc_q[i];
+		pthread_mutex_init(&q->q_mtx, NULL);
+		q->q_vq = &sc->vbsc_vq[i];
+		q->q_ios = calloc(qsize, sizeof(struct pci_vtblk_ioreq));
+		for (j = 0; j < qsize; j++) {
+			struct pci_vtblk_ioreq *io = &q->q_ios[j];
+			io->io_req.br_callback = pci_vtblk_done;
+			io->io_req.br_param = io;
+			io->io_q = q;
+			io->io_idx = j;
+		}
 	}
 
 	bcopy(&vtblk_vi_consts, &sc->vbsc_consts, sizeof (vtblk_vi_consts));
+	sc->vbsc_consts.vc_nvq = nq;
+	if (nq > 1)
+		sc->vbsc_consts.vc_hv_caps |= VTBLK_F_MQ;
 	if (blockif_candelete(sc->bc))
 		sc->vbsc_consts.vc_hv_caps |= VTBLK_F_DISCARD;
 
 	pthread_mutex_init(&sc->vsc_mtx, NULL);
 
 	/* init virtio softc and virtqueues */
-	vi_softc_linkup(&sc->vbsc_vs, &sc->vbsc_consts, sc, pi, &sc->vbsc_vq);
+	vi_softc_linkup(&sc->vbsc_vs, &sc->vbsc_consts, sc, pi, sc->vbsc_vq);
 	sc->vbsc_vs.vs_mtx = &sc->vsc_mtx;
 
-	sc->vbsc_vq.vq_qsize = VTBLK_RINGSZ;
-	/* sc->vbsc_vq.vq_notify = we have no per-queue notify */
+	for (i = 0; i < nq; i++) {
+		sc->vbsc_vq[i].vq_qsize = qsize;
+		sc->vbsc_vq[i].vq_mtx = &sc->vbsc_q[i].q_mtx;
+		/* no per-queue notify, pci_vtblk_notify() serves them all */
+	}
 
 	/*
 	 * Create an identifier for the backing file. Use parts of the
 	 * md5 sum of the filename
 	 */
 	MD5Init(&mdctx);
-	MD5Update(&mdctx, opts, strlen(opts));
+	MD5Update(&mdctx, bopts, strlen(bopts));
 	MD5Final(digest, &mdctx);
 	snprintf(sc->vbsc_ident, VTBLK_BLK_ID_BYTES,
 	    "BHYVE-%02X%02X-%02X%02X-%02X%02X",
@@ -507,9 +572,14 @@ pci_vtblk_init(struct vmctx *ctx, struct pci_devinst *pi, char *opts)
 	 * size, it can stumble into situations where it violates its own
 	 * invariants and panics.  For safety, we keep seg_max clamped, paying
 	 * heed to the two extra descriptors needed for the header and status
-	 * of a request.
+	 * of a request.  Indirect chains take a single ring entry however
+	 * long they are, so with those on offer the split ring does not
+	 * limit the request size.
 	 */
-	sc->vbsc_cfg.vbc_seg_max = MIN(VTBLK_RINGSZ - 2, BLOCKIF_IOV_MAX);
+	if (sc->vbsc_consts.vc_hv_caps & VIRTIO_RING_F_INDIRECT_DESC)
+		sc->vbsc_cfg.vbc_seg_max = BLOCKIF_IOV_MAX;
+	else
+		sc->vbsc_cfg.vbc_seg_max = MIN(qsize - 2, BLOCKIF_IOV_MAX);
 	sc->vbsc_cfg.vbc_geometry.cylinders = 0;	/* no geometry */
 	sc->vbsc_cfg.vbc_geometry.heads = 0;
 	sc->vbsc_cfg.vbc_geometry.sectors = 0;
@@ -521,6 +591,7 @@ pci_vtblk_init(struct vmctx *ctx, struct pci_devinst *pi, char *opts)
 	sc->vbsc_cfg.vbc_topology.min_io_size = 0;
 	sc->vbsc_cfg.vbc_topology.opt_io_size = 0;
 	sc->vbsc_cfg.vbc_writeback = 0;
+	sc->vbsc_cfg.num_queues = nq;
 	sc->vbsc_cfg.max_discard_sectors = VTBLK_MAX_DISCARD_SECT;
 	sc->vbsc_cfg.max_discard_seg = VTBLK_MAX_DISCARD_SEG;
 	sc->vbsc_cfg.discard_sector_alignment = sectsz / VTBLK_BSIZE;
@@ -536,8 +607,12 @@ pci_vtblk_init(struct vmctx *ctx, struct pci_devinst *pi, char *opts)
 	pci_set_cfgdata16(pi, PCIR_SUBDEV_0, VIRTIO_TYPE_BLOCK);
 	pci_set_cfgdata16(pi, PCIR_SUBVEND_0, VIRTIO_VENDOR);
 
+	free(bopts);
+
 	if (vi_intr_init(&sc->vbsc_vs, 1, fbsdrun_virtio_msix())) {
 		blockif_close(sc->bc);
+		for (i = 0; i < nq; i++)
+			free(sc->vbsc_q[i].q_ios);
 		free(sc);
 		return (1);
 	}
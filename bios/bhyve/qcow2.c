@@ -0,0 +1,982 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright 2020 Leon Dang
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY NETAPP, INC ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL NETAPP, INC OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * qcow2 image format (versions 2 and 3).
+ *
+ * The L1 and refcount tables are kept in memory; L2 tables are read on
+ * demand into a small LRU cache. All metadata updates are written
+ * through: data first, then the refcount, then the L2 entry, then the
+ * L1 entry, so a crash can leak clusters but never expose stale data.
+ *
+ * New clusters are appended to the end of the image. Reads of
+ * unallocated clusters go to the backing image, if any, which may itself
+ * be qcow2 if the header's backing format extension says so, and is
+ * raw otherwise. Compressed clusters are readable; writing to one
+ * moves it to a fresh cluster. Images with internal snapshots, a
+ * refcount width other than 16 bits or the corrupt bit set are only
+ * opened read-only, and encryption, external data files and extended
+ * L2 entries are not supported.
+ */
+
+#include <sys/cdefs.h>
+
+#include <sys/param.h>
+#ifndef WITHOUT_CAPSICUM
+#include <sys/capsicum.h>
+#endif
+#include <sys/endian.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#ifndef WITHOUT_CAPSICUM
+#include <capsicum_helpers.h>
+#endif
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "debug.h"
+#include "iov.h"
+#include "qcow2.h"
+
+#define	QCOW2_MAGIC		0x514649fb	/* "QFI\xfb" */
+#define	QCOW2_HDR_V2_LEN	72
+#define	QCOW2_HDR_V3_LEN	104
+#define	QCOW2_MIN_CLUSTER_BITS	9
+#define	QCOW2_MAX_CLUSTER_BITS	21
+#define	QCOW2_MAX_CHAIN		16	/* backing images */
+#define	QCOW2_L2CACHE_DEFAULT	32	/* tables */
+
+#define	QCOW2_OFLAG_COPIED	(1ULL << 63)
+#define	QCOW2_OFLAG_COMPRESSED	(1ULL << 62)
+#define	QCOW2_OFLAG_ZERO	(1ULL << 0)
+#define	QCOW2_OFFSET_MASK	0x00fffffffffffe00ULL
+
+#define	QCOW2_INCOMPAT_DIRTY	(1ULL << 0)
+#define	QCOW2_INCOMPAT_CORRUPT	(1ULL << 1)
+
+#define	QCOW2_EXT_END		0x00000000
+#define	QCOW2_EXT_BACKING_FMT	0xe2792aca
+
+enum qcow2_kind {
+	QCOW2_UNALLOC,
+	QCOW2_ZERO,
+	QCOW2_DATA,
+	QCOW2_COMPRESSED
+};
+
+struct qcow2_l2 {
+	uint64_t	l2_offset;	/* host offset, 0 if slot is unused */
+	uint64_t	l2_stamp;
+	uint64_t	*l2_tbl;	/* host byte order */
+};
+
+struct qcow2 {
+	int		q_fd;
+	int		q_ownfd;
+	int		q_ro;
+	uint32_t	q_version;
+	int		q_cbits;
+	uint64_t	q_csize;
+	int		q_l2bits;
+	uint64_t	q_size;
+
+	uint32_t	q_l1_size;
+	uint64_t	q_l1_offset;
+	uint64_t	*q_l1;
+	uint64_t	q_rct_offset;
+	uint64_t	q_rct_size;	/* entries */
+	uint64_t	*q_rct;
+	uint64_t	q_free;		/* next host offset to allocate */
+
+	pthread_mutex_t	q_mtx;
+	struct qcow2_l2	*q_l2;
+	int		q_nl2;
+	uint64_t	q_clock;
+
+	struct qcow2	*q_bq;		/* qcow2 backing image, or */
+	int		q_bfd;		/* raw backing file, -1 if none */
+	off_t		q_bsize;
+};
+
+static struct qcow2 *qcow2_open_chain(int fd, const char *path, int ro,
+    int l2cache, int depth);
+
+static int
+qcow2_pread_full(int fd, void *buf, size_t len, off_t off)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = pread(fd, buf, len, off);
+		if (n < 0)
+			return (-1);
+		if (n == 0) {
+			/* Past EOF reads as zero */
+			memset(buf, 0, len);
+			break;
+		}
+		buf = (uint8_t *)buf + n;
+		len -= n;
+		off += n;
+	}
+	return (0);
+}
+
+static int
+qcow2_pwrite_full(int fd, const void *buf, size_t len, off_t off)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = pwrite(fd, buf, len, off);
+		if (n < 0)
+			return (-1);
+		if (n == 0) {
+			errno = EIO;
+			return (-1);
+		}
+		buf = (const uint8_t *)buf + n;
+		len -= n;
+		off += n;
+	}
+	return (0);
+}
+
+static void
+qcow2_iov_copy(const struct iovec *iov, int iovcnt, uint8_t *buf, int tobuf)
+{
+	int i;
+
+	for (i = 0; i < iovcnt; i++) {
+		if (tobuf)
+			memcpy(buf, iov[i].iov_base, iov[i].iov_len);
+		else
+			memcpy(iov[i].iov_base, buf, iov[i].iov_len);
+		buf += iov[i].iov_len;
+	}
+}
+
+static enum qcow2_kind
+qcow2_kind(struct qcow2 *q, uint64_t e)
+{
+
+	if (e & QCOW2_OFLAG_COMPRESSED)
+		return (QCOW2_COMPRESSED);
+	if (q->q_version >= 3 && (e & QCOW2_OFLAG_ZERO))
+		return (QCOW2_ZERO);
+	if (e & QCOW2_OFFSET_MASK)
+		return (QCOW2_DATA);
+	return (QCOW2_UNALLOC);
+}
+
+/*
+ * Set the refcount of the host cluster at 'hoff', allocating the
+ * refcount block if needed. Called with q_mtx held.
+ */
+static int
+qcow2_refcount_set(struct qcow2 *q, uint64_t hoff, uint16_t val)
+{
+	uint64_t ci, epb, rbo, rti;
+	uint8_t b[8];
+
+	epb = q->q_csize / sizeof(uint16_t);
+	ci = hoff >> q->q_cbits;
+	rti = ci / epb;
+	if (rti >= q->q_rct_size) {
+		errno = ENOSPC;
+		return (-1);
+	}
+
+	rbo = q->q_rct[rti] & QCOW2_OFFSET_MASK;
+	if (rbo == 0) {
+		rbo = q->q_free;
+		q->q_free += q->q_csize;
+		if (ftruncate(q->q_fd, q->q_free) < 0)
+			return (-1);
+		be64enc(b, rbo);
+		if (qcow2_pwrite_full(q->q_fd, b, 8, q->q_rct_offset + rti * 8))
+			return (-1);
+		q->q_rct[rti] = rbo;
+		if (qcow2_refcount_set(q, rbo, 1))
+			return (-1);
+	}
+
+	be16enc(b, val);
+	return (qcow2_pwrite_full(q->q_fd, b, 2, rbo + (ci % epb) * 2));
+}
+
+/*
+ * Allocate a zero-filled host cluster. Called with q_mtx held.
+ */
+static uint64_t
+qcow2_alloc(struct qcow2 *q)
+{
+	uint64_t hoff;
+
+	hoff = q->q_free;
+	q->q_free += q->q_csize;
+	if (ftruncate(q->q_fd, q->q_free) < 0)
+		return (0);
+	if (qcow2_refcount_set(q, hoff, 1))
+		return (0);
+	return (hoff);
+}
+
+/*
+ * Return the cached L2 table for L1 index 'l1i' in *tblp, or NULL if
+ * there is none and 'alloc' is not set. Called with q_mtx held.
+ */
+static int
+qcow2_l2_get(struct qcow2 *q, uint64_t l1i, int alloc, uint64_t **tblp)
+{
+	struct qcow2_l2 *l2, *victim;
+	uint64_t l1e, l2off;
+	uint8_t b[8];
+	int i;
+
+	*tblp = NULL;
+	if (l1i >= q->q_l1_size)
+		return (0);
+
+	l2off = q->q_l1[l1i] & QCOW2_OFFSET_MASK;
+	if (l2off == 0) {
+		if (!alloc)
+			return (0);
+		if ((l2off = qcow2_alloc(q)) == 0)
+			return (-1);
+		l1e = l2off | QCOW2_OFLAG_COPIED;
+		be64enc(b, l1e);
+		if (qcow2_pwrite_full(q->q_fd, b, 8, q->q_l1_offset + l1i * 8))
+			return (-1);
+		q->q_l1[l1i] = l1e;
+	}
+
+	victim = &q->q_l2[0];
+	for (i = 0; i < q->q_nl2; i++) {
+		l2 = &q->q_l2[i];
+		if (l2->l2_offset == l2off) {
+			l2->l2_stamp = ++q->q_clock;
+			*tblp = l2->l2_tbl;
+			return (0);
+		}
+		if (l2->l2_stamp < victim->l2_stamp)
+			victim = l2;
+	}
+
+	victim->l2_offset = 0;
+	victim->l2_stamp = 0;
+	if (qcow2_pread_full(q->q_fd, victim->l2_tbl, q->q_csize, l2off))
+		return (-1);
+	for (i = 0; i < (1 << q->q_l2bits); i++)
+		victim->l2_tbl[i] = be64dec(&victim->l2_tbl[i]);
+	victim->l2_offset = l2off;
+	victim->l2_stamp = ++q->q_clock;
+	*tblp = victim->l2_tbl;
+	return (0);
+}
+
+static int
+qcow2_l2_set(struct qcow2 *q, uint64_t l1i, uint64_t l2i, uint64_t *tbl,
+    uint64_t e)
+{
+	uint8_t b[8];
+
+	be64enc(b, e);
+	if (qcow2_pwrite_full(q->q_fd, b, 8,
+	    (q->q_l1[l1i] & QCOW2_OFFSET_MASK) + l2i * 8))
+		return (-1);
+	tbl[l2i] = e;
+	return (0);
+}
+
+/*
+ * Look up the guest offset 'voff'. Returns the L2 entry of its cluster
+ * in *ep and the length, up to 'max', of the run of clusters that can
+ * be handled the same way: all unallocated, all zero, or data clusters
+ * that are contiguous in the image file.
+ */
+static ssize_t
+qcow2_lookup(struct qcow2 *q, uint64_t voff, size_t max, uint64_t *ep)
+{
+	enum qcow2_kind kind;
+	uint64_t *tbl, e, l1i, l2i;
+	size_t n;
+	int j;
+
+	l1i = voff >> (q->q_cbits + q->q_l2bits);
+	l2i = (voff >> q->q_cbits) & ((1 << q->q_l2bits) - 1);
+	n = MIN(max, q->q_csize - (voff & (q->q_csize - 1)));
+
+	pthread_mutex_lock(&q->q_mtx);
+	if (qcow2_l2_get(q, l1i, 0, &tbl)) {
+		pthread_mutex_unlock(&q->q_mtx);
+		return (-1);
+	}
+	e = tbl != NULL ? tbl[l2i] : 0;
+	kind = qcow2_kind(q, e);
+	if (kind != QCOW2_COMPRESSED) {
+		for (j = l2i + 1; j < (1 << q->q_l2bits) && n < max; j++) {
+			if (qcow2_kind(q, tbl != NULL ? tbl[j] : 0) != kind)
+				break;
+			if (kind == QCOW2_DATA &&
+			    ((tbl[j] ^ e) & QCOW2_OFLAG_COPIED ||
+			    (tbl[j] & QCOW2_OFFSET_MASK) !=
+			    (e & QCOW2_OFFSET_MASK) + (j - l2i) * q->q_csize))
+				break;
+			n += MIN(max - n, q->q_csize);
+		}
+	}
+	pthread_mutex_unlock(&q->q_mtx);
+
+	*ep = e;
+	return (n);
+}
+
+/*
+ * Inflate the compressed cluster described by 'e' into 'buf'.
+ */
+static int
+qcow2_inflate(struct qcow2 *q, uint64_t e, uint8_t *buf)
+{
+	z_stream zs;
+	uint64_t hoff, nsec;
+	size_t clen;
+	uint8_t *cbuf;
+	int x, zerr;
+
+	x = 62 - (q->q_cbits - 8);
+	hoff = e & ((1ULL << x) - 1);
+	nsec = ((e >> x) & ((1ULL << (q->q_cbits - 8)) - 1)) + 1;
+	clen = nsec * 512 - (hoff & 511);
+
+	cbuf = malloc(clen);
+	if (cbuf == NULL)
+		return (-1);
+	if (qcow2_pread_full(q->q_fd, cbuf, clen, hoff)) {
+		free(cbuf);
+		return (-1);
+	}
+
+	memset(&zs, 0, sizeof(zs));
+	if (inflateInit2(&zs, -12) != Z_OK) {
+		free(cbuf);
+		errno = ENOMEM;
+		return (-1);
+	}
+	zs.next_in = cbuf;
+	zs.avail_in = clen;
+	zs.next_out = buf;
+	zs.avail_out = q->q_csize;
+	zerr = inflate(&zs, Z_FINISH);
+	inflateEnd(&zs);
+	free(cbuf);
+
+	if ((zerr != Z_STREAM_END && zerr != Z_BUF_ERROR) || zs.avail_out != 0) {
+		EPRINTLN("qcow2: corrupt compressed cluster at %#jx",
+		    (uintmax_t)hoff);
+		errno = EIO;
+		return (-1);
+	}
+	return (0);
+}
+
+static int
+qcow2_backing_read(struct qcow2 *q, const struct iovec *iov, int iovcnt,
+    uint64_t voff, size_t len)
+{
+	ssize_t n;
+
+	n = 0;
+	if (voff < q->q_bsize) {
+		if (q->q_bq != NULL)
+			n = qcow2_preadv(q->q_bq, iov, iovcnt, voff);
+		else if (q->q_bfd >= 0)
+			n = preadv(q->q_bfd, iov, iovcnt, voff);
+		if (n < 0)
+			return (-1);
+	}
+	if (n < len)
+		zero_iov(iov, iovcnt, n);
+	return (0);
+}
+
+int
+qcow2_probe(int fd)
+{
+	uint8_t b[4];
+
+	if (pread(fd, b, sizeof(b), 0) != sizeof(b))
+		return (0);
+	return (be32dec(b) == QCOW2_MAGIC);
+}
+
+ssize_t
+qcow2_preadv(struct qcow2 *q, const struct iovec *iov, int iovcnt, off_t off)
+{
+	struct iovec *siov;
+	uint64_t e, coff;
+	size_t done, len;
+	ssize_t n, rn;
+	uint8_t *buf;
+	int sn, error;
+
+	if (off < 0 || (uint64_t)off >= q->q_size)
+		return (0);
+	len = MIN(count_iov(iov, iovcnt), q->q_size - off);
+
+	siov = malloc(iovcnt * sizeof(struct iovec));
+	if (siov == NULL)
+		return (-1);
+	buf = NULL;
+	error = 0;
+	for (done = 0; done < len; done += n) {
+		if ((n = qcow2_lookup(q, off + done, len - done, &e)) < 0) {
+			error = -1;
+			break;
+		}
+		sn = slice_iov(iov, iovcnt, done, n, siov);
+		coff = (off + done) & (q->q_csize - 1);
+
+		switch (qcow2_kind(q, e)) {
+		case QCOW2_COMPRESSED:
+			if (buf == NULL && (buf = malloc(q->q_csize)) == NULL) {
+				error = -1;
+				break;
+			}
+			if ((error = qcow2_inflate(q, e, buf)) == 0)
+				qcow2_iov_copy(siov, sn, buf + coff, 0);
+			break;
+		case QCOW2_ZERO:
+			zero_iov(siov, sn, 0);
+			break;
+		case QCOW2_DATA:
+			rn = preadv(q->q_fd, siov, sn,
+			    (e & QCOW2_OFFSET_MASK) + coff);
+			if (rn < 0)
+				error = -1;
+			else if (rn < n)
+				zero_iov(siov, sn, rn);
+			break;
+		case QCOW2_UNALLOC:
+			error = qcow2_backing_read(q, siov, sn, off + done, n);
+			break;
+		}
+		if (error)
+			break;
+	}
+	free(buf);
+	free(siov);
+
+	return (error ? -1 : (ssize_t)len);
+}
+
+/*
+ * Write to a cluster that is not an allocated data cluster of this
+ * image: allocate one (or reuse a preallocated zero cluster), fill the
+ * parts not being written from what the cluster used to read as, and
+ * point the L2 entry at it.
+ */
+static int
+qcow2_write_cluster(struct qcow2 *q, uint64_t voff, const struct iovec *iov,
+    int iovcnt, size_t len)
+{
+	struct iovec biov;
+	enum qcow2_kind kind;
+	uint64_t *tbl, e, hoff, coff, l1i, l2i;
+	uint8_t *buf;
+	int error;
+
+	l1i = voff >> (q->q_cbits + q->q_l2bits);
+	l2i = (voff >> q->q_cbits) & ((1 << q->q_l2bits) - 1);
+	coff = voff & (q->q_csize - 1);
+	buf = NULL;
+	error = -1;
+
+	pthread_mutex_lock(&q->q_mtx);
+	if (qcow2_l2_get(q, l1i, 1, &tbl))
+		goto done;
+	e = tbl[l2i];
+	kind = qcow2_kind(q, e);
+
+	/* Raced with another writer that allocated it */
+	if (kind == QCOW2_DATA && (e & QCOW2_OFLAG_COPIED)) {
+		if (pwritev(q->q_fd, iov, iovcnt,
+		    (e & QCOW2_OFFSET_MASK) + coff) >= 0)
+			error = 0;
+		goto done;
+	}
+
+	if (kind == QCOW2_ZERO && (e & QCOW2_OFFSET_MASK) != 0 &&
+	    (e & QCOW2_OFLAG_COPIED))
+		hoff = e & QCOW2_OFFSET_MASK;
+	else if ((hoff = qcow2_alloc(q)) == 0)
+		goto done;
+
+	if (coff == 0 && len == q->q_csize) {
+		if (pwritev(q->q_fd, iov, iovcnt, hoff) < 0)
+			goto done;
+	} else {
+		if ((buf = malloc(q->q_csize)) == NULL)
+			goto done;
+		switch (kind) {
+		case QCOW2_COMPRESSED:
+			if (qcow2_inflate(q, e, buf))
+				goto done;
+			break;
+		case QCOW2_DATA:
+			if (qcow2_pread_full(q->q_fd, buf, q->q_csize,
+			    e & QCOW2_OFFSET_MASK))
+				goto done;
+			break;
+		case QCOW2_ZERO:
+			memset(buf, 0, q->q_csize);
+			break;
+		case QCOW2_UNALLOC:
+			biov.iov_base = buf;
+			biov.iov_len = q->q_csize;
+			if (qcow2_backing_read(q, &biov, 1, voff - coff,
+			    q->q_csize))
+				goto done;
+			break;
+		}
+		qcow2_iov_copy(iov, iovcnt, buf + coff, 1);
+		if (qcow2_pwrite_full(q->q_fd, buf, q->q_csize, hoff))
+			goto done;
+	}
+
+	error = qcow2_l2_set(q, l1i, l2i, tbl, hoff | QCOW2_OFLAG_COPIED);
+done:
+	pthread_mutex_unlock(&q->q_mtx);
+	free(buf);
+	return (error);
+}
+
+ssize_t
+qcow2_pwritev(struct qcow2 *q, const struct iovec *iov, int iovcnt, off_t off)
+{
+	struct iovec *siov;
+	uint64_t e, coff;
+	size_t done, len;
+	ssize_t n;
+	int sn, error;
+
+	if (q->q_ro) {
+		errno = EROFS;
+		return (-1);
+	}
+	if (off < 0 || (uint64_t)off >= q->q_size)
+		return (0);
+	len = MIN(count_iov(iov, iovcnt), q->q_size - off);
+
+	siov = malloc(iovcnt * sizeof(struct iovec));
+	if (siov == NULL)
+		return (-1);
+	error = 0;
+	for (done = 0; done < len; done += n) {
+		if ((n = qcow2_lookup(q, off + done, len - done, &e)) < 0) {
+			error = -1;
+			break;
+		}
+		coff = (off + done) & (q->q_csize - 1);
+		if (qcow2_kind(q, e) == QCOW2_DATA &&
+		    (e & QCOW2_OFLAG_COPIED)) {
+			sn = slice_iov(iov, iovcnt, done, n, siov);
+			if (pwritev(q->q_fd, siov, sn,
+			    (e & QCOW2_OFFSET_MASK) + coff) < 0)
+				error = -1;
+		} else {
+			n = MIN(n, q->q_csize - coff);
+			sn = slice_iov(iov, iovcnt, done, n, siov);
+			error = qcow2_write_cluster(q, off + done, siov, sn, n);
+		}
+		if (error)
+			break;
+	}
+	free(siov);
+
+	return (error ? -1 : (ssize_t)len);
+}
+
+int
+qcow2_flush(struct qcow2 *q)
+{
+
+	if (fsync(q->q_fd))
+		return (errno);
+	return (0);
+}
+
+/*
+ * Turn every cluster entirely inside [off, off + len) into a zero
+ * cluster, keeping its host cluster for reuse. Partial clusters are
+ * left alone.
+ */
+int
+qcow2_discard(struct qcow2 *q, off_t off, off_t len)
+{
+	uint64_t *tbl, e, ne, voff, end, l1i, l2i;
+	int error;
+
+	if (q->q_ro)
+		return (EROFS);
+	if (q->q_version < 3)
+		return (EOPNOTSUPP);
+
+	voff = roundup2((uint64_t)off, q->q_csize);
+	end = rounddown2((uint64_t)MIN(off + len, (off_t)q->q_size),
+	    q->q_csize);
+	error = 0;
+	pthread_mutex_lock(&q->q_mtx);
+	for (; voff < end; voff += q->q_csize) {
+		l1i = voff >> (q->q_cbits + q->q_l2bits);
+		l2i = (voff >> q->q_cbits) & ((1 << q->q_l2bits) - 1);
+		if (qcow2_l2_get(q, l1i, q->q_bq != NULL || q->q_bfd >= 0,
+		    &tbl)) {
+			error = errno;
+			break;
+		}
+		if (tbl == NULL)
+			continue;	/* unallocated, no backing: reads zero */
+		e = tbl[l2i];
+		switch (qcow2_kind(q, e)) {
+		case QCOW2_ZERO:
+			continue;
+		case QCOW2_DATA:
+			if (e & QCOW2_OFLAG_COPIED) {
+				ne = (e & QCOW2_OFFSET_MASK) |
+				    QCOW2_OFLAG_COPIED | QCOW2_OFLAG_ZERO;
+				break;
+			}
+			/* FALLTHROUGH */
+		default:
+			ne = QCOW2_OFLAG_ZERO;
+			break;
+		}
+		if (qcow2_l2_set(q, l1i, l2i, tbl, ne)) {
+			error = errno;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&q->q_mtx);
+
+	return (error);
+}
+
+off_t
+qcow2_size(struct qcow2 *q)
+{
+
+	return (q->q_size);
+}
+
+int
+qcow2_is_ro(struct qcow2 *q)
+{
+
+	return (q->q_ro);
+}
+
+int
+qcow2_candelete(struct qcow2 *q)
+{
+
+	return (!q->q_ro && q->q_version >= 3);
+}
+
+/*
+ * Open the backing image named in the header. A relative name is
+ * relative to the directory holding the image itself.
+ */
+static int
+qcow2_open_backing(struct qcow2 *q, const char *path, const char *name,
+    const char *fmt, int l2cache, int depth)
+{
+	char bpath[MAXPATHLEN], dir[MAXPATHLEN];
+	struct stat sbuf;
+	int fd, isqcow;
+#ifndef WITHOUT_CAPSICUM
+	cap_rights_t rights;
+#endif
+
+	if (name[0] == '/')
+		strlcpy(bpath, name, sizeof(bpath));
+	else {
+		strlcpy(dir, path, sizeof(dir));
+		snprintf(bpath, sizeof(bpath), "%s/%s", dirname(dir), name);
+	}
+
+	fd = open(bpath, O_RDONLY);
+	if (fd < 0) {
+		warn("Could not open qcow2 backing file %s", bpath);
+		return (-1);
+	}
+	if (fstat(fd, &sbuf) < 0) {
+		warn("Could not stat qcow2 backing file %s", bpath);
+		close(fd);
+		return (-1);
+	}
+
+#ifndef WITHOUT_CAPSICUM
+	cap_rights_init(&rights, CAP_FSTAT, CAP_READ, CAP_SEEK);
+	if (caph_rights_limit(fd, &rights) == -1)
+		errx(EX_OSERR, "Unable to apply rights for sandbox");
+#endif
+
+	/*
+	 * Without a backing format extension the backing file is raw;
+	 * it is not probed, since it may be an image a guest has written.
+	 */
+	isqcow = strcmp(fmt, "qcow2") == 0;
+	if (fmt[0] != '\0' && !isqcow && strcmp(fmt, "raw") != 0) {
+		EPRINTLN("qcow2: unsupported backing format \"%s\"", fmt);
+		close(fd);
+		return (-1);
+	}
+
+	if (isqcow) {
+		q->q_bq = qcow2_open_chain(fd, bpath, 1, l2cache, depth + 1);
+		if (q->q_bq == NULL) {
+			close(fd);
+			return (-1);
+		}
+		q->q_bq->q_ownfd = 1;
+		q->q_bsize = q->q_bq->q_size;
+	} else {
+		q->q_bfd = fd;
+		q->q_bsize = sbuf.st_size;
+	}
+	return (0);
+}
+
+static struct qcow2 *
+qcow2_open_chain(int fd, const char *path, int ro, int l2cache, int depth)
+{
+	char bname[MAXPATHLEN], bfmt[16];
+	uint8_t hdr[QCOW2_HDR_V3_LEN], ext[8];
+	struct stat sbuf;
+	struct qcow2 *q;
+	uint64_t autoclear, bfo, incompat, off;
+	uint32_t bfs, crypt, elen, etype, hlen, rcorder, nsnap, rctc;
+	int i;
+
+	if (depth >= QCOW2_MAX_CHAIN) {
+		EPRINTLN("qcow2: backing chain of %s is too long", path);
+		return (NULL);
+	}
+
+	if (qcow2_pread_full(fd, hdr, sizeof(hdr), 0) ||
+	    fstat(fd, &sbuf) < 0) {
+		warn("Could not read qcow2 header of %s", path);
+		return (NULL);
+	}
+
+	q = calloc(1, sizeof(struct qcow2));
+	if (q == NULL)
+		return (NULL);
+	q->q_fd = fd;
+	q->q_bfd = -1;
+	q->q_ro = ro;
+	pthread_mutex_init(&q->q_mtx, NULL);
+
+	q->q_version = be32dec(hdr + 4);
+	bfo = be64dec(hdr + 8);
+	bfs = be32dec(hdr + 16);
+	q->q_cbits = be32dec(hdr + 20);
+	q->q_size = be64dec(hdr + 24);
+	crypt = be32dec(hdr + 32);
+	q->q_l1_size = be32dec(hdr + 36);
+	q->q_l1_offset = be64dec(hdr + 40);
+	q->q_rct_offset = be64dec(hdr + 48);
+	rctc = be32dec(hdr + 56);
+	nsnap = be32dec(hdr + 60);
+	incompat = autoclear = 0;
+	rcorder = 4;
+	hlen = QCOW2_HDR_V2_LEN;
+	if (q->q_version >= 3) {
+		incompat = be64dec(hdr + 72);
+		autoclear = be64dec(hdr + 88);
+		rcorder = be32dec(hdr + 96);
+		hlen = be32dec(hdr + 100);
+	}
+
+	if (be32dec(hdr) != QCOW2_MAGIC ||
+	    (q->q_version != 2 && q->q_version != 3)) {
+		EPRINTLN("qcow2: %s: unsupported version %u", path,
+		    q->q_version);
+		goto fail;
+	}
+	if (q->q_cbits < QCOW2_MIN_CLUSTER_BITS ||
+	    q->q_cbits > QCOW2_MAX_CLUSTER_BITS) {
+		EPRINTLN("qcow2: %s: bad cluster size", path);
+		goto fail;
+	}
+	if (crypt != 0) {
+		EPRINTLN("qcow2: %s: encrypted images are not supported", path);
+		goto fail;
+	}
+	if (incompat & ~(QCOW2_INCOMPAT_DIRTY | QCOW2_INCOMPAT_CORRUPT)) {
+		EPRINTLN("qcow2: %s: unsupported incompatible features %#jx",
+		    path, (uintmax_t)incompat);
+		goto fail;
+	}
+	if (!q->q_ro && (incompat & QCOW2_INCOMPAT_CORRUPT)) {
+		EPRINTLN("qcow2: %s is marked corrupt, opening read-only",
+		    path);
+		q->q_ro = 1;
+	}
+	if (!q->q_ro && nsnap != 0) {
+		EPRINTLN("qcow2: %s has internal snapshots, opening read-only",
+		    path);
+		q->q_ro = 1;
+	}
+	if (!q->q_ro && rcorder != 4) {
+		EPRINTLN("qcow2: %s: %u-bit refcounts unsupported, opening "
+		    "read-only", path, 1 << rcorder);
+		q->q_ro = 1;
+	}
+
+	q->q_csize = 1ULL << q->q_cbits;
+	q->q_l2bits = q->q_cbits - 3;
+	if (q->q_size > ((uint64_t)q->q_l1_size << (q->q_cbits + q->q_l2bits))) {
+		EPRINTLN("qcow2: %s: L1 table too small", path);
+		goto fail;
+	}
+
+	q->q_l1 = calloc(MAX(q->q_l1_size, 1), sizeof(uint64_t));
+	q->q_rct_size = (uint64_t)rctc * q->q_csize / sizeof(uint64_t);
+	q->q_rct = calloc(MAX(q->q_rct_size, 1), sizeof(uint64_t));
+	if (q->q_l1 == NULL || q->q_rct == NULL)
+		goto fail;
+	if (qcow2_pread_full(fd, q->q_l1, q->q_l1_size * sizeof(uint64_t),
+	    q->q_l1_offset) ||
+	    qcow2_pread_full(fd, q->q_rct, q->q_rct_size * sizeof(uint64_t),
+	    q->q_rct_offset)) {
+		warn("Could not read qcow2 tables of %s", path);
+		goto fail;
+	}
+	for (i = 0; i < q->q_l1_size; i++)
+		q->q_l1[i] = be64dec(&q->q_l1[i]);
+	for (i = 0; i < q->q_rct_size; i++)
+		q->q_rct[i] = be64dec(&q->q_rct[i]);
+	q->q_free = roundup2((uint64_t)sbuf.st_size, q->q_csize);
+
+	q->q_nl2 = l2cache > 0 ? l2cache : QCOW2_L2CACHE_DEFAULT;
+	q->q_l2 = calloc(q->q_nl2, sizeof(struct qcow2_l2));
+	if (q->q_l2 == NULL)
+		goto fail;
+	for (i = 0; i < q->q_nl2; i++) {
+		q->q_l2[i].l2_tbl = malloc(q->q_csize);
+		if (q->q_l2[i].l2_tbl == NULL)
+			goto fail;
+	}
+
+	/* Header extensions: only the backing file format is of interest */
+	bfmt[0] = '\0';
+	for (off = hlen; off + sizeof(ext) <= q->q_csize; off += roundup2(elen, 8)) {
+		if (qcow2_pread_full(fd, ext, sizeof(ext), off))
+			goto fail;
+		etype = be32dec(ext);
+		elen = be32dec(ext + 4);
+		off += sizeof(ext);
+		if (etype == QCOW2_EXT_END)
+			break;
+		if (etype == QCOW2_EXT_BACKING_FMT && elen < sizeof(bfmt)) {
+			if (qcow2_pread_full(fd, bfmt, elen, off))
+				goto fail;
+			bfmt[elen] = '\0';
+		}
+	}
+
+	if (bfo != 0) {
+		if (bfs == 0 || bfs >= sizeof(bname) ||
+		    qcow2_pread_full(fd, bname, bfs, bfo)) {
+			EPRINTLN("qcow2: %s: bad backing file name", path);
+			goto fail;
+		}
+		bname[bfs] = '\0';
+		if (qcow2_open_backing(q, path, bname, bfmt, l2cache, depth))
+			goto fail;
+	}
+
+	/*
+	 * Autoclear features (e.g. persistent bitmaps) describe data we
+	 * do not maintain; writers that don't understand them must clear
+	 * them.
+	 */
+	if (!q->q_ro && autoclear != 0) {
+		be64enc(ext, 0);
+		if (qcow2_pwrite_full(fd, ext, 8, 88)) {
+			warn("Could not update qcow2 header of %s", path);
+			goto fail;
+		}
+	}
+
+	return (q);
+fail:
+	qcow2_close(q);
+	return (NULL);
+}
+
+struct qcow2 *
+qcow2_open(int fd, const char *path, int ro, int l2cache)
+{
+
+	return (qcow2_open_chain(fd, path, ro, l2cache, 0));
+}
+
+void
+qcow2_close(struct qcow2 *q)
+{
+	int i;
+
+	if (q->q_bq != NULL)
+		qcow2_close(q->q_bq);
+	if (q->q_bfd >= 0)
+		close(q->q_bfd);
+	if (q->q_ownfd)
+		close(q->q_fd);
+	if (q->q_l2 != NULL) {
+		for (i = 0; i < q->q_nl2; i++)
+			free(q->q_l2[i].l2_tbl);
+		free(q->q_l2);
+	}
+	free(q->q_l1);
+	free(q->q_rct);
+	pthread_mutex_destroy(&q->q_mtx);
+	free(q);
+}
@@ -0,0 +1,55 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright 2020 Leon Dang
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY NETAPP, INC ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL NETAPP, INC OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _QCOW2_H_
+#define	_QCOW2_H_
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+struct qcow2;
+
+/*
+ * qcow2 images accessed through the blockif layer. The i/o routines
+ * follow preadv(2)/pwritev(2): they return the number of bytes moved,
+ * or -1 with errno set.
+ */
+int	qcow2_probe(int fd);
+struct qcow2 *qcow2_open(int fd, const char *path, int ro, int l2cache);
+void	qcow2_close(struct qcow2 *q);
+off_t	qcow2_size(struct qcow2 *q);
+int	qcow2_is_ro(struct qcow2 *q);
+int	qcow2_candelete(struct qcow2 *q);
+ssize_t	qcow2_preadv(struct qcow2 *q, const struct iovec *iov, int iovcnt,
+    off_t off);
+ssize_t	qcow2_pwritev(struct qcow2 *q, const struct iovec *iov, int iovcnt,
+    off_t off);
+int	qcow2_flush(struct qcow2 *q);
+int	qcow2_discard(struct qcow2 *q, off_t off, off_t len);
+
+#endif	/* _QCOW2_H_ */
@@ -35,10 +35,12 @@ __FBSDID("$FreeBSD: head/usr.sbin/bhyve/rfb.c 359065 2020-03-18 03:17:15Z bcran
 #include <sys/capsicum.h>
 #endif
 #include <sys/endian.h>
+#include <sys/queue.h>
 #include <sys/socket.h>
 #include <sys/select.h>
 #include <sys/time.h>
 #include <arpa/inet.h>
+#include <machine/atomic.h>
 #include <machine/cpufunc.h>
 #include <machine/specialreg.h>
 #include <netinet/in.h>
@@ -62,6 +64,10 @@ __FBSDID("$FreeBSD: head/usr.sbin/bhyve/rfb.c 359065 2020-03-18 03:17:15Z bcran
 
 #include <zlib.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "bhyvegc.h"
 #include "debug.h"
 #include "console.h"
@@ -86,47 +92,189 @@ static int rfb_debug = 0;
 #define AUTH_FAILED_UNAUTH	1
 #define AUTH_FAILED_ERROR	2
 
-struct rfb_softc {
-	int		sfd;
-	pthread_t	tid;
+struct rfb_pixfmt {
+	uint8_t		bpp;
+	uint8_t		depth;
+	uint8_t		bigendian;
+	uint8_t		truecolor;
+	uint16_t	red_max;
+	uint16_t	green_max;
+	uint16_t	blue_max;
+	uint8_t		red_shift;
+	uint8_t		green_shift;
+	uint8_t		blue_shift;
+	uint8_t		pad[3];
+};
 
-	int		cfd;
+/*
+ * Conversion from the framebuffer's 0x00RRGGBB pixels to the format the
+ * client asked for. Converted pixels are kept in 32-bit lanes holding the
+ * wire bytes in memory order, so the first psize bytes of a lane are what
+ * goes out.
+ */
+struct rfb_pixconv {
+	bool		identity;	/* client takes framebuffer pixels as is */
+	bool		cmap;		/* client uses our 3-3-2 colour map */
+	bool		swap;		/* big-endian wire pixels */
+	int		psize;		/* bytes per pixel */
+	int		cpsize;		/* bytes per ZRLE CPIXEL */
+
+	/* Channels with 2^n - 1 maxima: shift right, mask, shift left */
+	bool		pow2;
+	int		srl[3];
+	uint32_t	mask[3];
+	int		sll[3];
+
+	/* Anything else goes through per-channel lookup tables */
+	uint32_t	tab[3][256];
+};
 
-	int		width, height;
+struct rfb_softc;
+struct rfb_enc;
+typedef void (*rfb_job_func_t)(struct rfb_enc *re, void *arg, int job);
 
-	char		*password;
+/*
+ * Workers that split hashing and tile encoding of a frame with the
+ * writer thread doing the encode, which takes jobs alongside them.
+ */
+struct rfb_pool {
+	int		nthreads;
+	pthread_t	*tids;
+	pthread_mutex_t	mtx;
+	pthread_cond_t	work_cond;
+	pthread_cond_t	done_cond;
+
+	/* Current batch */
+	uint64_t	batch;
+	rfb_job_func_t	func;
+	struct rfb_enc	*re;
+	void		*arg;
+	int		njobs;
+	u_int		next;		/* next job to hand out */
+	int		busy;		/* workers yet to finish the batch */
+};
+
+/* A region encoded independently into its own slice of encbuf */
+struct rfb_tile_job {
+	int		x, y, w, h;
+	uint8_t		*out;
+	int		len;
+};
+
+/*
+ * An encoded FramebufferUpdate message. Viewers take a reference and
+ * write it out without holding the encoder lock.
+ */
+struct rfb_update {
+	u_int		refs;		/* protected by enc_mtx */
+	int		width, height;	/* frame size it was encoded at */
+	ssize_t		zoff;		/* first zlib length field, or -1 */
+	int32_t		zenc;		/* encoding of the rect at zoff */
+	size_t		len;
+	size_t		size;
+	uint8_t		*data;
+};
+
+/*
+ * Encoder state shared by every viewer that asked for the same encoding
+ * and pixel format. Each frame generation is hashed and encoded once and
+ * the resulting update handed to all of them; protected by enc_mtx.
+ */
+struct rfb_enc {
+	LIST_ENTRY(rfb_enc) link;
+	struct rfb_softc *rc;
+	int		refs;		/* viewers using this encoder */
+
+	int32_t	req_enc;	/* encoding the viewers asked for */
+	int32_t	enc;		/* encoding used for framebuffer rectangles */
+	bool	copyrect;	/* scrolls may be sent as CopyRect */
+	struct rfb_pixfmt pixfmt;	/* as requested by the viewers */
+	struct rfb_pixconv pixconv;
+
+	/*
+	 * Raw deflate streams, reset before every update so that an update
+	 * never refers back to data a newly joined viewer hasn't seen.
+	 */
+	bool		enc_zlib_ok;
+	z_stream	zstream;
+	bool		enc_zrle_ok;
+	z_stream	zrle_stream;	/* ZRLE keeps its own zlib stream */
+	uint8_t		*zbuf;
+	uint8_t		*encbuf;	/* tile encoder output */
+	struct rfb_tile_job *jobs;	/* per-cell or per-band encode jobs */
+	uint32_t	*rowbuf;	/* one converted scanline */
+
+	uint64_t	gen;		/* frame generation last encoded */
+	uint32_t	*crc;		/* WxH crc cells */
+	uint32_t	*crc_tmp;	/* buffer to store single crc row */
+	int		crc_width, crc_height;
+
+	/* Per-scanline hashes of the last frame encoded, for scrolls */
+	uint32_t	*row_crc;
+	uint32_t	*row_crc_tmp;
+	bool		row_crc_valid;
+
+	struct rfb_update *out;		/* update being encoded */
+	struct rfb_update *delta;	/* changes from delta_base to gen */
+	uint64_t	delta_base;
+	struct rfb_update *key;		/* whole frame at gen, on demand */
+};
+
+/* One connected viewer */
+struct rfb_conn {
+	TAILQ_ENTRY(rfb_conn) link;
+	struct rfb_softc *rc;
+	int		cfd;
+	pthread_t	tid;
+
+	int		width, height;	/* frame size the client knows */
 
 	bool	enc_raw_ok;
 	bool	enc_zlib_ok;
+	bool	enc_hextile_ok;
+	bool	enc_zrle_ok;
 	bool	enc_resize_ok;
+	bool	enc_copyrect_ok;
+	int32_t	enc;		/* preferred encoding for rectangles */
 
-	z_stream	zstream;
-	uint8_t		*zbuf;
-	int		zbuflen;
+	/* The client's inflaters got the zlib header for this stream */
+	bool	zlib_hdr;
+	bool	zrle_hdr;
+
+	/* SetPixelFormat/SetEncodings, applied by the writer; rc->mtx */
+	struct rfb_pixfmt pixfmt;
+	bool		enc_changed;
+
+	/* Update requests from the client; protected by rc->mtx */
+	bool		update_pending;
+	bool		update_full;
+	pthread_cond_t	wr_cond;
+
+	struct rfb_enc	*re;		/* writer only */
+	uint64_t	seen;		/* encoder generation the client shows */
+	int64_t		frame_usec;	/* adaptive interval between updates */
+};
+
+struct rfb_softc {
+	int		sfd;
+	pthread_t	tid;
+
+	char		*password;
 
 	int		conn_wait;
-	int		sending;
 	pthread_mutex_t mtx;
 	pthread_cond_t  cond;
+	TAILQ_HEAD(, rfb_conn) conns;	/* protected by mtx */
+	int		nconns;
 
-	int		hw_crc;
-	uint32_t	*crc;		/* WxH crc cells */
-	uint32_t	*crc_tmp;	/* buffer to store single crc row */
-	int		crc_width, crc_height;
-};
+	/* Serialises encoders, the pool and console refreshes */
+	pthread_mutex_t	enc_mtx;
+	LIST_HEAD(, rfb_enc) encs;
+	struct timeval	refresh_tv;	/* last console refresh */
 
-struct rfb_pixfmt {
-	uint8_t		bpp;
-	uint8_t		depth;
-	uint8_t		bigendian;
-	uint8_t		truecolor;
-	uint16_t	red_max;
-	uint16_t	green_max;
-	uint16_t	blue_max;
-	uint8_t		red_shift;
-	uint8_t		green_shift;
-	uint8_t		blue_shift;
-	uint8_t		pad[3];
+	struct rfb_pool	pool;		/* tile hashing/encoding workers */
+
+	int		hw_crc;
 };
 
 struct rfb_srvr_info {
@@ -143,16 +291,56 @@ struct rfb_pixfmt_msg {
 };
 
 #define	RFB_ENCODING_RAW		0
+#define	RFB_ENCODING_COPYRECT		1
+#define	RFB_ENCODING_HEXTILE		5
 #define	RFB_ENCODING_ZLIB		6
+#define	RFB_ENCODING_ZRLE		16
 #define	RFB_ENCODING_RESIZE		-223
 
 #define	RFB_MAX_WIDTH			2000
 #define	RFB_MAX_HEIGHT			1200
 #define	RFB_ZLIB_BUFSZ			RFB_MAX_WIDTH*RFB_MAX_HEIGHT*4
 
+/* Tile encoders may expand a worst-case screen by a few bytes per tile */
+#define	RFB_TILE_OVERHEAD		8
+#define	RFB_ENCBUF_SLACK		(256 * 1024)
+#define	RFB_ENCBUF_SZ			(RFB_ZLIB_BUFSZ + RFB_ENCBUF_SLACK)
+
+/* Hextile subencoding mask */
+#define	HEXTILE_RAW			0x01
+#define	HEXTILE_BG_SPECIFIED		0x02
+#define	HEXTILE_FG_SPECIFIED		0x04
+#define	HEXTILE_ANY_SUBRECTS		0x08
+#define	HEXTILE_SUBRECTS_COLOURED	0x10
+#define	HEXTILE_TILE			16
+
+/* ZRLE tile subencodings */
+#define	ZRLE_RAW			0
+#define	ZRLE_SOLID			1
+#define	ZRLE_PLAIN_RLE			128
+#define	ZRLE_TILE			64
+#define	ZRLE_MAX_PALETTE		127
+
+/* candidate offsets tried, and rows that must move, to send a scroll */
+#define	RFB_SCROLL_PROBES		8
+#define	RFB_SCROLL_MIN_ROWS		8
+
 /* percentage changes to screen before sending the entire screen */
 #define	RFB_SEND_ALL_THRESH		25
 
+/* Concurrent viewers */
+#define	RFB_MAX_CONNS			8
+
+/* Initial allocation for an encoded update */
+#define	RFB_UPDATE_MINSZ		(64 * 1024)
+
+/* Upper bound on encode workers, including the writer thread */
+#define	RFB_MAX_WORKERS			8
+
+/* Bounds for the adaptive interval between framebuffer updates */
+#define	RFB_FRAME_USEC_MIN		40000	/* ~24hz */
+#define	RFB_FRAME_USEC_MAX		1000000
+
 struct rfb_enc_msg {
 	uint8_t		type;
 	uint8_t		pad;
@@ -203,88 +391,141 @@ struct rfb_cuttext_msg {
 };
 
 
+/* Native framebuffer format, advertised in ServerInit */
+static void
+rfb_native_pixfmt(struct rfb_pixfmt *pf)
+{
+
+	memset(pf, 0, sizeof(*pf));
+	pf->bpp = 32;
+	pf->depth = 32;
+	pf->bigendian = 0;
+	pf->truecolor = 1;
+	pf->red_max = htons(255);
+	pf->green_max = htons(255);
+	pf->blue_max = htons(255);
+	pf->red_shift = 16;
+	pf->green_shift = 8;
+	pf->blue_shift = 0;
+}
+
 static void
-rfb_send_server_init_msg(int cfd)
+rfb_send_server_init_msg(struct rfb_conn *cn)
 {
 	struct bhyvegc_image *gc_image;
 	struct rfb_srvr_info sinfo;
 
 	gc_image = console_get_image();
+	cn->width = gc_image->width;
+	cn->height = gc_image->height;
 
 	sinfo.width = htons(gc_image->width);
 	sinfo.height = htons(gc_image->height);
-	sinfo.pixfmt.bpp = 32;
-	sinfo.pixfmt.depth = 32;
-	sinfo.pixfmt.bigendian = 0;
-	sinfo.pixfmt.truecolor = 1;
-	sinfo.pixfmt.red_max = htons(255);
-	sinfo.pixfmt.green_max = htons(255);
-	sinfo.pixfmt.blue_max = htons(255);
-	sinfo.pixfmt.red_shift = 16;
-	sinfo.pixfmt.green_shift = 8;
-	sinfo.pixfmt.blue_shift = 0;
+	rfb_native_pixfmt(&sinfo.pixfmt);
 	sinfo.namelen = htonl(strlen("bhyve"));
-	(void)stream_write(cfd, &sinfo, sizeof(sinfo));
-	(void)stream_write(cfd, "bhyve", strlen("bhyve"));
+	(void)stream_write(cn->cfd, &sinfo, sizeof(sinfo));
+	(void)stream_write(cn->cfd, "bhyve", strlen("bhyve"));
 }
 
-static void
-rfb_send_resize_update_msg(struct rfb_softc *rc, int cfd)
+static int
+rfb_send_resize_update_msg(struct rfb_conn *cn)
 {
-	struct rfb_srvr_updt_msg supdt_msg;
-	struct rfb_srvr_rect_hdr srect_hdr;
+	struct {
+		struct rfb_srvr_updt_msg supdt_msg;
+		struct rfb_srvr_rect_hdr srect_hdr;
+	} __packed msg;
 
 	/* Number of rectangles: 1 */
-	supdt_msg.type = 0;
-	supdt_msg.pad = 0;
-	supdt_msg.numrects = htons(1);
-	stream_write(cfd, &supdt_msg, sizeof(struct rfb_srvr_updt_msg));
+	msg.supdt_msg.type = 0;
+	msg.supdt_msg.pad = 0;
+	msg.supdt_msg.numrects = htons(1);
 
 	/* Rectangle header */
-	srect_hdr.x = htons(0);
-	srect_hdr.y = htons(0);
-	srect_hdr.width = htons(rc->width);
-	srect_hdr.height = htons(rc->height);
-	srect_hdr.encoding = htonl(RFB_ENCODING_RESIZE);
-	stream_write(cfd, &srect_hdr, sizeof(struct rfb_srvr_rect_hdr));
+	msg.srect_hdr.x = htons(0);
+	msg.srect_hdr.y = htons(0);
+	msg.srect_hdr.width = htons(cn->width);
+	msg.srect_hdr.height = htons(cn->height);
+	msg.srect_hdr.encoding = htonl(RFB_ENCODING_RESIZE);
+	return (stream_write(cn->cfd, &msg, sizeof(msg)));
 }
 
 static void
-rfb_recv_set_pixfmt_msg(struct rfb_softc *rc, int cfd)
+rfb_recv_set_pixfmt_msg(struct rfb_conn *cn)
 {
 	struct rfb_pixfmt_msg pixfmt_msg;
+	struct rfb_softc *rc;
+
+	rc = cn->rc;
+	(void)stream_read(cn->cfd, ((void *)&pixfmt_msg)+1,
+	    sizeof(pixfmt_msg)-1);
 
-	(void)stream_read(cfd, ((void *)&pixfmt_msg)+1, sizeof(pixfmt_msg)-1);
+	/* The writer thread switches formats between updates */
+	pthread_mutex_lock(&rc->mtx);
+	cn->pixfmt = pixfmt_msg.pixfmt;
+	cn->enc_changed = true;
+	pthread_mutex_unlock(&rc->mtx);
 }
 
 
 static void
-rfb_recv_set_encodings_msg(struct rfb_softc *rc, int cfd)
+rfb_recv_set_encodings_msg(struct rfb_conn *cn)
 {
 	struct rfb_enc_msg enc_msg;
+	struct rfb_softc *rc;
 	int i;
 	uint32_t encoding;
+	int32_t enc;
+	bool chosen, copyrect, resize;
 
+	rc = cn->rc;
 	assert((sizeof(enc_msg) - 1) == 3);
-	(void)stream_read(cfd, ((void *)&enc_msg)+1, sizeof(enc_msg)-1);
+	(void)stream_read(cn->cfd, ((void *)&enc_msg)+1, sizeof(enc_msg)-1);
 
+	/*
+	 * The list is in the client's order of preference; rectangles are
+	 * sent with the first one that we implement.
+	 */
+	enc = RFB_ENCODING_RAW;
+	copyrect = false;
+	resize = false;
+	chosen = false;
 	for (i = 0; i < htons(enc_msg.numencs); i++) {
-		(void)stream_read(cfd, &encoding, sizeof(encoding));
+		(void)stream_read(cn->cfd, &encoding, sizeof(encoding));
 		switch (htonl(encoding)) {
 		case RFB_ENCODING_RAW:
-			rc->enc_raw_ok = true;
+			cn->enc_raw_ok = true;
 			break;
 		case RFB_ENCODING_ZLIB:
-			if (!rc->enc_zlib_ok) {
-				deflateInit(&rc->zstream, Z_BEST_SPEED);
-				rc->enc_zlib_ok = true;
-			}
+			cn->enc_zlib_ok = true;
 			break;
-		case RFB_ENCODING_RESIZE:
-			rc->enc_resize_ok = true;
+		case RFB_ENCODING_HEXTILE:
+			cn->enc_hextile_ok = true;
 			break;
+		case RFB_ENCODING_ZRLE:
+			cn->enc_zrle_ok = true;
+			break;
+		case RFB_ENCODING_RESIZE:
+			resize = true;
+			continue;
+		case RFB_ENCODING_COPYRECT:
+			copyrect = true;
+			continue;
+		default:
+			continue;
+		}
+		if (!chosen) {
+			enc = htonl(encoding);
+			chosen = true;
 		}
 	}
+
+	/* The writer moves the viewer to a matching encoder */
+	pthread_mutex_lock(&rc->mtx);
+	cn->enc = enc;
+	cn->enc_copyrect_ok = copyrect;
+	cn->enc_resize_ok = resize;
+	cn->enc_changed = true;
+	pthread_mutex_unlock(&rc->mtx);
 }
 
 /*
@@ -309,31 +550,873 @@ fast_crc32(void *buf, int len, uint32_t crcval)
 }
 
 
+/* Framebuffer pixels are 0x00RRGGBB */
+static const int rfb_src_shift[3] = { 16, 8, 0 };
+
+/* Colour-map clients get a fixed 3-3-2 palette */
+#define	RFB_CMAP_COLOURS		256
+
+static __inline int
+rfb_mask_bits(uint16_t max)
+{
+	int bits;
+
+	for (bits = 0; max & 1; max >>= 1)
+		bits++;
+	return (max == 0 ? bits : -1);
+}
+
+/*
+ * Build the conversion for a client pixel format. Returns -1 if the
+ * format can't be honoured.
+ */
 static int
-rfb_send_rect(struct rfb_softc *rc, int cfd, struct bhyvegc_image *gc,
-              int x, int y, int w, int h)
+rfb_set_pixconv(struct rfb_pixconv *pc, const struct rfb_pixfmt *pf)
 {
-	struct rfb_srvr_updt_msg supdt_msg;
-	struct rfb_srvr_rect_hdr srect_hdr;
-	unsigned long zlen;
-	ssize_t nwrite, total;
-	int err;
-	uint32_t *p;
-	uint8_t *zbufp;
+	uint16_t max[3];
+	uint8_t shift[3];
+	uint32_t mask;
+	int bits, c, v;
+
+	if (pf->bpp != 8 && pf->bpp != 16 && pf->bpp != 32)
+		return (-1);
+
+	memset(pc, 0, sizeof(*pc));
+	pc->psize = pf->bpp / 8;
+	pc->swap = pf->bigendian && pc->psize > 1;
+
+	if (pf->truecolor) {
+		max[0] = ntohs(pf->red_max);
+		max[1] = ntohs(pf->green_max);
+		max[2] = ntohs(pf->blue_max);
+		shift[0] = pf->red_shift;
+		shift[1] = pf->green_shift;
+		shift[2] = pf->blue_shift;
+	} else {
+		if (pf->bpp != 8)
+			return (-1);
+		pc->cmap = true;
+		max[0] = 7;
+		max[1] = 7;
+		max[2] = 3;
+		shift[0] = 5;
+		shift[1] = 2;
+		shift[2] = 0;
+	}
+
+	mask = 0;
+	pc->pow2 = true;
+	for (c = 0; c < 3; c++) {
+		if (max[c] == 0 || max[c] > 255 || shift[c] >= pf->bpp)
+			return (-1);
+		mask |= (uint32_t)max[c] << shift[c];
+
+		bits = rfb_mask_bits(max[c]);
+		if (bits < 0)
+			pc->pow2 = false;
+		else {
+			pc->srl[c] = rfb_src_shift[c] + 8 - bits;
+			pc->mask[c] = max[c];
+			pc->sll[c] = shift[c];
+		}
+		/* Match the SIMD path, which truncates power-of-2 channels */
+		for (v = 0; v < 256; v++)
+			pc->tab[c][v] = (bits >= 0 ? v >> (8 - bits) :
+			    (v * max[c] + 127) / 255) << shift[c];
+	}
+
+	pc->identity = !pc->swap && pc->psize == 4 && !pc->cmap &&
+	    max[0] == 255 && max[1] == 255 && max[2] == 255 &&
+	    shift[0] == 16 && shift[1] == 8 && shift[2] == 0;
 
 	/*
-	 * Send a single rectangle of the given x, y, w h dimensions.
+	 * ZRLE packs 32bpp pixels into 3 bytes when the depth allows and
+	 * the colour bits sit in the 3 bytes that are sent first.
 	 */
+	pc->cpsize = pc->psize;
+	if (pc->psize == 4 && pf->depth <= 24 &&
+	    ((!pc->swap && (mask & 0xff000000) == 0) ||
+	     (pc->swap && (mask & 0x000000ff) == 0)))
+		pc->cpsize = 3;
+
+	return (0);
+}
+
+static __inline uint32_t
+rfb_cvt_pixel(const struct rfb_pixconv *pc, uint32_t p)
+{
+	uint32_t v;
+
+	v = pc->tab[0][(p >> 16) & 0xff] | pc->tab[1][(p >> 8) & 0xff] |
+	    pc->tab[2][p & 0xff];
+
+	if (pc->swap)
+		v = pc->psize == 2 ? bswap16(v) : bswap32(v);
+	return (v);
+}
+
+/*
+ * Convert n framebuffer pixels into wire-format lanes. src and dst may be
+ * the same buffer.
+ */
+static void
+rfb_cvt_pixels(const struct rfb_pixconv *pc, uint32_t *dst,
+               const uint32_t *src, int n)
+{
+	int i;
+
+	i = 0;
+#ifdef __SSE2__
+	if (pc->pow2 && (!pc->swap || pc->psize == 2)) {
+		__m128i srl0, srl1, srl2, sll0, sll1, sll2;
+		__m128i m0, m1, m2, m8, v, o;
+
+		srl0 = _mm_cvtsi32_si128(pc->srl[0]);
+		srl1 = _mm_cvtsi32_si128(pc->srl[1]);
+		srl2 = _mm_cvtsi32_si128(pc->srl[2]);
+		sll0 = _mm_cvtsi32_si128(pc->sll[0]);
+		sll1 = _mm_cvtsi32_si128(pc->sll[1]);
+		sll2 = _mm_cvtsi32_si128(pc->sll[2]);
+		m0 = _mm_set1_epi32(pc->mask[0]);
+		m1 = _mm_set1_epi32(pc->mask[1]);
+		m2 = _mm_set1_epi32(pc->mask[2]);
+		m8 = _mm_set1_epi32(0xff);
+
+		for (; i + 4 <= n; i += 4) {
+			v = _mm_loadu_si128((const __m128i *)&src[i]);
+			o = _mm_sll_epi32(_mm_and_si128(
+			    _mm_srl_epi32(v, srl0), m0), sll0);
+			o = _mm_or_si128(o, _mm_sll_epi32(_mm_and_si128(
+			    _mm_srl_epi32(v, srl1), m1), sll1));
+			o = _mm_or_si128(o, _mm_sll_epi32(_mm_and_si128(
+			    _mm_srl_epi32(v, srl2), m2), sll2));
+			if (pc->swap) {
+				/* 16bpp big-endian: swap the two low bytes */
+				o = _mm_or_si128(
+				    _mm_and_si128(_mm_srli_epi32(o, 8), m8),
+				    _mm_slli_epi32(_mm_and_si128(o, m8), 8));
+			}
+			_mm_storeu_si128((__m128i *)&dst[i], o);
+		}
+	}
+#endif
+	for (; i < n; i++)
+		dst[i] = rfb_cvt_pixel(pc, src[i]);
+}
+
+/*
+ * Pack n converted lanes into psize-byte wire pixels. Returns the end of
+ * the packed output.
+ */
+static uint8_t *
+rfb_pack_pixels(uint8_t *dst, const uint32_t *src, int n, int psize)
+{
+	int i;
+
+	i = 0;
+	switch (psize) {
+	case 4:
+		memcpy(dst, src, n * sizeof(uint32_t));
+		return (dst + n * sizeof(uint32_t));
+	case 2:
+#ifdef __SSE2__
+		{
+			__m128i bias32, bias16, a, b;
+
+			/* Bias into int16 range so packs doesn't saturate */
+			bias32 = _mm_set1_epi32(0x8000);
+			bias16 = _mm_set1_epi16((short)0x8000);
+			for (; i + 8 <= n; i += 8) {
+				a = _mm_sub_epi32(_mm_loadu_si128(
+				    (const __m128i *)&src[i]), bias32);
+				b = _mm_sub_epi32(_mm_loadu_si128(
+				    (const __m128i *)&src[i + 4]), bias32);
+				_mm_storeu_si128((__m128i *)&dst[i * 2],
+				    _mm_add_epi16(_mm_packs_epi32(a, b),
+				    bias16));
+			}
+		}
+#endif
+		for (; i < n; i++)
+			memcpy(&dst[i * 2], &src[i], 2);
+		break;
+	case 1:
+#ifdef __SSE2__
+		{
+			__m128i a, b;
+
+			for (; i + 16 <= n; i += 16) {
+				a = _mm_packs_epi32(
+				    _mm_loadu_si128((const __m128i *)&src[i]),
+				    _mm_loadu_si128(
+				    (const __m128i *)&src[i + 4]));
+				b = _mm_packs_epi32(
+				    _mm_loadu_si128(
+				    (const __m128i *)&src[i + 8]),
+				    _mm_loadu_si128(
+				    (const __m128i *)&src[i + 12]));
+				_mm_storeu_si128((__m128i *)&dst[i],
+				    _mm_packus_epi16(a, b));
+			}
+		}
+#endif
+		for (; i < n; i++)
+			dst[i] = src[i];
+		break;
+	default:
+		for (; i < n; i++)
+			memcpy(&dst[i * psize], &src[i], psize);
+		break;
+	}
+
+	return (dst + n * psize);
+}
+
+/*
+ * Convert and pack a run of n framebuffer pixels for the wire. Returns the
+ * number of bytes written.
+ */
+static int
+rfb_cvt_row(struct rfb_enc *re, uint8_t *dst, const uint32_t *src, int n)
+{
+	uint32_t lanes[64];
+	uint8_t *o;
+	int i, chunk;
+
+	if (re->pixconv.identity) {
+		memcpy(dst, src, n * sizeof(uint32_t));
+		return (n * sizeof(uint32_t));
+	}
+
+	o = dst;
+	for (i = 0; i < n; i += chunk) {
+		chunk = MIN(n - i, (int)nitems(lanes));
+		rfb_cvt_pixels(&re->pixconv, lanes, &src[i], chunk);
+		o = rfb_pack_pixels(o, lanes, chunk, re->pixconv.psize);
+	}
+	return (o - dst);
+}
+
+static int
+rfb_send_cmap(struct rfb_conn *cn)
+{
+	uint8_t buf[6 + RFB_CMAP_COLOURS * 6];
+	uint8_t *o;
+	int i;
+
+	/* SetColourMapEntries: first colour 0, 256 colours */
+	buf[0] = 1;
+	buf[1] = 0;
+	be16enc(&buf[2], 0);
+	be16enc(&buf[4], RFB_CMAP_COLOURS);
+	o = &buf[6];
+	for (i = 0; i < RFB_CMAP_COLOURS; i++) {
+		be16enc(o, ((i >> 5) & 7) * 65535 / 7);
+		be16enc(o + 2, ((i >> 2) & 7) * 65535 / 7);
+		be16enc(o + 4, (i & 3) * 65535 / 3);
+		o += 6;
+	}
+
+	return (stream_write(cn->cfd, buf, sizeof(buf)));
+}
+
+/*
+ * Copy a w x h tile out of the framebuffer into a contiguous array.
+ */
+static __inline void
+rfb_get_tile(uint32_t *dst, struct bhyvegc_image *gc, int x, int y,
+             int w, int h)
+{
+	uint32_t *p;
+
+	for (p = &gc->data[y * gc->width + x]; h > 0; h--) {
+		memcpy(dst, p, w * sizeof(uint32_t));
+		dst += w;
+		p += gc->width;
+	}
+}
+
+/*
+ * Hextile: encode one tile of at most 16x16 pixels into out. Every tile
+ * carries its own background so that tiles can be encoded independently.
+ * Pixels have been converted to the client's format and are psize bytes
+ * on the wire. Returns the number of bytes written.
+ */
+static int
+rfb_hextile_tile(uint8_t *out, const uint32_t *pix, int w, int h, int psize)
+{
+	uint8_t covered[HEXTILE_TILE * HEXTILE_TILE];
+	uint32_t colors[3];
+	int counts[3];
+	uint32_t bg, fg, c;
+	uint8_t *o, *nsubp;
+	int ncolors, nsubs, rawlen;
+	int i, j, x, y, x2, y2;
+	bool match;
+
+	/* Count up to three distinct colours; more means coloured subrects */
+	ncolors = 0;
+	for (i = 0; i < w * h; i++) {
+		for (j = 0; j < ncolors; j++) {
+			if (colors[j] == pix[i])
+				break;
+		}
+		if (j < ncolors) {
+			counts[j]++;
+			continue;
+		}
+		if (ncolors == 3) {
+			ncolors++;
+			break;
+		}
+		colors[ncolors] = pix[i];
+		counts[ncolors++] = 1;
+	}
+
+	o = out;
+	if (ncolors == 1) {
+		*o++ = HEXTILE_BG_SPECIFIED;
+		memcpy(o, &colors[0], psize);
+		return (1 + psize);
+	}
+
+	/* Background is the most common colour seen */
+	bg = colors[0];
+	fg = colors[1];
+	if (ncolors == 2 && counts[1] > counts[0]) {
+		bg = colors[1];
+		fg = colors[0];
+	} else if (ncolors >= 3) {
+		j = counts[0] >= counts[1] ? 0 : 1;
+		j = counts[j] >= counts[2] ? j : 2;
+		bg = colors[j];
+	}
+
+	rawlen = w * h * psize;
+	if (ncolors == 2) {
+		*o++ = HEXTILE_BG_SPECIFIED | HEXTILE_FG_SPECIFIED |
+		       HEXTILE_ANY_SUBRECTS;
+		memcpy(o, &bg, psize);
+		o += psize;
+		memcpy(o, &fg, psize);
+		o += psize;
+	} else {
+		*o++ = HEXTILE_BG_SPECIFIED | HEXTILE_ANY_SUBRECTS |
+		       HEXTILE_SUBRECTS_COLOURED;
+		memcpy(o, &bg, psize);
+		o += psize;
+	}
+	nsubp = o++;
+	nsubs = 0;
+
+	/* Greedily grow same-coloured rectangles right, then down */
+	memset(covered, 0, sizeof(covered));
+	for (y = 0; y < h; y++) {
+		for (x = 0; x < w; x++) {
+			c = pix[y * w + x];
+			if (c == bg || covered[y * w + x])
+				continue;
+
+			for (x2 = x + 1; x2 < w; x2++) {
+				if (pix[y * w + x2] != c || covered[y * w + x2])
+					break;
+			}
+			for (y2 = y + 1; y2 < h; y2++) {
+				match = true;
+				for (i = x; i < x2; i++) {
+					if (pix[y2 * w + i] != c ||
+					    covered[y2 * w + i]) {
+						match = false;
+						break;
+					}
+				}
+				if (!match)
+					break;
+			}
+			for (j = y; j < y2; j++)
+				memset(&covered[j * w + x], 1, x2 - x);
+
+			if (ncolors > 2) {
+				memcpy(o, &c, psize);
+				o += psize;
+			}
+			*o++ = (x << 4) | y;
+			*o++ = ((x2 - x - 1) << 4) | (y2 - y - 1);
+			nsubs++;
+
+			/* Subrects are no longer a win; send the tile raw */
+			if (o - out >= rawlen)
+				goto raw;
+		}
+	}
+	*nsubp = nsubs;
+	return (o - out);
+
+raw:
+	out[0] = HEXTILE_RAW;
+	rfb_pack_pixels(out + 1, pix, w * h, psize);
+	return (1 + rawlen);
+}
+
+/* Bytes used by ZRLE to encode a run length */
+static __inline int
+zrle_runlen_bytes(int len)
+{
+	return ((len - 1) / 255 + 1);
+}
+
+static __inline uint8_t *
+zrle_put_runlen(uint8_t *o, int len)
+{
+	len--;
+	while (len >= 255) {
+		*o++ = 255;
+		len -= 255;
+	}
+	*o++ = len;
+	return (o);
+}
+
+/*
+ * ZRLE: encode one tile of at most 64x64 pixels into out, picking whichever
+ * of raw, solid, packed palette, plain RLE or palette RLE is smallest.
+ * Pixels are written as cpsize byte CPIXELs.
+ * Returns the number of bytes written before compression.
+ */
+static int
+rfb_zrle_tile(uint8_t *out, const uint32_t *pix, int w, int h, int cpsize)
+{
+	uint32_t palette[ZRLE_MAX_PALETTE];
+	uint8_t idx[ZRLE_TILE * ZRLE_TILE];
+	int npal, n, i, j, run, bits, rowbytes;
+	int raw_cost, plain_cost, prle_cost, packed_cost;
+	uint8_t *o, byte;
+	int shift;
+
+	n = w * h;
+
+	/* Build the palette and cost both RLE flavours in one pass */
+	npal = 0;
+	plain_cost = 0;
+	prle_cost = 0;
+	for (i = 0; i < n; i += run) {
+		for (run = 1; i + run < n && pix[i + run] == pix[i]; run++)
+			;
+
+		plain_cost += cpsize + zrle_runlen_bytes(run);
+		prle_cost += run == 1 ? 1 : 1 + zrle_runlen_bytes(run);
+
+		if (npal > ZRLE_MAX_PALETTE)
+			continue;
+		for (j = 0; j < npal; j++) {
+			if (palette[j] == pix[i])
+				break;
+		}
+		if (j == npal) {
+			if (npal == ZRLE_MAX_PALETTE) {
+				npal++;
+				continue;
+			}
+			palette[npal++] = pix[i];
+		}
+		memset(&idx[i], j, run);
+	}
+
+	o = out;
+	if (npal == 1) {
+		*o++ = ZRLE_SOLID;
+		memcpy(o, &palette[0], cpsize);
+		return (1 + cpsize);
+	}
+
+	raw_cost = n * cpsize;
+	packed_cost = INT32_MAX;
+	bits = 0;
+	if (npal <= ZRLE_MAX_PALETTE) {
+		prle_cost += npal * cpsize;
+		if (npal <= 16) {
+			bits = npal <= 2 ? 1 : (npal <= 4 ? 2 : 4);
+			rowbytes = (w * bits + 7) / 8;
+			packed_cost = npal * cpsize + rowbytes * h;
+		}
+	} else
+		prle_cost = INT32_MAX;
+
+	if (packed_cost <= prle_cost && packed_cost <= plain_cost &&
+	    packed_cost < raw_cost) {
+		*o++ = npal;
+		o = rfb_pack_pixels(o, palette, npal, cpsize);
+		for (j = 0; j < h; j++) {
+			byte = 0;
+			shift = 8;
+			for (i = 0; i < w; i++) {
+				shift -= bits;
+				byte |= idx[j * w + i] << shift;
+				if (shift == 0) {
+					*o++ = byte;
+					byte = 0;
+					shift = 8;
+				}
+			}
+			if (shift != 8)
+				*o++ = byte;
+		}
+	} else if (prle_cost <= plain_cost && prle_cost < raw_cost) {
+		*o++ = ZRLE_PLAIN_RLE | npal;
+		o = rfb_pack_pixels(o, palette, npal, cpsize);
+		for (i = 0; i < n; i += run) {
+			for (run = 1; i + run < n && pix[i + run] == pix[i];
+			     run++)
+				;
+			if (run == 1)
+				*o++ = idx[i];
+			else {
+				*o++ = idx[i] | 0x80;
+				o = zrle_put_runlen(o, run);
+			}
+		}
+	} else if (plain_cost < raw_cost) {
+		*o++ = ZRLE_PLAIN_RLE;
+		for (i = 0; i < n; i += run) {
+			for (run = 1; i + run < n && pix[i + run] == pix[i];
+			     run++)
+				;
+			memcpy(o, &pix[i], cpsize);
+			o += cpsize;
+			o = zrle_put_runlen(o, run);
+		}
+	} else {
+		*o++ = ZRLE_RAW;
+		o = rfb_pack_pixels(o, pix, n, cpsize);
+	}
+
+	return (o - out);
+}
+
+static void *
+rfb_pool_thr(void *arg)
+{
+	struct rfb_pool *pool;
+	uint64_t batch;
+	u_int job;
+
+	pool = arg;
+	batch = 0;
+
+	pthread_mutex_lock(&pool->mtx);
+	for (;;) {
+		while (pool->batch == batch)
+			pthread_cond_wait(&pool->work_cond, &pool->mtx);
+		batch = pool->batch;
+		pthread_mutex_unlock(&pool->mtx);
+
+		while ((job = atomic_fetchadd_int(&pool->next, 1)) <
+		    pool->njobs)
+			(*pool->func)(pool->re, pool->arg, job);
+
+		pthread_mutex_lock(&pool->mtx);
+		if (--pool->busy == 0)
+			pthread_cond_signal(&pool->done_cond);
+	}
+
+	/* NOTREACHED */
+	return (NULL);
+}
+
+/*
+ * Run func over jobs [0, njobs) on the pool and the calling thread, and
+ * return once every job has completed. Callers hold enc_mtx.
+ */
+static void
+rfb_pool_run(struct rfb_enc *re, rfb_job_func_t func, void *arg, int njobs)
+{
+	struct rfb_pool *pool;
+	u_int job;
+
+	pool = &re->rc->pool;
+	if (pool->nthreads == 0 || njobs <= 1) {
+		for (job = 0; job < njobs; job++)
+			(*func)(re, arg, job);
+		return;
+	}
+
+	pthread_mutex_lock(&pool->mtx);
+	pool->func = func;
+	pool->re = re;
+	pool->arg = arg;
+	pool->njobs = njobs;
+	pool->next = 0;
+	pool->busy = pool->nthreads;
+	pool->batch++;
+	pthread_cond_broadcast(&pool->work_cond);
+	pthread_mutex_unlock(&pool->mtx);
+
+	while ((job = atomic_fetchadd_int(&pool->next, 1)) < njobs)
+		(*func)(re, arg, job);
+
+	pthread_mutex_lock(&pool->mtx);
+	while (pool->busy > 0)
+		pthread_cond_wait(&pool->done_cond, &pool->mtx);
+	pthread_mutex_unlock(&pool->mtx);
+}
+
+static void
+rfb_pool_init(struct rfb_softc *rc)
+{
+	struct rfb_pool *pool;
+	char tname[MAXCOMLEN + 1];
+	long ncpus;
+	int i;
+
+	pool = &rc->pool;
+	pthread_mutex_init(&pool->mtx, NULL);
+	pthread_cond_init(&pool->work_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+
+	/* The encoding writer thread takes jobs too */
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	pool->nthreads = MIN(ncpus, RFB_MAX_WORKERS) - 1;
+	if (pool->nthreads <= 0) {
+		pool->nthreads = 0;
+		return;
+	}
+
+	pool->tids = calloc(pool->nthreads, sizeof(pthread_t));
+	for (i = 0; i < pool->nthreads; i++) {
+		if (pthread_create(&pool->tids[i], NULL, rfb_pool_thr,
+		    pool) != 0)
+			break;
+		snprintf(tname, sizeof(tname), "rfbenc-%d", i);
+		pthread_set_name_np(pool->tids[i], tname);
+	}
+	pool->nthreads = i;
+}
+
+static int
+rfb_tile_size(int enc)
+{
+	return (enc == RFB_ENCODING_ZRLE ? ZRLE_TILE : HEXTILE_TILE);
+}
+
+/*
+ * Worst-case output of the tiled encoders for a w x h region.
+ */
+static int
+rfb_tile_bound(int enc, int w, int h)
+{
+	int t;
+
+	t = rfb_tile_size(enc);
+	return (w * h * sizeof(uint32_t) +
+	    howmany(w, t) * howmany(h, t) * RFB_TILE_OVERHEAD);
+}
+
+/*
+ * Encode a region with the encoder's tiled encoding (Hextile or the
+ * uncompressed ZRLE tile stream). Tiles are stateless, so any tile-aligned
+ * split of a rectangle can be encoded concurrently and concatenated.
+ */
+static void
+rfb_encode_job(struct rfb_enc *re, void *arg, int i)
+{
+	uint32_t tile[ZRLE_TILE * ZRLE_TILE];
+	struct bhyvegc_image *gc;
+	struct rfb_tile_job *job;
+	uint8_t *o;
+	int tx, ty, tw, th, t;
+
+	gc = console_get_image();
+	job = &((struct rfb_tile_job *)arg)[i];
+	t = rfb_tile_size(re->enc);
+
+	o = job->out;
+	for (ty = job->y; ty < job->y + job->h; ty += t) {
+		th = MIN(t, job->y + job->h - ty);
+		for (tx = job->x; tx < job->x + job->w; tx += t) {
+			tw = MIN(t, job->x + job->w - tx);
+			rfb_get_tile(tile, gc, tx, ty, tw, th);
+			if (!re->pixconv.identity)
+				rfb_cvt_pixels(&re->pixconv, tile, tile,
+				               tw * th);
+			if (re->enc == RFB_ENCODING_ZRLE)
+				o += rfb_zrle_tile(o, tile, tw, th,
+				                   re->pixconv.cpsize);
+			else
+				o += rfb_hextile_tile(o, tile, tw, th,
+				                      re->pixconv.psize);
+		}
+	}
+	job->len = o - job->out;
+}
+
+/*
+ * Lay out jobs for a rectangle split into bands of whole tile rows.
+ * Returns the number of jobs.
+ */
+static int
+rfb_split_bands(struct rfb_enc *re, struct rfb_tile_job *jobs,
+                int x, int y, int w, int h)
+{
+	uint8_t *out;
+	int band, n;
+
+	/* A band per worker, rounded to whole tiles */
+	band = roundup(howmany(h, re->rc->pool.nthreads + 1),
+	    rfb_tile_size(re->enc));
+
+	out = re->encbuf;
+	for (n = 0; h > 0; n++) {
+		jobs[n].x = x;
+		jobs[n].y = y;
+		jobs[n].w = w;
+		jobs[n].h = MIN(band, h);
+		jobs[n].out = out;
+		out += rfb_tile_bound(re->enc, w, jobs[n].h);
+		y += jobs[n].h;
+		h -= jobs[n].h;
+	}
+	return (n);
+}
+
+static struct rfb_update *
+rfb_update_alloc(struct bhyvegc_image *gc)
+{
+	struct rfb_update *u;
+
+	u = calloc(1, sizeof(struct rfb_update));
+	assert(u != NULL);
+	u->refs = 1;
+	u->width = gc->width;
+	u->height = gc->height;
+	u->zoff = -1;
+	return (u);
+}
+
+/* Drop a reference to an update; called with enc_mtx held */
+static void
+rfb_update_rele(struct rfb_update *u)
+{
+
+	if (u == NULL || --u->refs > 0)
+		return;
+	free(u->data);
+	free(u);
+}
+
+/*
+ * Make room for n more bytes in the update being encoded and return where
+ * they go. The caller advances len once they are filled in.
+ */
+static uint8_t *
+rfb_out_reserve(struct rfb_enc *re, size_t n)
+{
+	struct rfb_update *u;
+
+	u = re->out;
+	if (u->len + n > u->size) {
+		u->size = MAX(MAX(u->size * 2, u->len + n), RFB_UPDATE_MINSZ);
+		u->data = realloc(u->data, u->size);
+		assert(u->data != NULL);
+	}
+	return (u->data + u->len);
+}
+
+static void
+rfb_out(struct rfb_enc *re, const void *p, size_t n)
+{
+
+	memcpy(rfb_out_reserve(re, n), p, n);
+	re->out->len += n;
+}
+
+/* Length of a zlib or ZRLE payload; the first one is noted for joiners */
+static void
+rfb_out_zlen(struct rfb_enc *re, int32_t enc, uint32_t len)
+{
+	uint32_t zlen;
+
+	if (re->out->zoff < 0) {
+		re->out->zoff = re->out->len;
+		re->out->zenc = enc;
+	}
+	zlen = htonl(len);
+	rfb_out(re, &zlen, sizeof(uint32_t));
+}
+
+/*
+ * Add one rectangle whose payload is the concatenated output of the
+ * already encoded jobs.
+ */
+static int
+rfb_put_rect_tiled(struct rfb_enc *re, struct rfb_srvr_rect_hdr *srect_hdr,
+                   struct rfb_tile_job *jobs, int njobs)
+{
+	int err, i;
+
+	if (re->enc == RFB_ENCODING_HEXTILE) {
+		srect_hdr->encoding = htonl(RFB_ENCODING_HEXTILE);
+		rfb_out(re, srect_hdr, sizeof(struct rfb_srvr_rect_hdr));
+		for (i = 0; i < njobs; i++)
+			rfb_out(re, jobs[i].out, jobs[i].len);
+		return (0);
+	}
+
+	/* ZRLE: a single zlib stream, so compress in order */
+	re->zrle_stream.next_out = (Bytef *)re->zbuf;
+	re->zrle_stream.avail_out = RFB_ENCBUF_SZ;
+	re->zrle_stream.data_type = Z_BINARY;
+	re->zrle_stream.total_in = 0;
+	re->zrle_stream.total_out = 0;
+	for (i = 0; i < njobs; i++) {
+		re->zrle_stream.next_in = (Bytef *)jobs[i].out;
+		re->zrle_stream.avail_in = jobs[i].len;
+
+		err = deflate(&re->zrle_stream,
+		    i == njobs - 1 ? Z_SYNC_FLUSH : Z_NO_FLUSH);
+		if (err != Z_OK || re->zrle_stream.avail_in != 0) {
+			/* The caller starts over with raw rectangles */
+			WPRINTF(("zrle deflate err: %d", err));
+			re->enc_zrle_ok = false;
+			re->enc = RFB_ENCODING_RAW;
+			deflateEnd(&re->zrle_stream);
+			return (-1);
+		}
+	}
+
+	srect_hdr->encoding = htonl(RFB_ENCODING_ZRLE);
+	rfb_out(re, srect_hdr, sizeof(struct rfb_srvr_rect_hdr));
+	rfb_out_zlen(re, RFB_ENCODING_ZRLE, re->zrle_stream.total_out);
+	rfb_out(re, re->zbuf, re->zrle_stream.total_out);
+	return (0);
+}
+
+static void
+rfb_put_update_header(struct rfb_enc *re, int numrects)
+{
+	struct rfb_srvr_updt_msg supdt_msg;
 
-	/* Number of rectangles: 1 */
 	supdt_msg.type = 0;
 	supdt_msg.pad = 0;
-	supdt_msg.numrects = htons(1);
-	nwrite = stream_write(cfd, &supdt_msg,
-	                      sizeof(struct rfb_srvr_updt_msg));
-	if (nwrite <= 0)
-		return (nwrite);
+	supdt_msg.numrects = htons(numrects);
 
+	rfb_out(re, &supdt_msg, sizeof(struct rfb_srvr_updt_msg));
+}
+
+/*
+ * Add a single rectangle of the given x, y, w h dimensions. The caller has
+ * already added the FramebufferUpdate header.
+ * Returns -1 if a compressed encoding failed, in which case the encoder
+ * has fallen back to raw and the update must be redone.
+ */
+static int
+rfb_put_rect(struct rfb_enc *re, struct bhyvegc_image *gc,
+             int x, int y, int w, int h)
+{
+	struct rfb_srvr_rect_hdr srect_hdr;
+	int err;
+	int njobs;
+	uint32_t *p;
+	uint8_t *zbufp;
 
 	/* Rectangle header */
 	srect_hdr.x = htons(x);
@@ -341,190 +1424,357 @@ rfb_send_rect(struct rfb_softc *rc, int cfd, struct bhyvegc_image *gc,
 	srect_hdr.width = htons(w);
 	srect_hdr.height = htons(h);
 
+	if ((re->enc == RFB_ENCODING_ZRLE && re->enc_zrle_ok) ||
+	    re->enc == RFB_ENCODING_HEXTILE) {
+		njobs = rfb_split_bands(re, re->jobs, x, y, w, h);
+		rfb_pool_run(re, rfb_encode_job, re->jobs, njobs);
+		return (rfb_put_rect_tiled(re, &srect_hdr, re->jobs, njobs));
+	}
+
 	h = y + h;
-	w *= sizeof(uint32_t);
-	if (rc->enc_zlib_ok) {
-		zbufp = rc->zbuf;
-		rc->zstream.total_in = 0;
-		rc->zstream.total_out = 0;
+	if (re->enc == RFB_ENCODING_ZLIB && re->enc_zlib_ok) {
+		zbufp = re->zbuf;
+		re->zstream.total_in = 0;
+		re->zstream.total_out = 0;
 		for (p = &gc->data[y * gc->width + x]; y < h; y++) {
-			rc->zstream.next_in = (Bytef *)p;
-			rc->zstream.avail_in = w;
-			rc->zstream.next_out = (Bytef *)zbufp;
-			rc->zstream.avail_out = RFB_ZLIB_BUFSZ + 16 -
-			                        rc->zstream.total_out;
-			rc->zstream.data_type = Z_BINARY;
-
-			/* Compress with zlib */
-			err = deflate(&rc->zstream, Z_SYNC_FLUSH);
+			re->zstream.next_in = (Bytef *)re->rowbuf;
+			re->zstream.avail_in = rfb_cvt_row(re,
+			    (uint8_t *)re->rowbuf, p, w);
+			re->zstream.next_out = (Bytef *)zbufp;
+			re->zstream.avail_out = RFB_ZLIB_BUFSZ + 16 -
+			                        re->zstream.total_out;
+			re->zstream.data_type = Z_BINARY;
+
+			/* Compress with zlib; flush once the rect is done */
+			err = deflate(&re->zstream,
+			    y == h - 1 ? Z_SYNC_FLUSH : Z_NO_FLUSH);
 			if (err != Z_OK) {
 				WPRINTF(("zlib[rect] deflate err: %d", err));
-				rc->enc_zlib_ok = false;
-				deflateEnd(&rc->zstream);
-				goto doraw;
+				re->enc_zlib_ok = false;
+				re->enc = RFB_ENCODING_RAW;
+				deflateEnd(&re->zstream);
+				return (-1);
 			}
-			zbufp = rc->zbuf + rc->zstream.total_out;
+			zbufp = re->zbuf + re->zstream.total_out;
 			p += gc->width;
 		}
 		srect_hdr.encoding = htonl(RFB_ENCODING_ZLIB);
-		nwrite = stream_write(cfd, &srect_hdr,
-		                      sizeof(struct rfb_srvr_rect_hdr));
-		if (nwrite <= 0)
-			return (nwrite);
-
-		zlen = htonl(rc->zstream.total_out);
-		nwrite = stream_write(cfd, &zlen, sizeof(uint32_t));
-		if (nwrite <= 0)
-			return (nwrite);
-		return (stream_write(cfd, rc->zbuf, rc->zstream.total_out));
+		rfb_out(re, &srect_hdr, sizeof(struct rfb_srvr_rect_hdr));
+		rfb_out_zlen(re, RFB_ENCODING_ZLIB, re->zstream.total_out);
+		rfb_out(re, re->zbuf, re->zstream.total_out);
+		return (0);
 	}
 
-doraw:
+	srect_hdr.encoding = htonl(RFB_ENCODING_RAW);
+	rfb_out(re, &srect_hdr, sizeof(struct rfb_srvr_rect_hdr));
 
-	total = 0;
-	zbufp = rc->zbuf;
 	for (p = &gc->data[y * gc->width + x]; y < h; y++) {
-		memcpy(zbufp, p, w);
-		zbufp += w;
-		total += w;
+		zbufp = rfb_out_reserve(re, w * sizeof(uint32_t));
+		re->out->len += rfb_cvt_row(re, zbufp, p, w);
 		p += gc->width;
 	}
 
-	srect_hdr.encoding = htonl(RFB_ENCODING_RAW);
-	nwrite = stream_write(cfd, &srect_hdr,
-	                      sizeof(struct rfb_srvr_rect_hdr));
-	if (nwrite <= 0)
-		return (nwrite);
-
-	total = stream_write(cfd, rc->zbuf, total);
-
-	return (total);
+	return (0);
 }
 
 static int
-rfb_send_all(struct rfb_softc *rc, int cfd, struct bhyvegc_image *gc)
+rfb_put_all(struct rfb_enc *re, struct bhyvegc_image *gc)
 {
-	struct rfb_srvr_updt_msg supdt_msg;
         struct rfb_srvr_rect_hdr srect_hdr;
-	ssize_t nwrite;
-	unsigned long zlen;
 	int err;
 
+	/* Number of rectangles: 1 */
+	rfb_put_update_header(re, 1);
+
 	/*
-	 * Send the whole thing
+	 * Only unconverted zlib can compress the framebuffer in one go;
+	 * everything else handles the screen like any other rectangle.
 	 */
-
-	/* Number of rectangles: 1 */
-	supdt_msg.type = 0;
-	supdt_msg.pad = 0;
-	supdt_msg.numrects = htons(1);
-	nwrite = stream_write(cfd, &supdt_msg,
-	                      sizeof(struct rfb_srvr_updt_msg));
-	if (nwrite <= 0)
-		return (nwrite);
+	if (re->enc != RFB_ENCODING_ZLIB || !re->enc_zlib_ok ||
+	    !re->pixconv.identity)
+		return (rfb_put_rect(re, gc, 0, 0, gc->width, gc->height));
 
 	/* Rectangle header */
 	srect_hdr.x = 0;
 	srect_hdr.y = 0;
 	srect_hdr.width = htons(gc->width);
 	srect_hdr.height = htons(gc->height);
-	if (rc->enc_zlib_ok) {
-		rc->zstream.next_in = (Bytef *)gc->data;
-		rc->zstream.avail_in = gc->width * gc->height *
-		                   sizeof(uint32_t);
-		rc->zstream.next_out = (Bytef *)rc->zbuf;
-		rc->zstream.avail_out = RFB_ZLIB_BUFSZ + 16;
-		rc->zstream.data_type = Z_BINARY;
-
-		rc->zstream.total_in = 0;
-		rc->zstream.total_out = 0;
-
-		/* Compress with zlib */
-		err = deflate(&rc->zstream, Z_SYNC_FLUSH);
-		if (err != Z_OK) {
-			WPRINTF(("zlib deflate err: %d", err));
-			rc->enc_zlib_ok = false;
-			deflateEnd(&rc->zstream);
-			goto doraw;
+
+	re->zstream.next_in = (Bytef *)gc->data;
+	re->zstream.avail_in = gc->width * gc->height * sizeof(uint32_t);
+	re->zstream.next_out = (Bytef *)re->zbuf;
+	re->zstream.avail_out = RFB_ZLIB_BUFSZ + 16;
+	re->zstream.data_type = Z_BINARY;
+
+	re->zstream.total_in = 0;
+	re->zstream.total_out = 0;
+
+	/* Compress with zlib */
+	err = deflate(&re->zstream, Z_SYNC_FLUSH);
+	if (err != Z_OK) {
+		WPRINTF(("zlib deflate err: %d", err));
+		re->enc_zlib_ok = false;
+		re->enc = RFB_ENCODING_RAW;
+		deflateEnd(&re->zstream);
+		return (-1);
+	}
+
+	srect_hdr.encoding = htonl(RFB_ENCODING_ZLIB);
+	rfb_out(re, &srect_hdr, sizeof(struct rfb_srvr_rect_hdr));
+	rfb_out_zlen(re, RFB_ENCODING_ZLIB, re->zstream.total_out);
+	rfb_out(re, re->zbuf, re->zstream.total_out);
+	return (0);
+}
+
+#define	PIX_PER_CELL	32
+#define	PIXCELL_SHIFT	5
+#define	PIXCELL_MASK	0x1F
+
+/*
+ * Returns true if any scanline in [y0, y1) changed after generation gen.
+ */
+static __inline bool
+rfb_rows_dirty(struct bhyvegc_image *gc, int y0, int y1, uint64_t gen)
+{
+	int y;
+
+	if (gc->row_gen == NULL)
+		return (true);
+
+	for (y = y0; y < y1; y++) {
+		if (gc->row_gen[y] > gen)
+			return (true);
+	}
+	return (false);
+}
+
+/* Geometry of the cell grid for one scan of the screen */
+struct rfb_scan {
+	struct bhyvegc_image *gc;
+	int		w, h;
+	int		xcells;
+	int		rem_x;
+	uint64_t	gen;		/* generation of the last update */
+};
+
+/*
+ * Hash one row of cells and flag the ones that changed in crc_tmp.
+ * Rows of cells whose scanlines were not rendered since the last update
+ * are skipped outright.
+ */
+static void
+rfb_hash_job(struct rfb_enc *re, void *arg, int celly)
+{
+	struct rfb_scan *scan;
+	uint32_t *crc_p, *orig_crc;
+	uint32_t *p;
+	int x, y, y0, y1;
+	int cellwidth;
+
+	scan = arg;
+	y0 = celly << PIXCELL_SHIFT;
+	y1 = MIN(y0 + PIX_PER_CELL, scan->h);
+	if (!rfb_rows_dirty(scan->gc, y0, y1, scan->gen))
+		return;
+
+	crc_p = re->crc_tmp + celly * scan->xcells;
+	orig_crc = re->crc + celly * scan->xcells;
+	p = &scan->gc->data[y0 * scan->w];
+	for (y = y0; y < y1; y++) {
+		for (x = 0; x < scan->xcells; x++) {
+			if (x == (scan->xcells - 1) && scan->rem_x > 0)
+				cellwidth = scan->rem_x;
+			else
+				cellwidth = PIX_PER_CELL;
+
+			if (re->rc->hw_crc)
+				crc_p[x] = fast_crc32(p,
+				             cellwidth * sizeof(uint32_t),
+				             crc_p[x]);
+			else
+				crc_p[x] = (uint32_t)crc32(crc_p[x],
+				             (Bytef *)p,
+				             cellwidth * sizeof(uint32_t));
+
+			p += cellwidth;
+		}
+	}
+
+	/* check for crc delta */
+	for (x = 0; x < scan->xcells; x++) {
+		if (orig_crc[x] != crc_p[x]) {
+			orig_crc[x] = crc_p[x];
+			crc_p[x] = 1;
+		} else {
+			crc_p[x] = 0;
+		}
+	}
+}
+
+/*
+ * Hash each scanline in a row of cells into row_crc_tmp. Scanlines not
+ * rendered since the last update keep their previous hash.
+ */
+static void
+rfb_row_hash_job(struct rfb_enc *re, void *arg, int celly)
+{
+	struct rfb_scan *scan;
+	uint32_t *p;
+	int y, y0, y1;
+
+	scan = arg;
+	y0 = celly << PIXCELL_SHIFT;
+	y1 = MIN(y0 + PIX_PER_CELL, scan->h);
+	if (re->row_crc_valid && !rfb_rows_dirty(scan->gc, y0, y1, scan->gen)) {
+		memcpy(&re->row_crc_tmp[y0], &re->row_crc[y0],
+		       (y1 - y0) * sizeof(uint32_t));
+		return;
+	}
+
+	p = &scan->gc->data[y0 * scan->w];
+	for (y = y0; y < y1; y++, p += scan->w) {
+		if (re->rc->hw_crc)
+			re->row_crc_tmp[y] = fast_crc32(p,
+			    scan->w * sizeof(uint32_t), 0);
+		else
+			re->row_crc_tmp[y] = (uint32_t)crc32(0, (Bytef *)p,
+			    scan->w * sizeof(uint32_t));
+	}
+}
+
+/*
+ * Look for a vertical scroll between the last frame encoded (row_crc) and the
+ * current one (row_crc_tmp). Candidate offsets come from where the first
+ * few changed scanlines used to be; the one explaining the most changed
+ * scanlines wins. On success rows [*y0p, *y1p) of the new frame are rows
+ * [*y0p + *dyp, *y1p + *dyp) of the old one.
+ */
+static bool
+rfb_find_scroll(struct rfb_enc *re, int h, int *y0p, int *y1p, int *dyp)
+{
+	uint32_t *cur, *prev;
+	int cand[RFB_SCROLL_PROBES];
+	int ncand, best, i, d;
+	int y, ylo, yhi, dy, run, moved;
+
+	cur = re->row_crc_tmp;
+	prev = re->row_crc;
+
+	ncand = 0;
+	for (y = 0; y < h && ncand < RFB_SCROLL_PROBES; y++) {
+		/* Skip unchanged and repeated (e.g. blank) scanlines */
+		if (cur[y] == prev[y] || (y > 0 && cur[y] == cur[y - 1]))
+			continue;
+
+		/* Nearest old position of this scanline */
+		for (d = 1; d < h; d++) {
+			if (y - d >= 0 && prev[y - d] == cur[y]) {
+				dy = -d;
+				break;
+			}
+			if (y + d < h && prev[y + d] == cur[y]) {
+				dy = d;
+				break;
+			}
+		}
+		if (d == h)
+			continue;
+
+		for (i = 0; i < ncand && cand[i] != dy; i++)
+			;
+		if (i == ncand)
+			cand[ncand++] = dy;
+	}
+
+	best = 0;
+	for (i = 0; i < ncand; i++) {
+		dy = cand[i];
+		ylo = MAX(0, -dy);
+		yhi = MIN(h, h - dy);
+
+		/* Longest run of scanlines that moved by dy */
+		run = ylo;
+		moved = 0;
+		for (y = ylo; y <= yhi; y++) {
+			if (y < yhi && cur[y] == prev[y + dy]) {
+				if (cur[y] != prev[y])
+					moved++;
+				continue;
+			}
+			if (moved > best) {
+				best = moved;
+				*y0p = run;
+				*y1p = y;
+				*dyp = dy;
+			}
+			run = y + 1;
+			moved = 0;
 		}
-
-		srect_hdr.encoding = htonl(RFB_ENCODING_ZLIB);
-		nwrite = stream_write(cfd, &srect_hdr,
-		                      sizeof(struct rfb_srvr_rect_hdr));
-		if (nwrite <= 0)
-			return (nwrite);
-
-		zlen = htonl(rc->zstream.total_out);
-		nwrite = stream_write(cfd, &zlen, sizeof(uint32_t));
-		if (nwrite <= 0)
-			return (nwrite);
-		return (stream_write(cfd, rc->zbuf, rc->zstream.total_out));
 	}
 
-doraw:
-	srect_hdr.encoding = htonl(RFB_ENCODING_RAW);
-	nwrite = stream_write(cfd, &srect_hdr,
-	                      sizeof(struct rfb_srvr_rect_hdr));
-	if (nwrite <= 0)
-		return (nwrite);
+	return (best >= RFB_SCROLL_MIN_ROWS);
+}
 
-	nwrite = stream_write(cfd, gc->data,
-	               gc->width * gc->height * sizeof(uint32_t));
+static void
+rfb_put_copyrect(struct rfb_enc *re, int y, int w, int h, int sy)
+{
+	struct rfb_srvr_rect_hdr srect_hdr;
+	uint16_t src[2];
 
-	return (nwrite);
-}
+	srect_hdr.x = htons(0);
+	srect_hdr.y = htons(y);
+	srect_hdr.width = htons(w);
+	srect_hdr.height = htons(h);
+	srect_hdr.encoding = htonl(RFB_ENCODING_COPYRECT);
+	rfb_out(re, &srect_hdr, sizeof(struct rfb_srvr_rect_hdr));
 
-#define	PIX_PER_CELL	32
-#define	PIXCELL_SHIFT	5
-#define	PIXCELL_MASK	0x1F
+	src[0] = htons(0);
+	src[1] = htons(sy);
+	rfb_out(re, src, sizeof(src));
+}
 
+/*
+ * Encode the changes between the encoder's last frame and the current
+ * console image into re->out, or the whole screen if all is set.
+ * Returns -1 if the encoder had to fall back to raw part way through,
+ * 0 if nothing changed and 1 if an update was encoded.
+ */
 static int
-rfb_send_screen(struct rfb_softc *rc, int cfd, int all)
+rfb_encode_screen(struct rfb_enc *re, struct bhyvegc_image *gc_image,
+                  int all)
 {
-	struct bhyvegc_image *gc_image;
-	ssize_t nwrite;
+	struct rfb_srvr_rect_hdr srect_hdr;
+	struct rfb_scan scan;
+	struct rfb_tile_job *job;
 	int x, y;
 	int celly, cellwidth;
 	int xcells, ycells;
 	int w, h;
-	uint32_t *p;
 	int rem_x, rem_y;   /* remainder for resolutions not x32 pixels ratio */
 	int retval;
-	uint32_t *crc_p, *orig_crc;
+	uint32_t *crc_p;
 	int changes;
-
-	console_refresh();
-	gc_image = console_get_image();
-
-	pthread_mutex_lock(&rc->mtx);
-	if (rc->sending) {
-		pthread_mutex_unlock(&rc->mtx);
-		return (1);
-	}
-	rc->sending = 1;
-	pthread_mutex_unlock(&rc->mtx);
+	uint8_t *out;
+	uint32_t *tmp;
+	bool tiled;
+	bool rows, scroll;
+	int sy0, sy1, sdy;
 
 	retval = 0;
-
-	if (all) {
-		retval = rfb_send_all(rc, cfd, gc_image);
-		goto done;
-	}
-
-	/*
-	 * Calculate the checksum for each 32x32 cell. Send each that
-	 * has changed since the last scan.
-	 */
+	scroll = false;
 
 	/* Resolution changed */
+	if (re->crc_width != gc_image->width ||
+	    re->crc_height != gc_image->height)
+		re->row_crc_valid = false;
 
-	rc->crc_width = gc_image->width;
-	rc->crc_height = gc_image->height;
+	re->crc_width = gc_image->width;
+	re->crc_height = gc_image->height;
 
-	w = rc->crc_width;
-	h = rc->crc_height;
-	xcells = howmany(rc->crc_width, PIX_PER_CELL);
-	ycells = howmany(rc->crc_height, PIX_PER_CELL);
+	w = re->crc_width;
+	h = re->crc_height;
+	xcells = howmany(re->crc_width, PIX_PER_CELL);
+	ycells = howmany(re->crc_height, PIX_PER_CELL);
 
 	rem_x = w & PIXCELL_MASK;
 
@@ -532,62 +1782,120 @@ rfb_send_screen(struct rfb_softc *rc, int cfd, int all)
 	if (!rem_y)
 		rem_y = PIX_PER_CELL;
 
-	p = gc_image->data;
+	scan.gc = gc_image;
+	scan.w = w;
+	scan.h = h;
+	scan.xcells = xcells;
+	scan.rem_x = rem_x;
+	scan.gen = re->gen;
+
+	/* Scanline hashes feed scroll detection when viewers have CopyRect */
+	rows = re->copyrect;
+
+	/*
+	 * A scroll moves most scanlines without changing them; send it as a
+	 * CopyRect so only the exposed band has to be encoded.
+	 */
+	if (rows) {
+		rfb_pool_run(re, rfb_row_hash_job, &scan, ycells);
+		scroll = !all && re->row_crc_valid &&
+		    rfb_find_scroll(re, h, &sy0, &sy1, &sdy);
+	}
 
 	/*
-	 * Go through all cells and calculate crc. If significant number
-	 * of changes, then send entire screen.
+	 * Calculate the checksum for each 32x32 cell. Send each that
+	 * has changed since the last scan. A full update still hashes the
+	 * cells so that the next delta starts from what was sent.
+	 *
+	 * Go through all cells and calculate crc, a row of cells per job.
+	 * If significant number of changes, then send entire screen.
 	 * crc_tmp is dual purpose: to store the new crc and to flag as
 	 * a cell that has changed.
 	 */
-	crc_p = rc->crc_tmp - xcells;
-	orig_crc = rc->crc - xcells;
-	changes = 0;
-	memset(rc->crc_tmp, 0, sizeof(uint32_t) * xcells * ycells);
-	for (y = 0; y < h; y++) {
-		if ((y & PIXCELL_MASK) == 0) {
-			crc_p += xcells;
-			orig_crc += xcells;
+	memset(re->crc_tmp, 0, sizeof(uint32_t) * xcells * ycells);
+	rfb_pool_run(re, rfb_hash_job, &scan, ycells);
+
+	if (all) {
+		retval = rfb_put_all(re, gc_image) < 0 ? -1 : 1;
+		goto done;
+	}
+
+	/* Cells entirely inside the scrolled band are already on the client */
+	if (scroll) {
+		for (celly = 0; celly < ycells; celly++) {
+			y = celly << PIXCELL_SHIFT;
+			if (y >= sy0 && MIN(y + PIX_PER_CELL, h) <= sy1)
+				memset(re->crc_tmp + celly * xcells, 0,
+				       sizeof(uint32_t) * xcells);
 		}
+	}
 
-		for (x = 0; x < xcells; x++) {
-			if (x == (xcells - 1) && rem_x > 0)
-				cellwidth = rem_x;
-			else
-				cellwidth = PIX_PER_CELL;
+	changes = 0;
+	for (x = 0; x < xcells * ycells; x++)
+		changes += re->crc_tmp[x];
 
-			if (rc->hw_crc)
-				crc_p[x] = fast_crc32(p,
-				             cellwidth * sizeof(uint32_t),
-				             crc_p[x]);
-			else
-				crc_p[x] = (uint32_t)crc32(crc_p[x],
-				             (Bytef *)p,
-				             cellwidth * sizeof(uint32_t));
+	if (changes == 0 && !scroll) {
+		retval = 0;
+		goto done;
+	}
 
-			p += cellwidth;
+	/* If number of changes is > THRESH percent, send the whole screen */
+	if (((changes * 100) / (xcells * ycells)) >= RFB_SEND_ALL_THRESH) {
+		retval = rfb_put_all(re, gc_image) < 0 ? -1 : 1;
+		goto done;
+	}
 
-			/* check for crc delta if last row in cell */
-			if ((y & PIXCELL_MASK) == PIXCELL_MASK || y == (h-1)) {
-				if (orig_crc[x] != crc_p[x]) {
-					orig_crc[x] = crc_p[x];
-					crc_p[x] = 1;
-					changes++;
-				} else {
-					crc_p[x] = 0;
-				}
+	/*
+	 * With a tiled encoding, encode every changed cell up front on the
+	 * pool; the results are then added in order as one update.
+	 */
+	tiled = (re->enc == RFB_ENCODING_ZRLE && re->enc_zrle_ok) ||
+	    re->enc == RFB_ENCODING_HEXTILE;
+	if (tiled) {
+		job = re->jobs;
+		out = re->encbuf;
+		crc_p = re->crc_tmp;
+		for (y = 0; y < h; y += PIX_PER_CELL) {
+			for (x = 0; x < xcells; x++) {
+				if (*crc_p++ == 0)
+					continue;
+				job->x = x * PIX_PER_CELL;
+				job->y = y;
+				job->w = (x == (xcells - 1) && rem_x > 0) ?
+				    rem_x : PIX_PER_CELL;
+				job->h = y + PIX_PER_CELL >= h ?
+				    rem_y : PIX_PER_CELL;
+				job->out = out;
+				out += rfb_tile_bound(re->enc, job->w, job->h);
+				job++;
 			}
 		}
+		rfb_pool_run(re, rfb_encode_job, re->jobs, changes);
 	}
 
-	/* If number of changes is > THRESH percent, send the whole screen */
-	if (((changes * 100) / (xcells * ycells)) >= RFB_SEND_ALL_THRESH) {
-		retval = rfb_send_all(rc, cfd, gc_image);
+	rfb_put_update_header(re, changes + (scroll ? 1 : 0));
+
+	/* The copy goes first; the changed cells are drawn over it */
+	if (scroll)
+		rfb_put_copyrect(re, sy0, w, sy1 - sy0, sy0 + sdy);
+
+	if (tiled) {
+		for (job = re->jobs; job < re->jobs + changes; job++) {
+			srect_hdr.x = htons(job->x);
+			srect_hdr.y = htons(job->y);
+			srect_hdr.width = htons(job->w);
+			srect_hdr.height = htons(job->h);
+			if (rfb_put_rect_tiled(re, &srect_hdr, job, 1) < 0) {
+				retval = -1;
+				goto done;
+			}
+		}
+		retval = 1;
 		goto done;
 	}
-	
+
 	/* Go through all cells, and send only changed ones */
-	crc_p = rc->crc_tmp;
+	crc_p = re->crc_tmp;
 	for (y = 0; y < h; y += PIX_PER_CELL) {
 		/* previous cell's row */
 		celly = (y >> PIXCELL_SHIFT);
@@ -601,14 +1909,12 @@ rfb_send_screen(struct rfb_softc *rc, int cfd, int all)
 				cellwidth = rem_x;
 			else
 				cellwidth = PIX_PER_CELL;
-			nwrite = rfb_send_rect(rc, cfd,
-				gc_image,
+			if (rfb_put_rect(re, gc_image,
 				x * PIX_PER_CELL,
 				celly * PIX_PER_CELL,
 			        cellwidth,
-				y + PIX_PER_CELL >= h ? rem_y : PIX_PER_CELL);
-			if (nwrite <= 0) {
-				retval = nwrite;
+				y + PIX_PER_CELL >= h ? rem_y : PIX_PER_CELL) < 0) {
+				retval = -1;
 				goto done;
 			}
 		}
@@ -616,136 +1922,452 @@ rfb_send_screen(struct rfb_softc *rc, int cfd, int all)
 	retval = 1;
 
 done:
-	pthread_mutex_lock(&rc->mtx);
-	rc->sending = 0;
-	pthread_mutex_unlock(&rc->mtx);
-	
+	/* The hashed scanlines now describe the encoder's frame */
+	if (rows && retval >= 0) {
+		tmp = re->row_crc;
+		re->row_crc = re->row_crc_tmp;
+		re->row_crc_tmp = tmp;
+		re->row_crc_valid = true;
+	} else
+		re->row_crc_valid = false;
+
 	return (retval);
 }
 
+/*
+ * Deflate streams start afresh with every update, so any viewer can pick
+ * up the stream at the start of any update.
+ */
+static void
+rfb_enc_reset_streams(struct rfb_enc *re)
+{
+
+	if (re->enc_zlib_ok)
+		deflateReset(&re->zstream);
+	if (re->enc_zrle_ok)
+		deflateReset(&re->zrle_stream);
+}
 
+/*
+ * Bring the encoder up to the current console image: encode the changes
+ * since its last frame as the new delta. The keyframe of the old frame is
+ * dropped.
+ */
 static void
-rfb_recv_update_msg(struct rfb_softc *rc, int cfd, int discardonly)
+rfb_enc_frame(struct rfb_enc *re, struct bhyvegc_image *gc)
 {
-	struct rfb_updt_msg updt_msg;
-	struct bhyvegc_image *gc_image;
+	struct rfb_update *u;
+	int all, err;
+
+	all = re->gen == 0 || re->crc_width != gc->width ||
+	    re->crc_height != gc->height;
+	for (;;) {
+		u = rfb_update_alloc(gc);
+		re->out = u;
+		rfb_enc_reset_streams(re);
+		err = rfb_encode_screen(re, gc, all);
+		re->out = NULL;
+		if (err >= 0)
+			break;
 
-	(void)stream_read(cfd, ((void *)&updt_msg) + 1 , sizeof(updt_msg) - 1);
+		/* The encoder fell back to raw; redo the whole screen */
+		rfb_update_rele(u);
+		all = 1;
+	}
 
-	console_refresh();
-	gc_image = console_get_image();
+	rfb_update_rele(re->delta);
+	rfb_update_rele(re->key);
+	re->key = NULL;
+	re->delta = u;
+	re->delta_base = re->gen;
+	re->gen = gc->gen;
+
+	/* A whole screen doubles as the keyframe */
+	if (all) {
+		re->delta_base = 0;
+		re->key = u;
+		u->refs++;
+	}
+}
+
+static struct rfb_update *
+rfb_enc_keyframe(struct rfb_enc *re, struct bhyvegc_image *gc)
+{
+	struct rfb_update *u;
+
+	if (re->key != NULL)
+		return (re->key);
+
+	for (;;) {
+		u = rfb_update_alloc(gc);
+		re->out = u;
+		rfb_enc_reset_streams(re);
+		if (rfb_put_all(re, gc) >= 0)
+			break;
+		re->out = NULL;
+		rfb_update_rele(u);
+	}
+	re->out = NULL;
+
+	re->key = u;
+	return (u);
+}
+
+static int64_t
+timeval_delta(struct timeval *prev, struct timeval *now)
+{
+	int64_t n1, n2;
+	n1 = now->tv_sec * 1000000 + now->tv_usec;
+	n2 = prev->tv_sec * 1000000 + prev->tv_usec;
+	return (n1 - n2);
+}
+
+/*
+ * Find the update that takes a viewer from what it shows to the current
+ * frame, encoding it if no other viewer of the encoder has yet. Returns a
+ * referenced update, or NULL if the viewer is up to date. Called with
+ * enc_mtx held.
+ */
+static struct rfb_update *
+rfb_enc_update(struct rfb_conn *cn, int all)
+{
+	struct rfb_softc *rc;
+	struct rfb_enc *re;
+	struct bhyvegc_image *gc;
+	struct rfb_update *u;
+	struct timeval tv;
+
+	rc = cn->rc;
+	re = cn->re;
+
+	/* Viewers share refreshes; the fastest one paces the console */
+	gettimeofday(&tv, NULL);
+	if (timeval_delta(&rc->refresh_tv, &tv) >= RFB_FRAME_USEC_MIN) {
+		console_refresh();
+		rc->refresh_tv = tv;
+	}
+
+	gc = console_get_image();
+	if (gc->gen != re->gen)
+		rfb_enc_frame(re, gc);
+
+	if (!all && cn->seen == re->gen)
+		return (NULL);
+
+	/*
+	 * Viewers that took the previous update get the delta; anyone that
+	 * fell behind, just joined or asked for everything gets the whole
+	 * frame, encoded at most once per generation.
+	 */
+	if (!all && cn->seen != 0 && cn->seen == re->delta_base)
+		u = re->delta;
+	else
+		u = rfb_enc_keyframe(re, gc);
+
+	cn->seen = re->gen;
+	if (u->len == 0)
+		return (NULL);
+	u->refs++;
+	return (u);
+}
 
-	updt_msg.x = htons(updt_msg.x);
-	updt_msg.y = htons(updt_msg.y);
-	updt_msg.width = htons(updt_msg.width);
-	updt_msg.height = htons(updt_msg.height);
+/*
+ * Find or create the encoder for an encoding and pixel format. Called with
+ * enc_mtx held.
+ */
+static struct rfb_enc *
+rfb_enc_get(struct rfb_softc *rc, int32_t enc, bool copyrect,
+            const struct rfb_pixfmt *pixfmt, const struct rfb_pixconv *pc)
+{
+	struct rfb_enc *re;
 
-	if (updt_msg.width != gc_image->width ||
-	    updt_msg.height != gc_image->height) {
-		rc->width = gc_image->width;
-		rc->height = gc_image->height;
-		if (rc->enc_resize_ok)
-			rfb_send_resize_update_msg(rc, cfd);
+	LIST_FOREACH(re, &rc->encs, link) {
+		if (re->req_enc == enc && re->copyrect == copyrect &&
+		    memcmp(&re->pixfmt, pixfmt, sizeof(*pixfmt)) == 0) {
+			re->refs++;
+			return (re);
+		}
 	}
 
-	if (discardonly)
+	re = calloc(1, sizeof(struct rfb_enc));
+	assert(re != NULL);
+	re->rc = rc;
+	re->refs = 1;
+	re->req_enc = enc;
+	re->enc = enc;
+	re->copyrect = copyrect;
+	re->pixfmt = *pixfmt;
+	re->pixconv = *pc;
+
+	/*
+	 * Raw deflate: the zlib header is added for each viewer's first
+	 * compressed rectangle instead.
+	 */
+	if (enc == RFB_ENCODING_ZLIB)
+		re->enc_zlib_ok = deflateInit2(&re->zstream, Z_BEST_SPEED,
+		    Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+	if (enc == RFB_ENCODING_ZRLE)
+		re->enc_zrle_ok = deflateInit2(&re->zrle_stream,
+		    Z_BEST_SPEED, Z_DEFLATED, -MAX_WBITS, 8,
+		    Z_DEFAULT_STRATEGY) == Z_OK;
+	if ((enc == RFB_ENCODING_ZLIB && !re->enc_zlib_ok) ||
+	    (enc == RFB_ENCODING_ZRLE && !re->enc_zrle_ok))
+		re->enc = RFB_ENCODING_RAW;
+
+	re->zbuf = malloc(RFB_ENCBUF_SZ);
+	re->encbuf = malloc(RFB_ENCBUF_SZ);
+	re->rowbuf = malloc(RFB_MAX_WIDTH * sizeof(uint32_t));
+	re->jobs = calloc(howmany(RFB_MAX_WIDTH, PIX_PER_CELL) *
+	                  howmany(RFB_MAX_HEIGHT, PIX_PER_CELL),
+	                  sizeof(struct rfb_tile_job));
+	re->crc = calloc(howmany(RFB_MAX_WIDTH * RFB_MAX_HEIGHT, 32),
+	                 sizeof(uint32_t));
+	re->crc_tmp = calloc(howmany(RFB_MAX_WIDTH * RFB_MAX_HEIGHT, 32),
+	                     sizeof(uint32_t));
+	re->row_crc = calloc(RFB_MAX_HEIGHT, sizeof(uint32_t));
+	re->row_crc_tmp = calloc(RFB_MAX_HEIGHT, sizeof(uint32_t));
+	assert(re->zbuf != NULL && re->encbuf != NULL &&
+	    re->rowbuf != NULL && re->jobs != NULL && re->crc != NULL &&
+	    re->crc_tmp != NULL && re->row_crc != NULL &&
+	    re->row_crc_tmp != NULL);
+
+	LIST_INSERT_HEAD(&rc->encs, re, link);
+	return (re);
+}
+
+/* Called with enc_mtx held */
+static void
+rfb_enc_put(struct rfb_enc *re)
+{
+
+	if (re == NULL || --re->refs > 0)
 		return;
 
-	rfb_send_screen(rc, cfd, 1);
+	LIST_REMOVE(re, link);
+	if (re->enc_zlib_ok)
+		deflateEnd(&re->zstream);
+	if (re->enc_zrle_ok)
+		deflateEnd(&re->zrle_stream);
+	rfb_update_rele(re->delta);
+	rfb_update_rele(re->key);
+	free(re->zbuf);
+	free(re->encbuf);
+	free(re->rowbuf);
+	free(re->jobs);
+	free(re->crc);
+	free(re->crc_tmp);
+	free(re->row_crc);
+	free(re->row_crc_tmp);
+	free(re);
+}
+
+/*
+ * Write an update to a viewer, after a resize message if the frame size
+ * changed under it.
+ */
+static int
+rfb_conn_send(struct rfb_conn *cn, struct rfb_update *u, bool resize)
+{
+	uint8_t zhdr[6];
+	ssize_t nwrite;
+	bool *hdrp;
+
+	/* Resolution changed */
+	if (u->width != cn->width || u->height != cn->height) {
+		cn->width = u->width;
+		cn->height = u->height;
+		if (resize && rfb_send_resize_update_msg(cn) <= 0)
+			return (-1);
+	}
+
+	hdrp = u->zenc == RFB_ENCODING_ZRLE ? &cn->zrle_hdr : &cn->zlib_hdr;
+	if (u->zoff < 0 || *hdrp)
+		return (stream_write(cn->cfd, u->data, u->len));
+
+	/*
+	 * The shared streams are headerless; the viewer's inflater expects
+	 * a zlib header in front of the first compressed payload.
+	 */
+	nwrite = stream_write(cn->cfd, u->data, u->zoff);
+	if (nwrite <= 0)
+		return (nwrite);
+	be32enc(zhdr, be32dec(u->data + u->zoff) + 2);
+	zhdr[4] = 0x78;
+	zhdr[5] = 0x01;
+	nwrite = stream_write(cn->cfd, zhdr, sizeof(zhdr));
+	if (nwrite <= 0)
+		return (nwrite);
+	*hdrp = true;
+
+	return (stream_write(cn->cfd, u->data + u->zoff + sizeof(uint32_t),
+	                     u->len - u->zoff - sizeof(uint32_t)));
+}
+
+
+static void
+rfb_recv_update_msg(struct rfb_conn *cn)
+{
+	struct rfb_updt_msg updt_msg;
+	struct rfb_softc *rc;
+
+	rc = cn->rc;
+	(void)stream_read(cn->cfd, ((void *)&updt_msg) + 1 ,
+	    sizeof(updt_msg) - 1);
+
+	/*
+	 * Only record the request; the writer thread answers it once
+	 * the framebuffer has something new to show.
+	 */
+	pthread_mutex_lock(&rc->mtx);
+	cn->update_pending = true;
+	if (!updt_msg.incremental)
+		cn->update_full = true;
+	pthread_cond_signal(&cn->wr_cond);
+	pthread_mutex_unlock(&rc->mtx);
 }
 
 static void
-rfb_recv_key_msg(struct rfb_softc *rc, int cfd)
+rfb_recv_key_msg(struct rfb_conn *cn)
 {
 	struct rfb_key_msg key_msg;
 
-	(void)stream_read(cfd, ((void *)&key_msg) + 1, sizeof(key_msg) - 1);
+	(void)stream_read(cn->cfd, ((void *)&key_msg) + 1,
+	    sizeof(key_msg) - 1);
 
 	console_key_event(key_msg.down, htonl(key_msg.code));
 }
 
 static void
-rfb_recv_ptr_msg(struct rfb_softc *rc, int cfd)
+rfb_recv_ptr_msg(struct rfb_conn *cn)
 {
 	struct rfb_ptr_msg ptr_msg;
 
-	(void)stream_read(cfd, ((void *)&ptr_msg) + 1, sizeof(ptr_msg) - 1);
+	(void)stream_read(cn->cfd, ((void *)&ptr_msg) + 1,
+	    sizeof(ptr_msg) - 1);
 
 	console_ptr_event(ptr_msg.button, htons(ptr_msg.x), htons(ptr_msg.y));
 }
 
 static void
-rfb_recv_cuttext_msg(struct rfb_softc *rc, int cfd)
+rfb_recv_cuttext_msg(struct rfb_conn *cn)
 {
 	struct rfb_cuttext_msg ct_msg;
 	unsigned char buf[32];
 	int len;
 
-	len = stream_read(cfd, ((void *)&ct_msg) + 1, sizeof(ct_msg) - 1);
+	len = stream_read(cn->cfd, ((void *)&ct_msg) + 1, sizeof(ct_msg) - 1);
 	ct_msg.length = htonl(ct_msg.length);
 	while (ct_msg.length > 0) {
-		len = stream_read(cfd, buf, ct_msg.length > sizeof(buf) ?
+		len = stream_read(cn->cfd, buf, ct_msg.length > sizeof(buf) ?
 			sizeof(buf) : ct_msg.length);
 		ct_msg.length -= len;
 	}
 }
 
-static int64_t
-timeval_delta(struct timeval *prev, struct timeval *now)
-{
-	int64_t n1, n2;
-	n1 = now->tv_sec * 1000000 + now->tv_usec;
-	n2 = prev->tv_sec * 1000000 + prev->tv_usec;
-	return (n1 - n2);
-}
-
 static void *
 rfb_wr_thr(void *arg)
 {
+	struct rfb_conn *cn;
 	struct rfb_softc *rc;
-	fd_set rfds;
+	struct rfb_update *u;
+	struct rfb_pixfmt pixfmt;
+	struct rfb_pixconv pc;
+	struct timeval start_tv;
 	struct timeval tv;
-	struct timeval prev_tv;
 	int64_t tdiff;
-	int cfd;
+	int32_t enc;
+	int all;
 	int err;
+	bool newenc, copyrect, resize;
 
-	rc = arg;
-	cfd = rc->cfd;
+	cn = arg;
+	rc = cn->rc;
 
-	prev_tv.tv_sec = 0;
-	prev_tv.tv_usec = 0;
-	while (rc->cfd >= 0) {
-		FD_ZERO(&rfds);
-		FD_SET(cfd, &rfds);
-		tv.tv_sec = 0;
-		tv.tv_usec = 10000;
+	for (;;) {
+		/* Wait for the client to ask for an update */
+		pthread_mutex_lock(&rc->mtx);
+		while (cn->cfd >= 0 && !cn->update_pending)
+			pthread_cond_wait(&cn->wr_cond, &rc->mtx);
+		all = cn->update_full;
+		newenc = cn->enc_changed;
+		cn->enc_changed = false;
+		pixfmt = cn->pixfmt;
+		enc = cn->enc;
+		copyrect = cn->enc_copyrect_ok;
+		resize = cn->enc_resize_ok;
+		pthread_mutex_unlock(&rc->mtx);
 
-		err = select(cfd+1, &rfds, NULL, NULL, &tv);
-		if (err < 0)
-			return (NULL);
+		if (cn->cfd < 0)
+			break;
 
-		/* Determine if its time to push screen; ~24hz */
-		gettimeofday(&tv, NULL);
-		tdiff = timeval_delta(&prev_tv, &tv);
-		if (tdiff > 40000) {
-			prev_tv.tv_sec = tv.tv_sec;
-			prev_tv.tv_usec = tv.tv_usec;
-			if (rfb_send_screen(rc, cfd, 0) <= 0) {
-				return (NULL);
+		/* Move to the encoder for the new encoding and format */
+		if (newenc) {
+			if (rfb_set_pixconv(&pc, &pixfmt) != 0) {
+				WPRINTF(("rfb unsupported pixel format "
+				    "%d bpp, using 32 bpp", pixfmt.bpp));
+				rfb_native_pixfmt(&pixfmt);
+				rfb_set_pixconv(&pc, &pixfmt);
 			}
-		} else {
-			/* sleep */
-			usleep(40000 - tdiff);
+			memset(pixfmt.pad, 0, sizeof(pixfmt.pad));
+			if (pc.cmap && rfb_send_cmap(cn) <= 0)
+				break;
+
+			pthread_mutex_lock(&rc->enc_mtx);
+			rfb_enc_put(cn->re);
+			cn->re = rfb_enc_get(rc, enc, copyrect, &pixfmt, &pc);
+			pthread_mutex_unlock(&rc->enc_mtx);
+			cn->seen = 0;
 		}
+
+		gettimeofday(&start_tv, NULL);
+
+		pthread_mutex_lock(&rc->enc_mtx);
+		u = rfb_enc_update(cn, all);
+		pthread_mutex_unlock(&rc->enc_mtx);
+
+		if (u != NULL) {
+			err = rfb_conn_send(cn, u, resize);
+			pthread_mutex_lock(&rc->enc_mtx);
+			rfb_update_rele(u);
+			pthread_mutex_unlock(&rc->enc_mtx);
+			if (err <= 0)
+				break;
+		}
+
+		gettimeofday(&tv, NULL);
+		tdiff = timeval_delta(&start_tv, &tv);
+
+		if (u != NULL) {
+			pthread_mutex_lock(&rc->mtx);
+			cn->update_pending = false;
+			if (all)
+				cn->update_full = false;
+			pthread_mutex_unlock(&rc->mtx);
+
+			/*
+			 * Writes block once the socket buffer fills, so the
+			 * time taken to push this update tracks the client's
+			 * bandwidth. Back off the frame rate to match it.
+			 */
+			cn->frame_usec = (cn->frame_usec * 3 + tdiff * 2) / 4;
+			if (cn->frame_usec < RFB_FRAME_USEC_MIN)
+				cn->frame_usec = RFB_FRAME_USEC_MIN;
+			else if (cn->frame_usec > RFB_FRAME_USEC_MAX)
+				cn->frame_usec = RFB_FRAME_USEC_MAX;
+		}
+
+		/* sleep until the next frame is due */
+		if (tdiff < cn->frame_usec)
+			usleep(cn->frame_usec - tdiff);
 	}
 
 	return (NULL);
 }
 
 void
-rfb_handle(struct rfb_softc *rc, int cfd)
+rfb_handle(struct rfb_conn *cn)
 {
+	struct rfb_softc *rc;
 	const char *vbuf = "RFB 003.008\n";
 	unsigned char buf[80];
 	unsigned char *message = NULL;
@@ -761,10 +2383,12 @@ rfb_handle(struct rfb_softc *rc, int cfd)
 
 	pthread_t tid;
 	uint32_t sres = 0;
+	int cfd;
 	int len;
 	int perror = 1;
 
-	rc->cfd = cfd;
+	rc = cn->rc;
+	cfd = cn->cfd;
 
 	/* 1a. Send server version */
 	stream_write(cfd, vbuf, strlen(vbuf));
@@ -863,16 +2487,10 @@ rfb_handle(struct rfb_softc *rc, int cfd)
 	len = stream_read(cfd, buf, 1);
 
 	/* 4a. Write server-init info */
-	rfb_send_server_init_msg(cfd);
-
-	if (!rc->zbuf) {
-		rc->zbuf = malloc(RFB_ZLIB_BUFSZ + 16);
-		assert(rc->zbuf != NULL);
-	}
+	rfb_send_server_init_msg(cn);
 
-	rfb_send_screen(rc, cfd, 1);
-
-	perror = pthread_create(&tid, NULL, rfb_wr_thr, rc);
+	/* The client's first, non-incremental request pulls the screen */
+	perror = pthread_create(&tid, NULL, rfb_wr_thr, cn);
 	if (perror == 0)
 		pthread_set_name_np(tid, "rfbout");
 
@@ -886,22 +2504,22 @@ rfb_handle(struct rfb_softc *rc, int cfd)
 
 		switch (buf[0]) {
 		case 0:
-			rfb_recv_set_pixfmt_msg(rc, cfd);
+			rfb_recv_set_pixfmt_msg(cn);
 			break;
 		case 2:
-			rfb_recv_set_encodings_msg(rc, cfd);
+			rfb_recv_set_encodings_msg(cn);
 			break;
 		case 3:
-			rfb_recv_update_msg(rc, cfd, 1);
+			rfb_recv_update_msg(cn);
 			break;
 		case 4:
-			rfb_recv_key_msg(rc, cfd);
+			rfb_recv_key_msg(cn);
 			break;
 		case 5:
-			rfb_recv_ptr_msg(rc, cfd);
+			rfb_recv_ptr_msg(cn);
 			break;
 		case 6:
-			rfb_recv_cuttext_msg(rc, cfd);
+			rfb_recv_cuttext_msg(cn);
 			break;
 		default:
 			WPRINTF(("rfb unknown cli-code %d!", buf[0] & 0xff));
@@ -909,17 +2527,48 @@ rfb_handle(struct rfb_softc *rc, int cfd)
 		}
 	}
 done:
-	rc->cfd = -1;
+	pthread_mutex_lock(&rc->mtx);
+	cn->cfd = -1;
+	pthread_cond_signal(&cn->wr_cond);
+	pthread_mutex_unlock(&rc->mtx);
 	if (perror == 0)
 		pthread_join(tid, NULL);
-	if (rc->enc_zlib_ok)
-		deflateEnd(&rc->zstream);
+
+	pthread_mutex_lock(&rc->enc_mtx);
+	rfb_enc_put(cn->re);
+	cn->re = NULL;
+	pthread_mutex_unlock(&rc->enc_mtx);
+}
+
+static void *
+rfb_conn_thr(void *arg)
+{
+	struct rfb_conn *cn;
+	struct rfb_softc *rc;
+	int cfd;
+
+	cn = arg;
+	rc = cn->rc;
+	cfd = cn->cfd;
+
+	rfb_handle(cn);
+	close(cfd);
+
+	pthread_mutex_lock(&rc->mtx);
+	TAILQ_REMOVE(&rc->conns, cn, link);
+	rc->nconns--;
+	pthread_mutex_unlock(&rc->mtx);
+
+	pthread_cond_destroy(&cn->wr_cond);
+	free(cn);
+	return (NULL);
 }
 
 static void *
 rfb_thr(void *arg)
 {
 	struct rfb_softc *rc;
+	struct rfb_conn *cn;
 	sigset_t set;
 
 	int cfd;
@@ -934,19 +2583,51 @@ rfb_thr(void *arg)
 	}
 
 	for (;;) {
-		rc->enc_raw_ok = false;
-		rc->enc_zlib_ok = false;
-		rc->enc_resize_ok = false;
-
 		cfd = accept(rc->sfd, NULL, NULL);
+		if (cfd < 0)
+			continue;
 		if (rc->conn_wait) {
 			pthread_mutex_lock(&rc->mtx);
 			pthread_cond_signal(&rc->cond);
 			pthread_mutex_unlock(&rc->mtx);
 			rc->conn_wait = 0;
 		}
-		rfb_handle(rc, cfd);
-		close(cfd);
+
+		pthread_mutex_lock(&rc->mtx);
+		if (rc->nconns >= RFB_MAX_CONNS) {
+			pthread_mutex_unlock(&rc->mtx);
+			WPRINTF(("rfb too many viewers, dropping connection"));
+			close(cfd);
+			continue;
+		}
+
+		/* Each viewer starts on the native format and raw encoding */
+		cn = calloc(1, sizeof(struct rfb_conn));
+		assert(cn != NULL);
+		cn->rc = rc;
+		cn->cfd = cfd;
+		cn->enc = RFB_ENCODING_RAW;
+		rfb_native_pixfmt(&cn->pixfmt);
+		cn->enc_changed = true;
+		cn->frame_usec = RFB_FRAME_USEC_MIN;
+		pthread_cond_init(&cn->wr_cond, NULL);
+		TAILQ_INSERT_TAIL(&rc->conns, cn, link);
+		rc->nconns++;
+		pthread_mutex_unlock(&rc->mtx);
+
+		/* The connection thread inherits the blocked SIGPIPE */
+		if (pthread_create(&cn->tid, NULL, rfb_conn_thr, cn) != 0) {
+			pthread_mutex_lock(&rc->mtx);
+			TAILQ_REMOVE(&rc->conns, cn, link);
+			rc->nconns--;
+			pthread_mutex_unlock(&rc->mtx);
+			pthread_cond_destroy(&cn->wr_cond);
+			free(cn);
+			close(cfd);
+			continue;
+		}
+		pthread_detach(cn->tid);
+		pthread_set_name_np(cn->tid, "rfbconn");
 	}
 
 	/* NOTREACHED */
@@ -980,12 +2661,8 @@ rfb_init(char *hostname, int port, int wait, char *password)
 
 	rc = calloc(1, sizeof(struct rfb_softc));
 
-	rc->crc = calloc(howmany(RFB_MAX_WIDTH * RFB_MAX_HEIGHT, 32),
-	                 sizeof(uint32_t));
-	rc->crc_tmp = calloc(howmany(RFB_MAX_WIDTH * RFB_MAX_HEIGHT, 32),
-	                     sizeof(uint32_t));
-	rc->crc_width = RFB_MAX_WIDTH;
-	rc->crc_height = RFB_MAX_HEIGHT;
+	TAILQ_INIT(&rc->conns);
+	LIST_INIT(&rc->encs);
 	rc->sfd = -1;
 
 	rc->password = password;
@@ -1022,7 +2699,7 @@ rfb_init(char *hostname, int port, int wait, char *password)
 		goto error;
 	}
 
-	if (listen(rc->sfd, 1) < 0) {
+	if (listen(rc->sfd, RFB_MAX_CONNS) < 0) {
 		perror("listen");
 		goto error;
 	}
@@ -1034,12 +2711,12 @@ rfb_init(char *hostname, int port, int wait, char *password)
 #endif
 
 	rc->hw_crc = sse42_supported();
+	rfb_pool_init(rc);
 
 	rc->conn_wait = wait;
-	if (wait) {
-		pthread_mutex_init(&rc->mtx, NULL);
-		pthread_cond_init(&rc->cond, NULL);
-	}
+	pthread_mutex_init(&rc->mtx, NULL);
+	pthread_cond_init(&rc->cond, NULL);
+	pthread_mutex_init(&rc->enc_mtx, NULL);
 
 	pthread_create(&rc->tid, NULL, rfb_thr, rc);
 	pthread_set_name_np(rc->tid, "rfb");
@@ -1060,8 +2737,6 @@ rfb_init(char *hostname, int port, int wait, char *password)
 		freeaddrinfo(ai);
 	if (rc->sfd != -1)
 		close(rc->sfd);
-	free(rc->crc);
-	free(rc->crc_tmp);
 	free(rc);
 	return (-1);
 }
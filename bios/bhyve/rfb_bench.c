@@ -0,0 +1,268 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright 2020 Leon Dang
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY NETAPP, INC ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL NETAPP, INC OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Bandwidth and CPU cost of the RFB encoders. A sequence of frames is
+ * fed through the server's encoder for each of RAW, zlib, Hextile and
+ * ZRLE, exactly as for a viewer that keeps up with every frame, and the
+ * bytes sent and CPU time taken per frame are reported.
+ *
+ *  cc -O2 -o rfb_bench rfb_bench.c sockstream.c -lz -lcrypto -lpthread
+ *
+ *  rfb_bench [-C] [-g widthxheight] [-n frames] [recording]
+ *
+ * A recording is a file of raw frames of the given geometry, one 32-bit
+ * 0x00RRGGBB pixel after another in host byte order, as produced by e.g.
+ *
+ *  ffmpeg -i capture.mkv -pix_fmt bgr0 -f rawvideo recording
+ *
+ * Without one, a text console that scrolls by a line every few frames is
+ * synthesised. -C disables CopyRect, which is otherwise used for scrolls.
+ */
+
+/* The server is built in; the console is replaced by the frame source */
+#include "rfb.c"
+
+#include <err.h>
+#include <time.h>
+
+#define	BENCH_LINE	16		/* scanlines per text line */
+
+static struct bhyvegc_image bench_img;
+static uint32_t *bench_prev;
+
+struct bhyvegc_image *
+console_get_image(void)
+{
+
+	return (&bench_img);
+}
+
+void
+console_refresh(void)
+{
+}
+
+void
+console_key_event(int down, uint32_t keysym)
+{
+}
+
+void
+console_ptr_event(uint8_t button, int x, int y)
+{
+}
+
+/*
+ * Frame n of the synthetic sequence: lines of 8x16 "glyphs" on a dark
+ * background that scroll up by a line every fourth frame, with a
+ * blinking cursor on the bottom line.
+ */
+static void
+bench_synth(uint32_t *data, int w, int h, int n)
+{
+	uint32_t fg, hash;
+	int line, x, y;
+
+	for (y = 0; y < h; y++) {
+		line = y / BENCH_LINE + n / 4;
+		for (x = 0; x < w; x++) {
+			hash = (uint32_t)(x / 8) * 2654435761u ^
+			    (uint32_t)line * 40503u;
+			fg = (hash >> 24) % 8 == 0 ? 0xffff55 : 0xaaaaaa;
+			if ((hash >> 8) % 5 == 0 || line % 7 == 6 ||
+			    x % 8 == 7 || y % BENCH_LINE >= 12)
+				data[y * w + x] = 0x000020;
+			else
+				data[y * w + x] = (hash >> (x % 8 +
+				    y % BENCH_LINE)) & 1 ? fg : 0x000020;
+		}
+	}
+	if (n % 2 == 0)
+		for (y = h - 4; y < h; y++)
+			for (x = 0; x < 8; x++)
+				data[y * w + x] = 0xaaaaaa;
+}
+
+/*
+ * Load frame n and mark the scanlines that differ from the previous one,
+ * as a renderer does. Returns 0 at the end of the recording.
+ */
+static int
+bench_next(FILE *fp, int n)
+{
+	size_t rowsz;
+	int changed, y;
+
+	rowsz = bench_img.width * sizeof(uint32_t);
+	memcpy(bench_prev, bench_img.data, rowsz * bench_img.height);
+	if (fp == NULL)
+		bench_synth(bench_img.data, bench_img.width, bench_img.height,
+		    n);
+	else if (fread(bench_img.data, rowsz, bench_img.height, fp) !=
+	    (size_t)bench_img.height)
+		return (0);
+
+	changed = 0;
+	for (y = 0; y < bench_img.height; y++) {
+		if (n == 0 || memcmp(bench_img.data + y * bench_img.width,
+		    bench_prev + y * bench_img.width, rowsz) != 0) {
+			bench_img.row_gen[y] = bench_img.gen + 1;
+			changed = 1;
+		}
+	}
+	if (changed)
+		bench_img.gen++;
+	return (1);
+}
+
+static uint64_t
+bench_cputime(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+static void
+bench_encoding(struct rfb_softc *rc, FILE *fp, int32_t enc, bool copyrect,
+    int nframes)
+{
+	struct rfb_pixfmt pf;
+	struct rfb_pixconv pc;
+	struct rfb_enc *re;
+	uint64_t bytes, ns, t0;
+	int n;
+
+	rfb_native_pixfmt(&pf);
+	rfb_set_pixconv(&pc, &pf);
+
+	if (fp != NULL)
+		rewind(fp);
+	bench_img.gen = 0;
+	memset(bench_img.row_gen, 0, bench_img.height * sizeof(uint64_t));
+	memset(bench_img.data, 0, bench_img.width * bench_img.height *
+	    sizeof(uint32_t));
+
+	pthread_mutex_lock(&rc->enc_mtx);
+	re = rfb_enc_get(rc, enc, copyrect, &pf, &pc);
+	bytes = ns = 0;
+	for (n = 0; n < nframes && bench_next(fp, n); n++) {
+		if (bench_img.gen == re->gen)
+			continue;
+		t0 = bench_cputime();
+		rfb_enc_frame(re, &bench_img);
+		ns += bench_cputime() - t0;
+		bytes += re->delta->len;
+	}
+	rfb_enc_put(re);
+	pthread_mutex_unlock(&rc->enc_mtx);
+
+	if (n == 0)
+		errx(1, "no frames");
+	printf("%-8s %6d frames %10.0f bytes/frame %7.3f ms CPU/frame "
+	    "%6.1f%% of a full frame\n",
+	    enc == RFB_ENCODING_RAW ? "raw" :
+	    enc == RFB_ENCODING_ZLIB ? "zlib" :
+	    enc == RFB_ENCODING_HEXTILE ? "hextile" : "zrle",
+	    n, (double)bytes / n, ns / 1e6 / n,
+	    100.0 * bytes / n / (bench_img.width * bench_img.height * 4));
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: rfb_bench [-C] [-g widthxheight] "
+	    "[-n frames] [recording]\n");
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const int32_t encs[] = { RFB_ENCODING_RAW, RFB_ENCODING_ZLIB,
+	    RFB_ENCODING_HEXTILE, RFB_ENCODING_ZRLE };
+	struct rfb_softc *rc;
+	FILE *fp;
+	bool copyrect;
+	int ch, h, i, nframes, w;
+
+	copyrect = true;
+	w = 1024;
+	h = 768;
+	nframes = 200;
+	while ((ch = getopt(argc, argv, "Cg:n:")) != -1) {
+		switch (ch) {
+		case 'C':
+			copyrect = false;
+			break;
+		case 'g':
+			if (sscanf(optarg, "%dx%d", &w, &h) != 2)
+				usage();
+			break;
+		case 'n':
+			nframes = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc > 1 || w <= 0 || w > RFB_MAX_WIDTH || h <= 0 ||
+	    h > RFB_MAX_HEIGHT || nframes <= 0)
+		usage();
+
+	fp = NULL;
+	if (argc == 1 && (fp = fopen(argv[0], "r")) == NULL)
+		err(1, "%s", argv[0]);
+
+	bench_img.width = w;
+	bench_img.height = h;
+	bench_img.data = calloc(w * h, sizeof(uint32_t));
+	bench_img.row_gen = calloc(h, sizeof(uint64_t));
+	bench_prev = calloc(w * h, sizeof(uint32_t));
+	if (bench_img.data == NULL || bench_img.row_gen == NULL ||
+	    bench_prev == NULL)
+		err(1, "frame buffers");
+
+	/* What rfb_init() sets up for encoding, without the listener */
+	rc = calloc(1, sizeof(struct rfb_softc));
+	LIST_INIT(&rc->encs);
+	pthread_mutex_init(&rc->enc_mtx, NULL);
+	rc->hw_crc = sse42_supported();
+	rfb_pool_init(rc);
+
+	printf("%dx%d, CopyRect %s\n", w, h, copyrect ? "on" : "off");
+	for (i = 0; i < (int)nitems(encs); i++)
+		bench_encoding(rc, fp, encs[i], copyrect, nframes);
+
+	return (0);
+}
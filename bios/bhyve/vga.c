@@ -81,6 +81,7 @@ struct vga_softc {
 	uint8_t                 txt_page;
 	uint8_t			vga_mode;
 	uint8_t			gc_bpp;      // bits per pixel
+	bool			render_all;  // shadows are stale; redraw everything
 
 	/*
 	 * General registers
@@ -284,8 +285,10 @@ vga_check_size(struct bhyvegc *gc, struct vga_softc *sc)
 	old_width = sc->gc_image->width;
 	old_height = sc->gc_image->height;
 
-	if (old_width != sc->gc_width || old_height != sc->gc_height)
+	if (old_width != sc->gc_width || old_height != sc->gc_height) {
 		bhyvegc_resize(gc, sc->gc_width, sc->gc_height);
+		sc->render_all = true;
+	}
 }
 
 static inline uint32_t
@@ -297,19 +300,28 @@ vga_get_pixel(struct vga_softc *sc, uint8_t data)
 static void
 vga_render_mode12(struct vga_softc *sc)
 {
-	uint8_t pixels;
-	int x, y, i;
+	uint8_t pixels, *src, *shadow;
+	int x, y, stride;
 	uint32_t *data;
 
+	// half byte per pixel
+	stride = sc->gc_width / 2;
+	src = sc->vga_ram;
+	shadow = sc->vga_shadow;
 	data = sc->gc_image->data;
-	i = 0;
 	for (y = 0; y < sc->gc_height; y++) {
-		for (x = 0; x < sc->gc_width; x += 2) {  // half byte per pixel
-			pixels = sc->vga_ram[i];
-			*data++ = colors4bpp[pixels & 0xf];
-			*data++ = colors4bpp[(pixels >> 4) & 0xf];
-			i++;
+		if (sc->render_all || memcmp(shadow, src, stride) != 0) {
+			memcpy(shadow, src, stride);
+			for (x = 0; x < stride; x++) {
+				pixels = src[x];
+				data[2*x] = colors4bpp[pixels & 0xf];
+				data[2*x + 1] = colors4bpp[(pixels >> 4) & 0xf];
+			}
+			bhyvegc_mark_dirty(sc->gc, y, 1);
 		}
+		src += stride;
+		shadow += stride;
+		data += sc->gc_width;
 	}
 }
 
@@ -318,7 +330,7 @@ vga_render_graphics(struct vga_softc *sc)
 {
 	int x, y;
 	uint32_t *data;
-	uint8_t *src;
+	uint8_t *src, *shadow;
 
 	if (sc->vga_mode == 0x12) { // 640x480x16
 		vga_render_mode12(sc);
@@ -328,31 +340,47 @@ vga_render_graphics(struct vga_softc *sc)
 	// 320x200x32
 	data = sc->gc_image->data;
 	src = sc->vga_ram;
+	shadow = sc->vga_shadow;
 	for (y = 0; y < sc->gc_height; y++) {
-		for (x = 0; x < sc->gc_width; x++) {
-			*data++ = vga_get_pixel(sc, *src);
-			src++;
+		if (sc->render_all || memcmp(shadow, src, sc->gc_width) != 0) {
+			memcpy(shadow, src, sc->gc_width);
+			for (x = 0; x < sc->gc_width; x++)
+				data[x] = vga_get_pixel(sc, src[x]);
+			bhyvegc_mark_dirty(sc->gc, y, 1);
 		}
+		src += sc->gc_width;
+		shadow += sc->gc_width;
+		data += sc->gc_width;
 	}
 }
 
-// Go through the current text page and 
+// Go through the current text page and render the rows that differ from
+// the shadow copy taken on the previous pass.
 static void
 vga_render_text(struct vga_softc *sc)
 {
 	uint8 txtpage = microbios_get_textpage();
-	uint8 *txtbuf;
+	uint8 *txtbuf, *shadow;
 	uint32_t *data;
 
 	txtbuf = sc->txt_ram + txtpage*(80*25*2); // XXX row, col
+	shadow = sc->txt_shadow;
 
-	// TODO: compare with shadow buffer and see if there are differences;
-	// only render those changes
+	if (txtpage != sc->txt_page) {
+		sc->txt_page = txtpage;
+		sc->render_all = true;
+	}
 
 	data = sc->gc_image->data;
 	for (int y = 0; y < 25; y++) {
-		data = glyph_render_line((uint16_t *)txtbuf, 80, data);
+		if (sc->render_all || memcmp(shadow, txtbuf, 2*80) != 0) {
+			memcpy(shadow, txtbuf, 2*80);
+			glyph_render_line((uint16_t *)txtbuf, 80, data);
+			bhyvegc_mark_dirty(sc->gc, y*16, 16);
+		}
+		data += 80*8*16;
 		txtbuf += 2*80;
+		shadow += 2*80;
 	}
 }
 
@@ -361,12 +389,18 @@ vga_render(struct bhyvegc *gc)
 {
 	struct vga_softc *sc = vgasc;
 
+	sc->gc = gc;
 	vga_check_size(gc, sc);
 
 	if (vga_in_reset(sc)) {
-		memset(sc->gc_image->data, 0,
-		    sc->gc_image->width * sc->gc_image->height *
-		     sizeof (uint32_t));
+		/* Blank once; the shadows are re-synced when reset ends. */
+		if (!sc->render_all) {
+			memset(sc->gc_image->data, 0,
+			    sc->gc_image->width * sc->gc_image->height *
+			     sizeof (uint32_t));
+			bhyvegc_mark_dirty(gc, 0, sc->gc_image->height);
+			sc->render_all = true;
+		}
 		return;
 	}
 
@@ -374,6 +408,7 @@ vga_render(struct bhyvegc *gc)
 		vga_render_graphics(sc);
 	else
 		vga_render_text(sc);
+	sc->render_all = false;
 }
 
 static uint64_t
@@ -1181,6 +1216,7 @@ vga_port_out_handler(struct vmctx *ctx, int in, int port, int bytes,
 
 			sc->vga_dac.dac_wr_index++;
 			sc->vga_dac.dac_wr_subindex = 0;
+			sc->render_all = true;
 		}
 		break;
 	case GC_IDX_PORT:
@@ -1342,6 +1378,7 @@ vga_switchmode(uint8_t mode)
 		return -1;
 	}
 	vgasc->vga_mode = mode;
+	vgasc->render_all = true;
 	return 0;
 }
 
@@ -1379,6 +1416,7 @@ vga_init(struct vmctx *ctx)
 	sc->txt_shadow = malloc(8 * KB);
 	memset(sc->txt_shadow, 0, 8 * KB);
 	sc->vga_mode = 3;
+	sc->render_all = true;
 
 	printf("VGA RAM mapped to %p, Text buf mapped to %p\r\n", sc->vga_ram, sc->txt_ram);
 
@@ -74,6 +74,7 @@ vi_softc_linkup(struct virtio_softc *vs, struct virtio_consts *vc,
 	vs->vs_vc = vc;
 	vs->vs_pi = pi;
 	pi->pi_arg = vs;
+	pthread_mutex_init(&vs->vs_isr_mtx, NULL);
 
 	vs->vs_queues = queues;
 	for (i = 0; i < vc->vc_nvq; i++) {
@@ -104,6 +105,7 @@ vi_reset_dev(struct virtio_softc *vs)
 	for (vq = vs->vs_queues, i = 0; i < nvq; vq++, i++) {
 		vq->vq_flags = 0;
 		vq->vq_last_avail = 0;
+		vq->vq_shadow_avail = 0;
 		vq->vq_next_used = 0;
 		vq->vq_save_used = 0;
 		vq->vq_pfn = 0;
@@ -112,9 +114,11 @@ vi_reset_dev(struct virtio_softc *vs)
 	vs->vs_negotiated_caps = 0;
 	vs->vs_curq = 0;
 	/* vs->vs_status = 0; -- redundant */
+	pthread_mutex_lock(&vs->vs_isr_mtx);
 	if (vs->vs_isr)
 		pci_lintr_deassert(vs->vs_pi);
 	vs->vs_isr = 0;
+	pthread_mutex_unlock(&vs->vs_isr_mtx);
 	vs->vs_msix_cfg_idx = VIRTIO_MSI_NO_VECTOR;
 }
 
@@ -202,6 +206,7 @@ vi_vq_init(struct virtio_softc *vs, uint32_t pfn)
 	/* Mark queue as allocated, and start at 0 when we use it. */
 	vq->vq_flags = VQ_ALLOC;
 	vq->vq_last_avail = 0;
+	vq->vq_shadow_avail = 0;
 	vq->vq_next_used = 0;
 	vq->vq_save_used = 0;
 }
@@ -211,7 +216,7 @@ vi_vq_init(struct virtio_softc *vs, uint32_t pfn)
  * descriptor.
  */
 static inline void
-_vq_record(int i, volatile struct virtio_desc *vd, struct vmctx *ctx,
+_vq_record(int i, const struct virtio_desc *vd, struct vmctx *ctx,
 	   struct iovec *iov, int n_iov, uint16_t *flags) {
 
 	if (i >= n_iov)
@@ -223,6 +228,32 @@ _vq_record(int i, volatile struct virtio_desc *vd, struct vmctx *ctx,
 }
 #define	VQ_MAX_DESCRIPTORS	512	/* see below */
 
+/*
+ * Re-read the guest's avail index into vq_shadow_avail and return
+ * whether any chains are available.  If there are none and the guest
+ * uses event indices, ask to be notified about the next one: the
+ * avail event is only moved here, when the device runs dry, so the
+ * guest does not kick while a batch is being processed.
+ */
+int
+vq_avail_refresh(struct vqueue_info *vq)
+{
+
+	vq->vq_shadow_avail = vq->vq_avail->va_idx;
+	if (vq->vq_shadow_avail == vq->vq_last_avail &&
+	    (vq->vq_vs->vs_negotiated_caps & VIRTIO_RING_F_EVENT_IDX)) {
+		VQ_AVAIL_EVENT_IDX(vq) = vq->vq_last_avail;
+		atomic_thread_fence_seq_cst();
+		vq->vq_shadow_avail = vq->vq_avail->va_idx;
+	}
+	if (vq->vq_shadow_avail == vq->vq_last_avail)
+		return (0);
+
+	/* Ring entries and descriptors are read after va_idx. */
+	atomic_thread_fence_acq();
+	return (1);
+}
+
 /*
  * Examine the chain of descriptors starting at the "next one" to
  * make sure that they describe a sensible request.  If so, return
@@ -269,7 +300,8 @@ vq_getchain(struct vqueue_info *vq, uint16_t *pidx,
 	int i;
 	u_int ndesc, n_indir;
 	u_int idx, next;
-	volatile struct virtio_desc *vdir, *vindir, *vp;
+	volatile struct virtio_desc *vindir;
+	struct virtio_desc vdir, vp;
 	struct vmctx *ctx;
 	struct virtio_softc *vs;
 	const char *name;
@@ -291,9 +323,9 @@ vq_getchain(struct vqueue_info *vq, uint16_t *pidx,
 	 * then trim off excess bits.
 	 */
 	idx = vq->vq_last_avail;
-	ndesc = (uint16_t)((u_int)vq->vq_avail->va_idx - idx);
-	if (ndesc == 0)
+	if (idx == vq->vq_shadow_avail && !vq_avail_refresh(vq))
 		return (0);
+	ndesc = (uint16_t)((u_int)vq->vq_shadow_avail - idx);
 	if (ndesc > vq->vq_qsize) {
 		/* XXX need better way to diagnose issues */
 		EPRINTLN(
@@ -309,11 +341,14 @@ vq_getchain(struct vqueue_info *vq, uint16_t *pidx,
 	 * To prevent loops, we could be more complicated and
 	 * check whether we're re-visiting a previously visited
 	 * index, but we just abort if the count gets excessive.
+	 *
+	 * Each descriptor is copied out of guest memory once, so that
+	 * the checks below and the values used agree.
 	 */
 	ctx = vs->vs_pi->pi_vmctx;
 	*pidx = next = vq->vq_avail->va_ring[idx & (vq->vq_qsize - 1)];
 	vq->vq_last_avail++;
-	for (i = 0; i < VQ_MAX_DESCRIPTORS; next = vdir->vd_next) {
+	for (i = 0; i < VQ_MAX_DESCRIPTORS; next = vdir.vd_next) {
 		if (next >= vq->vq_qsize) {
 			EPRINTLN(
 			    "%s: descriptor index %u out of range, "
@@ -321,9 +356,9 @@ vq_getchain(struct vqueue_info *vq, uint16_t *pidx,
 			    name, next);
 			return (-1);
 		}
-		vdir = &vq->vq_desc[next];
-		if ((vdir->vd_flags & VRING_DESC_F_INDIRECT) == 0) {
-			_vq_record(i, vdir, ctx, iov, n_iov, flags);
+		vdir = vq->vq_desc[next];
+		if ((vdir.vd_flags & VRING_DESC_F_INDIRECT) == 0) {
+			_vq_record(i, &vdir, ctx, iov, n_iov, flags);
 			i++;
 		} else if ((vs->vs_vc->vc_hv_caps &
 		    VIRTIO_RING_F_INDIRECT_DESC) == 0) {
@@ -333,16 +368,16 @@ vq_getchain(struct vqueue_info *vq, uint16_t *pidx,
 			    name);
 			return (-1);
 		} else {
-			n_indir = vdir->vd_len / 16;
-			if ((vdir->vd_len & 0xf) || n_indir == 0) {
+			n_indir = vdir.vd_len / 16;
+			if ((vdir.vd_len & 0xf) || n_indir == 0) {
 				EPRINTLN(
 				    "%s: invalid indir len 0x%x, "
 				    "driver confused?",
-				    name, (u_int)vdir->vd_len);
+				    name, (u_int)vdir.vd_len);
 				return (-1);
 			}
 			vindir = paddr_guest2host(ctx,
-			    vdir->vd_addr, vdir->vd_len);
+			    vdir.vd_addr, vdir.vd_len);
 			/*
 			 * Indirects start at the 0th, then follow
 			 * their own embedded "next"s until those run
@@ -352,20 +387,20 @@ vq_getchain(struct vqueue_info *vq, uint16_t *pidx,
 			 */
 			next = 0;
 			for (;;) {
-				vp = &vindir[next];
-				if (vp->vd_flags & VRING_DESC_F_INDIRECT) {
+				vp = vindir[next];
+				if (vp.vd_flags & VRING_DESC_F_INDIRECT) {
 					EPRINTLN(
 					    "%s: indirect desc has INDIR flag,"
 					    " driver confused?",
 					    name);
 					return (-1);
 				}
-				_vq_record(i, vp, ctx, iov, n_iov, flags);
+				_vq_record(i, &vp, ctx, iov, n_iov, flags);
 				if (++i > VQ_MAX_DESCRIPTORS)
 					goto loopy;
-				if ((vp->vd_flags & VRING_DESC_F_NEXT) == 0)
+				if ((vp.vd_flags & VRING_DESC_F_NEXT) == 0)
 					break;
-				next = vp->vd_next;
+				next = vp.vd_next;
 				if (next >= n_indir) {
 					EPRINTLN(
 					    "%s: invalid next %u > %u, "
@@ -375,7 +410,7 @@ vq_getchain(struct vqueue_info *vq, uint16_t *pidx,
 				}
 			}
 		}
-		if ((vdir->vd_flags & VRING_DESC_F_NEXT) == 0)
+		if ((vdir.vd_flags & VRING_DESC_F_NEXT) == 0)
 			return (i);
 	}
 loopy:
@@ -547,6 +582,23 @@ vi_find_cr(int offset) {
 	return (NULL);
 }
 
+/*
+ * Deliver QNOTIFY for a queue to the driver.
+ */
+static void
+vi_vq_notify(struct virtio_softc *vs, struct vqueue_info *vq)
+{
+	struct virtio_consts *vc = vs->vs_vc;
+
+	if (vq->vq_notify)
+		(*vq->vq_notify)(DEV_SOFTC(vs), vq);
+	else if (vc->vc_qnotify)
+		(*vc->vc_qnotify)(DEV_SOFTC(vs), vq);
+	else
+		EPRINTLN("%s: qnotify queue %d: missing vq/vc notify",
+		    vc->vc_name, vq->vq_num);
+}
+
 /*
  * Handle pci config space reads.
  * If it's to the MSI-X info, do that.
@@ -647,10 +699,12 @@ bad:
 		value = vs->vs_status;
 		break;
 	case VTCFG_R_ISR:
+		pthread_mutex_lock(&vs->vs_isr_mtx);
 		value = vs->vs_isr;
 		vs->vs_isr = 0;		/* a read clears this flag */
 		if (value)
 			pci_lintr_deassert(pi);
+		pthread_mutex_unlock(&vs->vs_isr_mtx);
 		break;
 	case VTCFG_R_CFGVEC:
 		value = vs->vs_msix_cfg_idx;
@@ -697,12 +751,25 @@ vi_pci_write(struct vmctx *ctx, int vcpu, struct pci_devinst *pi,
 	/* XXX probably should do something better than just assert() */
 	assert(baridx == 0);
 
-	if (vs->vs_mtx)
-		pthread_mutex_lock(vs->vs_mtx);
-
 	vc = vs->vs_vc;
 	name = vc->vc_name;
 
+	/*
+	 * Notify queues with their own lock without taking the device
+	 * lock; see the comment above struct vqueue_info.
+	 */
+	if (offset == VTCFG_R_QNOTIFY && size == 2 && value < vc->vc_nvq &&
+	    vs->vs_queues[value].vq_mtx != NULL) {
+		vq = &vs->vs_queues[value];
+		pthread_mutex_lock(vq->vq_mtx);
+		vi_vq_notify(vs, vq);
+		pthread_mutex_unlock(vq->vq_mtx);
+		return;
+	}
+
+	if (vs->vs_mtx)
+		pthread_mutex_lock(vs->vs_mtx);
+
 	if (size != 1 && size != 2 && size != 4)
 		goto bad;
 
@@ -773,14 +840,11 @@ bad:
 			goto done;
 		}
 		vq = &vs->vs_queues[value];
-		if (vq->vq_notify)
-			(*vq->vq_notify)(DEV_SOFTC(vs), vq);
-		else if (vc->vc_qnotify)
-			(*vc->vc_qnotify)(DEV_SOFTC(vs), vq);
-		else
-			EPRINTLN(
-			    "%s: qnotify queue %d: missing vq/vc notify",
-				name, (int)value);
+		if (vq->vq_mtx != NULL)
+			pthread_mutex_lock(vq->vq_mtx);
+		vi_vq_notify(vs, vq);
+		if (vq->vq_mtx != NULL)
+			pthread_mutex_unlock(vq->vq_mtx);
 		break;
 	case VTCFG_R_STATUS:
 		vs->vs_status = value;
@@ -890,6 +954,8 @@ vi_pci_snapshot_queues(struct virtio_softc *vs, struct vm_snapshot_meta *meta)
 
 		SNAPSHOT_VAR_OR_LEAVE(vq->vq_flags, meta, ret, done);
 		SNAPSHOT_VAR_OR_LEAVE(vq->vq_last_avail, meta, ret, done);
+		/* Not saved; re-read va_idx on the next vq_has_descs(). */
+		vq->vq_shadow_avail = vq->vq_last_avail;
 		SNAPSHOT_VAR_OR_LEAVE(vq->vq_next_used, meta, ret, done);
 		SNAPSHOT_VAR_OR_LEAVE(vq->vq_save_used, meta, ret, done);
 		SNAPSHOT_VAR_OR_LEAVE(vq->vq_msix_idx, meta, ret, done);
@@ -333,6 +333,7 @@ struct virtio_softc {
 	int	vs_curq;		/* current queue */
 	uint8_t	vs_status;		/* value from last status write */
 	uint8_t	vs_isr;			/* ISR flags, if not MSI-X */
+	pthread_mutex_t vs_isr_mtx;	/* protects vs_isr and INTx state */
 	uint16_t vs_msix_cfg_idx;	/* MSI-X vector for config event */
 };
 
@@ -379,6 +380,13 @@ struct virtio_consts {
  * The remaining fields should only be fussed-with by the generic
  * code.
  *
+ * A driver that sets vq_mtx protects the queue's rings with it rather
+ * than with vs_mtx.  QNOTIFY for such a queue is then delivered holding
+ * only vq_mtx, so vCPUs kicking different queues do not serialize.  The
+ * lock order is vs_mtx before vq_mtx.  vq_interrupt() takes neither: it
+ * only takes vs_isr_mtx, which is never held while taking another lock,
+ * so it may be called with or without them.
+ *
  * Note: the addresses of vq_desc, vq_avail, and vq_used are all
  * computable from each other, but it's a lot simpler if we just
  * keep a pointer to each one.  The event indices are similarly
@@ -391,12 +399,14 @@ struct vqueue_info {
 	uint16_t vq_qsize;	/* size of this queue (a power of 2) */
 	void	(*vq_notify)(void *, struct vqueue_info *);
 				/* called instead of vc_notify, if not NULL */
+	pthread_mutex_t *vq_mtx;	/* per-queue lock, if any (see below) */
 
 	struct virtio_softc *vq_vs;	/* backpointer to softc */
 	uint16_t vq_num;	/* we're the num'th queue in the softc */
 
 	uint16_t vq_flags;	/* flags (see above) */
 	uint16_t vq_last_avail;	/* a recent value of vq_avail->va_idx */
+	uint16_t vq_shadow_avail; /* last vq_avail->va_idx read */
 	uint16_t vq_next_used;	/* index of the next used slot to be filled */
 	uint16_t vq_save_used;	/* saved vq_used->vu_idx; see vq_endchains */
 	uint16_t vq_msix_idx;	/* MSI-X index, or VIRTIO_MSI_NO_VECTOR */
@@ -424,16 +434,25 @@ vq_ring_ready(struct vqueue_info *vq)
 	return (vq->vq_flags & VQ_ALLOC);
 }
 
+int	vq_avail_refresh(struct vqueue_info *vq);
+
 /*
  * Are there "available" descriptors?  (This does not count
  * how many, just returns True if there are some.)
+ *
+ * The guest's va_idx is only re-read once the chains seen on the
+ * previous read have all been taken, so a burst of requests costs
+ * one access to the shared avail index rather than one per chain.
  */
 static inline int
 vq_has_descs(struct vqueue_info *vq)
 {
 
-	return (vq_ring_ready(vq) && vq->vq_last_avail !=
-	    vq->vq_avail->va_idx);
+	if (!vq_ring_ready(vq))
+		return (0);
+	if (vq->vq_last_avail != vq->vq_shadow_avail)
+		return (1);
+	return (vq_avail_refresh(vq));
 }
 
 /*
@@ -447,11 +466,11 @@ vq_interrupt(struct virtio_softc *vs, struct vqueue_info *vq)
 	if (pci_msix_enabled(vs->vs_pi))
 		pci_generate_msix(vs->vs_pi, vq->vq_msix_idx);
 	else {
-		VS_LOCK(vs);
+		pthread_mutex_lock(&vs->vs_isr_mtx);
 		vs->vs_isr |= VTCFG_ISR_QUEUES;
 		pci_generate_msi(vs->vs_pi, 0);
 		pci_lintr_assert(vs->vs_pi);
-		VS_UNLOCK(vs);
+		pthread_mutex_unlock(&vs->vs_isr_mtx);
 	}
 }
 
@@ -460,10 +479,13 @@ vq_kick_enable(struct vqueue_info *vq)
 {
 
 	vq->vq_used->vu_flags &= ~VRING_USED_F_NO_NOTIFY;
+	if (vq->vq_vs->vs_negotiated_caps & VIRTIO_RING_F_EVENT_IDX)
+		VQ_AVAIL_EVENT_IDX(vq) = vq->vq_last_avail;
 	/*
-	 * Full memory barrier to make sure the store to vu_flags
-	 * happens before the load from va_idx, which results from
-	 * a subsequent call to vq_has_descs().
+	 * Full memory barrier to make sure the store to vu_flags (or
+	 * to the avail event index) happens before the load from
+	 * va_idx, which results from a subsequent call to
+	 * vq_has_descs().
 	 */
 	atomic_thread_fence_seq_cst();
 }
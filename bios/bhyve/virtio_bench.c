@@ -0,0 +1,378 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright 2020 Leon Dang
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY NETAPP, INC ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL NETAPP, INC OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Split virtqueue microbenchmark. A guest driver thread and a device
+ * thread share a ring in the program's own memory; the device side is
+ * served by vq_getchain()/vq_relchain()/vq_endchains() as virtio-blk
+ * uses them, completing each chain at once. Reported are chains per
+ * second, device time per chain, and guest kicks and interrupts per
+ * chain, with the avail index shadow and EVENT_IDX each on and off:
+ *
+ *  - without the shadow, va_idx is re-read for every chain, as it was
+ *    before vq_shadow_avail, by discarding the shadow before each one;
+ *  - without EVENT_IDX, the guest kicks after every batch it posts.
+ *
+ *  cc -O2 -o virtio_bench virtio_bench.c -lpthread
+ *
+ *  virtio_bench [-b batch] [-q qsize] [-s seconds]
+ */
+
+/* The virtqueue code is built in, with the PCI layer stubbed out below */
+#include "virtio.c"
+
+#include <err.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define	BENCH_NDESC	2		/* descriptors per chain */
+
+const char *vmname = "virtio_bench";
+int raw_stdio;
+
+static struct virtio_softc bench_vs;
+static struct virtio_consts bench_vc = {
+	.vc_name = "bench",
+	.vc_nvq = 1,
+	.vc_hv_caps = VIRTIO_RING_F_EVENT_IDX,
+};
+static struct vqueue_info bench_vq;
+static struct pci_devinst bench_pi;
+
+static volatile u_int bench_stop;
+static volatile u_int bench_kicks;	/* guest to device */
+static volatile u_int bench_intrs;	/* device to guest */
+static int bench_shadow;
+static uint64_t bench_dev_ns, bench_dev_chains;
+static int batch = 8;
+static int qsize = 256;
+
+/*
+ * The PCI layer, which the ring paths reach only to deliver interrupts.
+ * Guest addresses are host addresses.
+ */
+void *
+paddr_guest2host(struct vmctx *ctx, uintptr_t addr, size_t len)
+{
+
+	return ((void *)addr);
+}
+
+int
+pci_msix_enabled(struct pci_devinst *pi)
+{
+
+	return (1);
+}
+
+void
+pci_generate_msix(struct pci_devinst *pi, int msgnum)
+{
+
+	atomic_add_int(&bench_intrs, 1);
+}
+
+void
+pci_generate_msi(struct pci_devinst *pi, int msgnum)
+{
+}
+
+void
+pci_lintr_assert(struct pci_devinst *pi)
+{
+}
+
+void
+pci_lintr_deassert(struct pci_devinst *pi)
+{
+}
+
+void
+pci_lintr_request(struct pci_devinst *pi)
+{
+}
+
+int
+pci_emul_alloc_bar(struct pci_devinst *pdi, int idx, enum pcibar_type type,
+    uint64_t size)
+{
+
+	return (0);
+}
+
+int
+pci_emul_add_msicap(struct pci_devinst *pi, int msgnum)
+{
+
+	return (0);
+}
+
+int
+pci_emul_add_msixcap(struct pci_devinst *pi, int msgnum, int barnum)
+{
+
+	return (0);
+}
+
+int
+pci_emul_msix_twrite(struct pci_devinst *pi, uint64_t offset, int size,
+    uint64_t value)
+{
+
+	return (0);
+}
+
+uint64_t
+pci_emul_msix_tread(struct pci_devinst *pi, uint64_t offset, int size)
+{
+
+	return (0);
+}
+
+int
+pci_msix_table_bar(struct pci_devinst *pi)
+{
+
+	return (-1);
+}
+
+int
+pci_msix_pba_bar(struct pci_devinst *pi)
+{
+
+	return (-1);
+}
+
+static uint64_t
+bench_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+/* What a QNOTIFY handler does: take every chain and complete it. */
+static void
+bench_notify(struct vqueue_info *vq)
+{
+	struct iovec iov[BENCH_NDESC];
+	uint16_t flags[BENCH_NDESC], idx;
+	uint64_t t0;
+	int n;
+
+	t0 = bench_nsec();
+	for (;;) {
+		if (!bench_shadow)
+			vq->vq_shadow_avail = vq->vq_last_avail;
+		if (!vq_has_descs(vq))
+			break;
+		n = vq_getchain(vq, &idx, iov, BENCH_NDESC, flags);
+		if (n != BENCH_NDESC)
+			errx(1, "vq_getchain returned %d", n);
+		vq_relchain(vq, idx, iov[1].iov_len);
+		bench_dev_chains++;
+	}
+	vq_endchains(vq, 1);
+	bench_dev_ns += bench_nsec() - t0;
+}
+
+static void *
+bench_device(void *arg)
+{
+	struct vqueue_info *vq = arg;
+	u_int seen;
+
+	seen = 0;
+	while (!atomic_load_acq_int(&bench_stop)) {
+		if (atomic_load_acq_int(&bench_kicks) == seen) {
+			sched_yield();
+			continue;
+		}
+		seen = atomic_load_acq_int(&bench_kicks);
+		bench_notify(vq);
+	}
+
+	return (NULL);
+}
+
+/*
+ * The guest side follows the usual split-ring driver: post up to a
+ * batch of chains, publish va_idx, and kick unless the device has said
+ * it does not need one; reap used entries and re-arm the used event.
+ */
+static uint64_t
+bench_guest(struct vqueue_info *vq, int seconds)
+{
+	uint16_t *freelist, avail, last_used, new, old;
+	uint64_t chains, deadline;
+	int evidx, i, nfree;
+
+	freelist = calloc(qsize / BENCH_NDESC, sizeof(uint16_t));
+	for (i = 0; i < qsize / BENCH_NDESC; i++)
+		freelist[i] = i * BENCH_NDESC;
+	nfree = qsize / BENCH_NDESC;
+	evidx = (bench_vs.vs_negotiated_caps & VIRTIO_RING_F_EVENT_IDX) != 0;
+	avail = last_used = 0;
+	chains = 0;
+
+	deadline = bench_nsec() + (uint64_t)seconds * 1000000000;
+	while (bench_nsec() < deadline) {
+		while (last_used != atomic_load_acq_16(&vq->vq_used->vu_idx)) {
+			freelist[nfree++] =
+			    vq->vq_used->vu_ring[last_used & (qsize - 1)].vu_idx;
+			last_used++;
+			chains++;
+		}
+		if (evidx)
+			VQ_USED_EVENT_IDX(vq) = last_used;
+
+		if (nfree == 0) {
+			sched_yield();
+			continue;
+		}
+		old = avail;
+		for (i = 0; i < batch && nfree > 0; i++)
+			vq->vq_avail->va_ring[avail++ & (qsize - 1)] =
+			    freelist[--nfree];
+		atomic_thread_fence_rel();
+		vq->vq_avail->va_idx = new = avail;
+		atomic_thread_fence_seq_cst();
+		if (evidx ? (uint16_t)(new - VQ_AVAIL_EVENT_IDX(vq) - 1) <
+		    (uint16_t)(new - old) :
+		    !(vq->vq_used->vu_flags & VRING_USED_F_NO_NOTIFY))
+			atomic_add_int(&bench_kicks, 1);
+	}
+	free(freelist);
+
+	return (chains);
+}
+
+static void
+bench_run(int shadow, int evidx, int seconds)
+{
+	pthread_t tid;
+	uint64_t chains, t0;
+	uint8_t *ring, *buf;
+	size_t ringsz;
+	double secs;
+	int i;
+
+	/* A legacy ring, set up as a PFN write to the device would */
+	ringsz = vring_size(qsize);
+	ring = aligned_alloc(VRING_ALIGN, ringsz);
+	buf = malloc(qsize * 256);
+	if (ring == NULL || buf == NULL)
+		err(1, "ring");
+	memset(ring, 0, ringsz);
+
+	memset(&bench_vq, 0, sizeof(bench_vq));
+	bench_vq.vq_qsize = qsize;
+	vi_softc_linkup(&bench_vs, &bench_vc, &bench_vs, &bench_pi, &bench_vq);
+	vi_vq_init(&bench_vs, (uintptr_t)ring >> VRING_PFN);
+	bench_vq.vq_msix_idx = 0;
+	bench_vs.vs_negotiated_caps = evidx ? VIRTIO_RING_F_EVENT_IDX : 0;
+
+	/* Each chain is a device-readable header and a writable buffer */
+	for (i = 0; i < qsize; i += BENCH_NDESC) {
+		bench_vq.vq_desc[i].vd_addr = (uintptr_t)(buf + i * 128);
+		bench_vq.vq_desc[i].vd_len = 16;
+		bench_vq.vq_desc[i].vd_flags = VRING_DESC_F_NEXT;
+		bench_vq.vq_desc[i].vd_next = i + 1;
+		bench_vq.vq_desc[i + 1].vd_addr = (uintptr_t)(buf + i * 128 +
+		    16);
+		bench_vq.vq_desc[i + 1].vd_len = 240;
+		bench_vq.vq_desc[i + 1].vd_flags = VRING_DESC_F_WRITE;
+	}
+
+	bench_shadow = shadow;
+	bench_stop = bench_kicks = bench_intrs = 0;
+	bench_dev_ns = bench_dev_chains = 0;
+	pthread_create(&tid, NULL, bench_device, &bench_vq);
+	t0 = bench_nsec();
+	chains = bench_guest(&bench_vq, seconds);
+	secs = (bench_nsec() - t0) / 1e9;
+	atomic_store_rel_int(&bench_stop, 1);
+	pthread_join(tid, NULL);
+
+	printf("shadow %-3s event_idx %-3s %10.0f chains/s %6.1f ns/chain "
+	    "%5.3f kicks/chain %5.3f intrs/chain\n",
+	    shadow ? "on" : "off", evidx ? "on" : "off", chains / secs,
+	    bench_dev_chains ? (double)bench_dev_ns / bench_dev_chains : 0,
+	    chains ? (double)bench_kicks / chains : 0,
+	    chains ? (double)bench_intrs / chains : 0);
+
+	pthread_mutex_destroy(&bench_vs.vs_isr_mtx);
+	free(buf);
+	free(ring);
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: virtio_bench [-b batch] [-q qsize] "
+	    "[-s seconds]\n");
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int ch, seconds;
+
+	seconds = 2;
+	while ((ch = getopt(argc, argv, "b:q:s:")) != -1) {
+		switch (ch) {
+		case 'b':
+			batch = atoi(optarg);
+			break;
+		case 'q':
+			qsize = atoi(optarg);
+			break;
+		case 's':
+			seconds = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (argc != optind || batch <= 0 || seconds <= 0 || qsize < 2 ||
+	    qsize > 32768 || !powerof2(qsize))
+		usage();
+
+	bench_run(0, 0, seconds);
+	bench_run(1, 0, seconds);
+	bench_run(0, 1, seconds);
+	bench_run(1, 1, seconds);
+
+	return (0);
+}